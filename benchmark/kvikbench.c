@@ -0,0 +1,212 @@
+/*
+ * kvikbench.c: benchmark harness for kvikdos
+ *
+ * This is free software, GNU GPL >=2.0. There is NO WARRANTY. Use at your risk.
+ *
+ * Usage: benchmark/kvikbench [<flag> ...] <kvikdos-binary> <benchmark-dir> [<name> ...]
+ *
+ * It runs each benchmark guest program (<benchmark-dir>/<name>.com, see
+ * `benchmarks' below) in kvikdos <n> times (after a warmup run), in a
+ * temporary directory, with stdin and stdout redirected to /dev/null, and
+ * it reports the wall time median, p99 and minimum, and the exit code.
+ * Benchmarks with a nonzero exit code are reported as failed, and then the
+ * exit code of kvikbench is 2.
+ *
+ * Flags:
+ *
+ * --runs=<n>: Number of timed runs of each benchmark. Default: 20.
+ * --format=text: Print the results as a table (default).
+ * --format=json: Print the results as JSON, one object per line.
+ * --kvikdos-flag=<flag>: Pass <flag> to kvikdos. Can be specified multiple times.
+ */
+
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const struct Benchmark {
+  const char *name;
+  const char *args;  /* Single DOS command-line argument, or NULL. */
+  const char *description;
+} benchmarks[] = {
+  { "startup", NULL, "empty program startup latency" },
+  { "write1", NULL, "100000 1-byte writes (int 0x21 ah=0x40)" },
+  { "stream", NULL, "32 MiB written and read back in 32 KiB chunks" },
+  { "fileops", NULL, "20000 findfirst+open+close" },
+  { "malloc", NULL, "20000 * 2 malloc+free" },
+  { "execc", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", "chain of 100 nested execs (int 0x21 ah=0x4b)" },
+};
+
+#define MAX_KVIKDOS_FLAGS 32
+
+static double get_monotonic_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Runs argv (with argv[0] being the full pathname) once, and returns its
+ * exit code (or 256 + signal number), and sets *sec_out to the wall time.
+ */
+static int run_once(char **argv, double *sec_out) {
+  double start = get_monotonic_sec();
+  int status;
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fatal: fork");
+    exit(3);
+  }
+  if (pid == 0) {
+    const int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0) { perror("fatal: open /dev/null"); _exit(124); }
+    dup2(null_fd, 0);
+    dup2(null_fd, 1);
+    if (null_fd > 2) close(null_fd);
+    execv(argv[0], argv);
+    perror("fatal: execv kvikdos");
+    _exit(125);
+  }
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      perror("fatal: waitpid");
+      exit(3);
+    }
+  }
+  *sec_out = get_monotonic_sec() - start;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 256 + WTERMSIG(status);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double da = *(const double*)a, db = *(const double*)b;
+  return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/* Returns the nearest-rank percentile of the sorted values. */
+static double get_percentile(const double *sorted_values, unsigned count, unsigned percent) {
+  unsigned rank = (count * percent + 99) / 100;  /* Round up. */
+  if (rank == 0) rank = 1;
+  return sorted_values[rank - 1];
+}
+
+static char *get_abs_filename(const char *filename) {
+  char *cwd, *result;
+  if (filename[0] == '/') return strdup(filename);
+  if ((cwd = getcwd(NULL, 0)) == NULL) {
+    perror("fatal: getcwd");
+    exit(3);
+  }
+  if ((result = malloc(strlen(cwd) + strlen(filename) + 2)) == NULL) {
+    fprintf(stderr, "fatal: out of memory\n");
+    exit(3);
+  }
+  sprintf(result, "%s/%s", cwd, filename);
+  free(cwd);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  unsigned run_count = 20, u, bi;
+  char is_json = 0, had_failure = 0;
+  const char *kvikdos_flags[MAX_KVIKDOS_FLAGS];
+  unsigned kvikdos_flag_count = 0;
+  char *kvikdos_prog, *bench_dir, tmp_dir[] = "/tmp/kvikbench.XXXXXX";
+  char **names;
+  double *secs;
+  (void)argc;
+  for (++argv; argv[0] && argv[0][0] == '-' && argv[0][1] == '-'; ++argv) {
+    const char *arg = argv[0];
+    if (0 == strcmp(arg, "--")) {
+      ++argv;
+      break;
+    } else if (0 == strncmp(arg, "--runs=", 7)) {
+      run_count = (unsigned)strtoul(arg + 7, NULL, 0);
+      if (run_count == 0) {
+        fprintf(stderr, "fatal: bad --runs=... value: %s\n", arg);
+        return 1;
+      }
+    } else if (0 == strcmp(arg, "--format=text")) {
+      is_json = 0;
+    } else if (0 == strcmp(arg, "--format=json")) {
+      is_json = 1;
+    } else if (0 == strncmp(arg, "--kvikdos-flag=", 15)) {
+      if (kvikdos_flag_count == MAX_KVIKDOS_FLAGS) {
+        fprintf(stderr, "fatal: too many --kvikdos-flag=... flags\n");
+        return 1;
+      }
+      kvikdos_flags[kvikdos_flag_count++] = arg + 15;
+    } else {
+      fprintf(stderr, "fatal: unknown command-line flag: %s\n", arg);
+      return 1;
+    }
+  }
+  if (!argv[0] || !argv[1]) {
+    fprintf(stderr, "Usage: kvikbench [--runs=<n>] [--format=text|json] [--kvikdos-flag=<flag> ...] <kvikdos-binary> <benchmark-dir> [<name> ...]\n");
+    return 1;
+  }
+  kvikdos_prog = get_abs_filename(argv[0]);
+  bench_dir = get_abs_filename(argv[1]);
+  names = argv + 2;
+  if ((secs = malloc(sizeof(*secs) * run_count)) == NULL) {
+    fprintf(stderr, "fatal: out of memory\n");
+    return 3;
+  }
+  if (mkdtemp(tmp_dir) == NULL || chdir(tmp_dir) != 0) {  /* The benchmarks create their temporary files here. */
+    perror("fatal: mkdtemp");
+    return 3;
+  }
+  if (!is_json) printf("%-10s %5s %11s %11s %11s %4s  %s\n", "benchmark", "runs", "median_ms", "p99_ms", "min_ms", "exit", "description");
+  for (bi = 0; bi < sizeof(benchmarks) / sizeof(benchmarks[0]); ++bi) {
+    const struct Benchmark *b = &benchmarks[bi];
+    char *run_argv[MAX_KVIKDOS_FLAGS + 4], **p = run_argv;
+    char *prog_filename;
+    int exit_code;
+    double median, p99;
+    if (names[0]) {
+      char **np;
+      for (np = names; *np && strcmp(*np, b->name) != 0; ++np) {}
+      if (!*np) continue;
+    }
+    if ((prog_filename = malloc(strlen(bench_dir) + strlen(b->name) + 6)) == NULL) {
+      fprintf(stderr, "fatal: out of memory\n");
+      return 3;
+    }
+    sprintf(prog_filename, "%s/%s.com", bench_dir, b->name);
+    *p++ = kvikdos_prog;
+    for (u = 0; u < kvikdos_flag_count; ++u) *p++ = (char*)kvikdos_flags[u];
+    *p++ = prog_filename;
+    if (b->args) *p++ = (char*)b->args;
+    *p = NULL;
+    exit_code = run_once(run_argv, &secs[0]);  /* Warmup, e.g. page cache. */
+    for (u = 0; u < run_count && exit_code == 0; ++u) {
+      exit_code = run_once(run_argv, &secs[u]);
+    }
+    if (exit_code != 0) {
+      had_failure = 1;
+      if (is_json) {
+        printf("{\"benchmark\":\"%s\",\"status\":\"failed\",\"exit_code\":%d}\n", b->name, exit_code);
+      } else {
+        printf("%-10s %5s %11s %11s %11s %4d  %s\n", b->name, "-", "-", "-", "-", exit_code, b->description);
+      }
+    } else {
+      qsort(secs, run_count, sizeof(secs[0]), compare_doubles);
+      median = run_count & 1 ? secs[run_count >> 1] : (secs[(run_count >> 1) - 1] + secs[run_count >> 1]) / 2;
+      p99 = get_percentile(secs, run_count, 99);
+      if (is_json) {
+        printf("{\"benchmark\":\"%s\",\"status\":\"ok\",\"runs\":%u,\"median_ms\":%.3f,\"p99_ms\":%.3f,\"min_ms\":%.3f}\n",
+               b->name, run_count, median * 1e3, p99 * 1e3, secs[0] * 1e3);
+      } else {
+        printf("%-10s %5u %11.3f %11.3f %11.3f %4d  %s\n", b->name, run_count, median * 1e3, p99 * 1e3, secs[0] * 1e3, 0, b->description);
+      }
+    }
+    fflush(stdout);
+    free(prog_filename);
+  }
+  if (chdir("/") != 0 || rmdir(tmp_dir) != 0) fprintf(stderr, "warning: cannot remove temporary directory: %s\n", tmp_dir);
+  return had_failure ? 2 : 0;
+}
@@ -12,7 +12,7 @@
  * TODO(pts): udosrun integration.
  * TODO(pts): udosrun command-line flag compatibility.
  * TODO(pts): Run Linux ELF programs and scripts (#!), for convenience.
- * TODO(pts): Add support for 32-bit programs: more memory (easy), XMS (and maybe VCPI); make PMODE.INC and WDOSX work (WDOSX maybe works without XMS).
+ * TODO(pts): Add support for 32-bit programs: VCPI (more memory and XMS are available with --mem-mb=<n>); make PMODE.INC and WDOSX work (WDOSX maybe works without XMS).
  *
  * Since many parts of the DOS ABI is undocumented, the specific behavior of
  * kvikdos in corner cases is matched to:
@@ -25,9 +25,12 @@
  */
 
 #define _GNU_SOURCE 1  /* For MAP_ANONYMOUS and memmem(). */
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>  /* For stdin availability check. */
+#include <setjmp.h>  /* For exits in the middle of an instruction with --cpu=interp. */
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,7 +38,14 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>  /* For PR_SET_PDEATHSIG in --serve workers. */
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>  /* For __NR_memfd_create. */
+#include <sys/time.h>  /* For setitimer(2) in --sample-hz=... and gettimeofday(2). */
+#include <sys/uio.h>  /* For struct iovec in --async-io. */
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -58,7 +68,14 @@
 #endif
 
 #define CMD_PARSE_DEBUG DEBUG
-#define CMD_PARSE_MEM_MB_1 1
+#define CMD_PARSE_MEM_MB_LIMIT 2048  /* Keep guest linear addresses (and XMS sizes in KiB) in 32 bits. */
+
+/* Used by --profile=... and --timings (also in parse_args(...)). */
+static double get_monotonic_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
 /* --- Command-line (argv) parser. Can be used separately from kvikdos. */
 
@@ -71,8 +88,8 @@
 #define CMD_PARSE_DEBUG 0
 #endif
 
-#ifndef CMD_PARSE_MEM_MB_1
-#define CMD_PARSE_MEM_MB_1 0
+#ifndef CMD_PARSE_MEM_MB_LIMIT
+#define CMD_PARSE_MEM_MB_LIMIT 0  /* 0 means unlimited. */
 #endif
 
 #define CASE_MODE_UPPERCASE 0
@@ -80,6 +97,13 @@
 #define CASE_MODE_UNSPECIFIED 2
 
 #define DRIVE_COUNT 8
+
+/* linux_mount_dir of a drive mounted as an in-memory drive (--mount=<drive>~).
+ * Linux filenames starting with this are not on the Linux filesystem, see
+ * is_ram_filename(...).
+ */
+#define RAM_MOUNT_DIR "\1/"
+
 static const char *skip_dot_slash(const char *p) {
   while (p[0] == '.' && p[1] == '/') {  /* Skip ./ at the beginning. */
     for (p += 2; p[0] == '/'; ++p) {}
@@ -101,6 +125,22 @@ static void remove_duplicate_slashes(char *p) {
   *p = '\0';
 }
 
+/* Normalizes Linux directory name p of --mount=... in place, and returns
+ * the result (empty or ends with '/'), or NULL if it doesn't end with '/'.
+ */
+static char *normalize_mount_dir(char *p) {
+  p = (char*)skip_dot_slash(p);
+  remove_duplicate_slashes(p);
+  if (p[0] == '.' && p[1] == '\0') {
+    ++p;
+  } else if (p[0] != '\0') {
+    char *q = p + strlen(p);
+    if (p[1] != '\0' && q[-1] == '.' && q[-2] == '/') *--q = '\0';  /* Remove trailing . if it ends with /. */
+    if (q[-1] != '/') return NULL;
+  }
+  return p;
+}
+
 static char is_same_ascii_nocase(const char *a, const char *b, unsigned size) {
   while (size-- != 0) {
     const unsigned char pa = *a++;
@@ -147,6 +187,7 @@ typedef struct DirState {
   char drive;  /* 'A', 'B', 'C', 'D', ... ('A' + DRIVE_COUNT - 1). */
   char current_dir[DRIVE_COUNT][1];  /* Currently mostly unused. */ /*char current_dir[DRIVE_COUNT][128];*/  /* In DOS syntax. Ends with \, unless empty. If current_dir[2] is FOO\BAR\, then it corresponds to C:\FOO\BAR. */
   const char *linux_mount_dir[DRIVE_COUNT];  /* Linux directory to which the specific drive has been mounted, with '/' suffix (or empty), or NULL. Owned externally. linux_mount_dir[2] == "/tmp/foo/" maps DOS path C:\MY\FILE.TXT to Linux path /tmp/foo/MY/FILE.TXT .  */
+  const char *linux_upper_dir[DRIVE_COUNT];  /* For overlay mounts (--mount=<drive>:<lower>/+<upper>/): Linux directory receiving the writes, with '/' suffix (or empty), or NULL. Owned externally. */
   char case_mode[DRIVE_COUNT];  /* CASE_MODE_... indicating how letters in DOS filename characters should be converted to Linux (uppercase or lowercase). CASE_MODE_UPPERCASE (0) is the default. We could also call it case_fold. */
   const char *dos_prog_abs;  /* DOS absolute pathname of the program being run. Externally owned, can be NULL. */
   const char *linux_prog;  /* Linux pathname of the program being run. Externally owned, can be NULL. */
@@ -338,8 +379,6 @@ static char *get_linux_filename_r(const char *p, const DirState *dir_state, char
   return out_buf;
 }
 
-static char fnbuf[LINUX_PATH_SIZE], fnbuf2[LINUX_PATH_SIZE], argv0_fnbuf[LINUX_PATH_SIZE];
-
 /* Same extension lookup order as in DOS. */
 static const char * const find_prog_on_path_exts[] = { ".com", ".exe", ".bat", /* ".cmd", for Windows NT+. */ NULL };
 static const char * const find_prog_on_path_no_exts[] = { "", NULL };
@@ -348,10 +387,10 @@ static const char * const find_prog_on_path_no_exts[] = { "", NULL };
  * if detect_prog_filename_type has returned PFT_PATH.
  * prog_filename is a single-component DOS program name, with or without a '.'.
  * The return value is a Linux pathname.
- * Uses global variable fnbuf as temporary storage and return value.
- * Uses global variable fnbuf2 as temporary storage.
+ * Uses out_buf (of size LINUX_PATH_SIZE) as temporary storage and return value.
+ * Uses tmp_buf (of size LINUX_PATH_SIZE) as temporary storage.
  */
-static char *find_prog_on_path(const char *prog_filename, const DirState *dir_state, const char *dos_path, char *drive_out) {
+static char *find_prog_on_path(const char *prog_filename, const DirState *dir_state, const char *dos_path, char *drive_out, char *out_buf, char *tmp_buf) {
   size_t size;
   const char *p, *pp, *pq;
   char *r;
@@ -364,10 +403,10 @@ static char *find_prog_on_path(const char *prog_filename, const DirState *dir_st
     fprintf(stderr, "assert: prog_filename contains disallowed characters: %s\n", prog_filename);
     exit(252);
   }
-  get_linux_filename_r(prog_filename, NULL /* dir_state */, fnbuf2, NULL);
-  if ((fnbuf2[0] == '.' && fnbuf2[1] == '\0') ||  /* "." is an invalid program name. */
-      fnbuf2[0] == '\0') { too_long:
-    fnbuf[0] = '\0'; return fnbuf;  /* Invalid program name. */
+  get_linux_filename_r(prog_filename, NULL /* dir_state */, tmp_buf, NULL);
+  if ((tmp_buf[0] == '.' && tmp_buf[1] == '\0') ||  /* "." is an invalid program name. */
+      tmp_buf[0] == '\0') { too_long:
+    out_buf[0] = '\0'; return out_buf;  /* Invalid program name. */
   }
   size = strlen(prog_filename);
   for (p = prog_filename + size; p != prog_filename && *--p != '.';) {}
@@ -377,7 +416,7 @@ static char *find_prog_on_path(const char *prog_filename, const DirState *dir_st
   pp = pq = NULL;
   for (;;) {  /* Find in current directory first, then continue finding on DOS %PATH%. */
     const char * const * exts;
-    r = fnbuf;
+    r = out_buf;
     if (pp) {
       char c, *pt, ptc;
       for (pq = pp; (c = *pp) != ';' && c != '\0'; ++pp) {}
@@ -390,34 +429,34 @@ static char *find_prog_on_path(const char *prog_filename, const DirState *dir_st
       *(char*)pp = '\0';  /* Temporary terminator within dos_path, for get_linux_filename_r. */
       for (pt = (char*)pp; pt != pq && ((ptc = pt[-1]) == '\\' || ptc == '/'); --pt) {}
       if (pt != pq) { ptc = *pt; *pt = '\0'; }  /* Temporarily remove trailing backslashes. */
-      get_linux_filename_r(pq, dir_state, fnbuf, NULL);
+      get_linux_filename_r(pq, dir_state, out_buf, NULL);
       if (pt != pq) *pt = ptc;  /* Restore trailing backlashes, if any. */
       *(char*)pp = c;  /* Restore the terminator. */
-      if (*fnbuf == '\0') goto end_of_pp;  /* Skip if filename is invalid. */
-      r = fnbuf + strlen(fnbuf);
-      if (fnbuf[0] != '\0' && r[-1] != '/') {  /* fnbuf ends with a slash if %PATH% component is just a drive letter, e.g. C: */
-        if ((unsigned)(r - fnbuf)  >= sizeof(fnbuf)) goto too_long;
+      if (*out_buf == '\0') goto end_of_pp;  /* Skip if filename is invalid. */
+      r = out_buf + strlen(out_buf);
+      if (out_buf[0] != '\0' && r[-1] != '/') {  /* out_buf ends with a slash if %PATH% component is just a drive letter, e.g. C: */
+        if ((unsigned)(r - out_buf)  >= LINUX_PATH_SIZE) goto too_long;
         *r++ = '/';
       }
     }
-    if ((unsigned)(r - fnbuf) + size >= sizeof(fnbuf)) goto too_long;
+    if ((unsigned)(r - out_buf) + size >= LINUX_PATH_SIZE) goto too_long;
     memcpy(r, prog_filename, size + 1);  /* Including the trailing '\0'. */
     case_fold_on_drive(r, drive, dir_state);
     if (*r == '\0') goto end_of_pp;  /* Invalid pathname or invalid drive. */
     r += size;
     *r = '\0';
-    if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: trying progs: %s\n", fnbuf);
+    if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: trying progs: %s\n", out_buf);
     for (exts = exts0; *exts; ++exts) {
       const size_t ext_size = strlen(*exts);
       struct stat st;
-      if ((unsigned)(r - fnbuf) + ext_size >= sizeof(fnbuf)) goto too_long;
+      if ((unsigned)(r - out_buf) + ext_size >= LINUX_PATH_SIZE) goto too_long;
       memcpy(r, *exts, ext_size + 1);  /* Including the trailing '\0'. */
       case_fold_on_drive(r, drive, dir_state);
-      if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: trying prog: %s\n", fnbuf);
-      if (stat(fnbuf, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: found prog on drive=%c: %s\n", drive, fnbuf);
+      if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: trying prog: %s\n", out_buf);
+      if (stat(out_buf, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: found prog on drive=%c: %s\n", drive, out_buf);
         *drive_out = drive;
-        return fnbuf;  /* Found executable program file. */
+        return out_buf;  /* Found executable program file. */
       }
     }
    end_of_pp:
@@ -434,11 +473,57 @@ static char *find_prog_on_path(const char *prog_filename, const DirState *dir_st
 }
 
 #define DOS_PATH_SIZE 64  /* See int 0x21 ah == 0x47 (get current directory) */
-static char dosfnbuf[DOS_PATH_SIZE];
+
+/* How DOS standard output is buffered before it's written to Linux fd 1. */
+#define SBM_AUTO 0  /* SBM_FULL if stdout is not a TTY, SBM_NONE otherwise. */
+#define SBM_NONE 1
+#define SBM_LINE 2
+#define SBM_FULL 3
+
+/* How kvikdos (host) is entered for int calls not handled by the guest (--trampoline=...). */
+#define TRAMPOLINE_HLT 0  /* `hlt' at INT_HLT_PARA:int_num. Default. */
+#define TRAMPOLINE_OUT 1  /* `out int_num, al' at INT_OUT_PARA:(int_num * 2). */
+
+#define PERSIST_LIMIT 16  /* Maximum number of --persist=... flags. */
+
+/* Where the date, time and timer ticks of the DOS program come from (--clock=...). */
+#define CLOCK_HOST 0  /* Host wall clock in the local time zone. Default. */
+#define CLOCK_FIXED 1  /* Always clock_epoch, in UTC. */
+#define CLOCK_VIRTUAL 2  /* Starts at clock_epoch (UTC), advances with the VM exit count. */
+#define CLOCK_DEFAULT_EPOCH 315532800UL  /* 1980-01-01 00:00:00 UTC, the earliest DOS file timestamp. */
+
+/* How the guest memory is backed by Linux pages (--prefault, --hugepages). */
+#define MEM_BACKING_LAZY 0  /* Faulted in on first touch, dropped by madvise(MADV_DONTNEED) at exec. Default. */
+#define MEM_BACKING_PREFAULT 1  /* Populated at VM creation, cleared by memset(...) at exec. */
+#define MEM_BACKING_HUGEPAGES 2  /* Like MEM_BACKING_PREFAULT, but 2 MiB aligned and backed by transparent hugepages. */
+
+/* Which CPU runs the DOS program (--cpu=...). */
+#define CPU_AUTO 0  /* CPU_KVM if /dev/kvm can be opened, CPU_INTERP otherwise. Default. */
+#define CPU_KVM 1  /* KVM vCPU. */
+#define CPU_INTERP 2  /* Software CPU: 8086/80186 interpreter, see run_interp_cpu(...). Slower than KVM for CPU-bound code. */
 
 typedef struct EmuParams {
   char is_hlt_ok;
+  char trampoline;  /* TRAMPOLINE_... */
+  char clock_mode;  /* CLOCK_... */
+  unsigned long clock_epoch;  /* Seconds since 1970-01-01 00:00:00 UTC, for CLOCK_FIXED and CLOCK_VIRTUAL. */
   unsigned mem_mb;
+  char mem_backing;  /* MEM_BACKING_... */
+  char cpu;  /* CPU_... */
+  const char *snapshot_dir;  /* NULL if not specified. */
+  int snapshot_fd;  /* Preloaded snapshot (see --fork-server), or -1. */
+  const char *profile_filename;  /* NULL if not specified. */
+  unsigned sample_hz;  /* 0 if --sample-hz=... not specified. */
+  const char *sample_filename;
+  const char *sample_map_filename;  /* NULL if not specified. */
+  char is_enoent_cache;
+  char is_async_io;
+  char is_timings;
+  unsigned batch_jobs;  /* Maximum number of DOS programs run in parallel by a .bat file. */
+  const char *overlay_manifest_filename;  /* NULL if not specified. */
+  const char *trace_filename;  /* NULL if not specified. */
+  char is_replay_check;
+  const char *persist[PERSIST_LIMIT + 1];  /* NULL-terminated list of --persist=... arguments (<dos-filename>[=<linux-filename>]). */
 } EmuParams;
 
 typedef struct ParsedCmdArgs {
@@ -446,14 +531,19 @@ typedef struct ParsedCmdArgs {
   EmuParams emu_params;
   DirState dir_state;
   int tty_in_fd;
+  char stdout_buffer_mode;  /* SBM_... */
   const char* const *args;  /* NULL-terminated list of NUL-terminated strings. Overlaps the program main(...) argv. */
   const char* const *envp0;  /* NULL-terminated list of NUL-terminated strings. Overlaps the program main(...) argv. */
   const char *dpmi_prog;
+  char prog_fnbuf[LINUX_PATH_SIZE];  /* prog_filename may point here. */
+  char tmp_fnbuf[LINUX_PATH_SIZE];  /* Used temporarily by parse_args(...). */
+  char argv0_fnbuf[LINUX_PATH_SIZE];  /* dir_state.linux_mount_dir['D' - 'A'] may point here. */
+  char dos_prog_abs_buf[DOS_PATH_SIZE];  /* dir_state.dos_prog_abs may point here. */
+  double find_prog_sec;  /* Time spent in find_prog_on_path(...), only with --timings. */
 } ParsedCmdArgs;
 
-static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const char *pre_msg, const char *usage_extra, const char *post_msg) {
+static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args, const char *pre_msg, const char *usage_extra, const char *post_msg) {
   char *placeholder_for_default = (char*)pre_msg;
-  ParsedCmdArgs cmd_args;
   const char *argv0;
   char is_drive_specified;
   char prog_filename_type;
@@ -472,34 +562,103 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
                     "--prog=<dos-pathname>: Sets DOS pathname of program.\n"
                     "--mount=<drive><case><dirname>/: Makes Linux dir visible as <drive> for DOS program.\n"
                     "    If <case> is :, then mount uppercase. If <case> is -, then mount lowercase.\n"
+                    "--mount=<drive><case><dirname>/+<upper-dirname>/: Makes Linux dir visible as\n"
+                    "    <drive>, but writes, deletes and renames go to <upper-dirname>.\n"
+                    "--overlay-manifest=<file>: At exit, write the list of files changed in the\n"
+                    "    overlay upper directories (with size and SHA-256) to <file>.\n"
                     "--mount=<drive>0: Makes sure that <drive>: is not visible in DOS.\n"
+                    "--mount=<drive>~: Makes <drive> an in-memory drive (for temporary files).\n"
+                    "--persist=<dos-filename>[=<linux-filename>]: At exit, copy this file from an\n"
+                    "    in-memory drive to Linux. Default <linux-filename>: its basename.\n"
                     "--drive=<drive>: Sets initial current drive for DOS program.\n"
                     "--tty-in=<fd>: Selects Linux file descriptor for keyboard input.\n"
                     "    -3: fake keys; -2: stdin buffered; -1: /dev/tty; 0: stdin etc.\n"
-                    "--mem-mb=<n>: Use n MiB of memory for DOS. Only 1 is supported.\n"
-                    "--hlt-ok: Allow the hlt instruction.\n",
+                    "--mem-mb=<n>: Use n MiB of memory for DOS. Above 1, the memory above 1 MiB\n"
+                     "    is available as HMA and XMS.\n"
+                    "--prefault: Populate the guest memory at startup, and clear it with memset\n"
+                    "    instead of dropping its pages at exec. Fewer page faults, more RSS.\n"
+                    "--hugepages: Like --prefault, with 2 MiB transparent hugepages.\n"
+                    "--cpu=<mode>: CPU running the DOS program: auto (default), kvm or interp.\n"
+                    "    With auto, the 8086/186 software CPU (interp) if /dev/kvm is not usable.\n"
+                    "--hlt-ok: Allow the hlt instruction.\n"
+                    "--trampoline=<mode>: How int calls enter kvikdos: hlt (default) or out.\n"
+                    "    With out, the DOS program returns from int calls by itself.\n"
+                    "--clock=<mode>: Date, time and timer ticks of the DOS program: host (default),\n"
+                    "    fixed[:<epoch>] or virtual[:<epoch>] (advancing with the VM exit count).\n"
+                    "    With fixed and virtual, the files written get the mtime of the clock.\n"
+                    "--stdout-buffer=<mode>: Buffering of DOS standard output: line, full or none.\n"
+                    "    Default: full if stdout is not a TTY, otherwise none.\n"
+                    "--snapshot-dir=<dirname>: Cache loaded program images in <dirname> for\n"
+                    "    faster startup next time.\n"
+                    "--profile=<file>: At exit, write the count and host time of each int call,\n"
+                    "    and the count of I/O port and memory exits to <file>.\n"
+                    "--sample-hz=<n>: Sample the guest CS:IP and stack <n> times per CPU second, and\n"
+                    "    at exit, write collapsed stacks (for flamegraph.pl) to --sample-file=<file>\n"
+                    "    (default: kvikdos.folded). --sample-map=<file>: Use symbols of .map file.\n"
+                    "--timings: At the exit of each DOS program (and exec child), write the wall\n"
+                    "    time of its startup phases, guest and host runtime to stderr.\n"
+                    "--trace=<file>: Write a binary trace of the int calls, input hashes, stdout\n"
+                    "    and output files to <file>. --replay-check: If the inputs in the trace\n"
+                    "    still match, write its outputs instead of running the program.\n"
+                    "--enoent-cache: Remember nonexistent files, don't notice other processes\n"
+                    "    creating them while the DOS program is running.\n"
+                    "--async-io: Write files in the background with io_uring, while the DOS\n"
+                    "    program continues. Errors are reported by the next write or close.\n"
+                    "--batch-jobs=<n>: Run up to <n> consecutive DOS program lines of a .bat file\n"
+                    "    in parallel. `rem kvikdos:wait' and other commands wait for them.\n"
+                    "--connect=<socket>: Run the program in the kvikdos server listening on the\n"
+                    "    Unix domain <socket>, or locally if the server is not running.\n"
+                    "    Must be the first flag.\n"
+                    "--serve=<socket> [--serve-workers=<n>]: Run as a server with a pool of <n>\n"
+                    "    warm VMs (default: number of CPUs). No <dos-executable-file>.\n"
+                    "--fork-server=<socket> [<flag> ...] <dos-executable-file>: Run as a server\n"
+                    "    which preloads <dos-executable-file>, and forks a process for each client.\n"
+                    "--jobs=<n> --manifest=<file>: Run each line of <file> (flags, program and\n"
+                    "    arguments) on a pool of <n> workers. No <dos-executable-file>.\n",
                     pre_msg, argv0, usage_extra, post_msg);
     exit(argv0 && argv[1] ? 0 : 1);
   }
 
   { unsigned u;
     for (u = 0; u < DRIVE_COUNT; ++u) {
-      cmd_args.dir_state.current_dir[u][0] = '\0';
-      cmd_args.dir_state.linux_mount_dir[u] = NULL;
+      cmd_args->dir_state.current_dir[u][0] = '\0';
+      cmd_args->dir_state.linux_mount_dir[u] = NULL;
+      cmd_args->dir_state.linux_upper_dir[u] = NULL;
     }
-    cmd_args.dir_state.drive = 'C';
-    cmd_args.dir_state.dos_prog_abs = NULL;
-    cmd_args.dir_state.linux_mount_dir['C' - 'A'] = placeholder_for_default;
-    cmd_args.dir_state.linux_mount_dir['D' - 'A'] = placeholder_for_default;
-    cmd_args.dir_state.linux_mount_dir['E' - 'A'] = placeholder_for_default;
-    memset(cmd_args.dir_state.case_mode, CASE_MODE_UNSPECIFIED, DRIVE_COUNT);
+    cmd_args->dir_state.drive = 'C';
+    cmd_args->dir_state.dos_prog_abs = NULL;
+    cmd_args->dir_state.linux_mount_dir['C' - 'A'] = placeholder_for_default;
+    cmd_args->dir_state.linux_mount_dir['D' - 'A'] = placeholder_for_default;
+    cmd_args->dir_state.linux_mount_dir['E' - 'A'] = placeholder_for_default;
+    memset(cmd_args->dir_state.case_mode, CASE_MODE_UNSPECIFIED, DRIVE_COUNT);
   }
 
   envp = envp0 = ++argv;
-  cmd_args.dpmi_prog = NULL;
-  cmd_args.tty_in_fd = -1;
-  cmd_args.emu_params.mem_mb = 1;
-  cmd_args.emu_params.is_hlt_ok = 0;
+  cmd_args->dpmi_prog = NULL;
+  cmd_args->tty_in_fd = -1;
+  cmd_args->stdout_buffer_mode = SBM_AUTO;
+  cmd_args->emu_params.mem_mb = 1;
+  cmd_args->emu_params.mem_backing = MEM_BACKING_LAZY;
+  cmd_args->emu_params.cpu = CPU_AUTO;
+  cmd_args->emu_params.is_hlt_ok = 0;
+  cmd_args->emu_params.trampoline = TRAMPOLINE_HLT;
+  cmd_args->emu_params.clock_mode = CLOCK_HOST;
+  cmd_args->emu_params.clock_epoch = CLOCK_DEFAULT_EPOCH;
+  cmd_args->emu_params.snapshot_dir = NULL;
+  cmd_args->emu_params.snapshot_fd = -1;
+  cmd_args->emu_params.profile_filename = NULL;
+  cmd_args->emu_params.sample_hz = 0;
+  cmd_args->emu_params.sample_filename = "kvikdos.folded";
+  cmd_args->emu_params.sample_map_filename = NULL;
+  cmd_args->emu_params.is_enoent_cache = 0;
+  cmd_args->emu_params.is_async_io = 0;
+  cmd_args->emu_params.is_timings = 0;
+  cmd_args->emu_params.batch_jobs = 1;
+  cmd_args->emu_params.overlay_manifest_filename = NULL;
+  cmd_args->emu_params.trace_filename = NULL;
+  cmd_args->emu_params.is_replay_check = 0;
+  cmd_args->emu_params.persist[0] = NULL;
+  cmd_args->find_prog_sec = 0;
   is_drive_specified = 0;
   while (argv[0]) {
     char *arg = *argv++;
@@ -508,7 +667,19 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
     } else if (arg[1] == '-' && arg[2] == '\0') {
       break;
     } else if (0 == strcmp(arg, "--hlt-ok")) {
-      cmd_args.emu_params.is_hlt_ok = 1;
+      cmd_args->emu_params.is_hlt_ok = 1;
+    } else if (0 == strcmp(arg, "--prefault")) {
+      if (cmd_args->emu_params.mem_backing == MEM_BACKING_LAZY) cmd_args->emu_params.mem_backing = MEM_BACKING_PREFAULT;
+    } else if (0 == strcmp(arg, "--hugepages")) {
+      cmd_args->emu_params.mem_backing = MEM_BACKING_HUGEPAGES;
+    } else if (0 == strcmp(arg, "--enoent-cache")) {
+      cmd_args->emu_params.is_enoent_cache = 1;
+    } else if (0 == strcmp(arg, "--async-io")) {
+      cmd_args->emu_params.is_async_io = 1;
+    } else if (0 == strcmp(arg, "--timings")) {
+      cmd_args->emu_params.is_timings = 1;
+    } else if (0 == strcmp(arg, "--replay-check")) {
+      cmd_args->emu_params.is_replay_check = 1;
     } else if (0 == strcmp(arg, "--env")) {
       if (!argv[0]) { missing_argument:
         fprintf(stderr, "fatal: missing argument for flag: %s\n", arg);
@@ -529,7 +700,7 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
       if (!argv[0]) goto missing_argument;
       arg = *argv++;
      do_prog:
-      cmd_args.dir_state.dos_prog_abs = arg;
+      cmd_args->dir_state.dos_prog_abs = arg;
     } else if (0 == strncmp(arg, "--prog=", 7)) {
       arg += 7;
       goto do_prog;
@@ -537,7 +708,7 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
       if (!argv[0]) goto missing_argument;
       arg = *argv++;
      do_dpmi:
-      cmd_args.dpmi_prog = (const char*)arg;
+      cmd_args->dpmi_prog = (const char*)arg;
     } else if (0 == strncmp(arg, "--dpmi=", 7)) {
       arg += 7;
       goto do_dpmi;
@@ -545,11 +716,12 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
       if (!argv[0]) goto missing_argument;
       arg = *argv++;
      do_mount:  /* Default: --mount C:. */
-      if ((arg[0] & ~32) - 'A' + 0U >= DRIVE_COUNT || !(arg[1] == ':' || arg[1] == '-' || arg[1] == '0')) {
+      if ((arg[0] & ~32) - 'A' + 0U >= DRIVE_COUNT || !(arg[1] == ':' || arg[1] == '-' || arg[1] == '0' || arg[1] == '~')) {
         fprintf(stderr, "fatal: mount argument must start with <drive>: or <drive>-, <drive> must be A .. %c: %s\n", 'A' + DRIVE_COUNT - 1, arg);
         exit(1);
       } else {
         const char drive_idx = (arg[0] & ~32) - 'A';
+        char *upper_dir = NULL;
         const char case_mode = arg[1] == '0' ? CASE_MODE_UNSPECIFIED : arg[1] == '-' ? CASE_MODE_LOWERCASE : CASE_MODE_UPPERCASE;
         if (arg[1] == '0') {
           if (arg[2] != '\0') {
@@ -557,28 +729,37 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
             exit(1);
           }
           arg = NULL;  /* Make sure not mounted. */
+        } else if (arg[1] == '~') {
+          if (arg[2] != '\0') {
+            fprintf(stderr, "fatal: mount argument for in-memory drive must stop at ~: %s\n", arg);
+            exit(1);
+          }
+          arg = (char*)RAM_MOUNT_DIR;
         } else {
+          char *plus;
           arg += 2;
           if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: mount %c: %s\n", drive_idx + 'A', arg);
+          if ((plus = arg[0] == '+' ? arg : strstr(arg, "/+")) != NULL) {  /* Overlay: <lower>/+<upper>/ */
+            if (plus != arg) ++plus;
+            *plus++ = '\0';
+            if (plus[0] == '\0' || (upper_dir = normalize_mount_dir(plus)) == NULL) {
+              fprintf(stderr, "fatal: mount overlay upper directory must end with /: %s\n", plus);
+              exit(1);
+            }
+          }
           if (arg[0] == '\0') {
             arg = placeholder_for_default;
           } else {
-            arg = (char*)skip_dot_slash(arg);
-            remove_duplicate_slashes(arg);
-            if (arg[0] == '.' && arg[1] == '\0') {
-              ++arg;
-            } else if (arg[0] != '\0') {
-              char *p = arg + strlen(arg);
-              if (arg[1] != '\0' && p[-1] == '.' && p[-2] == '/') *--p = '\0';  /* Remove trailing . if it ends with /. */
-              if (p[-1] != '/') {
-                fprintf(stderr, "fatal: mount directory target must end with /: %s\n", arg);
-                exit(1);
-              }
+            char * const p = arg;
+            if ((arg = normalize_mount_dir(p)) == NULL) {
+              fprintf(stderr, "fatal: mount directory target must end with /: %s\n", p);
+              exit(1);
             }
           }
         }
-        cmd_args.dir_state.linux_mount_dir[(int)drive_idx] = arg;  /* argv retains ownership of arg. */
-        cmd_args.dir_state.case_mode[(int)drive_idx] = case_mode;
+        cmd_args->dir_state.linux_mount_dir[(int)drive_idx] = arg;  /* argv retains ownership of arg. */
+        cmd_args->dir_state.linux_upper_dir[(int)drive_idx] = upper_dir;
+        cmd_args->dir_state.case_mode[(int)drive_idx] = case_mode;
       }
     } else if (0 == strncmp(arg, "--mount=", 8)) {
       arg += 8;
@@ -591,7 +772,7 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
         fprintf(stderr, "fatal: drive argument must be <drive>:, <drive> must be A .. %c: %s\n", 'A' + DRIVE_COUNT - 1, arg);
         exit(1);
       }
-      cmd_args.dir_state.drive = arg[0] & ~32;
+      cmd_args->dir_state.drive = arg[0] & ~32;
       is_drive_specified = 1;
     } else if (0 == strncmp(arg, "--drive=", 8)) {
       arg += 8;
@@ -601,32 +782,217 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
       if (!argv[0]) goto missing_argument;
       arg = *argv++;
      do_tty_in:
-      if (sscanf(arg, "%d%n", &cmd_args.tty_in_fd, &char_count) < 1 || char_count + 0U != strlen(arg) || cmd_args.tty_in_fd < -3) {
+      if (sscanf(arg, "%d%n", &cmd_args->tty_in_fd, &char_count) < 1 || char_count + 0U != strlen(arg) || cmd_args->tty_in_fd < -3) {
         /* -1: use /dev/tty; -2: use 0 (stdin), but don't try to disable buffering; -3: fake keys in round-robin. */
         fprintf(stderr, "fatal: tty-in argument must be nonnegative integer or -1, -2 or -3: %s\n", arg);
         exit(1);
       }
-      /* Now we've set cmd_args.tty_in_fd. */
+      /* Now we've set cmd_args->tty_in_fd. */
     } else if (0 == strncmp(arg, "--tty-in=", 9)) {
       arg += 9;
       goto do_tty_in;
+    } else if (0 == strcmp(arg, "--stdout-buffer")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_stdout_buffer:
+      if (0 == strcmp(arg, "none")) {
+        cmd_args->stdout_buffer_mode = SBM_NONE;
+      } else if (0 == strcmp(arg, "line")) {
+        cmd_args->stdout_buffer_mode = SBM_LINE;
+      } else if (0 == strcmp(arg, "full")) {
+        cmd_args->stdout_buffer_mode = SBM_FULL;
+      } else {
+        fprintf(stderr, "fatal: stdout-buffer argument must be line, full or none: %s\n", arg);
+        exit(1);
+      }
+    } else if (0 == strncmp(arg, "--stdout-buffer=", 16)) {
+      arg += 16;
+      goto do_stdout_buffer;
+    } else if (0 == strcmp(arg, "--trampoline")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_trampoline:
+      if (0 == strcmp(arg, "hlt")) {
+        cmd_args->emu_params.trampoline = TRAMPOLINE_HLT;
+      } else if (0 == strcmp(arg, "out")) {
+        cmd_args->emu_params.trampoline = TRAMPOLINE_OUT;
+      } else {
+        fprintf(stderr, "fatal: trampoline argument must be hlt or out: %s\n", arg);
+        exit(1);
+      }
+    } else if (0 == strncmp(arg, "--trampoline=", 13)) {
+      arg += 13;
+      goto do_trampoline;
+    } else if (0 == strcmp(arg, "--cpu")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_cpu:
+      if (0 == strcmp(arg, "auto")) {
+        cmd_args->emu_params.cpu = CPU_AUTO;
+      } else if (0 == strcmp(arg, "kvm")) {
+        cmd_args->emu_params.cpu = CPU_KVM;
+      } else if (0 == strcmp(arg, "interp")) {
+        cmd_args->emu_params.cpu = CPU_INTERP;
+      } else {
+        fprintf(stderr, "fatal: cpu argument must be auto, kvm or interp: %s\n", arg);
+        exit(1);
+      }
+    } else if (0 == strncmp(arg, "--cpu=", 6)) {
+      arg += 6;
+      goto do_cpu;
+    } else if (0 == strcmp(arg, "--clock")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_clock:
+      if (0 == strcmp(arg, "host")) {
+        cmd_args->emu_params.clock_mode = CLOCK_HOST;
+      } else {
+        const char *epoch_arg = 0 == strncmp(arg, "fixed", 5) ? arg + 5 : 0 == strncmp(arg, "virtual", 7) ? arg + 7 : NULL;
+        int char_count = 0;
+        cmd_args->emu_params.clock_mode = arg[0] == 'f' ? CLOCK_FIXED : CLOCK_VIRTUAL;
+        cmd_args->emu_params.clock_epoch = CLOCK_DEFAULT_EPOCH;
+        if (!epoch_arg || (epoch_arg[0] != '\0' && (epoch_arg[0] != ':' ||
+            sscanf(epoch_arg + 1, "%lu%n", &cmd_args->emu_params.clock_epoch, &char_count) < 1 || char_count + 1U != strlen(epoch_arg)))) {
+          fprintf(stderr, "fatal: clock argument must be host, fixed[:<epoch>] or virtual[:<epoch>]: %s\n", arg);
+          exit(1);
+        }
+      }
+    } else if (0 == strncmp(arg, "--clock=", 8)) {
+      arg += 8;
+      goto do_clock;
     } else if (0 == strcmp(arg, "--mem-mb")) {
       int char_count;
       if (!argv[0]) goto missing_argument;
       arg = *argv++;
      do_mem_mb:
-      if (sscanf(arg, "%d%n", (int*)&cmd_args.emu_params.mem_mb, &char_count) < 1 || char_count + 0U != strlen(arg) || (int)cmd_args.emu_params.mem_mb <= 0) {
+      if (sscanf(arg, "%d%n", (int*)&cmd_args->emu_params.mem_mb, &char_count) < 1 || char_count + 0U != strlen(arg) || (int)cmd_args->emu_params.mem_mb <= 0) {
         fprintf(stderr, "fatal: mem-mb argument must be poisitive: %s\n", arg);
         exit(1);
       }
-      if (CMD_PARSE_MEM_MB_1 && cmd_args.emu_params.mem_mb != 1) {
-        fprintf(stderr, "fatal: only 1 MiB of memory is supported, requested: %s\n", arg);
+      if (CMD_PARSE_MEM_MB_LIMIT && cmd_args->emu_params.mem_mb > CMD_PARSE_MEM_MB_LIMIT) {
+        fprintf(stderr, "fatal: mem-mb argument too large, maximum is %d: %s\n", CMD_PARSE_MEM_MB_LIMIT, arg);
         exit(1);
       }
-      /* Now we've set cmd_args.mem_mb. */
+      /* Now we've set cmd_args->mem_mb. */
     } else if (0 == strncmp(arg, "--mem-mb=", 9)) {
       arg += 9;
       goto do_mem_mb;
+    } else if (0 == strcmp(arg, "--batch-jobs")) {
+      int char_count;
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_batch_jobs:
+      if (sscanf(arg, "%u%n", &cmd_args->emu_params.batch_jobs, &char_count) < 1 || char_count + 0U != strlen(arg) || cmd_args->emu_params.batch_jobs == 0) {
+        fprintf(stderr, "fatal: batch-jobs argument must be positive: %s\n", arg);
+        exit(1);
+      }
+    } else if (0 == strncmp(arg, "--batch-jobs=", 13)) {
+      arg += 13;
+      goto do_batch_jobs;
+    } else if (0 == strcmp(arg, "--snapshot-dir")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_snapshot_dir:
+      if (arg[0] == '\0') {
+        fprintf(stderr, "fatal: snapshot-dir argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.snapshot_dir = arg;
+    } else if (0 == strncmp(arg, "--snapshot-dir=", 15)) {
+      arg += 15;
+      goto do_snapshot_dir;
+    } else if (0 == strcmp(arg, "--profile")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_profile:
+      if (arg[0] == '\0') {
+        fprintf(stderr, "fatal: profile argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.profile_filename = arg;
+    } else if (0 == strncmp(arg, "--profile=", 10)) {
+      arg += 10;
+      goto do_profile;
+    } else if (0 == strcmp(arg, "--trace")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_trace:
+      if (!*arg) {
+        fprintf(stderr, "fatal: trace argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.trace_filename = arg;
+    } else if (0 == strncmp(arg, "--trace=", 8)) {
+      arg += 8;
+      goto do_trace;
+    } else if (0 == strcmp(arg, "--sample-hz")) {
+      int char_count;
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_sample_hz:
+      if (sscanf(arg, "%u%n", &cmd_args->emu_params.sample_hz, &char_count) < 1 || char_count + 0U != strlen(arg) || cmd_args->emu_params.sample_hz == 0) {
+        fprintf(stderr, "fatal: sample-hz argument must be a positive integer: %s\n", arg);
+        exit(1);
+      }
+    } else if (0 == strncmp(arg, "--sample-hz=", 12)) {
+      arg += 12;
+      goto do_sample_hz;
+    } else if (0 == strcmp(arg, "--sample-file")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_sample_file:
+      if (arg[0] == '\0') {
+        fprintf(stderr, "fatal: sample file argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.sample_filename = arg;
+    } else if (0 == strncmp(arg, "--sample-file=", 14)) {
+      arg += 14;
+      goto do_sample_file;
+    } else if (0 == strcmp(arg, "--sample-map")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_sample_map:
+      if (arg[0] == '\0') {
+        fprintf(stderr, "fatal: sample map argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.sample_map_filename = arg;
+    } else if (0 == strncmp(arg, "--sample-map=", 13)) {
+      arg += 13;
+      goto do_sample_map;
+    } else if (0 == strcmp(arg, "--overlay-manifest")) {
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_overlay_manifest:
+      if (arg[0] == '\0') {
+        fprintf(stderr, "fatal: overlay manifest argument must not be empty\n");
+        exit(1);
+      }
+      cmd_args->emu_params.overlay_manifest_filename = arg;
+    } else if (0 == strncmp(arg, "--overlay-manifest=", 19)) {
+      arg += 19;
+      goto do_overlay_manifest;
+    } else if (0 == strcmp(arg, "--persist")) {  /* Can be specified multiple times. */
+      if (!argv[0]) goto missing_argument;
+      arg = *argv++;
+     do_persist:
+      { unsigned u;
+        for (u = 0; cmd_args->emu_params.persist[u]; ++u) {}
+        if (arg[0] == '\0' || arg[0] == '=') {
+          fprintf(stderr, "fatal: persist argument must start with a DOS filename: %s\n", arg);
+          exit(1);
+        }
+        if (u == PERSIST_LIMIT) {
+          fprintf(stderr, "fatal: too many --persist=... flags\n");
+          exit(1);
+        }
+        cmd_args->emu_params.persist[u] = arg;
+        cmd_args->emu_params.persist[u + 1] = NULL;
+      }
+    } else if (0 == strncmp(arg, "--persist=", 10)) {
+      arg += 10;
+      goto do_persist;
     } else {
       fprintf(stderr, "fatal: unknown command-line flag: %s\n", arg);
       exit(1);
@@ -637,6 +1003,10 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
     fprintf(stderr, "fatal: missing <dos-executable-file> DOS program filename\n");
     exit(1);
   }
+  if (cmd_args->emu_params.is_replay_check && !cmd_args->emu_params.trace_filename) {
+    fprintf(stderr, "fatal: --replay-check needs --trace=<file>\n");
+    exit(1);
+  }
 #if 0  /* Tests for replacing the output with "" */
   fprintf(stderr, "GLF (%s)\n", get_linux_filename("C:\\foo\\.\\.\\\\bar\\."));
   fprintf(stderr, "GLF (%s)\n", get_linux_filename(".\\.\\."));
@@ -650,23 +1020,23 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
   /* Remaining arguments in argv will be passed to the DOS program in PSP:0x80. */
   dos_path = getenv_prefix("PATH=", (char const**)envp0, (char const**)envp);
 
-  if (cmd_args.dir_state.linux_mount_dir['C' - 'A'] == placeholder_for_default) {  /* Set to current directory in Linux. */
-    cmd_args.dir_state.linux_mount_dir['C' - 'A'] = "";  /* Either --mount=C:. (uppercase) or --mount=C-. (lowercase). */
-    /*if (cmd_args.dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED) { ... }*/  /* Will be changed below. */
+  if (cmd_args->dir_state.linux_mount_dir['C' - 'A'] == placeholder_for_default) {  /* Set to current directory in Linux. */
+    cmd_args->dir_state.linux_mount_dir['C' - 'A'] = "";  /* Either --mount=C:. (uppercase) or --mount=C-. (lowercase). */
+    /*if (cmd_args->dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED) { ... }*/  /* Will be changed below. */
   }
-  if (cmd_args.dir_state.linux_mount_dir['D' - 'A'] == placeholder_for_default) {  /* Set to emulator directory (based on argv0). !! Process readlink(2). */
+  if (cmd_args->dir_state.linux_mount_dir['D' - 'A'] == placeholder_for_default) {  /* Set to emulator directory (based on argv0). !! Process readlink(2). */
     const char *p_base = skip_dot_slash(argv0), *p = p_base + strlen(p_base);
     size_t size;
     for (; p != p_base && p[-1] != '/'; --p) {}
-    if ((size = p - p_base) >= sizeof(argv0_fnbuf)) {
+    if ((size = p - p_base) >= sizeof(cmd_args->argv0_fnbuf)) {
       fprintf(stderr, "fatal: emulator program name (argv[0]) too long for mount: %s\n", p_base);
       exit(252);
     }
-    memcpy(argv0_fnbuf, p_base, size);  /* Empty or ends with slash. */
-    argv0_fnbuf[size] = '\0';
-    remove_duplicate_slashes(argv0_fnbuf);
-    cmd_args.dir_state.linux_mount_dir['D' - 'A'] = argv0_fnbuf;  /* Either --mount=C:. (uppercase) or --mount=C-. (lowercase). */
-    /*if (cmd_args.dir_state.case_mode['D' - 'A'] == CASE_MODE_UNSPECIFIED) { ... }*/  /* Will be changed below. */
+    memcpy(cmd_args->argv0_fnbuf, p_base, size);  /* Empty or ends with slash. */
+    cmd_args->argv0_fnbuf[size] = '\0';
+    remove_duplicate_slashes(cmd_args->argv0_fnbuf);
+    cmd_args->dir_state.linux_mount_dir['D' - 'A'] = cmd_args->argv0_fnbuf;  /* Either --mount=C:. (uppercase) or --mount=C-. (lowercase). */
+    /*if (cmd_args->dir_state.case_mode['D' - 'A'] == CASE_MODE_UNSPECIFIED) { ... }*/  /* Will be changed below. */
   }
   dos_prog_drive = '\0';
 
@@ -674,67 +1044,69 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
   if (prog_filename_type == PFT_LINUX) {
     prog_name_arg = (char*)skip_dot_slash(prog_name_arg);
     remove_duplicate_slashes(prog_name_arg);
-    cmd_args.prog_filename = prog_name_arg;
-    if (cmd_args.dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) {  /* If not explicitly mounted, mount E: to the directory of prog_filename.  */
+    cmd_args->prog_filename = prog_name_arg;
+    if (cmd_args->dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) {  /* If not explicitly mounted, mount E: to the directory of prog_filename.  */
       const char *p = prog_name_arg + strlen(prog_name_arg), *q;
       size_t q_size;
       for (; p != prog_name_arg && p[-1] != '/'; --p) {}
       for (q = p; *q != '\0' && *q - 'a' + 0U > 'z' - 'a' + 0U; ++q) {}
-      if (cmd_args.dir_state.case_mode['E' - 'A'] == CASE_MODE_UNSPECIFIED) {
-        cmd_args.dir_state.case_mode['E' - 'A'] = (*q == '\0') ? CASE_MODE_UPPERCASE : CASE_MODE_LOWERCASE;  /* Mount as lowercase iff the executable program name has at least one lowercase character. */
+      if (cmd_args->dir_state.case_mode['E' - 'A'] == CASE_MODE_UNSPECIFIED) {
+        cmd_args->dir_state.case_mode['E' - 'A'] = (*q == '\0') ? CASE_MODE_UPPERCASE : CASE_MODE_LOWERCASE;  /* Mount as lowercase iff the executable program name has at least one lowercase character. */
       }
       q = prog_name_arg;
       while (q != p && q[0] == '.' && q[1] == '/') {  /* Skip ./ at the beginning. */
         for (q += 2; q != p && q[0] == '/'; ++q) {}
       }
       q_size = strlen(q) + 1;
-      if (q_size > sizeof(fnbuf)) {
+      if (q_size > sizeof(cmd_args->prog_fnbuf)) {
         fprintf(stderr, "fatal: Linux name of executable program too long: %s\n", q);
         exit(252);
       }
-      memcpy(fnbuf, q, q_size);  /* Including the trailing '\0'. */
-      cmd_args.prog_filename = fnbuf;
+      memcpy(cmd_args->prog_fnbuf, q, q_size);  /* Including the trailing '\0'. */
+      cmd_args->prog_filename = cmd_args->prog_fnbuf;
       *(char*)p = '\0';  /* Modify it in place in argv. */
-      cmd_args.dir_state.linux_mount_dir['E' - 'A'] = q;  /* Empty or ends with '/'. */
+      cmd_args->dir_state.linux_mount_dir['E' - 'A'] = q;  /* Empty or ends with '/'. */
       dos_prog_drive = 'E';
-      if (!is_drive_specified && !cmd_args.dir_state.linux_mount_dir[cmd_args.dir_state.drive - 'A']) cmd_args.dir_state.drive = 'E';
+      if (!is_drive_specified && !cmd_args->dir_state.linux_mount_dir[cmd_args->dir_state.drive - 'A']) cmd_args->dir_state.drive = 'E';
     }
-    if (cmd_args.dir_state.case_mode['D' - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args.dir_state.linux_mount_dir['D' - 'A']) {
-      cmd_args.dir_state.case_mode['D' - 'A'] = get_case_mode_from_last_component(cmd_args.prog_filename);  /* Mount as lowercase iff the executable program has at least one lowercase character. */
+    if (cmd_args->dir_state.case_mode['D' - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args->dir_state.linux_mount_dir['D' - 'A']) {
+      cmd_args->dir_state.case_mode['D' - 'A'] = get_case_mode_from_last_component(cmd_args->prog_filename);  /* Mount as lowercase iff the executable program has at least one lowercase character. */
     }
-    /* We will set cmd_args.dir_state.case_mode['C' - 'A'] later. */
+    /* We will set cmd_args->dir_state.case_mode['C' - 'A'] later. */
   } else {
-    if (cmd_args.dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) cmd_args.dir_state.linux_mount_dir['E' - 'A'] = NULL;  /* Drive E: not mounted by default. */
-    if (prog_filename_type == PFT_PATH && !dos_path && cmd_args.dir_state.drive == 'C' && cmd_args.dir_state.linux_mount_dir['C' - 'A'] && cmd_args.dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED) {  /* Just a command without a filename extension, e.g. "guest" or "GUEST". */
-      cmd_args.dir_state.case_mode['C' - 'A'] = get_case_mode_from_last_component(prog_name_arg);
+    if (cmd_args->dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) cmd_args->dir_state.linux_mount_dir['E' - 'A'] = NULL;  /* Drive E: not mounted by default. */
+    if (prog_filename_type == PFT_PATH && !dos_path && cmd_args->dir_state.drive == 'C' && cmd_args->dir_state.linux_mount_dir['C' - 'A'] && cmd_args->dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED) {  /* Just a command without a filename extension, e.g. "guest" or "GUEST". */
+      cmd_args->dir_state.case_mode['C' - 'A'] = get_case_mode_from_last_component(prog_name_arg);
     }
     { char drive;
       for (drive = 'C'; drive <= 'E'; ++drive) {
-        if (cmd_args.dir_state.case_mode[drive - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args.dir_state.linux_mount_dir[drive - 'A']) {
-          cmd_args.dir_state.case_mode[drive - 'A'] = CASE_MODE_UPPERCASE;
+        if (cmd_args->dir_state.case_mode[drive - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args->dir_state.linux_mount_dir[drive - 'A']) {
+          cmd_args->dir_state.case_mode[drive - 'A'] = CASE_MODE_UPPERCASE;
         }
       }
     }
-    /* cmd_args.dir_state.linux_mount_dir[...] and cmd_args.dir_state.case_mode[...] are used below. */
+    /* cmd_args->dir_state.linux_mount_dir[...] and cmd_args->dir_state.case_mode[...] are used below. */
     if (prog_filename_type == PFT_DOS) {
-      cmd_args.prog_filename = get_linux_filename_r(prog_name_arg, &cmd_args.dir_state, fnbuf, NULL);  /* Return value is fnbuf. */
-      if (*cmd_args.prog_filename == '\0') {
+      cmd_args->prog_filename = get_linux_filename_r(prog_name_arg, &cmd_args->dir_state, cmd_args->prog_fnbuf, NULL);  /* Return value is cmd_args->prog_fnbuf. */
+      if (*cmd_args->prog_filename == '\0') {
         fprintf(stderr, "fatal: <dos-executable-file> is not a valid DOS pathname or contains an invalid drive: %s\n", prog_name_arg);
         exit(252);
       }
     } else if (prog_filename_type == PFT_PATH) {
-      if (cmd_args.dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) cmd_args.dir_state.linux_mount_dir['E' - 'A'] = NULL;  /* Drive E: not mounted by default. */
-      cmd_args.prog_filename = get_linux_filename_r(prog_name_arg, NULL /* cmd_args.dir_state */, fnbuf, NULL);  /* Return value is fnbuf. */
-      if (*cmd_args.prog_filename == '\0') {
+      if (cmd_args->dir_state.linux_mount_dir['E' - 'A'] == placeholder_for_default) cmd_args->dir_state.linux_mount_dir['E' - 'A'] = NULL;  /* Drive E: not mounted by default. */
+      cmd_args->prog_filename = get_linux_filename_r(prog_name_arg, NULL /* cmd_args->dir_state */, cmd_args->prog_fnbuf, NULL);  /* Return value is cmd_args->prog_fnbuf. */
+      if (*cmd_args->prog_filename == '\0') {
         fprintf(stderr, "fatal: <dos-executable-file> is not a valid DOS filename: %s\n", prog_name_arg);
         exit(252);
       }
-      cmd_args.prog_filename = find_prog_on_path(prog_name_arg, &cmd_args.dir_state, dos_path, &dos_prog_drive);  /* Return value is fnbuf or NULL. */
-      if (!cmd_args.prog_filename) {
-        fprintf(stderr, "fatal: DOS command not found on %c:\\ or %%PATH%%: %s\n", cmd_args.dir_state.drive, prog_name_arg);
+      if (cmd_args->emu_params.is_timings) cmd_args->find_prog_sec = get_monotonic_sec();
+      cmd_args->prog_filename = find_prog_on_path(prog_name_arg, &cmd_args->dir_state, dos_path, &dos_prog_drive, cmd_args->prog_fnbuf, cmd_args->tmp_fnbuf);  /* Return value is cmd_args->prog_fnbuf or NULL. */
+      if (cmd_args->emu_params.is_timings) cmd_args->find_prog_sec = get_monotonic_sec() - cmd_args->find_prog_sec;
+      if (!cmd_args->prog_filename) {
+        fprintf(stderr, "fatal: DOS command not found on %c:\\ or %%PATH%%: %s\n", cmd_args->dir_state.drive, prog_name_arg);
         exit(252);
       }
-      if (*cmd_args.prog_filename == '\0') {
+      if (*cmd_args->prog_filename == '\0') {
         fprintf(stderr, "fatal: invalid <dos-executable-file> DOS program name: %s\n", prog_name_arg);
         exit(252);
       }
@@ -743,37 +1115,36 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
       exit(252);
     }
   }
-  prog_name_arg = NULL;  /* Make sure we don't use it later, we've already modified it for cmd_args.dir_state.linux_mount_dir['E' - 'A']. */
+  prog_name_arg = NULL;  /* Make sure we don't use it later, we've already modified it for cmd_args->dir_state.linux_mount_dir['E' - 'A']. */
 
-  if (!cmd_args.dir_state.linux_mount_dir[cmd_args.dir_state.drive - 'A']) {
-    /*cmd_args.dir_state.drive = 'C';*/
-    fprintf(stderr, "fatal: no mount point for default drive (specify --mount=...): %c:\n", cmd_args.dir_state.drive);
+  if (!cmd_args->dir_state.linux_mount_dir[cmd_args->dir_state.drive - 'A']) {
+    /*cmd_args->dir_state.drive = 'C';*/
+    fprintf(stderr, "fatal: no mount point for default drive (specify --mount=...): %c:\n", cmd_args->dir_state.drive);
     exit(1);
   }
-  if (cmd_args.dir_state.dos_prog_abs == NULL) {
-    cmd_args.dir_state.dos_prog_abs = get_dos_abs_filename_r(cmd_args.prog_filename, dos_prog_drive, &cmd_args.dir_state, dosfnbuf);
-    if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: prog_filename=(%s) dos_prog_abs=(%s) dos_prog_drive=%c\n", cmd_args.prog_filename, cmd_args.dir_state.dos_prog_abs, dos_prog_drive);
+  if (cmd_args->dir_state.dos_prog_abs == NULL) {
+    cmd_args->dir_state.dos_prog_abs = get_dos_abs_filename_r(cmd_args->prog_filename, dos_prog_drive, &cmd_args->dir_state, cmd_args->dos_prog_abs_buf);
+    if (CMD_PARSE_DEBUG) fprintf(stderr, "debug: prog_filename=(%s) dos_prog_abs=(%s) dos_prog_drive=%c\n", cmd_args->prog_filename, cmd_args->dir_state.dos_prog_abs, dos_prog_drive);
   }
-  if (prog_filename_type == PFT_LINUX && cmd_args.dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args.dir_state.linux_mount_dir['C' - 'A']) {
-    const char *mount_c = cmd_args.dir_state.linux_mount_dir['C' - 'A'];
+  if (prog_filename_type == PFT_LINUX && cmd_args->dir_state.case_mode['C' - 'A'] == CASE_MODE_UNSPECIFIED && cmd_args->dir_state.linux_mount_dir['C' - 'A']) {
+    const char *mount_c = cmd_args->dir_state.linux_mount_dir['C' - 'A'];
     const char *q;
-    if (cmd_args.dir_state.dos_prog_abs[0] == 'C' || strncmp(cmd_args.prog_filename, mount_c, strlen(mount_c)) == 0) {  /* Set case mode from the entire pathname. */
-      for (q = cmd_args.prog_filename; *q != '\0' && *q - 'a' + 0U > 'z' - 'a' + 0U; ++q) {}
-      cmd_args.dir_state.case_mode['C' - 'A'] = (*q == '\0') ? CASE_MODE_UPPERCASE : CASE_MODE_LOWERCASE;
+    if (cmd_args->dir_state.dos_prog_abs[0] == 'C' || strncmp(cmd_args->prog_filename, mount_c, strlen(mount_c)) == 0) {  /* Set case mode from the entire pathname. */
+      for (q = cmd_args->prog_filename; *q != '\0' && *q - 'a' + 0U > 'z' - 'a' + 0U; ++q) {}
+      cmd_args->dir_state.case_mode['C' - 'A'] = (*q == '\0') ? CASE_MODE_UPPERCASE : CASE_MODE_LOWERCASE;
     } else {  /* Set case mode from the basename only. */
-      cmd_args.dir_state.case_mode['C' - 'A'] = get_case_mode_from_last_component(cmd_args.prog_filename);
+      cmd_args->dir_state.case_mode['C' - 'A'] = get_case_mode_from_last_component(cmd_args->prog_filename);
     }
   }
 
-  cmd_args.args = (const char* const*)argv;
-  cmd_args.envp0 = (const char* const*)envp0;
-  *cmd_args_out = cmd_args;
+  cmd_args->args = (const char* const*)argv;
+  cmd_args->envp0 = (const char* const*)envp0;
 }
 
 
 /* --- End of command-line parser */
 
-#if 0  /* We don't use ROM and BIOS area and then XMS above DOS_MEM_LIMIT, we just map DOS_MEM_LIMIT. */
+#if 0  /* We don't map the ROM and BIOS area, see HMA_START and XMS_START for the memory above 1 MiB. */
 #define MEM_SIZE (2 << 20)  /* In bytes. 2 MiB. */
 #endif
 
@@ -785,11 +1156,18 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
  * 0x00534...0x0053f      +0xb  Unused (00).
  * 0x0053f...0x00540        +1  `retf' opcode used by country case map.
  * 0x00540...0x00640    +0x100  INT_HLT_PARA. hlt instructions for interrupt entry points. Needed for getting the interrupt number in KVM_EXIT_HLT.
- * 0x00640...0x00ff0    +0xabc  ENV_PARA. Environment variables and program pathname.
+ * 0x00640...0x00740    +0x100  INT_STUB_PARA. In-guest int 0x21 and int 0x16 fast path stubs and their state block.
+ * 0x00740...0x00ff0    +0x8b0  ENV_PARA. Environment variables and program pathname.
  * 0x00ff0...0x01000     +0x10  PROGRAM_MCB_PARA. Memory Control Block (MCB) of PSP.
  * 0x01000...0x01100    +0x100  PSP_PARA. Program Segment Prefix (PSP). https://stanislavs.org/helppc/program_segment_prefix.html
  * 0x01100...0xa0000  +0x9ef00  Loaded program image, .bss and stack. This region is called ``conventional memory''.
  * 0xa0000                  +0  DOS_ALLOC_PARA_LIMIT and DOS_MEM_LIMIT.
+ * 0xf0000...0xf0203    +0x203  INT_OUT_PARA. out instructions for interrupt entry points (--trampoline=out) and `retf 2'. Read-only.
+ *
+ * With --mem-mb=<n> (n >= 2), also:
+ *
+ * 0x100000..0x10fff0  +0xfff0  HMA_START. High memory area (HMA), via XMS.
+ * 0x110000...<n> MiB           XMS_START. Extended memory blocks (EMBs), via XMS.
  *
  * On a normal machine, there is also EBDA which ends at 0xa0000. You can
  * determine the size of the EBDA by using BIOS function `int 0x12', or by
@@ -873,6 +1251,19 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
 
 #define INT_HLT_PARA 0x54
 
+/* With --trampoline=out, the interrupt vectors point to INT_OUT_PARA:(int_num
+ * * 2) instead, each containing an `out int_num, al' instruction, which causes
+ * a KVM_EXIT_IO with port == int_num. After the host has handled the int,
+ * it continues at INT_OUT_PARA:INT_OUT_RET_OFS, which contains `retf 2',
+ * so the guest pops the return address, and the host doesn't have to change
+ * cs (and call the expensive KVM_SET_SREGS). The int_num * 2 offsets are
+ * like the entry points in the motherboard BIOS ROM of a real PC.
+ */
+#define INT_OUT_PARA 0xf000
+#define INT_OUT_RET_OFS 0x200
+/* Guest memory (at mem) is mapped at least up to here, for the INT_OUT_PARA page. */
+#define INT_OUT_LIMIT ((INT_OUT_PARA << 4) + 0x1000)
+
 /* Start of Program Segment Prefix (PSP) in paragraphs (unit of 16 bytes).
  * It must be at leasge GUEST_MEM_MODULE_START >> 4, otherwise it isn't
  * writable by the program.
@@ -891,20 +1282,53 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
 
 #define PROGRAM_MCB_PARA (PSP_PARA - 1)
 
+/* In-guest front-end code for int 0x21 and int 0x16 (see int_stub_code),
+ * starting with a state block (ISS_...) written by kvikdos (host) before
+ * each KVM_RUN, not to be written by the guest. It answers some simple
+ * calls without a VM exit.
+ */
+#define INT_STUB_PARA 0x64
+#define ISS_DTA 0  /* dword: DTA (offset, segment). */
+#define ISS_PSP 4  /* word: PSP segment. */
+#define ISS_DRIVE 6  /* byte: current drive, 0 means A:. */
+#define ISS_FLAGS 7  /* byte: ISF_... bits. */
+#define ISS_GET_INTS 8  /* 32 bytes: bitmap of int_nums for which int 0x21 ah == 0x35 can be answered by the guest. */
+#define ISS_SIZE 0x28
+#define ISF_VERSION 1  /* int 0x21 ah == 0x30 can be answered by the guest. */
+#define INT21_STUB_OFS 0x28
+#define INT16_STUB_OFS 0xa1
+#define XMS_STUB_OFS 0xc6  /* XMS driver entry point (far call), see int 0x2f ax == 0x4310. */
+#define XMS_STUB_RET_OFS (XMS_STUB_OFS + 0xb)  /* Return address of the call to the hlt of int 0x2f within the XMS stub. */
+/* Far pointers to host trampolines within int_stub_code, set by run_dos_prog(...) to INT_TRAMPOLINE_VALUE(...). */
+#define INT21_STUB_HOST_OFS 0x47  /* int 0x21. */
+#define INT16_STUB_HOST_OFS 0xac  /* int 0x16. */
+#define XMS_STUB_HOST_OFS (XMS_STUB_RET_OFS - 4)  /* int 0x2f. */
+
 /* Environment starts at this paragraph. */
-#define ENV_PARA 0x64
+#define ENV_PARA 0x74
 /* How long the environment can extend (in bytes). */
 #define ENV_LIMIT (PROGRAM_MCB_PARA << 4)
 
 /* Must be a multiple of the Linux page size (0x1000), minimum value is
  * 0x500 (after magic interrupt table). Must be at most PSP_PARA << 4. Can
  * be 0. By setting it to nonzero (0x1000), we effectively make the magic
- * interrupt table read-only.
+ * interrupt table read-only, and then each write of the DOS program to the
+ * IVT or the environment becomes a slow KVM_EXIT_MMIO. With 0, these writes
+ * run at native speed, and kvikdos checks the changed interrupt vectors
+ * at the next int call handled by kvikdos, see check_ivt_changes(...).
  */
-#define GUEST_MEM_MODULE_START 0x1000
+#define GUEST_MEM_MODULE_START 0
 
-/* Points to 0x40:int_num, pointer encoded as cs:ip. */
-#define MAGIC_INT_VALUE(int_num) ((unsigned)INT_HLT_PARA << 16 | (unsigned)int_num)
+/* Points to the host trampoline of int_num, pointer encoded as cs:ip. */
+#define INT_TRAMPOLINE_VALUE(int_num) (run_state->int_trampoline == TRAMPOLINE_OUT ? \
+    (unsigned)INT_OUT_PARA << 16 | (unsigned)(int_num) << 1 : \
+    (unsigned)INT_HLT_PARA << 16 | (unsigned)(int_num))
+
+/* Points to the host trampoline of int_num or to the stub, pointer encoded as cs:ip. */
+#define MAGIC_INT_VALUE(int_num) ( \
+    (int_num) == 0x21 ? (unsigned)INT_STUB_PARA << 16 | INT21_STUB_OFS : \
+    (int_num) == 0x16 ? (unsigned)INT_STUB_PARA << 16 | INT16_STUB_OFS : \
+    INT_TRAMPOLINE_VALUE(int_num))
 
 /* Maximum byte offset where the program (including .bss and stack) can end.
  * 640 KiB should be enough for everyone :-).
@@ -916,6 +1340,11 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
 /* Points after last paragraph which can be allocated by DOS, conventional memory. 640 KiB. */
 #define DOS_ALLOC_PARA_LIMIT 0xa000
 
+/* With --mem-mb=<n> (n >= 2) only. See handle_xms_call(...). */
+#define HMA_START 0x100000  /* Linear address of 0xffff:0x0010. */
+#define HMA_SIZE 0xfff0
+#define XMS_START 0x110000  /* Extended memory blocks (EMBs) start here. */
+
 /* .com size + 0x100 bytes of PSP + stack must be at most 0x10000 bytes. The
  * absolute minimum stack size for kvikdos is 8 bytes (2 bytes for the
  * return address and 6 bytest for interrupt return (iret), but we play it
@@ -935,6 +1364,7 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
  *   it can do 0x10 bytes of stack.
  */
 #define MAX_DOS_COM_SIZE 0xfef0
+#define COM_MIN_PARA 0x1000  /* Memory block size (including the PSP) needed to load a DOS .com program. */
 
 #define PROGRAM_HEADER_SIZE 26  /* Large enough for .exe header (prefix of 26 bytes) and other header detection. */
 
@@ -945,12 +1375,74 @@ static void parse_args(char **argv, struct ParsedCmdArgs *cmd_args_out, const ch
 
 #define FINDFIRST_MAGIC 0xd5ba1ad0U
 
+/* --- Run state.
+ *
+ * The host-side state of running DOS programs on an EmuState: caches,
+ * buffers, bookkeeping of Linux fds, and the collectors of --profile=...,
+ * --sample-hz=..., --trace=... and --timings. Each EmuState has its own,
+ * allocated by select_run_state(...), and kvikdos_run(...) makes it the
+ * current one, so DOS programs run on different EmuStates don't share
+ * caches or buffers.
+ */
+
+typedef struct DosRunState {
+  char int_trampoline;  /* TRAMPOLINE_..., for the DOS program being run, set by run_dos_prog(...). */
+  struct McbIndex *mcb_index;
+  /* Linux file descriptors of the emulator (other than the KVM fds) which
+   * must not be visible to DOS programs. Used by the --serve worker for its
+   * listening socket, connection and saved stdio (0 ... 5), and by
+   * run_dos_batch(...) for the saved stdin and stdout of a redirected
+   * command (6 and 7), by --async-io for its io_uring (8), and by
+   * kvikdos_run(...) for the saved stdio (9 ... 11). -1 means unused.
+   */
+  int hidden_fds[12];
+  unsigned char ram_fd_bits[0x10000 >> 3];  /* Linux fds holding the files of the in-memory drives (see RamFile), also hidden. */
+  struct HandleBuf *handle_bufs;  /* HANDLE_BUF_COUNT entries. */
+  unsigned handle_buf_evict_idx;  /* Round-robin eviction if all slots are used. */
+  unsigned char handle_nocache_bits[0x10000 >> 3];  /* Linux fds sharing their file offset with another fd (dup(...)), never buffered. */
+  unsigned char handle_error_bits[0x10000 >> 3];  /* Linux fds whose buffered data failed to sync, reported by the next read, write, seek or close. */
+  char is_async_io;  /* --async-io. Cleared if io_uring is not available. */
+  struct AsyncIoSlot *async_io_slots;  /* ASYNC_IO_SLOT_COUNT entries. */
+  unsigned async_io_in_flight;
+  int async_io_fd;
+  pid_t async_io_pid;  /* Process which has created the ring. A forked child (e.g. --batch-jobs=<n>) creates its own. */
+  volatile uint32_t *async_io_sq_tail, *async_io_sq_array, *async_io_cq_head, *async_io_cq_tail;
+  uint32_t async_io_sq_mask, async_io_cq_mask;
+  struct AsyncIoSqe *async_io_sqes;
+  const struct AsyncIoCqe *async_io_cqes;
+  /* CLOCK_... and the epoch of the DOS program being run, set by run_dos_prog(...). */
+  char clock_mode;
+  unsigned long clock_epoch;
+  unsigned long clock_exit_count;  /* VM exits since the start of kvikdos_run(...), for CLOCK_VIRTUAL. */
+  unsigned char clock_written_fd_bits[0x10000 >> 3];  /* Linux fds written by the DOS program (only with CLOCK_FIXED and CLOCK_VIRTUAL), see stamp_written_file(...). */
+  struct FnCacheEntry *fn_cache;  /* FN_CACHE_SIZE entries. Direct-mapped, indexed by hash. */
+  struct FnCacheEntry *fn_cache_last;  /* Entry of the last get_linux_filename_cached_r(...) call, or NULL. */
+  unsigned fn_cache_enoent_generation;  /* 0 is never used. */
+  char is_enoent_cache_enabled;
+  struct RamFile **ram_files;  /* RAM_FILE_HASH_SIZE buckets. */
+  struct Overlay *overlays;  /* DRIVE_COUNT entries. */
+  unsigned overlay_count;  /* Number of entries used in overlays. */
+  struct OverlayChange **overlay_changes;  /* OVERLAY_CHANGE_HASH_SIZE buckets. */
+  struct TraceState *tracer;  /* NULL unless --trace=... is active. */
+  struct FindDir *find_dirs;  /* FIND_DIR_COUNT entries. */
+  struct FindDirName *find_dir_names;  /* find_dir_name_count entries, never evicted. */
+  unsigned find_dir_name_count, find_dir_name_capacity;
+  unsigned find_dir_next_id;
+  unsigned find_dir_epoch;
+  unsigned find_dir_evict_idx;  /* Round-robin eviction if all slots are used. */
+  struct ProfileState *profile;  /* NULL unless --profile=... is active. */
+  struct SampleState *sampler;  /* NULL unless --sample-hz=... is active. */
+  struct TimingsState *timings;  /* NULL unless --timings is active. */
+} DosRunState;
+
+static DosRunState *run_state;  /* Of the EmuState being run, see select_run_state(...). */
+
 /* --- Memory allocation helpers. */
 
-#define PROCESS_ID  0x192  /* Same as in DOSBox. */
+#define PROCESS_ID PSP_PARA  /* Owner of the memory blocks of the main program: its PSP, as in DOS. Nested exec children own theirs by their PSPs. */
 
 #define MCB_TYPE(mcb) (*(char*)(mcb))  /* 'Z' indicates last member of MCB chain; 'M' would be non-last. */
-#define MCB_PID(mcb) (*(unsigned short*)((char*)(mcb) + 1)) /* 0 indicates free block, PROCESS_ID indicates used block. */
+#define MCB_PID(mcb) (*(unsigned short*)((char*)(mcb) + 1)) /* 0 indicates free block, otherwise the PSP of the owner (e.g. PROCESS_ID). */
 #define MCB_SIZE_PARA(mcb) (*(unsigned short*)((char*)(mcb) + 3))  /* Block size in paragraphs (excluding MCB), must be at least 1 in kvikdos. */
 #define MCB_PSIZE_PARA(mcb) (*(unsigned short*)((char*)(mcb) + 5))  /* Size of previous block (excluding MCB), or 0 if this is the first block. This is a kvikdos-specific field, DOS doesn't specify it. */
 
@@ -982,7 +1474,7 @@ static char is_mcb_bad(void *mem, unsigned short block_para) {
   } else if (MCB_TYPE(mcb) != 'M') {
     return 5;  /* Bad MCB type. */
   }
-  if (MCB_PID(mcb) != 0 && MCB_PID(mcb) != PROCESS_ID) return 6;  /* Bad MCB process ID. */
+  if (MCB_PID(mcb) != 0 && (MCB_PID(mcb) < PSP_PARA || MCB_PID(mcb) >= DOS_ALLOC_PARA_LIMIT)) return 6;  /* Bad MCB process ID, not a PSP. */
   size_para = MCB_SIZE_PARA(mcb);
   if (MCB_TYPE(mcb) == 'Z') {
     if (block_para + size_para > DOS_ALLOC_PARA_LIMIT) return 7;  /* Final MCB too long. */
@@ -1005,9 +1497,247 @@ static char is_mcb_bad(void *mem, unsigned short block_para) {
   return 0;  /* MCB looks good. */
 }
 
+/* --- Free memory block index.
+ *
+ * The MCB chain in DOS memory is authoritative (programs may walk it, see
+ * int 0x21 ah == 0x52), but finding a fit by walking it makes malloc(),
+ * and thus programs doing many allocations, slow. So we keep the free
+ * blocks (and the unallocated area after the last block, called the tail)
+ * in two treaps sharing the same nodes: one is ordered by block_para (with
+ * the maximum size in each subtree for first fit and last fit), the other
+ * one is ordered by (size_para, block_para) (for best fit). Each operation
+ * is O(log n).
+ *
+ * The index is rebuilt from the MCB chain lazily, after the DOS program
+ * (or its parent in a nested exec) has been loaded or resumed. The int
+ * 0x21 memory handlers update it incrementally, and they verify the MCB of
+ * the found block before using it, rebuilding the index on mismatch.
+ */
+
+#define MI_ADDR 0
+#define MI_SIZE 1
+
+/* Each free block (with its MCB) takes at least 1 paragraph, and it is followed by a used block. */
+#define MCB_INDEX_NODE_LIMIT ((DOS_ALLOC_PARA_LIMIT - PSP_PARA) / 2 + 2)
+
+typedef struct McbIndexNode {
+  unsigned short block_para;
+  unsigned short size_para;
+  unsigned short max_size_para;  /* Maximum size_para in the subtree of the MI_ADDR treap. */
+  unsigned short prio;  /* Random treap priority, same in both treaps. */
+  unsigned short child[2][2];  /* child[MI_ADDR or MI_SIZE][0 for left, 1 for right]. 0 means none. */
+} McbIndexNode;
+
+typedef struct McbIndex {
+  char is_valid;
+  unsigned short root[2];
+  unsigned short free_list;  /* Freed nodes, linked by child[MI_ADDR][0]. */
+  unsigned short node_count;  /* Nodes 1 ... node_count - 1 have been used, node 0 is the nil sentinel. */
+  unsigned short block_count;  /* Number of blocks in the index. */
+  unsigned short last_block_para;  /* block_para of the last ('Z') MCB. */
+  unsigned short tail_para;  /* block_para of the tail, or 0 if there is no tail. */
+  unsigned rand_state;
+  McbIndexNode nodes[MCB_INDEX_NODE_LIMIT];
+} McbIndex;
+
+#define MI_NODE(n) (run_state->mcb_index->nodes + (n))
+
+static char is_mcb_index_less(unsigned tree, const McbIndexNode *a, const McbIndexNode *b) {
+  if (tree == MI_SIZE && a->size_para != b->size_para) return a->size_para < b->size_para;
+  return a->block_para < b->block_para;
+}
+
+static void fix_mcb_index_node(unsigned tree, McbIndexNode *t) {
+  if (tree == MI_ADDR) {
+    unsigned max_size_para = t->size_para;
+    if (t->child[MI_ADDR][0] && MI_NODE(t->child[MI_ADDR][0])->max_size_para > max_size_para) max_size_para = MI_NODE(t->child[MI_ADDR][0])->max_size_para;
+    if (t->child[MI_ADDR][1] && MI_NODE(t->child[MI_ADDR][1])->max_size_para > max_size_para) max_size_para = MI_NODE(t->child[MI_ADDR][1])->max_size_para;
+    t->max_size_para = max_size_para;
+  }
+}
+
+/* Inserts node n to the subtree t, and returns the new subtree root. */
+static unsigned short insert_mcb_index_node(unsigned tree, unsigned short t, unsigned short n) {
+  McbIndexNode *tp, *cp;
+  unsigned d;
+  unsigned short c;
+  if (!t) return n;
+  tp = MI_NODE(t);
+  d = !is_mcb_index_less(tree, MI_NODE(n), tp);
+  c = tp->child[tree][d] = insert_mcb_index_node(tree, tp->child[tree][d], n);
+  cp = MI_NODE(c);
+  if (cp->prio > tp->prio) {  /* Rotate c up. */
+    tp->child[tree][d] = cp->child[tree][!d];
+    cp->child[tree][!d] = t;
+    fix_mcb_index_node(tree, tp);
+    fix_mcb_index_node(tree, cp);
+    return c;
+  }
+  fix_mcb_index_node(tree, tp);
+  return t;
+}
+
+static unsigned short merge_mcb_index_nodes(unsigned tree, unsigned short l, unsigned short r) {
+  if (!l) return r;
+  if (!r) return l;
+  if (MI_NODE(l)->prio > MI_NODE(r)->prio) {
+    MI_NODE(l)->child[tree][1] = merge_mcb_index_nodes(tree, MI_NODE(l)->child[tree][1], r);
+    fix_mcb_index_node(tree, MI_NODE(l));
+    return l;
+  } else {
+    MI_NODE(r)->child[tree][0] = merge_mcb_index_nodes(tree, l, MI_NODE(r)->child[tree][0]);
+    fix_mcb_index_node(tree, MI_NODE(r));
+    return r;
+  }
+}
+
+/* Removes node n from the subtree t, and returns the new subtree root. */
+static unsigned short remove_mcb_index_node(unsigned tree, unsigned short t, unsigned short n) {
+  McbIndexNode * const tp = MI_NODE(t);
+  if (t == n) return merge_mcb_index_nodes(tree, tp->child[tree][0], tp->child[tree][1]);
+  if (!t) return 0;  /* Not found, shouldn't happen. */
+  if (is_mcb_index_less(tree, MI_NODE(n), tp)) {
+    tp->child[tree][0] = remove_mcb_index_node(tree, tp->child[tree][0], n);
+  } else {
+    tp->child[tree][1] = remove_mcb_index_node(tree, tp->child[tree][1], n);
+  }
+  fix_mcb_index_node(tree, tp);
+  return t;
+}
+
+static void add_to_mcb_index(unsigned block_para, unsigned size_para) {
+  McbIndex * const mcb_index = run_state->mcb_index;
+  unsigned short n;
+  McbIndexNode *np;
+  if (mcb_index->free_list) {
+    n = mcb_index->free_list;
+    mcb_index->free_list = MI_NODE(n)->child[MI_ADDR][0];
+  } else if (mcb_index->node_count < MCB_INDEX_NODE_LIMIT) {
+    n = mcb_index->node_count++;
+  } else {
+    fprintf(stderr, "assert: too many free MCBs\n");
+    exit(252);
+  }
+  np = MI_NODE(n);
+  np->block_para = block_para;
+  np->max_size_para = np->size_para = size_para;
+  mcb_index->rand_state ^= mcb_index->rand_state << 13;  /* xorshift32. */
+  mcb_index->rand_state ^= mcb_index->rand_state >> 17;
+  mcb_index->rand_state ^= mcb_index->rand_state << 5;
+  np->prio = (unsigned short)(mcb_index->rand_state >> 8);
+  np->child[MI_ADDR][0] = np->child[MI_ADDR][1] = np->child[MI_SIZE][0] = np->child[MI_SIZE][1] = 0;
+  mcb_index->root[MI_ADDR] = insert_mcb_index_node(MI_ADDR, mcb_index->root[MI_ADDR], n);
+  mcb_index->root[MI_SIZE] = insert_mcb_index_node(MI_SIZE, mcb_index->root[MI_SIZE], n);
+  ++mcb_index->block_count;
+}
+
+/* Returns the node with the smallest block_para >= min_block_para, or 0. */
+static unsigned short find_mcb_index_at_or_after(unsigned min_block_para) {
+  unsigned short t = run_state->mcb_index->root[MI_ADDR], result = 0;
+  while (t) {
+    if (MI_NODE(t)->block_para >= min_block_para) {
+      result = t;
+      t = MI_NODE(t)->child[MI_ADDR][0];
+    } else {
+      t = MI_NODE(t)->child[MI_ADDR][1];
+    }
+  }
+  return result;
+}
+
+/* Removes the blocks start_para <= block_para < end_para from the index. */
+static void remove_range_from_mcb_index(unsigned start_para, unsigned end_para) {
+  unsigned short n;
+  while ((n = find_mcb_index_at_or_after(start_para)) != 0 && MI_NODE(n)->block_para < end_para) {
+    run_state->mcb_index->root[MI_ADDR] = remove_mcb_index_node(MI_ADDR, run_state->mcb_index->root[MI_ADDR], n);
+    run_state->mcb_index->root[MI_SIZE] = remove_mcb_index_node(MI_SIZE, run_state->mcb_index->root[MI_SIZE], n);
+    MI_NODE(n)->child[MI_ADDR][0] = run_state->mcb_index->free_list;
+    run_state->mcb_index->free_list = n;
+    --run_state->mcb_index->block_count;
+  }
+}
+
+/* Updates the index after the MCB chain has been changed in the blocks
+ * start_para <= block_para < end_para (or, if the last MCB is reached,
+ * anywhere from start_para). start_para must be the block_para of an
+ * existing MCB. Returns nonzero (and invalidates the index) on a bad MCB.
+ */
+static char update_mcb_index(void *mem, unsigned start_para, unsigned end_para) {
+  unsigned block_para;
+  if (!run_state->mcb_index->is_valid) return 0;  /* It will be rebuilt later. */
+  remove_range_from_mcb_index(start_para, end_para);
+  for (block_para = start_para;;) {
+    const char * const mcb = (const char*)mem + (block_para << 4) - 16;
+    if (is_mcb_bad(mem, block_para)) {
+      run_state->mcb_index->is_valid = 0;
+      return 1;
+    }
+    if (MCB_TYPE(mcb) == 'Z') {
+      remove_range_from_mcb_index(block_para, DOS_ALLOC_PARA_LIMIT + 1);  /* The old tail. */
+      run_state->mcb_index->last_block_para = block_para;
+      block_para += 1 + MCB_SIZE_PARA(mcb);
+      if (block_para <= DOS_ALLOC_PARA_LIMIT) {
+        run_state->mcb_index->tail_para = block_para;
+        add_to_mcb_index(block_para, DOS_ALLOC_PARA_LIMIT - block_para);
+      } else {
+        run_state->mcb_index->tail_para = 0;
+      }
+      break;
+    }
+    if (MCB_PID(mcb) == 0) add_to_mcb_index(block_para, MCB_SIZE_PARA(mcb));
+    block_para += 1 + MCB_SIZE_PARA(mcb);
+    if (block_para >= end_para) break;
+  }
+  return 0;
+}
+
+/* Returns nonzero on a bad MCB. */
+static char rebuild_mcb_index(void *mem) {
+  run_state->mcb_index->root[MI_ADDR] = run_state->mcb_index->root[MI_SIZE] = run_state->mcb_index->free_list = 0;
+  run_state->mcb_index->node_count = 1;
+  run_state->mcb_index->block_count = 0;
+  run_state->mcb_index->rand_state = 0x2545f491;  /* Deterministic, for reproducible runs. */
+  run_state->mcb_index->is_valid = 1;
+  return update_mcb_index(mem, PSP_PARA, DOS_ALLOC_PARA_LIMIT + 1);
+}
+
+/* Returns the node of the first-fit (lowest block_para, is_last == 0) or
+ * last-fit (highest block_para, is_last == 1) block, or 0 if none.
+ */
+static unsigned short find_mcb_index_first_fit(unsigned size_para, char is_last) {
+  unsigned short t = run_state->mcb_index->root[MI_ADDR];
+  if (!t || MI_NODE(t)->max_size_para < size_para) return 0;
+  for (;;) {  /* Invariant: MI_NODE(t)->max_size_para >= size_para. */
+    const McbIndexNode * const tp = MI_NODE(t);
+    const unsigned short c = tp->child[MI_ADDR][(unsigned char)is_last];
+    if (c && MI_NODE(c)->max_size_para >= size_para) {
+      t = c;
+    } else if (tp->size_para >= size_para) {
+      return t;
+    } else {
+      t = tp->child[MI_ADDR][!is_last];
+    }
+  }
+}
+
+/* Returns the node of the best-fit block (smallest size_para, then lowest block_para), or 0 if none. */
+static unsigned short find_mcb_index_best_fit(unsigned size_para) {
+  unsigned short t = run_state->mcb_index->root[MI_SIZE], result = 0;
+  while (t) {
+    if (MI_NODE(t)->size_para >= size_para) {
+      result = t;
+      t = MI_NODE(t)->child[MI_SIZE][0];
+    } else {
+      t = MI_NODE(t)->child[MI_SIZE][1];
+    }
+  }
+  return result;
+}
+
 #if DEBUG || DEBUG_ALLOC
 static void check_all_mcbs(void *mem) {
-  unsigned block_para = PSP_PARA;
+  unsigned block_para = PSP_PARA, free_count = 0;
+  unsigned short n;
   for (;;) {
     const char mcb_error = is_mcb_bad(mem, block_para);
     const char * const mcb = (const char*)mem + (block_para << 4) - 16;
@@ -1016,8 +1746,19 @@ static void check_all_mcbs(void *mem) {
       exit(252);
     }
     if (MCB_TYPE(mcb) == 'Z') break;
+    if (MCB_PID(mcb) == 0) {
+      ++free_count;
+      if (run_state->mcb_index->is_valid && ((n = find_mcb_index_at_or_after(block_para)) == 0 || MI_NODE(n)->block_para != block_para || MI_NODE(n)->size_para != MCB_SIZE_PARA(mcb))) {
+        fprintf(stderr, "fatal: free MCB missing from index: block_para=0x%04x\n", block_para);
+        exit(252);
+      }
+    }
     block_para += 1 + MCB_SIZE_PARA(mcb);
   }
+  if (run_state->mcb_index->is_valid && run_state->mcb_index->block_count != free_count + (run_state->mcb_index->tail_para != 0)) {
+    fprintf(stderr, "fatal: bad free MCB count in index: %u\n", run_state->mcb_index->block_count);
+    exit(252);
+  }
 }
 #define DEBUG_CHECK_ALL_MCBS(mem) check_all_mcbs(mem)
 #else
@@ -1177,16 +1918,17 @@ static const unsigned char fixed_exepack_stub[283] = {
 #define EXE_NOVERLAY 13  /* Ignored and not even loaded by kvikdos. */
 
 /* Load DOS executable program from (img_fd, filename, header, header_size)
- * to (mem, regs and sregs), return the size (para count) of the memory
- * block allocated in *block_size_para_out.
+ * to (mem, regs and sregs), with its PSP at psp_para, in a memory block of
+ * *block_size_para_inout paragraphs (including the PSP). Returns the size
+ * (para count) needed by the program in *block_size_para_inout.
  *
  * r is the total number of header bytes alreday read from img_fd by
  * detect_dos_executable_program. Returns the Program Segment Prefix (PSP)
  * address.
  */
-static char *load_dos_executable_program(int img_fd, const char *filename, void *mem, const char *header, int header_size, struct kvm_regs *regs, struct kvm_sregs *sregs, unsigned short *block_size_para_out) {
+static char *load_dos_executable_program(int img_fd, const char *filename, void *mem, const char *header, int header_size, unsigned short psp_para, unsigned short env_para, struct kvm_regs *regs, struct kvm_sregs *sregs, unsigned short *block_size_para_inout) {
 #define MEMSIZE_AVAILABLE_PARA ((DOS_MEM_LIMIT >> 4) - PSP_PARA - 0x10 /* PSP */)
-  const unsigned memsize_available_para = MEMSIZE_AVAILABLE_PARA;
+  const unsigned memsize_available_para = *block_size_para_inout - 0x10 /* PSP */;
   char *psp;
   if (header_size >= 24 && (('M' | 'Z' << 8) == ((unsigned short*)header)[EXE_SIGNATURE] || ('M' << 8 | 'Z') == ((unsigned short*)header)[EXE_SIGNATURE])) {
     const unsigned short * const exehdr = (const unsigned short*)header;
@@ -1196,8 +1938,8 @@ static char *load_dos_executable_program(int img_fd, const char *filename, void
     const unsigned image_size = exesize - headsize;
     unsigned memsize_min_para = (nblocks << 5) - exehdr[EXE_HDRSIZE] + exehdr[EXE_MINALLOC];  /* This includes .bss after the image. Please note that this doesn't depend on exehdr[EXE_LASTSIZE]. Formula is same as in MS-DOS 6.22, FreeDOS 1.2, DOSBox 0.74-4. */
     const unsigned memsize_max_para = (unsigned short)(exehdr[EXE_MAXALLOC] + 1) < 2 ? 0xffff : (nblocks << 5) - exehdr[EXE_HDRSIZE] + exehdr[EXE_MAXALLOC];
-    char * const image_addr = (char*)mem + (PSP_PARA << 4) + 0x100;
-    const unsigned image_para = PSP_PARA + 0x10;
+    char * const image_addr = (char*)mem + (psp_para << 4) + 0x100;
+    const unsigned image_para = psp_para + 0x10;
     unsigned reloc_count = exehdr[EXE_NRELOC];
     const unsigned stack_end_plus_0x100 = ((unsigned)(unsigned short)(exehdr[EXE_SS] + 0x10) << 4) + (exehdr[EXE_SP] ? exehdr[EXE_SP] : 0x10000);
     if (exehdr[EXE_LASTSIZE] > 0x200) {
@@ -1271,7 +2013,7 @@ static char *load_dos_executable_program(int img_fd, const char *filename, void
     *(unsigned short*)&regs->rsp = exehdr[EXE_SP];
     sregs->ss.selector = exehdr[EXE_SS] + image_para;
     *(unsigned*)(psp + 6) = 0xc0;  /* CP/M far call 5 service request address. Obsolete. */
-    *block_size_para_out = ((memsize_max_para > memsize_available_para) ? memsize_available_para : memsize_max_para) + 0x10 /* PSP */;
+    *block_size_para_inout = ((memsize_max_para > memsize_available_para) ? memsize_available_para : memsize_max_para) + 0x10 /* PSP */;
     if (exehdr[EXE_IP] == 16 || exehdr[EXE_IP] == 18 || exehdr[EXE_IP] == 20) {  /* Detect exepack, find decompression stub within it, replace stub with fixed stub to avoid ``Packed file is corrupt'' error. DOS 5.0 does a similar fix. */
       /* More info about the A20 bug in the exepack stubs: https://github.com/joncampbell123/dosbox-x/issues/7#issuecomment-667653041
        * More info about the exepack file format: https://www.bamsoftware.com/software/exepack/
@@ -1316,7 +2058,7 @@ static char *load_dos_executable_program(int img_fd, const char *filename, void
     }
   } else {
     /* Load DOS .com program. */
-    char * const p = (char *)mem + (PSP_PARA << 4) + 0x100;
+    char * const p = (char *)mem + (psp_para << 4) + 0x100;
     int r;
     memcpy(p, header, header_size);
     r = read(img_fd, p + header_size, MAX_DOS_COM_SIZE + 1 - header_size);
@@ -1329,23 +2071,23 @@ static char *load_dos_executable_program(int img_fd, const char *filename, void
       fprintf(stderr, "fatal: DOS executable program too long: %s\n", filename);
       exit(252);
     }
-    sregs->cs.selector = sregs->ss.selector = PSP_PARA;
-    psp = (char*)mem + (PSP_PARA << 4);  /* Program Segment Prefix. */
+    sregs->cs.selector = sregs->ss.selector = psp_para;
+    psp = (char*)mem + (psp_para << 4);  /* Program Segment Prefix. */
     *(unsigned short*)&regs->rsp = 0xfffe;
     *(unsigned short*)(psp + *(unsigned short*)&regs->rsp) = 0;  /* Push a 0 byte. */
     *(unsigned short*)(psp + 6) = MAX_DOS_COM_SIZE + 0x100;  /* .COM bytes available in segment (CP/M). DOSBox doesn't initialize it. */
     /*memset(psp, 0, 0x100);*/  /* Not needed, mmap MAP_ANONYMOUS has done it. */
     *(unsigned short*)&regs->rip = 0x100;  /* DOS .com entry point. */
-    /* No need to check for DOS_MEM_LIMIT at runtime, because (PSP_PARA << 4) + 0x100 + MAX_DOS_COM_SIZE + 0x10 < DOS_MEM_LIMIT. */
-    { struct SA { int StaticAssert_MinimumComMemory : MEMSIZE_AVAILABLE_PARA + 0x10 >= 0x1000; }; }
-    *block_size_para_out = memsize_available_para + 0x10 /* PSP */;  /* Minimum would be 0x1000 paras (65536 bytes), including PSP. */
+    /* No need to check for DOS_MEM_LIMIT at runtime, because (PSP_PARA << 4) + 0x100 + MAX_DOS_COM_SIZE + 0x10 < DOS_MEM_LIMIT. Nested exec children get at least COM_MIN_PARA. */
+    { struct SA { int StaticAssert_MinimumComMemory : MEMSIZE_AVAILABLE_PARA + 0x10 >= COM_MIN_PARA; }; }
+    *block_size_para_inout = memsize_available_para + 0x10 /* PSP */;  /* Minimum would be COM_MIN_PARA paras (65536 bytes), including PSP. */
   }
 
   /* https://github.com/svn2github/dosbox/blob/acd380bcde72db74f3b476253899016f686bc0ef/src/dos/dos_execute.cpp#L501-L506 */
   *(unsigned short*)&regs->rax = 0;  /* FreeDOS 1.2 sets AH and AL to 0xff or 0x00 according to some FCB value (fcbcode) (https://github.com/FDOS/kernel/blob/8c8d21311974e3274b3c03306f3113ee77ff2f45/kernel/task.c#L339-L341), but most of the time they end up as 0. */
   *(unsigned short*)&regs->rbx = 0;  /* FreeDOS 1.2 and DOSBox 0.74-4 sets BX the same way as AX, i.e. based on some FCB values. */
   *(unsigned short*)&regs->rcx = 0xff;
-  *(unsigned short*)&regs->rdx = PSP_PARA;
+  *(unsigned short*)&regs->rdx = psp_para;
   *(unsigned short*)&regs->rsi = *(unsigned short*)&regs->rip;
   *(unsigned short*)&regs->rdi = *(unsigned short*)&regs->rsp;
   /**(unsigned short*)&regs->rsp = ...;*/  /* Set above. */
@@ -1354,19 +2096,19 @@ static char *load_dos_executable_program(int img_fd, const char *filename, void
   *(unsigned short*)&regs->rflags = 0x7202;  /* DOSBox 0.74-4 sets it to 0x7202 == (reserved|IF|IOPL3|NT) (and so do we), MS-DOS 6.22 sets it to 0x7246 == (reserved|AF|ZF|IF|IOPL3|NT), FreeDOS 1.2 sets it to 0x0200, but will be changed to 0x0202 (reserved|IF). */
   /**(unsigned short*)&regs->rip = ...;*/  /* Set above. */
   /*sregs->cs.selector = ...;*/  /* Set above. */
-  sregs->ds.selector = PSP_PARA;  /* Set above. */
-  sregs->es.selector = PSP_PARA;  /* Set above. */
+  sregs->ds.selector = psp_para;  /* Set above. */
+  sregs->es.selector = psp_para;  /* Set above. */
   /*sregs->ss.selector = ...;*/  /* Set above. */
 
   /* https://stanislavs.org/helppc/program_segment_prefix.html */
-  *(unsigned short*)(psp + 2) = DOS_MEM_LIMIT >> 4;  /* Top of memory. */
+  *(unsigned short*)(psp + 2) = psp_para + memsize_available_para + 0x10;  /* Top of memory: end of the block. */
   psp[5] = (char)0xf4;  /* hlt instruction; this is machine code to jump to the CP/M dispatcher. */
-  *(unsigned short*)(psp + 0x2c) = ENV_PARA;
+  *(unsigned short*)(psp + 0x2c) = env_para;
   *(unsigned short*)(psp) = 0x20cd;  /* `int 0x20' opcode. */
   *(unsigned short*)(psp + 0x40) = 5;  /* DOS version number (DOSBox also reports 5). */
   *(unsigned short*)(psp + 0x50) = 0x21cd;  /* `int 0x21' opcode. */
   *(unsigned short*)(psp + 0x32) = 20;  /* `Number of bytes in JFT. */
-  *(unsigned*)(psp + 0x34) = 0x18 | PSP_PARA << 16;  /* `Far pointer to JFT. */
+  *(unsigned*)(psp + 0x34) = 0x18 | (unsigned)psp_para << 16;  /* `Far pointer to JFT. */
   *(unsigned*)(psp + 0x38) = 0xffffffffU;  /* `Pointer to (lack of) previous PSP. */
   *(unsigned*)(psp + 0x0a) = *((unsigned*)mem + 0x22);  /* Copy of `int 0x22' vector. Program terminate address. Not an interrupt. */
   *(unsigned*)(psp + 0x0e) = *((unsigned*)mem + 0x23);  /* Copy of `int 0x23' vector. Ctrl-<Break> handler address. Not an interrupt.  */
@@ -1447,6 +2189,7 @@ static unsigned short get_dos_error_code(int le, unsigned short default_code) {
   return le == ENOENT ? 2  /* File not found. */
        : le == EACCES ? 5  /* Access denied. */
        : le == EBADF ? 6  /* Invalid handle. */
+       : le == EXDEV ? 0x11  /* Not same device. */
        : default_code;  /* Example: 0x1f: General failure. */
 }
 
@@ -1454,6 +2197,15 @@ struct kvm_fds {
   int kvm_fd, vm_fd, vcpu_fd;
 };
 
+static char is_hidden_fd(int fd) {
+  unsigned u;
+  if ((fd + 0U) >> 16 == 0 && (run_state->ram_fd_bits[fd >> 3] & (1 << (fd & 7)))) return 1;
+  for (u = 0; u < sizeof(run_state->hidden_fds) / sizeof(run_state->hidden_fds[0]); ++u) {
+    if (run_state->hidden_fds[u] == fd) return 1;
+  }
+  return 0;
+}
+
 static int get_linux_handle(unsigned short handle, const struct kvm_fds *kvm_fds) {
   /* Redirection (`./kvikdos prog >prog.out') just works and redirects DOS
    * STDOUT (not DOS STDERR), and because of the conditions below, STDPRN as
@@ -1466,85 +2218,732 @@ static int get_linux_handle(unsigned short handle, const struct kvm_fds *kvm_fds
                handle == 3 ? 2  /* Emulate STDAUX with stderr. */
              : handle == 4 ? 1  /* Emulate STDPRN with stdout. */
              : handle)
-       : (handle == kvm_fds->kvm_fd || handle == kvm_fds->vm_fd || handle == kvm_fds->vcpu_fd) ? -1  /* Disallow these handles from DOS for security. */
+       : (handle == kvm_fds->kvm_fd || handle == kvm_fds->vm_fd || handle == kvm_fds->vcpu_fd || is_hidden_fd(handle)) ? -1  /* Disallow these handles from DOS for security. */
        : handle;
 }
 
-/* p is a DOS pathname. Returns 'A' etc. or '\0' on error. */
-static char get_dos_filename_drive(const char *p, const DirState *dir_state) {
-  if (p[0] != '\0' && p[1] == ':') {
-    const char drive_idx = (p[0] & ~32) - 'A';
-    if ((unsigned char)drive_idx >= DRIVE_COUNT || !dir_state->linux_mount_dir[(int)drive_idx]) return '\0';  /* Bad drive. */
-    return drive_idx + 'A';
-  }
-  return dir_state->drive;
+/* --- Host-side buffering of small reads and writes of DOS file handles.
+ *
+ * Many DOS programs read their input and write their output in chunks of a
+ * few bytes, and each int 0x21 call with ah == 0x3f or ah == 0x40 would be
+ * a read(2) or write(2) syscall. For regular files with a DOS handle >= 5,
+ * small reads are served from a HANDLE_BUF_SIZE buffer filled by a single
+ * read(2), and small writes are collected in the buffer until it's full. A
+ * buffer is either in read or in write mode. It's synced (i.e. unread data
+ * is given back with lseek(2), and pending data is written) when the DOS
+ * program does something which would notice the difference (e.g. seek,
+ * close, dup, opening another file, exit).
+ */
+
+#define HANDLE_BUF_COUNT 8  /* Maximum number of Linux fds with a buffer. */
+#define HANDLE_BUF_SIZE 0x10000
+#define HANDLE_BUF_SMALL_SIZE 0x1000  /* Only reads and writes smaller than this are buffered. */
+
+/* HandleBuf.mode values. */
+#define HBM_NONE 0
+#define HBM_READ 1  /* Unread data is buf[pos : size], the Linux fd offset is after it. */
+#define HBM_WRITE 2  /* Pending data is buf[0 : size], to be written at the Linux fd offset. */
+
+typedef struct HandleBuf {
+  int fd;  /* -1 if the slot is free. */
+  char mode;  /* HBM_... */
+  char is_cacheable;  /* Is it a regular file? If not, the slot is just a negative cache entry. */
+  dev_t dev;
+  ino_t ino;
+  unsigned pos, size;
+  char *buf;  /* HANDLE_BUF_SIZE bytes if is_cacheable, allocated on first use. */
+  unsigned async_count;  /* Number of writes in flight (--async-io). */
+  char is_async;  /* Has anything been submitted since the last sync? If so, the mode remains HBM_WRITE. */
+  off_t async_ofs;  /* If is_async, the file offset after the submitted writes. The Linux fd offset is not updated by them. */
+} HandleBuf;
+
+
+/* Records that syncing the buffered data of fd has failed. This survives
+ * the buffer slot being evicted or dropped, and is reported (and cleared)
+ * by the next read, write, seek or close of fd.
+ */
+static void note_handle_error(int fd) {
+  run_state->handle_error_bits[fd >> 3] |= 1 << (fd & 7);
 }
 
-/* Converts a DOS pathname to a fully qualified, absolute DOS pathname. */
-static void get_dos_abspath_r(const char *p, const DirState *dir_state, char *out_buf, unsigned out_size) {
-  char *out_p = out_buf, *out_pend = out_buf + out_size;
-  char drive_idx;
-  const char *in_dos[2];
-  if (DEBUG) fprintf(stderr, "debug: get_dos_abspath_r (%s)\n", p);
-  if (*p == '\0' || out_size < 5) goto done;  /* Empty pathname is an error. */
-  if (p[0] != '\0' && p[1] == ':') {
-    drive_idx = (p[0] & ~32) - 'A';
-    if ((unsigned char)drive_idx >= DRIVE_COUNT) {  /* Bad or unknown drive letter. */  /* !! Report error 0x3 (Path not found) */
-      /*fprintf(stderr, "fatal: DOS filename on wrong drive: 0x%02x\n", (unsigned char)p[0]);*/  /* !! Report error 0x3 (Path not found) */
-      /*exit(252);*/
-      goto done;
-    }
-    p += 2;
-  } else {
-    drive_idx = dir_state->drive - 'A';
-  }
-  if (*p == '\\' || *p == '/') {
-    for (++p; *p == '\\' || *p == '/'; ++p) {}
-    in_dos[0] = "";
-  } else {
-    in_dos[0] = dir_state->current_dir[(int)drive_idx];
-  }
-  in_dos[1] = p;
-  {  /* Convert pathnames in in_dos */
-    const char * const *in_dosi;
-    *out_p++ = drive_idx + 'A';
-    *out_p++ = ':';
-    *out_p++ = '\\';
-    for (in_dosi = in_dos; in_dosi != in_dos + 2; ++in_dosi) {
-      p = *in_dosi;
-      for (; *p != '\0';) {
-        const char c = *p++;
-        if (out_p == out_pend) { out_p = out_buf; goto done; }
-        if (c == '\\' || c == '/') {
-          *out_p++ = '\\';  /* Convert '/' to '\\'. */
-          for (++p; *p == '\\' || *p == '/'; ++p) {}
-        } else {
-          *out_p++ = (c - 'a' + 0U <= 'z' - 'a' + 0U) ? c & ~32 : c;  /* Convert to uppercase. */
-          /* TODO(pts) Truncate each component to 8.3 characters? */
-        }
-      }
-    }
+/* Returns -1 (with errno set) and clears the pending sync error of fd if
+ * there is one, otherwise returns 0.
+ */
+static int take_handle_error(int fd) {
+  if (!(run_state->handle_error_bits[fd >> 3] & (1 << (fd & 7)))) return 0;
+  run_state->handle_error_bits[fd >> 3] &= ~(1 << (fd & 7));
+  errno = EIO;
+  return -1;
+}
+
+static HandleBuf *find_handle_buf(int fd) {
+  HandleBuf *hb;
+  for (hb = run_state->handle_bufs; hb != run_state->handle_bufs + HANDLE_BUF_COUNT; ++hb) {
+    if (hb->fd == fd) return hb;
   }
- done:
-  *out_p = '\0';
-  if (DEBUG) fprintf(stderr, "debug: get_dos_abspath_r=(%s)\n", out_buf);
+  return NULL;
 }
 
-static char fnbuf[LINUX_PATH_SIZE], fnbuf2[LINUX_PATH_SIZE], argv0_fnbuf[LINUX_PATH_SIZE];
+/* With --async-io, the full write buffer of a handle (and each write of at
+ * most HANDLE_BUF_SIZE bytes) is submitted to an io_uring(7) ring, and the
+ * DOS program continues without waiting for the write to finish. The buffer
+ * is swapped with the free buffer of an AsyncIoSlot. The Linux fd offset is
+ * not updated until these writes are waited for by sync_handle_buf(...), so
+ * anything which would notice the difference (read, seek, truncate, get or
+ * set file time, close, exit) waits for them. A failed asynchronous write
+ * is reported like a failed sync, see note_handle_error(...). If the kernel
+ * (Linux <5.1) or the libc headers don't support io_uring, writes remain
+ * synchronous.
+ */
 
-#define get_linux_filename(p) get_linux_filename_r((p), dir_state, fnbuf, NULL)
+#define ASYNC_IO_SLOT_COUNT 8  /* Maximum number of writes in flight, each with a HANDLE_BUF_SIZE buffer. */
 
-#define DOS_PATH_SIZE 64  /* See int 0x21 ah == 0x47 (get current directory) */
-static char dosfnbuf[DOS_PATH_SIZE];
+typedef struct AsyncIoSlot {
+  HandleBuf *hb;  /* Whose write is in flight, or NULL if the slot is free. */
+  char *buf;  /* HANDLE_BUF_SIZE bytes, allocated on first use. Swapped with HandleBuf.buf. */
+  struct iovec iov;
+} AsyncIoSlot;
 
-/* `var' usually looks like `PATH=C:\value'. Everything before the '=' is converted to lowercase. */
-static char *add_env(char *env, char *env_end, const char *var, char do_check) {
-  if (do_check && *var == '=') {
-    fprintf(stderr, "fatal: DOS environment variable has empty name\n");
-    exit(252);
+#ifdef __NR_io_uring_setup
+/* These are the kernel ABI of <linux/io_uring.h>, which old libc headers don't have. */
+typedef struct AsyncIoParams {  /* struct io_uring_params. */
+  uint32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle, features, wq_fd, resv[3];
+  uint32_t sq_head, sq_tail, sq_ring_mask, sq_ring_entries, sq_flags, sq_dropped, sq_array, sq_resv1;
+  uint64_t sq_resv2;
+  uint32_t cq_head, cq_tail, cq_ring_mask, cq_ring_entries, cq_overflow, cq_cqes, cq_flags, cq_resv1;
+  uint64_t cq_resv2;
+} AsyncIoParams;
+
+typedef struct AsyncIoSqe {  /* struct io_uring_sqe. */
+  uint8_t opcode, flags;
+  uint16_t ioprio;
+  int32_t fd;
+  uint64_t off, addr;
+  uint32_t len, rw_flags;
+  uint64_t user_data;
+  uint64_t pad[3];
+} AsyncIoSqe;
+
+typedef struct AsyncIoCqe {  /* struct io_uring_cqe. */
+  uint64_t user_data;
+  int32_t res;
+  uint32_t flags;
+} AsyncIoCqe;
+
+#define ASYNC_IO_OFF_SQ_RING 0
+#define ASYNC_IO_OFF_CQ_RING 0x8000000
+#define ASYNC_IO_OFF_SQES 0x10000000
+#define ASYNC_IO_FEAT_SINGLE_MMAP 1
+#define ASYNC_IO_ENTER_GETEVENTS 1
+#define ASYNC_IO_OP_WRITEV 2  /* IORING_OP_WRITE needs Linux 5.6. */
+
+/* Creates the io_uring ring (once per run state and process). Returns 1 on success, 0 if io_uring is not available. */
+static char init_async_io(void) {
+  AsyncIoParams params;
+  char *sq_ring, *cq_ring;
+  unsigned sq_ring_size, cq_ring_size;
+  void *sqes;
+  int fd;
+  if (run_state->async_io_pid == getpid()) return run_state->async_io_fd >= 0;
+  if (run_state->async_io_fd >= 0) close(run_state->async_io_fd);  /* Inherited from the parent. Its mappings stay. */
+  run_state->async_io_pid = getpid();
+  run_state->async_io_fd = run_state->hidden_fds[8] = -1;
+  memset(&params, 0, sizeof(params));
+  if ((fd = syscall(__NR_io_uring_setup, ASYNC_IO_SLOT_COUNT, &params)) < 0) {
+    if (DEBUG) perror("debug: io_uring_setup");
+    return 0;
   }
-  for (;;) {
-    const char c = *var++;
+  sq_ring_size = params.sq_array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size = params.cq_cqes + params.cq_entries * sizeof(AsyncIoCqe);
+  if (params.features & ASYNC_IO_FEAT_SINGLE_MMAP && cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+  if ((sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, ASYNC_IO_OFF_SQ_RING)) == MAP_FAILED ||
+      (cq_ring = params.features & ASYNC_IO_FEAT_SINGLE_MMAP ? sq_ring : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, ASYNC_IO_OFF_CQ_RING)) == MAP_FAILED ||
+      (sqes = mmap(NULL, params.sq_entries * sizeof(AsyncIoSqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, ASYNC_IO_OFF_SQES)) == MAP_FAILED) {
+    if (DEBUG) perror("debug: mmap io_uring");
+    close(fd);
+    return 0;
+  }
+  run_state->async_io_sq_tail = (uint32_t*)(sq_ring + params.sq_tail);
+  run_state->async_io_sq_array = (uint32_t*)(sq_ring + params.sq_array);
+  run_state->async_io_sq_mask = *(const uint32_t*)(sq_ring + params.sq_ring_mask);
+  run_state->async_io_cq_head = (uint32_t*)(cq_ring + params.cq_head);
+  run_state->async_io_cq_tail = (uint32_t*)(cq_ring + params.cq_tail);
+  run_state->async_io_cq_mask = *(const uint32_t*)(cq_ring + params.cq_ring_mask);
+  run_state->async_io_cqes = (const AsyncIoCqe*)(cq_ring + params.cq_cqes);
+  run_state->async_io_sqes = (AsyncIoSqe*)sqes;
+  run_state->async_io_fd = run_state->hidden_fds[8] = fd;
+  return 1;
+}
+
+/* Waits until at least min_complete writes in flight have finished, and
+ * frees the slots of all finished writes.
+ */
+static void reap_async_io(unsigned min_complete) {
+  uint32_t head;
+  if (min_complete != 0 && syscall(__NR_io_uring_enter, run_state->async_io_fd, 0, min_complete, ASYNC_IO_ENTER_GETEVENTS, NULL, 0L) < 0 && errno != EINTR) {
+    perror("fatal: io_uring_enter");
+    exit(252);
+  }
+  for (head = *run_state->async_io_cq_head;; ++head) {
+    const AsyncIoCqe *cqe;
+    AsyncIoSlot *slot;
+    __sync_synchronize();  /* Read the cqe after the tail. */
+    if (head == *run_state->async_io_cq_tail) break;
+    cqe = run_state->async_io_cqes + (head & run_state->async_io_cq_mask);
+    slot = run_state->async_io_slots + cqe->user_data;
+    if (cqe->res < 0 || (size_t)cqe->res != slot->iov.iov_len) note_handle_error(slot->hb->fd);  /* A short write is also an error, e.g. disk full. */
+    --slot->hb->async_count;
+    slot->hb = NULL;
+    --run_state->async_io_in_flight;
+  }
+  __sync_synchronize();  /* Write the head after reading the cqes. */
+  *run_state->async_io_cq_head = head;
+}
+
+/* Submits the pending data of hb (in write mode) as a write in flight, and
+ * gives hb an empty buffer. Returns 0 on success, -1 if the caller should
+ * write it synchronously instead.
+ */
+static int submit_async_write(HandleBuf *hb) {
+  AsyncIoSlot *slot;
+  AsyncIoSqe *sqe;
+  uint32_t tail;
+  char *buf;
+  if (!init_async_io()) {
+    run_state->is_async_io = 0;
+    return -1;
+  }
+  if (run_state->async_io_in_flight == ASYNC_IO_SLOT_COUNT) reap_async_io(1);
+  for (slot = run_state->async_io_slots; slot->hb; ++slot) {}
+  if (!slot->buf && (slot->buf = malloc(HANDLE_BUF_SIZE)) == NULL) return -1;
+  if (!hb->is_async && (hb->async_ofs = lseek(hb->fd, 0, SEEK_CUR)) == (off_t)-1) return -1;
+  slot->iov.iov_base = hb->buf;
+  slot->iov.iov_len = hb->size;
+  tail = *run_state->async_io_sq_tail;
+  sqe = run_state->async_io_sqes + (tail & run_state->async_io_sq_mask);
+  memset(sqe, '\0', sizeof(*sqe));
+  sqe->opcode = ASYNC_IO_OP_WRITEV;
+  sqe->fd = hb->fd;
+  sqe->off = hb->async_ofs;
+  sqe->addr = (uintptr_t)&slot->iov;
+  sqe->len = 1;
+  sqe->user_data = slot - run_state->async_io_slots;
+  run_state->async_io_sq_array[tail & run_state->async_io_sq_mask] = tail & run_state->async_io_sq_mask;
+  __sync_synchronize();  /* Write the tail after the sqe. */
+  *run_state->async_io_sq_tail = tail + 1;
+  if (syscall(__NR_io_uring_enter, run_state->async_io_fd, 1, 0, 0, NULL, 0L) != 1) {
+    perror("fatal: io_uring_enter submit");
+    exit(252);
+  }
+  slot->hb = hb;
+  buf = slot->buf; slot->buf = hb->buf; hb->buf = buf;
+  hb->async_ofs += hb->size;
+  hb->is_async = 1;
+  ++hb->async_count;
+  ++run_state->async_io_in_flight;
+  return 0;
+}
+#else
+static int submit_async_write(HandleBuf *hb) {
+  (void)hb;
+  run_state->is_async_io = 0;
+  return -1;  /* No io_uring support in the libc headers. */
+}
+
+static void reap_async_io(unsigned min_complete) { (void)min_complete; }
+#endif
+
+/* Waits for the writes in flight of hb, and moves the Linux fd offset after
+ * the submitted writes. Returns 0 on success, -1 on error (including failed writes).
+ */
+static int wait_async_writes(HandleBuf *hb) {
+  while (hb->async_count != 0) reap_async_io(1);
+  hb->is_async = 0;
+  if (lseek(hb->fd, hb->async_ofs, SEEK_SET) == (off_t)-1) return -1;
+  return run_state->handle_error_bits[hb->fd >> 3] & (1 << (hb->fd & 7)) ? -1 : 0;
+}
+
+/* Writes pending data (also waiting for the writes in flight) or gives back
+ * unread data, and changes hb->mode to HBM_NONE. Returns 0 on success, -1
+ * (with errno set) on error. Errors are also kept by note_handle_error(...)
+ * until reported, because most callers can't report them.
+ */
+static int sync_handle_buf(HandleBuf *hb) {
+  int result = 0;
+  if (hb->is_async && wait_async_writes(hb) != 0) result = -1;
+  if (hb->mode == HBM_WRITE) {
+    const char *p = hb->buf, *p_end = p + hb->size;
+    while (p != p_end) {
+      const int got = write(hb->fd, p, p_end - p);
+      if (got <= 0) { result = -1; break; }
+      p += got;
+    }
+  } else if (hb->mode == HBM_READ && hb->pos != hb->size) {
+    if (lseek(hb->fd, -(off_t)(hb->size - hb->pos), SEEK_CUR) == (off_t)-1) result = -1;
+  }
+  if (result != 0) note_handle_error(hb->fd);
+  hb->mode = HBM_NONE;
+  hb->pos = hb->size = 0;
+  return result;
+}
+
+/* Starts writing the pending data of hb: with --async-io in the
+ * background, otherwise like sync_handle_buf(hb). Returns 0 on success, -1
+ * (with errno set) on error.
+ */
+static int flush_handle_buf(HandleBuf *hb) {
+  if (hb->mode == HBM_WRITE && run_state->is_async_io && submit_async_write(hb) == 0) {
+    hb->pos = hb->size = 0;  /* Keeps HBM_WRITE, for sync_handle_buf(hb) before other operations. */
+    return 0;
+  }
+  return sync_handle_buf(hb);
+}
+
+/* Syncs all buffers in mode `mode' (or all buffers if HBM_NONE). */
+static void sync_handle_bufs(char mode) {
+  HandleBuf *hb;
+  for (hb = run_state->handle_bufs; hb != run_state->handle_bufs + HANDLE_BUF_COUNT; ++hb) {
+    if (hb->fd >= 0 && hb->mode != HBM_NONE && (mode == HBM_NONE || hb->mode == mode)) sync_handle_buf(hb);
+  }
+}
+
+/* Syncs buffers of other Linux fds of the same file as hb which are in mode
+ * `mode', so that the data in hb will be consistent with them.
+ */
+static void sync_other_handle_bufs(const HandleBuf *hb, char mode) {
+  HandleBuf *hb2;
+  for (hb2 = run_state->handle_bufs; hb2 != run_state->handle_bufs + HANDLE_BUF_COUNT; ++hb2) {
+    if (hb2 != hb && hb2->fd >= 0 && hb2->mode == mode && hb2->ino == hb->ino && hb2->dev == hb->dev) sync_handle_buf(hb2);
+  }
+}
+
+/* Syncs the buffer of fd (if any), and forgets about it. A sync error
+ * remains pending for fd.
+ */
+static void drop_handle_buf(int fd) {
+  HandleBuf *hb = find_handle_buf(fd);
+  if (hb) {
+    sync_handle_buf(hb);
+    hb->fd = -1;
+  }
+}
+
+/* Called after dup(fd) == fd2. */
+static void set_handle_dup(int fd, int fd2) {
+  drop_handle_buf(fd);
+  run_state->handle_nocache_bits[fd >> 3] |= 1 << (fd & 7);
+  run_state->handle_nocache_bits[fd2 >> 3] |= 1 << (fd2 & 7);
+}
+
+/* Syncs and forgets all buffers. Called when a DOS program exits. */
+static void reset_handle_bufs(void) {
+  HandleBuf *hb;
+  if (!run_state) return;  /* At exit, after kvikdos_vm_destroy(...). */
+  for (hb = run_state->handle_bufs; hb != run_state->handle_bufs + HANDLE_BUF_COUNT; ++hb) {
+    if (hb->fd >= 0) drop_handle_buf(hb->fd);
+  }
+}
+
+/* Returns the buffer of Linux fd of a DOS handle >= 5, creating it if
+ * needed, or NULL if the fd is not a regular file or out of memory.
+ */
+static HandleBuf *get_handle_buf(int fd) {
+  static char had_atexit;
+  HandleBuf *hb = find_handle_buf(fd);
+  struct stat st;
+  if (hb) return hb->is_cacheable ? hb : NULL;
+  if (run_state->handle_nocache_bits[fd >> 3] & (1 << (fd & 7))) return NULL;
+  for (hb = run_state->handle_bufs; hb != run_state->handle_bufs + HANDLE_BUF_COUNT && hb->fd >= 0; ++hb) {}
+  if (hb == run_state->handle_bufs + HANDLE_BUF_COUNT) {  /* Evict one. */
+    hb = run_state->handle_bufs + run_state->handle_buf_evict_idx;
+    run_state->handle_buf_evict_idx = (run_state->handle_buf_evict_idx + 1) % HANDLE_BUF_COUNT;
+    sync_handle_buf(hb);
+  }
+  hb->fd = fd;
+  hb->mode = HBM_NONE;
+  hb->pos = hb->size = 0;
+  hb->is_cacheable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (!hb->is_cacheable) return NULL;
+  hb->dev = st.st_dev;
+  hb->ino = st.st_ino;
+  if (!hb->buf && (hb->buf = malloc(HANDLE_BUF_SIZE)) == NULL) {
+    hb->is_cacheable = 0;
+    return NULL;
+  }
+  if (!had_atexit) {
+    atexit(reset_handle_bufs);  /* For exit(252) after fatal errors. */
+    had_atexit = 1;
+  }
+  return hb;
+}
+
+/* Like read(2), but uses the buffer for small reads. */
+static int read_handle_buf(int fd, char *p, unsigned size) {
+  HandleBuf *hb = fd >= 5 ? get_handle_buf(fd) : NULL;
+  unsigned got0;
+  int got;
+  if (fd >= 5 && take_handle_error(fd) != 0) return -1;
+  if (!hb) return read(fd, p, size);
+  if (hb->mode == HBM_WRITE) {
+    if (sync_handle_buf(hb) != 0) return take_handle_error(fd);
+  }
+  sync_other_handle_bufs(hb, HBM_WRITE);  /* Make their pending data visible to us. */
+  got0 = hb->mode == HBM_READ ? hb->size - hb->pos : 0;
+  if (got0 >= size) {
+    memcpy(p, hb->buf + hb->pos, size);
+    hb->pos += size;
+    return size;
+  }
+  memcpy(p, hb->buf + hb->pos, got0);  /* Empty the buffer. */
+  p += got0;
+  size -= got0;
+  hb->mode = HBM_NONE;
+  hb->pos = hb->size = 0;
+  if (size >= HANDLE_BUF_SMALL_SIZE) {
+    got = read(fd, p, size);
+  } else {
+    if ((got = read(fd, hb->buf, HANDLE_BUF_SIZE)) > 0) {
+      hb->mode = HBM_READ;
+      hb->size = got;
+      hb->pos = (unsigned)got < size ? (unsigned)got : size;
+      memcpy(p, hb->buf, got = hb->pos);
+    }
+  }
+  return got < 0 ? (got0 ? (int)got0 : -1) : (int)got0 + got;
+}
+
+/* Like write(2), but uses the buffer for small writes. */
+static int write_handle_buf(int fd, const char *p, unsigned size) {
+  HandleBuf *hb = fd >= 5 ? get_handle_buf(fd) : NULL;
+  if (fd >= 5 && take_handle_error(fd) != 0) return -1;  /* Also failed asynchronous writes. */
+  if (!hb) return write(fd, p, size);
+  if (hb->mode == HBM_READ) {
+    if (sync_handle_buf(hb) != 0) return take_handle_error(fd);
+  }
+  sync_other_handle_bufs(hb, HBM_READ);  /* Their data will be stale. */
+  sync_other_handle_bufs(hb, HBM_WRITE);  /* Keep the order of writes. */
+  if (size < HANDLE_BUF_SMALL_SIZE || (run_state->is_async_io && size <= HANDLE_BUF_SIZE)) {
+    if (hb->size + size > HANDLE_BUF_SIZE && flush_handle_buf(hb) != 0) return take_handle_error(fd);
+    memcpy(hb->buf + hb->size, p, size);
+    hb->size += size;
+    hb->mode = HBM_WRITE;
+    if (size >= HANDLE_BUF_SMALL_SIZE && flush_handle_buf(hb) != 0) return take_handle_error(fd);  /* Start large writes (with --async-io) right away. */
+    return size;
+  }
+  if (sync_handle_buf(hb) != 0) return take_handle_error(fd);
+  return write(fd, p, size);
+}
+
+/* Like lseek(2), but takes the buffer into account, and keeps the read
+ * buffer if the new offset is within it.
+ */
+static off_t lseek_handle_buf(int fd, off_t offset, int whence) {
+  HandleBuf *hb = fd >= 5 ? find_handle_buf(fd) : NULL;
+  if (fd >= 5 && take_handle_error(fd) != 0) return (off_t)-1;
+  if (hb && hb->mode == HBM_READ && whence != SEEK_END) {
+    const off_t end_ofs = lseek(fd, 0, SEEK_CUR);  /* File offset at the end of the buffered data. */
+    const off_t buf_ofs = end_ofs - hb->size;
+    if (end_ofs == (off_t)-1) return end_ofs;
+    if (whence == SEEK_CUR) offset += end_ofs - (hb->size - hb->pos);
+    if (offset >= buf_ofs && offset <= end_ofs) {
+      hb->pos = offset - buf_ofs;
+      return offset;
+    }
+    hb->mode = HBM_NONE;
+    hb->pos = hb->size = 0;
+    return lseek(fd, offset, SEEK_SET);
+  }
+  if (hb && sync_handle_buf(hb) != 0) return take_handle_error(fd);
+  return lseek(fd, offset, whence);
+}
+
+/* p is a DOS pathname. Returns 'A' etc. or '\0' on error. */
+static char get_dos_filename_drive(const char *p, const DirState *dir_state) {
+  if (p[0] != '\0' && p[1] == ':') {
+    const char drive_idx = (p[0] & ~32) - 'A';
+    if ((unsigned char)drive_idx >= DRIVE_COUNT || !dir_state->linux_mount_dir[(int)drive_idx]) return '\0';  /* Bad drive. */
+    return drive_idx + 'A';
+  }
+  return dir_state->drive;
+}
+
+/* Converts a DOS pathname to a fully qualified, absolute DOS pathname. */
+static void get_dos_abspath_r(const char *p, const DirState *dir_state, char *out_buf, unsigned out_size) {
+  char *out_p = out_buf, *out_pend = out_buf + out_size;
+  char drive_idx;
+  const char *in_dos[2];
+  if (DEBUG) fprintf(stderr, "debug: get_dos_abspath_r (%s)\n", p);
+  if (*p == '\0' || out_size < 5) goto done;  /* Empty pathname is an error. */
+  if (p[0] != '\0' && p[1] == ':') {
+    drive_idx = (p[0] & ~32) - 'A';
+    if ((unsigned char)drive_idx >= DRIVE_COUNT) {  /* Bad or unknown drive letter. */  /* !! Report error 0x3 (Path not found) */
+      /*fprintf(stderr, "fatal: DOS filename on wrong drive: 0x%02x\n", (unsigned char)p[0]);*/  /* !! Report error 0x3 (Path not found) */
+      /*exit(252);*/
+      goto done;
+    }
+    p += 2;
+  } else {
+    drive_idx = dir_state->drive - 'A';
+  }
+  if (*p == '\\' || *p == '/') {
+    for (++p; *p == '\\' || *p == '/'; ++p) {}
+    in_dos[0] = "";
+  } else {
+    in_dos[0] = dir_state->current_dir[(int)drive_idx];
+  }
+  in_dos[1] = p;
+  {  /* Convert pathnames in in_dos */
+    const char * const *in_dosi;
+    *out_p++ = drive_idx + 'A';
+    *out_p++ = ':';
+    *out_p++ = '\\';
+    for (in_dosi = in_dos; in_dosi != in_dos + 2; ++in_dosi) {
+      p = *in_dosi;
+      for (; *p != '\0';) {
+        const char c = *p++;
+        if (out_p == out_pend) { out_p = out_buf; goto done; }
+        if (c == '\\' || c == '/') {
+          *out_p++ = '\\';  /* Convert '/' to '\\'. */
+          for (++p; *p == '\\' || *p == '/'; ++p) {}
+        } else {
+          *out_p++ = (c - 'a' + 0U <= 'z' - 'a' + 0U) ? c & ~32 : c;  /* Convert to uppercase. */
+          /* TODO(pts) Truncate each component to 8.3 characters? */
+        }
+      }
+    }
+  }
+ done:
+  *out_p = '\0';
+  if (DEBUG) fprintf(stderr, "debug: get_dos_abspath_r=(%s)\n", out_buf);
+}
+
+#define get_linux_filename(p) get_linux_filename_cached_r((p), dir_state, emu->fnbuf, NULL)
+
+#define DOS_PATH_SIZE 64  /* See int 0x21 ah == 0x47 (get current directory) */
+
+/* --- Clock of the DOS program (--clock=...).
+ *
+ * The date and time (int 0x21 ah == 0x2a and ah == 0x2c), the timer ticks
+ * (int 0x1a ah == 0x00 and port 0x40) and the mtime of the files written
+ * by the DOS program all come from here. With --clock=host (default), the
+ * date and time are those of the host in its local time zone. With
+ * --clock=fixed:<epoch>, the time is always <epoch>, and with
+ * --clock=virtual:<epoch>, it starts at <epoch> and advances by
+ * CLOCK_VIRTUAL_USEC_PER_EXIT for each VM exit (so a progress loop querying
+ * the time still sees it advancing). Both use UTC (so $TZ doesn't matter),
+ * and both set the mtime of each file written by the DOS program to the
+ * current time of the clock when the file is closed, so the output files
+ * (and the timestamps which the next tools copy from them to their output,
+ * e.g. to OMF .obj files) don't depend on when the build was run.
+ *
+ * The timer ticks are not emulated in CLOCK_HOST and CLOCK_FIXED modes,
+ * they advance by one each time the DOS program queries them.
+ */
+
+#define CLOCK_VIRTUAL_USEC_PER_EXIT 100
+#define CLOCK_VIRTUAL_PIT_PER_EXIT 119  /* 1193182 Hz * CLOCK_VIRTUAL_USEC_PER_EXIT. */
+
+/* Sets *ts_out and *usec_out to the current time of the DOS program. */
+static void get_clock_time(time_t *ts_out, unsigned *usec_out) {
+  if (run_state->clock_mode == CLOCK_HOST) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *ts_out = tv.tv_sec;
+    *usec_out = tv.tv_usec;
+  } else if (run_state->clock_mode == CLOCK_FIXED) {
+    *ts_out = run_state->clock_epoch;
+    *usec_out = 0;
+  } else {  /* CLOCK_VIRTUAL. Split like this to avoid overflow with 32-bit longs. */
+    *ts_out = run_state->clock_epoch + run_state->clock_exit_count / (1000000 / CLOCK_VIRTUAL_USEC_PER_EXIT);
+    *usec_out = run_state->clock_exit_count % (1000000 / CLOCK_VIRTUAL_USEC_PER_EXIT) * CLOCK_VIRTUAL_USEC_PER_EXIT;
+  }
+}
+
+/* Converts a Linux timestamp to the broken-down time shown to the DOS program. */
+static struct tm *convert_clock_time(const time_t *ts) {
+  return run_state->clock_mode == CLOCK_HOST ? localtime(ts) : gmtime(ts);
+}
+
+/* Converts a DOS date and time (as in int 0x21 ah == 0x57) to a Linux timestamp. */
+static time_t get_clock_dos_timestamp(unsigned short dos_date, unsigned short dos_time) {
+  struct tm tm;
+  memset(&tm, '\0', sizeof(tm));
+  tm.tm_sec = (dos_time & 0x1f) << 1;
+  tm.tm_min = dos_time >> 5 & 0x3f;
+  tm.tm_hour = dos_time >> 11;
+  tm.tm_mday = dos_date & 0x1f;
+  tm.tm_mon = (dos_date >> 5 & 0xf) - 1;
+  tm.tm_year = (dos_date >> 9) + 80;
+  tm.tm_isdst = -1;  /* Let mktime(3) figure it out. */
+  return run_state->clock_mode == CLOCK_HOST ? mktime(&tm) : timegm(&tm);
+}
+
+/* Returns the current date and time of the DOS program, and sets
+ * *hundredths_out. The broken-down time is cached within the same second,
+ * because some DOS programs query the time in their progress loops.
+ */
+static const struct tm *get_clock_tm(unsigned char *hundredths_out) {
+  static time_t cached_ts = (time_t)-1;
+  static char cached_mode;
+  static struct tm cached_tm;
+  time_t ts;
+  unsigned usec;
+  get_clock_time(&ts, &usec);
+  *hundredths_out = usec / 10000;
+  if (ts != cached_ts || run_state->clock_mode != cached_mode) {
+    cached_tm = *convert_clock_time(&ts);
+    cached_ts = ts;
+    cached_mode = run_state->clock_mode;
+  }
+  return &cached_tm;
+}
+
+/* Returns the number of timer ticks (18.2 Hz) since midnight, for CLOCK_VIRTUAL. */
+static unsigned get_clock_ticks(void) {
+  unsigned char hundredths;
+  const struct tm *tm = get_clock_tm(&hundredths);
+  return (unsigned)((((tm->tm_hour * 60 + tm->tm_min) * 60 + tm->tm_sec) * 100 + hundredths) * (1193182.0 / 65536 / 100));
+}
+
+/* Returns the low byte of the PIT channel 0 counter (counting down), for CLOCK_VIRTUAL. */
+static unsigned char get_clock_pit_byte(void) {
+  return (unsigned char)-(run_state->clock_exit_count * CLOCK_VIRTUAL_PIT_PER_EXIT);
+}
+
+/* If Linux fd has been written by the DOS program, sets its mtime to the
+ * current time of the clock. Should be called after syncing its buffer,
+ * and before closing it.
+ */
+static void stamp_written_file(int fd) {
+  if (run_state->clock_written_fd_bits[fd >> 3] & (1 << (fd & 7))) {
+    struct timespec tss[2];
+    time_t ts;
+    unsigned usec;
+    run_state->clock_written_fd_bits[fd >> 3] &= ~(1 << (fd & 7));
+    get_clock_time(&ts, &usec);
+    tss[0].tv_sec = 0;
+    tss[0].tv_nsec = UTIME_OMIT;  /* Keep the atime. */
+    tss[1].tv_sec = ts;
+    tss[1].tv_nsec = usec * 1000L;
+    (void)!futimens(fd, tss);
+  }
+}
+
+/* Calls stamp_written_file(...) for all Linux fds. Called when the DOS program exits. */
+static void stamp_written_files(void) {
+  unsigned i, j;
+  for (i = 0; i < sizeof(run_state->clock_written_fd_bits); ++i) {
+    if (run_state->clock_written_fd_bits[i] != 0) {
+      for (j = 0; j < 8; ++j) {
+        stamp_written_file(i << 3 | j);
+      }
+    }
+  }
+}
+
+/* --- Filename translation cache.
+ *
+ * DOS programs (e.g. compilers opening include files) open, find and stat
+ * the same few filenames many times, and get_linux_filename_r(...) would
+ * redo the drive lookup, case folding and 8.3 truncation each time. The
+ * cache below maps (default drive, DOS filename) to the resulting Linux
+ * filename. The result also depends on dir_state->current_dir and the
+ * mount points (linux_mount_dir and case_mode), these don't change while a
+ * DOS program is running (there is no chdir yet, it must call
+ * clear_fn_cache(...)), so the cache is cleared when a DOS program starts.
+ *
+ * With --enoent-cache, it also remembers the filenames for which open(2)
+ * or stat(2) have failed with ENOENT, and subsequent opens and stats fail
+ * without a system call. These negative entries are dropped when kvikdos
+ * creates, renames or deletes a file or directory. Files created by other
+ * Linux processes meanwhile are not noticed, that's why it's not the
+ * default.
+ */
+
+#define FN_CACHE_SIZE 256  /* Number of entries. Must be a power of 2. */
+#define FN_CACHE_DOS_SIZE 80  /* Longer DOS filenames are not cached. */
+#define FN_CACHE_LINUX_SIZE 240  /* Longer Linux filenames are not cached. */
+
+typedef struct FnCacheEntry {
+  unsigned enoent_generation;  /* The Linux file is known not to exist iff this is equal to fn_cache_enoent_generation. */
+  unsigned short lastc_ofs;  /* Offset of the last pathname component in linux_filename. */
+  char dos_filename[FN_CACHE_DOS_SIZE];  /* Default drive letter followed by the DOS filename. Empty if the entry is free. */
+  char linux_filename[FN_CACHE_LINUX_SIZE];
+} FnCacheEntry;
+
+static void clear_fn_cache(char is_enoent_cache) {
+  unsigned u;
+  for (u = 0; u < FN_CACHE_SIZE; ++u) {
+    run_state->fn_cache[u].dos_filename[0] = '\0';
+    run_state->fn_cache[u].enoent_generation = 0;
+  }
+  run_state->fn_cache_last = NULL;
+  run_state->fn_cache_enoent_generation = 1;
+  run_state->is_enoent_cache_enabled = is_enoent_cache;
+}
+
+/* Called when kvikdos creates, renames or deletes a file or directory. */
+static void clear_fn_cache_enoent(void) {
+  if (++run_state->fn_cache_enoent_generation == 0) clear_fn_cache(run_state->is_enoent_cache_enabled);  /* Overflow. */
+}
+
+/* Returns true iff the Linux file of the last
+ * get_linux_filename_cached_r(...) call is known not to exist.
+ */
+static char is_last_fn_enoent(void) {
+  return run_state->fn_cache_last && run_state->fn_cache_last->enoent_generation == run_state->fn_cache_enoent_generation;
+}
+
+/* Records that the Linux file of the last get_linux_filename_cached_r(...)
+ * call doesn't exist. Should be called after open(2) or stat(2) failing
+ * with ENOENT.
+ */
+static void set_last_fn_enoent(void) {
+  if (run_state->fn_cache_last && run_state->is_enoent_cache_enabled) run_state->fn_cache_last->enoent_generation = run_state->fn_cache_enoent_generation;
+}
+
+/* Like get_linux_filename_r(...), but uses and fills fn_cache. */
+static char *get_linux_filename_cached_r(const char *p, const DirState *dir_state, char *out_buf, char **out_lastc_out) {
+  const size_t size = strlen(p);
+  const unsigned char *q;
+  unsigned hash = 2166136261U ^ (unsigned char)dir_state->drive;  /* FNV-1a. */
+  FnCacheEntry *fce;
+  char *out_lastc;
+  run_state->fn_cache_last = NULL;
+  if (size + 2 > FN_CACHE_DOS_SIZE || (dir_state->dos_prog_abs && strcmp(p, dir_state->dos_prog_abs) == 0)) {
+    return get_linux_filename_r(p, dir_state, out_buf, out_lastc_out);
+  }
+  for (q = (const unsigned char*)p; *q != '\0'; ++q) {
+    hash = (hash ^ *q) * 16777619U;
+  }
+  fce = run_state->fn_cache + (hash & (FN_CACHE_SIZE - 1));
+  if (fce->dos_filename[0] == dir_state->drive && strcmp(fce->dos_filename + 1, p) == 0) {
+    strcpy(out_buf, fce->linux_filename);
+    if (out_lastc_out) *out_lastc_out = out_buf + fce->lastc_ofs;
+    run_state->fn_cache_last = fce;
+    return out_buf;
+  }
+  get_linux_filename_r(p, dir_state, out_buf, &out_lastc);
+  if (out_lastc_out) *out_lastc_out = out_lastc;
+  if (strlen(out_buf) < FN_CACHE_LINUX_SIZE && (unsigned)(out_lastc - out_buf) < FN_CACHE_LINUX_SIZE) {
+    fce->dos_filename[0] = dir_state->drive;
+    memcpy(fce->dos_filename + 1, p, size + 1);
+    strcpy(fce->linux_filename, out_buf);
+    fce->lastc_ofs = out_lastc - out_buf;
+    fce->enoent_generation = 0;
+    run_state->fn_cache_last = fce;
+  }
+  return out_buf;
+}
+
+/* `var' usually looks like `PATH=C:\value'. Everything before the '=' is converted to lowercase. */
+static char *add_env(char *env, char *env_end, const char *var, char do_check) {
+  if (do_check && *var == '=') {
+    fprintf(stderr, "fatal: DOS environment variable has empty name\n");
+    exit(252);
+  }
+  for (;;) {
+    const char c = *var++;
     if (env == env_end) {
       fprintf(stderr, "fatal: DOS environment too long\n");
       exit(252);
@@ -1607,6 +3006,25 @@ static char set_int(unsigned char int_num, unsigned value_seg_ofs, void *mem, ch
   return 0;  /* Success. */
 }
 
+/* Checks (by calling set_int(...)) the interrupt vectors which the DOS
+ * program has changed by writing to the IVT directly since the previous
+ * call, based on the copy in ivt_shadow (0x100 entries), and updates
+ * ivt_shadow. Returns 0 on success.
+ */
+static char check_ivt_changes(void *mem, unsigned *ivt_shadow, char had_get_ints) {
+  unsigned * const ivt = (unsigned*)mem;
+  unsigned u, value;
+  if (memcmp(ivt, ivt_shadow, 0x100 << 2) == 0) return 0;  /* Fast path: no changes. */
+  for (u = 0; u < 0x100; ++u) {
+    if ((value = ivt[u]) != ivt_shadow[u]) {
+      ivt[u] = ivt_shadow[u];  /* set_int(...) compares against the old value. */
+      if (set_int(u, value, mem, had_get_ints)) return 1;
+      ivt_shadow[u] = value;
+    }
+  }
+  return 0;
+}
+
 static const struct {
   unsigned short date_format;
   char currency[5];
@@ -1646,284 +3064,5742 @@ static char is_dos_filename_83(const char *fn) {
   return 1;
 }
 
-/* scancodes[i] is the US English keyboard scancode corresponding to ASCII
- * code i.
+/* --- In-memory drive (--mount=<drive>~).
  *
- * Generated by scancode.py.
- * Based on https://stanislavs.org/helppc/scan_codes.html
+ * Compilers create, write and delete many temporary files, and if the
+ * current directory is slow (e.g. on NFS), each of these is a round trip. A
+ * drive mounted with --mount=<drive>~ keeps its files in memory instead,
+ * and they are lost when kvikdos_run(...) returns, except for those copied
+ * to Linux with --persist=.... There are no subdirectories.
+ *
+ * get_linux_filename_r(...) maps the DOS filenames on such a drive to Linux
+ * filenames starting with RAM_MOUNT_DIR, and the open, stat, unlink and
+ * rename calls of kvikdos go through open_file(...) etc. (see below), which
+ * call the functions here for these. Each file is a Linux memfd (see
+ * memfd_create(2)) in the ram_files hash table, and open_ram_file(...)
+ * opens it again via /proc/self/fd/, so the DOS handles are regular Linux
+ * fds with their own file offsets, and reads, writes, seeks, dups and the
+ * handle buffers work on them without special cases.
  */
-static const unsigned char scancodes[128] = {
-    0x3e, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22, 0x0e, 0x0f, 0x24, 0x25,
-    0x26, 0x0c, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f, 0x14, 0x16, 0x2f, 0x11,
-    0x2d, 0x15, 0x2c, 0x01, 0x2b, 0x1b, 0x07, 0x0c, 0x39, 0x02, 0x28, 0x04,
-    0x05, 0x06, 0x08, 0x28, 0x0a, 0x0b, 0x09, 0x0d, 0x33, 0x0c, 0x34, 0x35,
-    0x0b, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x27, 0x27,
-    0x33, 0x0d, 0x34, 0x35, 0x03, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22,
-    0x23, 0x17, 0x24, 0x25, 0x26, 0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f,
-    0x14, 0x16, 0x2f, 0x11, 0x2d, 0x15, 0x2c, 0x1a, 0x2b, 0x1b, 0x07, 0x0c,
-    0x29, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25,
-    0x26, 0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f, 0x14, 0x16, 0x2f, 0x11,
-    0x2d, 0x15, 0x2c, 0x1a, 0x2b, 0x1b, 0x29, 0x35 };
 
-/* Simulated, fake keypresses for --tty-in=-3 . */
-static const unsigned short fake_keys[3] = {
-    0x011b /* <Esc> */, 0x4400 /* <F10> */, 0x1c0d /* <Enter> */ };
+#define RAM_FILE_HASH_SIZE 64  /* Number of buckets. Must be a power of 2. */
 
-/* It's unclear whether running the new program and discarding the current
- * one is the right approach in the general case (especially with al == 3).
- * So we just whitelist a few programs where we do that.
- */
-static char should_skip_exec_program(char const *dos_filename, const char *args, const char *env, const char **env_end_inout, char had_get_first_mcb) {
-  size_t dos_filename_size;
-  char had_ml_env = 0;
-  const char *p, *env_end = *env_end_inout;
-  /* Detect Microsoft Macro Assembler 6.00B driver masm.exe. */
-  dos_filename_size = strlen(dos_filename);
-  for (p = dos_filename + dos_filename_size; p != dos_filename && p[-1] != '\\'; --p) {}
-  if (strcmp(p, "ML.EXE") == 0) {
-    if (!had_get_first_mcb || !args || *args != '\0') return 1;
-    for (p = env; *p != '\0';) {
-      char *q = memchr(p, '\0', env_end - p);
-      if (!q) return 3;  /* env too long. */
-      if (DEBUG) fprintf(stderr, "debug: load env line: (%s)\n", p);
-      if (strncmp(p, "ML= ", 4) == 0) had_ml_env = 1;
-      p = q + 1;
-    }
-    if (!had_ml_env) return 4;
-    if (++p + 4 > env_end) return 5;
-    if (*(const unsigned short*)p != 1) return 6;
-    p += 2;
-    if (p + dos_filename_size >= env_end) return 7;
-    if (strcmp(p, dos_filename) != 0) return 8;
-    *env_end_inout = p - 2;  /* Not: p + dos_filename_size + 1; */
-    return 0;  /* exec() it. */
-  } else if (strcmp(p, "tlink.exe") == 0) {  /* Borland C++ 2.0 compiler bcc.exe executing TLINK 4.0 linker tlink.exe */
-    if (!args || strcmp(args, "@turboc.$ln") != 0) return 11;
-    return -1;  /* exec() it, but delete file "turboc.$ln" later. */
-  } else {
-    return 2;
-  }
+typedef struct RamFile {
+  struct RamFile *next;  /* Next file in the same bucket. */
+  int fd;  /* memfd containing the data. In ram_fd_bits. */
+  char name[1];  /* Basename (Linux filename after RAM_MOUNT_DIR), NUL-terminated. Longer than 1 byte. */
+} RamFile;
+
+static char is_ram_filename(const char *fn) {
+  return fn[0] == RAM_MOUNT_DIR[0];
 }
 
-typedef struct TtyState {
+static char has_ram_drive(const DirState *dir_state) {
+  char drive_idx;
+  for (drive_idx = 0; drive_idx < DRIVE_COUNT; ++drive_idx) {
+    if (dir_state->linux_mount_dir[(int)drive_idx] && is_ram_filename(dir_state->linux_mount_dir[(int)drive_idx])) return 1;
+  }
+  return 0;
+}
+
+static unsigned get_filename_hash(const char *fn) {
+  const unsigned char *q;
+  unsigned hash = 2166136261U;  /* FNV-1a. */
+  for (q = (const unsigned char*)fn; *q != '\0'; ++q) {
+    hash = (hash ^ *q) * 16777619U;
+  }
+  return hash;
+}
+
+/* Returns the pointer to the RamFile pointer of name in ram_files, so that
+ * the caller can also add or remove it. It points to NULL if not found.
+ */
+static RamFile **find_ram_file(const char *name) {
+  RamFile **rfp;
+  for (rfp = run_state->ram_files + (get_filename_hash(name) & (RAM_FILE_HASH_SIZE - 1)); *rfp && strcmp((*rfp)->name, name) != 0; rfp = &(*rfp)->next) {}
+  return rfp;
+}
+
+/* Returns the basename in fn (is_ram_filename(fn) must be true), or NULL
+ * (with errno set) if fn is the root directory or it is in a subdirectory.
+ */
+static const char *get_ram_basename(const char *fn) {
+  const char *name = fn + sizeof(RAM_MOUNT_DIR) - 1;
+  if (*name == '\0' || strchr(name, '/')) {
+    errno = ENOENT;
+    return NULL;
+  }
+  return name;
+}
+
+static void remove_ram_file(RamFile **rfp) {
+  RamFile * const rf = *rfp;
+  *rfp = rf->next;
+  run_state->ram_fd_bits[rf->fd >> 3] &= ~(1 << (rf->fd & 7));
+  close(rf->fd);
+  free(rf);
+}
+
+/* Deletes all files on the in-memory drives. */
+static void clear_ram_files(void) {
+  RamFile **rfp;
+  for (rfp = run_state->ram_files; rfp != run_state->ram_files + RAM_FILE_HASH_SIZE; ++rfp) {
+    while (*rfp) remove_ram_file(rfp);
+  }
+}
+
+static int open_ram_file(const char *fn, int flags) {
+  const char *name;
+  RamFile **rfp, *rf;
+  char proc_fn[32];
+  if ((name = get_ram_basename(fn)) == NULL) return -1;
+  if ((rf = *(rfp = find_ram_file(name))) == NULL) {
+    if (!(flags & O_CREAT)) {
+      errno = ENOENT;
+      return -1;
+    }
+    if ((rf = malloc(sizeof(RamFile) + strlen(name))) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    if ((rf->fd = syscall(__NR_memfd_create, name, 0)) < 0) {
+      free(rf);
+      return -1;
+    }
+    if ((rf->fd + 0U) >> 16) {  /* Doesn't fit to ram_fd_bits. */
+      close(rf->fd);
+      free(rf);
+      errno = EMFILE;
+      return -1;
+    }
+    run_state->ram_fd_bits[rf->fd >> 3] |= 1 << (rf->fd & 7);
+    strcpy(rf->name, name);
+    rf->next = NULL;
+    *rfp = rf;
+  } else if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+    errno = EEXIST;
+    return -1;
+  }
+  sprintf(proc_fn, "/proc/self/fd/%d", rf->fd);
+  return open(proc_fn, flags & ~(O_CREAT | O_EXCL));
+}
+
+static int stat_ram_file(const char *fn, struct stat *st) {
+  const char *name;
+  RamFile *rf;
+  if (fn[sizeof(RAM_MOUNT_DIR) - 1] == '\0') {  /* Root directory. */
+    unsigned usec;
+    memset(st, '\0', sizeof(*st));
+    st->st_mode = S_IFDIR | 0755;
+    get_clock_time(&st->st_mtime, &usec);
+    return 0;
+  }
+  if ((name = get_ram_basename(fn)) == NULL) return -1;
+  if ((rf = *find_ram_file(name)) == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  return fstat(rf->fd, st);
+}
+
+/* DOS handles still open keep the data, like on Linux. */
+static int unlink_ram_file(const char *fn) {
+  const char *name;
+  RamFile **rfp;
+  if ((name = get_ram_basename(fn)) == NULL) return -1;
+  if (*(rfp = find_ram_file(name)) == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  remove_ram_file(rfp);
+  return 0;
+}
+
+static int rename_ram_file(const char *old_fn, const char *new_fn) {
+  const char *old_name, *new_name;
+  RamFile **rfp, *rf, *new_rf;
+  if ((old_name = get_ram_basename(old_fn)) == NULL || (new_name = get_ram_basename(new_fn)) == NULL) return -1;
+  if ((rf = *(rfp = find_ram_file(old_name))) == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (strcmp(old_name, new_name) == 0) return 0;
+  if ((new_rf = malloc(sizeof(RamFile) + strlen(new_name))) == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  *rfp = rf->next;
+  new_rf->fd = rf->fd;
+  strcpy(new_rf->name, new_name);
+  free(rf);
+  if (*(rfp = find_ram_file(new_name)) != NULL) remove_ram_file(rfp);  /* Replace the existing file, like rename(2). */
+  new_rf->next = NULL;
+  *rfp = new_rf;
+  return 0;
+}
+
+/* Creates Linux file linux_filename with the contents of fd (from offset
+ * 0). Returns 0 on success, or -1 with errno set.
+ */
+static int copy_to_file(int fd, const char *linux_filename) {
+  char buf[0x8000];
+  off_t ofs;
+  ssize_t got;
+  int out_fd;
+  if ((out_fd = open(linux_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+  for (ofs = 0; (got = pread(fd, buf, sizeof(buf), ofs)) > 0; ofs += got) {
+    if (write(out_fd, buf, got) != got) { got = -1; break; }
+  }
+  if (close(out_fd) != 0 || got < 0) return -1;
+  return 0;
+}
+
+/* Copies the files listed in persist (see EmuParams.persist) from the
+ * in-memory drives to Linux. Files which don't exist (e.g. because the
+ * compiler has failed) are skipped.
+ */
+static void persist_ram_files(const char* const *persist, const DirState *dir_state) {
+  char dos_filename[DOS_PATH_SIZE], fnbuf[LINUX_PATH_SIZE];
+  const char *linux_filename, *eq, *name;
+  RamFile *rf;
+  for (; *persist; ++persist) {
+    if ((eq = strchr(*persist, '=')) == NULL) eq = *persist + strlen(*persist);
+    if ((size_t)(eq - *persist) >= sizeof(dos_filename)) goto bad_filename;
+    memcpy(dos_filename, *persist, eq - *persist);
+    dos_filename[eq - *persist] = '\0';
+    get_linux_filename_r(dos_filename, dir_state, fnbuf, NULL);
+    if (!is_ram_filename(fnbuf) || (name = get_ram_basename(fnbuf)) == NULL) { bad_filename:
+      fprintf(stderr, "fatal: persist file not on an in-memory drive: %s\n", *persist);
+      exit(252);
+    }
+    if ((rf = *find_ram_file(name)) == NULL) continue;
+    linux_filename = *eq == '=' ? eq + 1 : get_dos_basename(dos_filename);
+    if (copy_to_file(rf->fd, linux_filename) != 0) {
+      fprintf(stderr, "fatal: cannot persist file: %s: %s\n", linux_filename, strerror(errno));
+      exit(252);
+    }
+  }
+}
+
+/* --- SHA-256 of file contents, for --overlay-manifest=....
+ *
+ * Based on FIPS 180-4. Only for files up to 2**32 - 1 bytes (the size
+ * limit of DOS anyway).
+ */
+
+static const unsigned sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/* Processes the 64-byte block p, updates h[0 .. 7]. */
+static void sha256_block(unsigned *h, const unsigned char *p) {
+  unsigned w[64], a[8], u, t1, t2;
+  for (u = 0; u < 16; ++u, p += 4) {
+    w[u] = (unsigned)p[0] << 24 | (unsigned)p[1] << 16 | (unsigned)p[2] << 8 | p[3];
+  }
+  for (; u < 64; ++u) {
+    w[u] = w[u - 16] + (SHA256_ROTR(w[u - 15], 7) ^ SHA256_ROTR(w[u - 15], 18) ^ w[u - 15] >> 3) +
+           w[u - 7] + (SHA256_ROTR(w[u - 2], 17) ^ SHA256_ROTR(w[u - 2], 19) ^ w[u - 2] >> 10);
+  }
+  memcpy(a, h, sizeof(a));
+  for (u = 0; u < 64; ++u) {
+    t1 = a[7] + (SHA256_ROTR(a[4], 6) ^ SHA256_ROTR(a[4], 11) ^ SHA256_ROTR(a[4], 25)) + ((a[4] & a[5]) ^ (~a[4] & a[6])) + sha256_k[u] + w[u];
+    t2 = (SHA256_ROTR(a[0], 2) ^ SHA256_ROTR(a[0], 13) ^ SHA256_ROTR(a[0], 22)) + ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+    memmove(a + 1, a, 7 * sizeof(a[0]));
+    a[4] += t1;
+    a[0] = t1 + t2;
+  }
+  for (u = 0; u < 8; ++u) {
+    h[u] += a[u];
+  }
+}
+
+/* Computes the SHA-256 of the contents of fd (from its current offset) as
+ * 64 hex digits to hex_out (65 bytes). Returns the file size, or -1 on
+ * error.
+ */
+static off_t get_sha256_hex(int fd, char *hex_out) {
+  static const unsigned sha256_init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  unsigned h[8], u;
+  unsigned char buf[0x8000], *p;
+  off_t size = 0;
+  ssize_t got;
+  size_t rest = 0;  /* Number of bytes at the beginning of buf not processed yet. */
+  memcpy(h, sha256_init, sizeof(h));
+  while ((got = read(fd, buf + rest, sizeof(buf) - rest)) > 0) {
+    size += got;
+    rest += got;
+    for (p = buf; rest >= 64; p += 64, rest -= 64) {
+      sha256_block(h, p);
+    }
+    memmove(buf, p, rest);
+  }
+  if (got < 0 || size > (off_t)0xffffffffU) return -1;
+  buf[rest++] = 0x80;
+  memset(buf + rest, '\0', 128 - rest);
+  rest = rest > 56 ? 128 : 64;
+  for (u = 0; u < 4; ++u) {
+    buf[rest - 1 - u] = (unsigned char)((size + 0U) << 3 >> (u << 3));
+  }
+  buf[rest - 5] = (unsigned char)((size + 0U) >> 29);
+  for (p = buf; p != buf + rest; p += 64) {
+    sha256_block(h, p);
+  }
+  for (u = 0; u < 8; ++u) {
+    sprintf(hex_out + (u << 3), "%08x", h[u]);
+  }
+  return size;
+}
+
+/* --- Overlay mount (--mount=<drive>:<lower>/+<upper>/).
+ *
+ * The DOS program sees the files in the Linux directory <lower>, overlaid
+ * by those in <upper>. Opening a file for writing, creating, deleting and
+ * renaming files and creating directories change <upper> only: a file in
+ * <lower> is copied to <upper> when it is opened for writing, and deleted
+ * files of <lower> are just hidden until kvikdos_run(...) returns. This
+ * makes build steps hermetic (they don't touch the source tree), and with
+ * --overlay-manifest=<file>, kvikdos writes the list of files created,
+ * modified and deleted (with their size and SHA-256) for a build cache.
+ *
+ * get_linux_filename_r(...) still returns Linux filenames in <lower>, and
+ * open_file(...) etc. (see below) redirect them to <upper>. Thus the overlay
+ * applies to all drives with a mount point within <lower>.
+ */
+
+typedef struct Overlay {
+  const char *lower_dir, *upper_dir;  /* Empty or ends with '/'. */
+  size_t lower_dir_size;
+} Overlay;
+
+#define OVERLAY_CHANGE_HASH_SIZE 64  /* Number of buckets. Must be a power of 2. */
+
+/* A file which the DOS program has written, created, deleted or renamed. */
+typedef struct OverlayChange {
+  struct OverlayChange *next;  /* Next change in the same bucket. */
+  char is_deleted;  /* Whether the file in <lower> is hidden. */
+  char lower_filename[1];  /* Linux filename in <lower>, NUL-terminated. Longer than 1 byte. */
+} OverlayChange;
+
+/* Forgets all changes of the overlays. */
+static void clear_overlay_changes(void) {
+  OverlayChange **ocp, *oc;
+  for (ocp = run_state->overlay_changes; ocp != run_state->overlay_changes + OVERLAY_CHANGE_HASH_SIZE; ++ocp) {
+    while ((oc = *ocp) != NULL) {
+      *ocp = oc->next;
+      free(oc);
+    }
+  }
+}
+
+/* Sets up overlays from the mounts in dir_state, and forgets all changes. */
+static void init_overlays(const DirState *dir_state) {
+  char drive_idx;
+  clear_overlay_changes();
+  run_state->overlay_count = 0;
+  for (drive_idx = 0; drive_idx < DRIVE_COUNT; ++drive_idx) {
+    const char * const lower_dir = dir_state->linux_mount_dir[(int)drive_idx];
+    if (lower_dir && dir_state->linux_upper_dir[(int)drive_idx] && !is_ram_filename(lower_dir)) {
+      run_state->overlays[run_state->overlay_count].lower_dir = lower_dir;
+      run_state->overlays[run_state->overlay_count].lower_dir_size = strlen(lower_dir);
+      run_state->overlays[run_state->overlay_count++].upper_dir = dir_state->linux_upper_dir[(int)drive_idx];
+    }
+  }
+}
+
+/* Returns the overlay with the longest <lower> containing Linux filename
+ * fn, or NULL.
+ */
+static const Overlay *find_overlay(const char *fn) {
+  const Overlay *ov, *best_ov = NULL;
+  for (ov = run_state->overlays; ov != run_state->overlays + run_state->overlay_count; ++ov) {
+    if ((fn[0] != '/' || ov->lower_dir[0] == '/') && strncmp(fn, ov->lower_dir, ov->lower_dir_size) == 0 &&
+        (!best_ov || ov->lower_dir_size > best_ov->lower_dir_size)) best_ov = ov;
+  }
+  return best_ov;
+}
+
+/* Converts Linux filename fn in <lower> to <upper>. out_buf is
+ * LINUX_PATH_SIZE bytes. Returns NULL (with errno set) if too long.
+ */
+static char *get_upper_filename(const Overlay *ov, const char *fn, char *out_buf) {
+  const size_t upper_dir_size = strlen(ov->upper_dir);
+  if (upper_dir_size + strlen(fn + ov->lower_dir_size) >= LINUX_PATH_SIZE) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  memcpy(out_buf, ov->upper_dir, upper_dir_size);
+  strcpy(out_buf + upper_dir_size, fn + ov->lower_dir_size);
+  return out_buf;
+}
+
+static OverlayChange **find_overlay_change(const char *fn) {
+  OverlayChange **ocp;
+  for (ocp = run_state->overlay_changes + (get_filename_hash(fn) & (OVERLAY_CHANGE_HASH_SIZE - 1)); *ocp && strcmp((*ocp)->lower_filename, fn) != 0; ocp = &(*ocp)->next) {}
+  return ocp;
+}
+
+/* Records a change of Linux filename fn in <lower>. Returns 0 on success. */
+static int add_overlay_change(const char *fn, char is_deleted) {
+  OverlayChange **ocp = find_overlay_change(fn), *oc;
+  if ((oc = *ocp) == NULL) {
+    if ((oc = malloc(sizeof(OverlayChange) + strlen(fn))) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    oc->next = NULL;
+    strcpy(oc->lower_filename, fn);
+    *ocp = oc;
+  }
+  oc->is_deleted = is_deleted;
+  return 0;
+}
+
+/* Returns true iff the DOS program has deleted Linux file fn in <lower>. */
+static char is_overlay_deleted(const char *fn) {
+  const OverlayChange *oc = *find_overlay_change(fn);
+  return oc && oc->is_deleted;
+}
+
+/* Like is_overlay_deleted(...), but fn is dir (empty or ends with '/')
+ * followed by name.
+ */
+static char is_overlay_deleted_in_dir(const char *dir, const char *name) {
+  char fnbuf[LINUX_PATH_SIZE];
+  const size_t dir_size = strlen(dir);
+  if (dir_size + strlen(name) >= sizeof(fnbuf)) return 0;
+  memcpy(fnbuf, dir, dir_size);
+  strcpy(fnbuf + dir_size, name);
+  return is_overlay_deleted(fnbuf);
+}
+
+/* Creates the missing parent directories of upper_fn (in <upper>),
+ * including <upper> itself. Returns 0 on success.
+ */
+static int make_upper_parents(char *upper_fn) {
+  char *p;
+  for (p = upper_fn + 1; (p = strchr(p, '/')) != NULL; *p++ = '/') {
+    *p = '\0';
+    if (mkdir(upper_fn, 0755) != 0 && errno != EEXIST) {
+      *p = '/';
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int open_overlay_file(const Overlay *ov, const char *fn, int flags) {
+  char upper_fn[LINUX_PATH_SIZE];
+  int fd, lower_fd;
+  if (!get_upper_filename(ov, fn, upper_fn)) return -1;
+  if ((flags & 3) == O_RDONLY && !(flags & O_CREAT)) {  /* Reading. */
+    if (is_overlay_deleted(fn)) {
+      errno = ENOENT;
+      return -1;
+    }
+    if ((fd = open(upper_fn, flags)) >= 0 || errno != ENOENT) return fd;
+    return open(fn, flags);
+  }
+  if ((fd = open(upper_fn, flags & ~O_CREAT)) < 0) {
+    if (errno != ENOENT || make_upper_parents(upper_fn) != 0) return -1;
+    if (!is_overlay_deleted(fn)) {
+      if (flags & O_TRUNC) {
+        if (access(fn, F_OK) == 0) flags |= O_CREAT;  /* No need to copy it up. */
+      } else if ((lower_fd = open(fn, O_RDONLY)) >= 0) {  /* Copy it up. */
+        const int result = copy_to_file(lower_fd, upper_fn);
+        close(lower_fd);
+        if (result != 0) return -1;
+      } else if (errno != ENOENT) {
+        return -1;
+      }
+    }
+    if ((fd = open(upper_fn, flags, 0644)) < 0) return -1;
+  }
+  if (add_overlay_change(fn, 0) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int stat_overlay_file(const Overlay *ov, const char *fn, struct stat *st) {
+  char upper_fn[LINUX_PATH_SIZE];
+  if (!get_upper_filename(ov, fn, upper_fn)) return -1;
+  if (is_overlay_deleted(fn)) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (stat(upper_fn, st) == 0) return 0;
+  if (errno != ENOENT) return -1;
+  return stat(fn, st);
+}
+
+static int unlink_overlay_file(const Overlay *ov, const char *fn) {
+  char upper_fn[LINUX_PATH_SIZE];
+  int result;
+  if (!get_upper_filename(ov, fn, upper_fn)) return -1;
+  if (is_overlay_deleted(fn)) {
+    errno = ENOENT;
+    return -1;
+  }
+  if ((result = unlink(upper_fn)) != 0 && errno != ENOENT) return -1;
+  if (access(fn, F_OK) == 0) return add_overlay_change(fn, 1);  /* Hide the file in <lower>. */
+  if (result != 0) errno = ENOENT;
+  return result;
+}
+
+static int rename_overlay_file(const Overlay *ov, const char *old_fn, const char *new_fn) {
+  char old_upper_fn[LINUX_PATH_SIZE], new_upper_fn[LINUX_PATH_SIZE];
+  int lower_fd;
+  if (!get_upper_filename(ov, old_fn, old_upper_fn) || !get_upper_filename(ov, new_fn, new_upper_fn)) return -1;
+  if (is_overlay_deleted(old_fn)) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (make_upper_parents(new_upper_fn) != 0) return -1;
+  if (rename(old_upper_fn, new_upper_fn) != 0) {
+    if (errno != ENOENT) return -1;
+    if ((lower_fd = open(old_fn, O_RDONLY)) < 0) return -1;  /* Copy it up to its new name. */
+    if (copy_to_file(lower_fd, new_upper_fn) != 0) {
+      close(lower_fd);
+      return -1;
+    }
+    close(lower_fd);
+  }
+  if (access(old_fn, F_OK) == 0 && add_overlay_change(old_fn, 1) != 0) return -1;  /* Hide the file in <lower>. */
+  return add_overlay_change(new_fn, 0);
+}
+
+static int mkdir_overlay(const Overlay *ov, const char *fn) {
+  char upper_fn[LINUX_PATH_SIZE];
+  struct stat st;
+  if (!get_upper_filename(ov, fn, upper_fn)) return -1;
+  if (stat_overlay_file(ov, fn, &st) == 0) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (make_upper_parents(upper_fn) != 0) return -1;
+  return mkdir(upper_fn, 0755);
+}
+
+static int rmdir_overlay(const Overlay *ov, const char *fn) {
+  char upper_fn[LINUX_PATH_SIZE];
+  if (!get_upper_filename(ov, fn, upper_fn)) return -1;
+  if (access(fn, F_OK) == 0) {  /* Directories in <lower> can't be hidden. */
+    errno = EACCES;
+    return -1;
+  }
+  return rmdir(upper_fn);
+}
+
+static int compare_overlay_changes(const void *a, const void *b) {
+  return strcmp((*(const OverlayChange* const*)a)->lower_filename, (*(const OverlayChange* const*)b)->lower_filename);
+}
+
+/* Writes the manifest of the overlay changes to Linux file filename, one
+ * line per file, sorted by filename, e.g.:
+ *
+ *   created 1234 <sha256> out/HELLO.OBJ
+ *   modified 567 <sha256> out/HELLO.MAP
+ *   deleted - - src/OLD.TMP
+ *
+ * The filename is in <upper> for created and modified files, and in
+ * <lower> for deleted files. Files which are the same as in <lower> (e.g.
+ * opened for writing, but not written) are omitted.
+ */
+static void write_overlay_manifest(const char *filename) {
+  OverlayChange **ocp, *oc, **ocs, **ocsp;
+  unsigned count = 0;
+  FILE *f;
+  const Overlay *ov;
+  char upper_fn[LINUX_PATH_SIZE], hex[65], lower_hex[65];
+  struct stat st;
+  int fd;
+  off_t size;
+  char is_in_lower, is_same;
+  for (ocp = run_state->overlay_changes; ocp != run_state->overlay_changes + OVERLAY_CHANGE_HASH_SIZE; ++ocp) {
+    for (oc = *ocp; oc; oc = oc->next) ++count;
+  }
+  if ((ocs = malloc((count + 1) * sizeof(*ocs))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for overlay manifest\n");
+    exit(252);
+  }
+  for (ocsp = ocs, ocp = run_state->overlay_changes; ocp != run_state->overlay_changes + OVERLAY_CHANGE_HASH_SIZE; ++ocp) {
+    for (oc = *ocp; oc; oc = oc->next) *ocsp++ = oc;
+  }
+  qsort(ocs, count, sizeof(*ocs), compare_overlay_changes);
+  if ((f = fopen(filename, "w")) == NULL) { error:
+    fprintf(stderr, "fatal: cannot write overlay manifest: %s: %s\n", filename, strerror(errno));
+    exit(252);
+  }
+  for (ocsp = ocs; ocsp != ocs + count; ++ocsp) {
+    oc = *ocsp;
+    if ((ov = find_overlay(oc->lower_filename)) == NULL || !get_upper_filename(ov, oc->lower_filename, upper_fn)) continue;
+    if ((fd = open(upper_fn, O_RDONLY)) >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      size = get_sha256_hex(fd, hex);
+      close(fd);
+      if (size < 0) goto error;
+      is_in_lower = 0;
+      if (!oc->is_deleted && (fd = open(oc->lower_filename, O_RDONLY)) >= 0) {
+        is_in_lower = 1;
+        is_same = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size && get_sha256_hex(fd, lower_hex) == size && strcmp(hex, lower_hex) == 0;
+        close(fd);
+        if (is_same) continue;
+      }
+      fprintf(f, "%s %lu %s %s\n", is_in_lower || oc->is_deleted ? "modified" : "created", (unsigned long)size, hex, upper_fn);
+    } else {
+      if (fd >= 0) close(fd);
+      if (oc->is_deleted) fprintf(f, "deleted - - %s\n", oc->lower_filename);
+    }
+  }
+  if (fclose(f) != 0) goto error;
+  free(ocs);
+}
+
+/* --- Execution trace (--trace=<file>) and its replay (--replay-check).
+ *
+ * The trace file starts with TRACE_MAGIC, followed by records, each of
+ * them a 1-byte type (TR_...), a 4-byte little-endian payload size and the
+ * payload:
+ *
+ * * TR_KEY: NUL-terminated strings identifying the run: the SHA-256 of
+ *   kvikdos and of the program file, the command-line arguments, the extra
+ *   environment variables, the Linux current directory, the mounts and the
+ *   emulation flags. Always the first record.
+ * * TR_INPUT: the SHA-256 (64 hex digits, or 64 `-' characters if the file
+ *   didn't exist) and the Linux filename of a file, when the DOS program
+ *   first opened it for reading.
+ * * TR_STAT: the stat(2) result as seen by the DOS program (1 byte: 0 if
+ *   the file didn't exist, otherwise 1 | 2 for a directory | 4 for
+ *   read-only; the 4-byte size and the 4-byte mtime in seconds) and the
+ *   Linux filename of a file, when the DOS program first queried its
+ *   attributes (int 0x21 ah == 0x43) or looked it up without wildcards
+ *   (ah == 0x4e).
+ * * TR_CALL: an int 0x10, 0x16, 0x1a or 0x21 call handled by kvikdos: the
+ *   int number (1 byte), the input ax, bx, cx, dx, si, di, ds and es, the
+ *   output ax, bx, cx, dx, si, di, ds, es and flags (2 bytes each), and the
+ *   FNV-1a hash of the data read or written (4 bytes, only for int 0x21
+ *   with ah == 0x3f and ah == 0x40, otherwise 0).
+ * * TR_STDOUT and TR_STDERR: data written to stdout and stderr.
+ * * TR_UNCACHEABLE: the reason (e.g. keyboard input) why the run can't be
+ *   replayed.
+ * * TR_OUTPUT (at exit): the mtime (4-byte seconds and 4-byte nanoseconds),
+ *   the NUL-terminated Linux filename and the final contents of a file
+ *   written by the DOS program.
+ * * TR_DELETED (at exit): the Linux filename of a file written, deleted or
+ *   renamed by the DOS program, which doesn't exist at exit.
+ * * TR_EXIT: the exit code (1 byte). Always the last record, the trace is
+ *   incomplete without it (e.g. after a fatal error).
+ *
+ * With --replay-check, kvikdos first reads the trace file, and if it is
+ * complete and replayable, and the key and the SHA-256 of all inputs
+ * match, it writes the recorded stdout, stderr and output files, and exits
+ * with the recorded exit code, without creating the VM. Otherwise it runs
+ * the DOS program, and overwrites the trace file. Thus kvikdos can be used
+ * as an action cache of deterministic DOS tools (e.g. assemblers,
+ * compilers and linkers), with --clock=fixed:... or --clock=virtual:...
+ * (otherwise their output may depend on the time). Directory listings
+ * (findfirst with wildcards) and the file date and time queried by handle
+ * (ah == 0x57) are not recorded as inputs, they make the run uncacheable.
+ * The program found on %PATH% is part of the key, and batch files are
+ * uncacheable, so find_prog_on_path(...) needs no records.
+ */
+
+#define TRACE_MAGIC "kvikTRC1"
+#define TR_KEY 1
+#define TR_INPUT 2
+#define TR_CALL 3
+#define TR_STDOUT 4
+#define TR_STDERR 5
+#define TR_UNCACHEABLE 6
+#define TR_OUTPUT 7
+#define TR_DELETED 8
+#define TR_EXIT 9
+#define TR_STAT 10
+
+#define TRACE_CALL_SIZE (1 + 17 * 2 + 4)
+#define TRACE_FILE_HASH_SIZE 256
+
+typedef struct TraceFile {
+  struct TraceFile *next;  /* In the same hash bucket. */
+  char is_input;  /* Has a TR_INPUT record. */
+  char is_stat_input;  /* Has a TR_STAT record. */
+  char is_output;  /* Written, deleted or renamed by the DOS program. */
+  char filename[1];  /* Linux filename, NUL-terminated. */
+} TraceFile;
+
+typedef struct TraceState {
+  FILE *f;
+  const char *filename;
+  char is_uncacheable;  /* Has a TR_UNCACHEABLE record. */
+  char is_call_pending;  /* call contains the input of an int call being handled. */
+  unsigned char call[TRACE_CALL_SIZE];
+  TraceFile *files[TRACE_FILE_HASH_SIZE];
+} TraceState;
+
+static unsigned char *put_trace_u16(unsigned char *p, unsigned v) {
+  p[0] = v; p[1] = v >> 8;
+  return p + 2;
+}
+
+static unsigned char *put_trace_u32(unsigned char *p, unsigned v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+  return p + 4;
+}
+
+static unsigned get_trace_u16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static unsigned get_trace_u32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+/* Writes the type and the size of a record. The caller writes the payload. */
+static void add_trace_header(unsigned char type, unsigned size) {
+  unsigned char header[5];
+  header[0] = type;
+  put_trace_u32(header + 1, size);
+  fwrite(header, 1, sizeof(header), run_state->tracer->f);
+}
+
+static void add_trace_record(unsigned char type, const void *p, unsigned size) {
+  add_trace_header(type, size);
+  fwrite(p, 1, size, run_state->tracer->f);
+}
+
+static void trace_uncacheable(const char *reason) {
+  if (!run_state->tracer->is_uncacheable) {
+    run_state->tracer->is_uncacheable = 1;
+    add_trace_record(TR_UNCACHEABLE, reason, strlen(reason));
+  }
+}
+
+/* Returns the TraceFile of Linux filename fn, adding it if needed. */
+static TraceFile *get_trace_file(const char *fn) {
+  TraceFile **tfp = &run_state->tracer->files[get_filename_hash(fn) & (TRACE_FILE_HASH_SIZE - 1)], *tf;
+  for (; (tf = *tfp) != NULL; tfp = &tf->next) {
+    if (strcmp(tf->filename, fn) == 0) return tf;
+  }
+  if ((tf = malloc(sizeof(*tf) + strlen(fn))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for trace\n");
+    exit(252);
+  }
+  tf->next = NULL;
+  tf->is_input = tf->is_stat_input = tf->is_output = 0;
+  strcpy(tf->filename, fn);
+  return *tfp = tf;
+}
+
+/* Called by open_file(...) after the open(2) call which returned fd. */
+static void trace_open(const char *fn, int flags, int fd) {
+  const int saved_errno = errno;
+  TraceFile * const tf = get_trace_file(fn);
+  if (!tf->is_input && !tf->is_output && !(flags & O_TRUNC) && (fd >= 0 || saved_errno == ENOENT)) {
+    char hex[65];
+    struct stat st;
+    tf->is_input = 1;
+    if (fd < 0 || (flags & O_EXCL)) {  /* The file didn't exist. */
+      memset(hex, '-', 64);
+    } else if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || get_sha256_hex(fd, hex) < 0 || lseek(fd, 0, SEEK_SET) != 0) {
+      trace_uncacheable("input is not a regular file");
+      memset(hex, '?', 64);
+    }
+    add_trace_header(TR_INPUT, 64 + strlen(fn));
+    fwrite(hex, 1, 64, run_state->tracer->f);
+    fputs(fn, run_state->tracer->f);
+  }
+  if (fd >= 0 && (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC))) tf->is_output = 1;
+  errno = saved_errno;
+}
+
+/* Sets the TR_STAT payload prefix from st (NULL if the file doesn't exist). */
+static void get_trace_stat(unsigned char *p, const struct stat *st) {
+  if (st) {
+    p[0] = 1 | (S_ISDIR(st->st_mode) ? 2 : 0) | (st->st_mode & 0200 ? 0 : 4);
+    put_trace_u32(p + 1, (unsigned)st->st_size);
+    put_trace_u32(p + 5, (unsigned)st->st_mtime);
+  } else {
+    memset(p, '\0', 9);
+  }
+}
+
+/* Called by stat_file(...) after the stat(2) call which returned ret. */
+static void trace_stat(const char *fn, int ret, const struct stat *st) {
+  const int saved_errno = errno;
+  TraceFile * const tf = get_trace_file(fn);
+  if (!tf->is_stat_input && !tf->is_output && (ret == 0 || saved_errno == ENOENT)) {
+    unsigned char buf[9];
+    tf->is_stat_input = 1;
+    get_trace_stat(buf, ret == 0 ? st : NULL);
+    add_trace_header(TR_STAT, sizeof(buf) + strlen(fn));
+    fwrite(buf, 1, sizeof(buf), run_state->tracer->f);
+    fputs(fn, run_state->tracer->f);
+  }
+  errno = saved_errno;
+}
+
+static unsigned char *put_trace_regs(unsigned char *p, const struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  p = put_trace_u16(p, regs->rax);
+  p = put_trace_u16(p, regs->rbx);
+  p = put_trace_u16(p, regs->rcx);
+  p = put_trace_u16(p, regs->rdx);
+  p = put_trace_u16(p, regs->rsi);
+  p = put_trace_u16(p, regs->rdi);
+  p = put_trace_u16(p, sregs->ds.selector);
+  return put_trace_u16(p, sregs->es.selector);
+}
+
+/* Called when kvikdos starts handling an int call. */
+static void trace_int(unsigned char int_num, const struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  const unsigned char ah = (unsigned)regs->rax >> 8;
+  if (int_num != 0x10 && int_num != 0x16 && int_num != 0x1a && int_num != 0x21) return;
+  if (int_num == 0x16 ? ah != 0x02 && ah != 0x12 :  /* Keyboard, except for shift status. */
+      int_num == 0x21 && (ah == 0x01 || ah == 0x07 || ah == 0x08 || ah == 0x0a || ah == 0x0b || ah == 0x0c ||
+                          (ah == 0x06 && (unsigned char)regs->rdx == 0xff) || (ah == 0x3f && (unsigned short)regs->rbx < 5))) {
+    trace_uncacheable("keyboard or stdin input");
+  } else if (int_num == 0x21 && (((ah == 0x45 || ah == 0x46) && (unsigned short)regs->rbx < 5) || ah == 0x39 || ah == 0x3a)) {
+    trace_uncacheable("dup of a standard handle or directory change");
+  }
+  run_state->tracer->call[0] = int_num;
+  put_trace_regs(run_state->tracer->call + 1, regs, sregs);
+  run_state->tracer->is_call_pending = 1;
+}
+
+/* Called when the guest continues after an int call traced by trace_int(...). */
+static void end_trace_int(const struct kvm_regs *regs, const struct kvm_sregs *sregs, const void *mem) {
+  const unsigned char * const in = run_state->tracer->call + 1;  /* Input registers. */
+  unsigned char *p = put_trace_regs(run_state->tracer->call + 17, regs, sregs);
+  unsigned hash = 0;
+  p = put_trace_u16(p, regs->rflags);
+  if (run_state->tracer->call[0] == 0x21 && (in[1] == 0x3f || in[1] == 0x40) && !(regs->rflags & 1)) {  /* Successful read or write, CF == 0. */
+    const unsigned char *q = (const unsigned char*)mem + (get_trace_u16(in + 12) << 4) + get_trace_u16(in + 6);
+    const unsigned char * const q_end = q + (in[1] == 0x3f ? (unsigned short)regs->rax : get_trace_u16(in + 4));
+    for (hash = 2166136261U; q != q_end; ++q) {  /* FNV-1a. */
+      hash = (hash ^ *q) * 16777619U;
+    }
+  }
+  put_trace_u32(p, hash);
+  add_trace_record(TR_CALL, run_state->tracer->call, TRACE_CALL_SIZE);
+  run_state->tracer->is_call_pending = 0;
+}
+
+/* Appends prefix and s (including the trailing NUL) to the key at *key_ptr (malloc(...)ed). */
+static void add_trace_key(char **key_ptr, unsigned *key_size_ptr, const char *prefix, const char *s) {
+  const unsigned prefix_size = strlen(prefix), size = strlen(s) + 1;
+  if ((*key_ptr = realloc(*key_ptr, *key_size_ptr + prefix_size + size)) == NULL) {
+    fprintf(stderr, "fatal: out of memory for trace key\n");
+    exit(252);
+  }
+  memcpy(*key_ptr + *key_size_ptr, prefix, prefix_size);
+  memcpy(*key_ptr + *key_size_ptr + prefix_size, s, size);
+  *key_size_ptr += prefix_size + size;
+}
+
+static void add_trace_key_sha256(char **key_ptr, unsigned *key_size_ptr, const char *prefix, const char *filename) {
+  char hex[65] = "-";
+  const int fd = open(filename, O_RDONLY);
+  if (fd >= 0) {
+    if (get_sha256_hex(fd, hex) < 0) strcpy(hex, "-");
+    close(fd);
+  }
+  add_trace_key(key_ptr, key_size_ptr, prefix, hex);
+  add_trace_key(key_ptr, key_size_ptr, "file=", filename);
+}
+
+/* Returns the key (TR_KEY payload) of running prog_filename, and sets *key_size_out. */
+static char *get_trace_key(const char *prog_filename, const char* const *args, const char* const *envp0, const DirState *dir_state, const EmuParams *emu_params, unsigned *key_size_out) {
+  char *key = NULL, buf[128];
+  unsigned key_size = 0;
+  char *cwd = getcwd(NULL, 0);
+  int i;
+  add_trace_key_sha256(&key, &key_size, "kvikdos=", "/proc/self/exe");
+  add_trace_key_sha256(&key, &key_size, "prog=", prog_filename);
+  add_trace_key(&key, &key_size, "cwd=", cwd ? cwd : "");
+  free(cwd);
+  for (; *args; ++args) {
+    add_trace_key(&key, &key_size, "arg=", *args);
+  }
+  for (; *envp0; ++envp0) {
+    add_trace_key(&key, &key_size, "env=", *envp0);
+  }
+  for (i = 0; i < DRIVE_COUNT; ++i) {
+    if (dir_state->linux_mount_dir[i]) {
+      sprintf(buf, "mount=%c%d:", 'A' + i, dir_state->case_mode[i]);
+      add_trace_key(&key, &key_size, buf, dir_state->linux_mount_dir[i]);
+    }
+  }
+  add_trace_key(&key, &key_size, "dos_prog=", dir_state->dos_prog_abs ? dir_state->dos_prog_abs : "");
+  sprintf(buf, "drive=%c mem_mb=%u clock=%d:%lu hlt_ok=%d", dir_state->drive, emu_params->mem_mb, emu_params->clock_mode, emu_params->clock_epoch, emu_params->is_hlt_ok);
+  add_trace_key(&key, &key_size, "", buf);
+  *key_size_out = key_size;
+  return key;
+}
+
+/* Starts writing the trace to filename. The trace is finished by write_trace(...). */
+static void start_trace(const char *filename, const char *key, unsigned key_size) {
+  if ((run_state->tracer = calloc(1, sizeof(*run_state->tracer))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for trace\n");
+    exit(252);
+  }
+  if ((run_state->tracer->f = fopen(filename, "wb")) == NULL) {
+    fprintf(stderr, "fatal: cannot open trace file: %s: %s\n", filename, strerror(errno));
+    exit(252);
+  }
+  run_state->tracer->filename = filename;
+  fputs(TRACE_MAGIC, run_state->tracer->f);
+  add_trace_record(TR_KEY, key, key_size);
+}
+
+/* Writes the final contents of the output files and the exit code to the trace, and stops tracing. */
+static void write_trace(unsigned char exit_code) {
+  TraceState * const tracer = run_state->tracer;
+  unsigned u;
+  TraceFile *tf, *tf_next;
+  if (!tracer) return;
+  tracer->is_call_pending = 0;  /* The exit call, its output is TR_EXIT. */
+  for (u = 0; u < TRACE_FILE_HASH_SIZE; ++u) {
+    for (tf = tracer->files[u]; tf; tf = tf_next) {
+      tf_next = tf->next;
+      if (tf->is_output) {
+        const int fd = open(tf->filename, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+          add_trace_record(TR_DELETED, tf->filename, strlen(tf->filename));
+        } else {
+          unsigned char mtime[8], buf[0x8000];
+          off_t ofs;
+          ssize_t got;
+          char is_truncated = 0;
+          add_trace_header(TR_OUTPUT, sizeof(mtime) + strlen(tf->filename) + 1 + st.st_size);
+          put_trace_u32(put_trace_u32(mtime, st.st_mtim.tv_sec), st.st_mtim.tv_nsec);
+          fwrite(mtime, 1, sizeof(mtime), tracer->f);
+          fwrite(tf->filename, 1, strlen(tf->filename) + 1, tracer->f);
+          for (ofs = 0; ofs < st.st_size; ofs += got) {
+            if ((got = pread(fd, buf, sizeof(buf), ofs)) <= 0) {  /* Truncated while reading. Keep the record size. */
+              memset(buf, '\0', sizeof(buf));
+              got = sizeof(buf);
+              is_truncated = 1;
+            }
+            if (got > st.st_size - ofs) got = st.st_size - ofs;
+            fwrite(buf, 1, got, tracer->f);
+          }
+          if (is_truncated) trace_uncacheable("cannot read output file");
+        }
+        if (fd >= 0) close(fd);
+      }
+      free(tf);
+    }
+  }
+  add_trace_record(TR_EXIT, &exit_code, 1);
+  if (ferror(tracer->f) | fclose(tracer->f)) fprintf(stderr, "error: cannot write trace file: %s\n", tracer->filename);
+  free(tracer);
+  run_state->tracer = NULL;
+}
+
+/* Writes size bytes at p to Linux fd. Returns 0 on success, -1 on error. */
+static int write_all(int fd, const unsigned char *p, unsigned size) {
+  ssize_t got;
+  for (; size != 0; p += got, size -= got) {
+    if ((got = write(fd, p, size)) <= 0) {
+      if (got < 0 && errno == EINTR) { got = 0; continue; }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Copies the filename (not NUL-terminated) of size bytes at p to fnbuf. Returns fnbuf, or NULL if too long. */
+static char *get_trace_filename(char *fnbuf, const unsigned char *p, unsigned size) {
+  if (size == 0 || size >= LINUX_PATH_SIZE || memchr(p, '\0', size)) return NULL;
+  memcpy(fnbuf, p, size);
+  fnbuf[size] = '\0';
+  return fnbuf;
+}
+
+/* If the trace in filename is complete and replayable, and its key and
+ * inputs match, writes its stdout, stderr, and output files, sets
+ * *exit_code_out and returns 1. Otherwise returns 0.
+ */
+static char replay_trace(const char *filename, const char *key, unsigned key_size, char is_set_mtime, unsigned char *exit_code_out) {
+  const int trace_fd = open(filename, O_RDONLY);
+  unsigned char *data, *data_end, *p;
+  struct stat st;
+  char fnbuf[LINUX_PATH_SIZE], hex[65], is_ok = 0, pass;
+  if (trace_fd < 0) return 0;
+  if (fstat(trace_fd, &st) != 0 || st.st_size < (off_t)sizeof(TRACE_MAGIC) - 1 || st.st_size > (off_t)0x7fffffff ||
+      (data = malloc(st.st_size)) == NULL) {
+    close(trace_fd);
+    return 0;
+  }
+  data_end = data + (pread(trace_fd, data, st.st_size, 0) == st.st_size ? st.st_size : 0);
+  close(trace_fd);
+  if (data_end != data + st.st_size || memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) goto done;
+  for (pass = 0; pass < 2; ++pass) {  /* Pass 0 checks all records, pass 1 writes the outputs. */
+    for (p = data + sizeof(TRACE_MAGIC) - 1; p != data_end; ) {
+      const unsigned char type = *p;
+      unsigned size;
+      unsigned char *payload;
+      if (data_end - p < 5 || (size = get_trace_u32(p + 1)) > (unsigned)(data_end - p - 5)) goto done;  /* Truncated. */
+      payload = p + 5;
+      p = payload + size;
+      if (pass == 0) {
+        if ((payload == data + sizeof(TRACE_MAGIC) - 1 + 5) != (type == TR_KEY)) goto done;  /* The key must be first. */
+        if (type == TR_KEY) {
+          if (size != key_size || memcmp(payload, key, key_size) != 0) goto done;
+        } else if (type == TR_UNCACHEABLE) {
+          goto done;
+        } else if (type == TR_INPUT) {
+          int fd;
+          if (size < 64 || !get_trace_filename(fnbuf, payload + 64, size - 64)) goto done;
+          if ((fd = open(fnbuf, O_RDONLY)) < 0) {
+            if (payload[0] != '-') goto done;
+          } else {
+            const char is_match = payload[0] != '-' && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && get_sha256_hex(fd, hex) >= 0 && memcmp(hex, payload, 64) == 0;
+            close(fd);
+            if (!is_match) goto done;
+          }
+        } else if (type == TR_STAT) {
+          unsigned char buf[9];
+          if (size < sizeof(buf) || !get_trace_filename(fnbuf, payload + sizeof(buf), size - sizeof(buf))) goto done;
+          get_trace_stat(buf, stat(fnbuf, &st) == 0 ? &st : NULL);
+          if (memcmp(buf, payload, sizeof(buf)) != 0) goto done;
+        } else if (type == TR_OUTPUT) {
+          if (size < 9 || !memchr(payload + 8, '\0', size - 8)) goto done;
+        } else if (type == TR_DELETED) {
+          if (!get_trace_filename(fnbuf, payload, size)) goto done;
+        } else if (type == TR_EXIT) {
+          if (size != 1 || p != data_end) goto done;
+          is_ok = 1;
+        }
+      } else {
+        if (type == TR_STDOUT || type == TR_STDERR) {
+          (void)!write_all(type == TR_STDOUT ? 1 : 2, payload, size);
+        } else if (type == TR_OUTPUT) {
+          char * const fn = (char*)payload + 8;
+          const unsigned fn_size = strlen(fn) + 1;
+          int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if (fd < 0 && errno == ENOENT && make_upper_parents(fn) == 0) fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if (fd < 0 || write_all(fd, payload + 8 + fn_size, size - 8 - fn_size) != 0) {
+            fprintf(stderr, "fatal: cannot write output file of trace: %s: %s\n", fn, strerror(errno));
+            exit(252);
+          }
+          if (is_set_mtime) {
+            struct timespec tss[2];
+            tss[0].tv_sec = 0;
+            tss[0].tv_nsec = UTIME_OMIT;  /* Keep the atime. */
+            tss[1].tv_sec = get_trace_u32(payload);
+            tss[1].tv_nsec = get_trace_u32(payload + 4);
+            (void)!futimens(fd, tss);
+          }
+          close(fd);
+        } else if (type == TR_DELETED) {
+          (void)!unlink(get_trace_filename(fnbuf, payload, size));
+        } else if (type == TR_EXIT) {
+          *exit_code_out = *payload;
+        }
+      }
+    }
+    if (!is_ok) goto done;
+  }
+ done:
+  free(data);
+  return is_ok;
+}
+
+/* --- Filesystem calls of the DOS program.
+ *
+ * Like the corresponding Linux system calls (e.g. open(2) with mode 0644),
+ * but they also work on in-memory drives and overlay mounts.
+ */
+
+static int open_file(const char *fn, int flags) {
+  const Overlay *ov;
+  int fd;
+  if (is_ram_filename(fn)) return open_ram_file(fn, flags);
+  if (run_state->overlay_count && (ov = find_overlay(fn)) != NULL) return open_overlay_file(ov, fn, flags);
+  fd = open(fn, flags, 0644);
+  if (run_state->tracer) trace_open(fn, flags, fd);
+  return fd;
+}
+
+static int stat_file(const char *fn, struct stat *st) {
+  const Overlay *ov;
+  if (is_ram_filename(fn)) return stat_ram_file(fn, st);
+  if (run_state->overlay_count && (ov = find_overlay(fn)) != NULL) return stat_overlay_file(ov, fn, st);
+  if (run_state->tracer) {
+    const int ret = stat(fn, st);
+    trace_stat(fn, ret, st);
+    return ret;
+  }
+  return stat(fn, st);
+}
+
+static int unlink_file(const char *fn) {
+  const Overlay *ov;
+  if (is_ram_filename(fn)) return unlink_ram_file(fn);
+  if (run_state->overlay_count && (ov = find_overlay(fn)) != NULL) return unlink_overlay_file(ov, fn);
+  if (run_state->tracer) get_trace_file(fn)->is_output = 1;
+  return unlink(fn);
+}
+
+/* Fails with EXDEV between different in-memory drives, overlays and Linux
+ * directories.
+ */
+static int rename_file(const char *old_fn, const char *new_fn) {
+  const Overlay * const old_ov = run_state->overlay_count ? find_overlay(old_fn) : NULL;
+  const Overlay * const new_ov = run_state->overlay_count ? find_overlay(new_fn) : NULL;
+  if (is_ram_filename(old_fn) != is_ram_filename(new_fn) || old_ov != new_ov) {
+    errno = EXDEV;
+    return -1;
+  }
+  if (is_ram_filename(old_fn)) return rename_ram_file(old_fn, new_fn);
+  if (old_ov) return rename_overlay_file(old_ov, old_fn, new_fn);
+  if (run_state->tracer) get_trace_file(old_fn)->is_output = get_trace_file(new_fn)->is_output = 1;
+  return rename(old_fn, new_fn);
+}
+
+static int make_dir(const char *fn) {
+  const Overlay *ov;
+  if (is_ram_filename(fn)) {  /* No subdirectories on in-memory drives. */
+    errno = EACCES;
+    return -1;
+  }
+  if (run_state->overlay_count && (ov = find_overlay(fn)) != NULL) return mkdir_overlay(ov, fn);
+  return mkdir(fn, 0755);
+}
+
+static int remove_dir(const char *fn) {
+  const Overlay *ov;
+  if (is_ram_filename(fn)) {
+    errno = EACCES;
+    return -1;
+  }
+  if (run_state->overlay_count && (ov = find_overlay(fn)) != NULL) return rmdir_overlay(ov, fn);
+  return rmdir(fn);
+}
+
+/* --- Wildcard findfirst and findnext.
+ *
+ * For a findfirst (int 0x21 ah == 0x4e) pattern with wildcards, kvikdos
+ * reads the Linux directory once (readdir(3) and fstatat(2) for each
+ * entry), keeps the entries which have a DOS 8.3 name on the drive (with
+ * the correct case), sorts them by name, and saves them to a FindDir
+ * listing. The DTA contains the id of the listing and a cursor (entry
+ * index), so findnext (ah == 0x4f) doesn't do any system calls. Listings
+ * are reused by subsequent findfirst calls on the same directory until
+ * kvikdos modifies a file or directory (see note_dir_change()) or a new DOS
+ * program starts. Then the next findfirst replaces the stale listing.
+ *
+ * Only FIND_DIR_COUNT listings are kept, but the high 16 bits of the id
+ * identify the directory (in find_dir_names, which is never evicted). If
+ * the listing of a findnext is gone, kvikdos reads the directory again, and
+ * continues after the name of the previously found file (at dta + 0x1e).
+ *
+ * DTA layout used by kvikdos (bytes 0x00 .. 0x14 are reserved for DOS):
+ * 0x00: FINDFIRST_MAGIC (dword); 0x04: FindDir.id or 0 (dword); 0x08:
+ * cursor (word, bit 15 is set if directories are also requested); 0x0a:
+ * name pattern in FCB format, i.e. 8 + 3 bytes, padded with spaces, '?' for
+ * wildcards.
+ */
+
+#define FIND_DIR_COUNT 4  /* Number of cached directory listings. */
+#define FIND_ENTRY_LIMIT 0x7fff  /* Maximum number of entries in a listing, because it must fit to the cursor. */
+
+#define DTA_FIND_ID 4
+#define DTA_FIND_CURSOR 8
+#define DTA_FIND_PATTERN 0xa
+#define FIND_CURSOR_DIRS 0x8000
+
+typedef struct FindEntry {
+  char name[13];  /* Uppercase DOS filename, NUL-terminated. */
+  char fcb_name[11];  /* Same as name, in FCB format. */
+  unsigned char attr;
+  unsigned short time, date;
+  unsigned size;
+} FindEntry;
+
+typedef struct FindDirName {
+  char case_flip;  /* 32 for lowercase drives, 0 for uppercase drives. */
+  char *linux_dir;  /* Owned. Empty or ends with '/'. */
+} FindDirName;
+
+typedef struct FindDir {
+  unsigned id;  /* Nonzero, stored in the DTA. 0 if the slot is free. High 16 bits: 1 + index in find_dir_names. */
+  unsigned epoch;  /* Value of find_dir_epoch when the listing was read. */
+  char case_flip;  /* Same as in the FindDirName. */
+  const char *linux_dir;  /* Owned by the FindDirName. */
+  FindEntry *entries;  /* Owned. Sorted by name. */
+  unsigned entry_count;
+} FindDir;
+
+/* Called when kvikdos creates, renames, deletes or writes a file or
+ * directory, or when a new DOS program starts.
+ */
+static void note_dir_change(void) {
+  clear_fn_cache_enoent();
+  ++run_state->find_dir_epoch;
+}
+
+/* Converts a DOS filename pattern (basename only) to FCB format. */
+static void get_fcb_pattern(const char *p, char *out) {
+  unsigned i = 0, i_end = 8;
+  memset(out, ' ', 11);
+  for (;; ++p) {
+    const char c = *p;
+    if (c == '\0') break;
+    if (c == '.' && i_end == 8) {
+      i = 8; i_end = 11;
+    } else if (c == '*') {
+      for (; i < i_end; ++i) out[i] = '?';
+    } else if (i < i_end) {
+      out[i++] = (c - 'a' + 0U <= 'z' - 'a' + 0U) ? c & ~32 : c;  /* Convert to uppercase. */
+    }
+  }
+}
+
+static char is_fcb_pattern_match(const char *pattern, const char *fcb_name) {
+  unsigned i;
+  for (i = 0; i < 11; ++i) {
+    if (pattern[i] != '?' && pattern[i] != fcb_name[i]) return 0;
+  }
+  return 1;
+}
+
+/* Sets fe->name and fe->fcb_name from the Linux basename (single pathname
+ * component). Returns 0 if get_linux_filename_r(...) wouldn't map any DOS
+ * filename to this Linux file, e.g. because it is too long or it has the
+ * wrong case.
+ */
+static char set_find_entry_name(FindEntry *fe, const char *name, char case_flip) {
+  char *q = fe->name;
+  unsigned i = 0, i_end = 8;
+  memset(fe->fcb_name, ' ', 11);
+  if (*name == '.') return 0;  /* Also "." and "..". */
+  for (; *name != '\0'; ++name) {
+    char c = *name;
+    if (c == '.') {
+      if (i_end != 8 || name[1] == '\0') return 0;  /* More than 1 '.', or last character is '.'. */
+      i = 8; i_end = 11;
+    } else if (c + 0U <= ' ' + 0U || c =='"' || c == '*' || c == '?' || c == ':' || c == '[' || c == ']' || c == '=' || c == '|' || c == '<' || c == '>' || c == ',' || c == ';' || c == '\x7f' || c == '\\') {
+      return 0;  /* Same characters as in get_linux_filename_r(...). */
+    } else {
+      const char c_uc = c & ~32;
+      if (c_uc - 'A' + 0U <= 'Z' - 'A' + 0U) {
+        if (c != (c_uc ^ case_flip)) return 0;  /* Wrong case for the drive. */
+        c = c_uc;
+      }
+      if (i == i_end) return 0;  /* Too long. */
+      fe->fcb_name[i++] = c;
+    }
+    *q++ = c;
+  }
+  *q = '\0';
+  return 1;
+}
+
+static void set_find_entry_stat(FindEntry *fe, const struct stat *st) {
+  const struct tm *tm = convert_clock_time(&st->st_mtime);
+  fe->attr = S_ISDIR(st->st_mode) ? 0x10 : 0;
+  if (!(st->st_mode & 0200)) fe->attr |= 1;  /* Read-only, same as in get file attributes. */
+  fe->time = tm->tm_sec >> 1 | tm->tm_min << 5 | tm->tm_hour << 11;
+  fe->date = tm->tm_mday | (tm->tm_mon + 1) << 5 | (tm->tm_year - 80) << 9;
+  fe->size = (sizeof(st->st_size) > 4 && st->st_size >> (32 * (sizeof(st->st_size) > 4))) ?
+      0xffffffffU : st->st_size + (size_t)0;  /* Cap file size at 0xffffffff, no way to return more than 32 bits. */
+}
+
+/* Fills the found file part of the DTA (at offset 0x15 .. 0x2b). */
+static void set_find_dta(char *dta, const FindEntry *fe) {
+  dta[0x15] = fe->attr;
+  *(unsigned short*)(dta + 0x16) = fe->time;
+  *(unsigned short*)(dta + 0x18) = fe->date;
+  *(unsigned*)(dta + 0x1a) = fe->size;
+  strcpy(dta + 0x1e, fe->name);  /* Secure because strlen(fe->name) <= 12. We use up to 0x1e + 13 == 0x2b bytes in dta. */
+}
+
+static int compare_find_entries(const void *a, const void *b) {
+  return strcmp(((const FindEntry*)a)->name, ((const FindEntry*)b)->name);
+}
+
+static FindDir *find_find_dir_by_id(unsigned id) {
+  FindDir *fdir;
+  if (id == 0) return NULL;
+  for (fdir = run_state->find_dirs; fdir != run_state->find_dirs + FIND_DIR_COUNT; ++fdir) {
+    if (fdir->id == id) return fdir;
+  }
+  return NULL;
+}
+
+/* Returns 1 + the index of linux_dir in find_dir_names, adding it if
+ * needed. Returns 0 (with errno set) on error.
+ */
+static unsigned get_find_dir_name_num(const char *linux_dir, char case_flip) {
+  FindDirName *fdn;
+  for (fdn = run_state->find_dir_names; fdn != run_state->find_dir_names + run_state->find_dir_name_count; ++fdn) {
+    if (fdn->case_flip == case_flip && strcmp(fdn->linux_dir, linux_dir) == 0) return fdn - run_state->find_dir_names + 1;
+  }
+  if (run_state->find_dir_name_count == 0xffff) {
+    errno = ENOMEM;  /* No more space in the id. */
+    return 0;
+  }
+  if (run_state->find_dir_name_count == run_state->find_dir_name_capacity) {
+    const unsigned capacity = run_state->find_dir_name_capacity ? run_state->find_dir_name_capacity << 1 : 16;
+    if ((fdn = realloc(run_state->find_dir_names, capacity * sizeof(FindDirName))) == NULL) goto out_of_memory;
+    run_state->find_dir_names = fdn;
+    run_state->find_dir_name_capacity = capacity;
+  }
+  fdn = run_state->find_dir_names + run_state->find_dir_name_count;
+  if ((fdn->linux_dir = strdup(linux_dir)) == NULL) goto out_of_memory;
+  fdn->case_flip = case_flip;
+  return ++run_state->find_dir_name_count;
+ out_of_memory:
+  errno = ENOMEM;
+  return 0;
+}
+
+/* Returns the listing of linux_dir (empty or ends with '/'), reading the
+ * directory if needed. Returns NULL (with errno set) on error. For overlay
+ * mounts, it merges the listings of the directories in <upper> and <lower>.
+ */
+static FindDir *get_find_dir(const char *linux_dir, char case_flip) {
+  FindDir *fdir, *stale_fdir = NULL;
+  DIR *dir, *upper_dir = NULL, *cur_dir;
+  struct dirent *de;
+  struct stat st;
+  unsigned capacity = 0, upper_count = 0, name_num;
+  FindEntry *fe;
+  RamFile **rfp, *rf;
+  const Overlay *ov = NULL;
+  for (fdir = run_state->find_dirs; fdir != run_state->find_dirs + FIND_DIR_COUNT; ++fdir) {
+    if (fdir->id != 0 && fdir->case_flip == case_flip && strcmp(fdir->linux_dir, linux_dir) == 0) {
+      if (fdir->epoch == run_state->find_dir_epoch) return fdir;
+      stale_fdir = fdir;
+    }
+  }
+  if ((name_num = get_find_dir_name_num(linux_dir, case_flip)) == 0) return NULL;
+  if (is_ram_filename(linux_dir)) {
+    if (linux_dir[sizeof(RAM_MOUNT_DIR) - 1] != '\0') {  /* No subdirectories on in-memory drives. */
+      errno = ENOENT;
+      return NULL;
+    }
+    dir = NULL;
+  } else {
+    if (run_state->overlay_count && (ov = find_overlay(linux_dir)) != NULL) {
+      char upper_fn[LINUX_PATH_SIZE];
+      if (!get_upper_filename(ov, linux_dir, upper_fn)) return NULL;
+      if ((upper_dir = opendir(*upper_fn == '\0' ? "." : upper_fn)) == NULL && errno != ENOENT) return NULL;
+    }
+    if ((dir = opendir(*linux_dir == '\0' ? "." : linux_dir)) == NULL && (errno != ENOENT || !upper_dir)) {
+      if (upper_dir) {
+        closedir(upper_dir);
+        errno = ENOENT;
+      }
+      return NULL;
+    }
+  }
+  if ((fdir = stale_fdir) == NULL) {  /* Replace the stale listing of the same directory (if any), so that it doesn't evict others. */
+    for (fdir = run_state->find_dirs; fdir != run_state->find_dirs + FIND_DIR_COUNT && fdir->id != 0; ++fdir) {}
+  }
+  if (fdir == run_state->find_dirs + FIND_DIR_COUNT) {  /* Evict one. Subsequent findnext calls on it will read the directory again. */
+    fdir = run_state->find_dirs + run_state->find_dir_evict_idx;
+    run_state->find_dir_evict_idx = (run_state->find_dir_evict_idx + 1) % FIND_DIR_COUNT;
+  }
+  free(fdir->entries);
+  fdir->entries = NULL;
+  fdir->entry_count = 0;
+  fdir->linux_dir = run_state->find_dir_names[name_num - 1].linux_dir;
+  for (rfp = run_state->ram_files, rf = NULL, cur_dir = upper_dir ? upper_dir : dir; fdir->entry_count < FIND_ENTRY_LIMIT;) {
+    if (fdir->entry_count == capacity) {
+      capacity = capacity ? capacity << 1 : 64;
+      if ((fe = realloc(fdir->entries, capacity * sizeof(FindEntry))) == NULL) goto out_of_memory;
+      fdir->entries = fe;
+    }
+    fe = fdir->entries + fdir->entry_count;
+    if (cur_dir) {
+      if ((de = readdir(cur_dir)) == NULL) {
+        if (cur_dir != upper_dir || !dir) break;
+        qsort(fdir->entries, fdir->entry_count, sizeof(FindEntry), compare_find_entries);  /* For the bsearch(...) below. */
+        upper_count = fdir->entry_count;
+        cur_dir = dir;
+        continue;
+      }
+      if (!set_find_entry_name(fe, de->d_name, case_flip)) continue;
+      if (upper_count != 0 && bsearch(fe, fdir->entries, upper_count, sizeof(FindEntry), compare_find_entries)) continue;  /* The file in <upper> overrides it. */
+      if (ov && cur_dir != upper_dir && is_overlay_deleted_in_dir(linux_dir, de->d_name)) continue;
+      if (fstatat(dirfd(cur_dir), de->d_name, &st, 0) != 0) continue;  /* E.g. dangling symlink. */
+      if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+    } else {  /* In-memory drive. */
+      for (rf = rf ? rf->next : NULL; !rf && rfp != run_state->ram_files + RAM_FILE_HASH_SIZE; rf = *rfp++) {}
+      if (!rf) break;
+      if (!set_find_entry_name(fe, rf->name, case_flip)) continue;
+      if (fstat(rf->fd, &st) != 0) continue;
+    }
+    set_find_entry_stat(fe, &st);
+    ++fdir->entry_count;
+  }
+  if (dir) closedir(dir);
+  if (upper_dir) closedir(upper_dir);
+  qsort(fdir->entries, fdir->entry_count, sizeof(FindEntry), compare_find_entries);
+  fdir->case_flip = case_flip;
+  fdir->epoch = run_state->find_dir_epoch;
+  fdir->id = name_num << 16 | (run_state->find_dir_next_id++ & 0xffff);
+  return fdir;
+ out_of_memory:
+  if (dir) closedir(dir);
+  if (upper_dir) closedir(upper_dir);
+  fdir->id = 0;
+  errno = ENOMEM;
+  return NULL;
+}
+
+/* Finds the next entry matching the pattern in the DTA, starting at the
+ * cursor, and fills the DTA. Returns 0 on success, -1 if there are no more
+ * files.
+ */
+static int find_next_in_dta(char *dta) {
+  const unsigned id = *(unsigned*)(dta + DTA_FIND_ID);
+  const FindDir *fdir = find_find_dir_by_id(id);
+  const unsigned cursor_flags = *(unsigned short*)(dta + DTA_FIND_CURSOR) & FIND_CURSOR_DIRS;
+  unsigned cursor = *(unsigned short*)(dta + DTA_FIND_CURSOR) & ~FIND_CURSOR_DIRS;
+  const FindEntry *fe;
+  if (!fdir || cursor > fdir->entry_count || (cursor != 0 && strcmp(fdir->entries[cursor - 1].name, dta + 0x1e) != 0)) {
+    /* The listing was evicted or replaced (or the id was reused). Continue after the previously found name in the current listing. */
+    unsigned lo = 0, hi;
+    if (id >> 16 == 0 || id >> 16 > run_state->find_dir_name_count) return -1;
+    if (!fdir) {
+      const FindDirName *fdn = run_state->find_dir_names + (id >> 16) - 1;
+      if ((fdir = get_find_dir(fdn->linux_dir, fdn->case_flip)) == NULL) return -1;
+      *(unsigned*)(dta + DTA_FIND_ID) = fdir->id;
+    }
+    dta[0x1e + 12] = '\0';  /* For security of strcmp(...) below. */
+    for (hi = fdir->entry_count; lo != hi;) {  /* Binary search for the first entry after the name. */
+      const unsigned mid = lo + ((hi - lo) >> 1);
+      if (strcmp(fdir->entries[mid].name, dta + 0x1e) <= 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    cursor = lo;
+  }
+  for (fe = fdir->entries + cursor; cursor < fdir->entry_count; ++cursor, ++fe) {
+    if ((fe->attr & 0x10) && !cursor_flags) continue;
+    if (is_fcb_pattern_match(dta + DTA_FIND_PATTERN, fe->fcb_name)) {
+      set_find_dta(dta, fe);
+      *(unsigned short*)(dta + DTA_FIND_CURSOR) = (cursor + 1) | cursor_flags;
+      return 0;
+    }
+  }
+  *(unsigned short*)(dta + DTA_FIND_CURSOR) = cursor | cursor_flags;
+  return -1;
+}
+
+/* scancodes[i] is the US English keyboard scancode corresponding to ASCII
+ * code i.
+ *
+ * Generated by scancode.py.
+ * Based on https://stanislavs.org/helppc/scan_codes.html
+ */
+static const unsigned char scancodes[128] = {
+    0x3e, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22, 0x0e, 0x0f, 0x24, 0x25,
+    0x26, 0x0c, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f, 0x14, 0x16, 0x2f, 0x11,
+    0x2d, 0x15, 0x2c, 0x01, 0x2b, 0x1b, 0x07, 0x0c, 0x39, 0x02, 0x28, 0x04,
+    0x05, 0x06, 0x08, 0x28, 0x0a, 0x0b, 0x09, 0x0d, 0x33, 0x0c, 0x34, 0x35,
+    0x0b, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x27, 0x27,
+    0x33, 0x0d, 0x34, 0x35, 0x03, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22,
+    0x23, 0x17, 0x24, 0x25, 0x26, 0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f,
+    0x14, 0x16, 0x2f, 0x11, 0x2d, 0x15, 0x2c, 0x1a, 0x2b, 0x1b, 0x07, 0x0c,
+    0x29, 0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25,
+    0x26, 0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1f, 0x14, 0x16, 0x2f, 0x11,
+    0x2d, 0x15, 0x2c, 0x1a, 0x2b, 0x1b, 0x29, 0x35 };
+
+/* Simulated, fake keypresses for --tty-in=-3 . */
+static const unsigned short fake_keys[3] = {
+    0x011b /* <Esc> */, 0x4400 /* <F10> */, 0x1c0d /* <Enter> */ };
+
+/* It's unclear whether running the new program and discarding the current
+ * one is the right approach in the general case of loading an overlay (al
+ * == 3). So we just whitelist a few programs where we do that.
+ */
+static char should_skip_exec_program(char const *dos_filename, const char *args, const char *env, const char **env_end_inout, char had_get_first_mcb) {
+  size_t dos_filename_size;
+  char had_ml_env = 0;
+  const char *p, *env_end = *env_end_inout;
+  /* Detect Microsoft Macro Assembler 6.00B driver masm.exe. */
+  dos_filename_size = strlen(dos_filename);
+  for (p = dos_filename + dos_filename_size; p != dos_filename && p[-1] != '\\'; --p) {}
+  if (strcmp(p, "ML.EXE") == 0) {
+    if (!had_get_first_mcb || !args || *args != '\0') return 1;
+    for (p = env; *p != '\0';) {
+      char *q = memchr(p, '\0', env_end - p);
+      if (!q) return 3;  /* env too long. */
+      if (DEBUG) fprintf(stderr, "debug: load env line: (%s)\n", p);
+      if (strncmp(p, "ML= ", 4) == 0) had_ml_env = 1;
+      p = q + 1;
+    }
+    if (!had_ml_env) return 4;
+    if (++p + 4 > env_end) return 5;
+    if (*(const unsigned short*)p != 1) return 6;
+    p += 2;
+    if (p + dos_filename_size >= env_end) return 7;
+    if (strcmp(p, dos_filename) != 0) return 8;
+    *env_end_inout = p - 2;  /* Not: p + dos_filename_size + 1; */
+    return 0;  /* exec() it. */
+  } else {
+    return 2;
+  }
+}
+
+typedef struct TtyState {
   int tty_in_fd;
   char is_tty_in_error;
   const unsigned short *next_fake_key;
+  char stdout_buffer_mode;  /* SBM_NONE, SBM_LINE or SBM_FULL. */
+  unsigned stdout_size;  /* Number of bytes in stdout_buf. */
+  char stdout_buf[0x2000];  /* DOS standard output not written yet. */
 } TtyState;
 
+static void flush_stdout_buf(TtyState *tty_state) {
+  const char *p = tty_state->stdout_buf, *p_end = p + tty_state->stdout_size;
+  int got;
+  while (p != p_end) {
+    if ((got = write(1, p, p_end - p)) <= 0) {  /* STDOUT_FILENO. */
+      if (got < 0 && errno == EINTR) continue;
+      break;  /* Ignore the error, just like the unbuffered write(2) did. */
+    }
+    p += got;
+  }
+  tty_state->stdout_size = 0;
+}
+
+/* Writes DOS standard output to Linux fd 1, possibly buffered. */
+static void write_stdout_buf(TtyState *tty_state, const char *p, unsigned size) {
+  if (run_state->tracer) add_trace_record(TR_STDOUT, p, size);
+  if (tty_state->stdout_buffer_mode == SBM_NONE) {
+    (void)!write(1, p, size);  /* STDOUT_FILENO. */
+    return;
+  }
+  if (size > sizeof(tty_state->stdout_buf) - tty_state->stdout_size) {
+    flush_stdout_buf(tty_state);
+    if (size >= sizeof(tty_state->stdout_buf)) {
+      (void)!write(1, p, size);  /* STDOUT_FILENO. */
+      return;
+    }
+  }
+  memcpy(tty_state->stdout_buf + tty_state->stdout_size, p, size);
+  tty_state->stdout_size += size;
+  if (tty_state->stdout_buffer_mode == SBM_LINE && memchr(p, '\n', size)) flush_stdout_buf(tty_state);
+}
+
+
+/* --- Software CPU (--cpu=interp).
+ *
+ * Without /dev/kvm (e.g. in containers and in nested VMs without nested
+ * virtualization), kvikdos runs the DOS program in this 8086/80186
+ * interpreter instead of a KVM vCPU. It implements the part of the KVM API
+ * used by run_dos_prog(...): run_interp_cpu(...) is the replacement of
+ * ioctl(vcpu_fd, KVM_RUN, 0) with KVM_CAP_SYNC_REGS, it runs the guest
+ * until it needs the host (hlt, in, out, or a memory access outside the
+ * guest memory mapped in reset_emu(...)), and it returns the same exit
+ * information in struct kvm_run, with the registers in run->s.regs. Thus
+ * the entire DOS and BIOS service layer is shared with KVM.
+ *
+ * For a memory access or port I/O in the middle of an instruction, it
+ * restores the registers to the beginning of the instruction (like KVM,
+ * CS:IP points to the instruction), and the next run_interp_cpu(...)
+ * executes the instruction again, replaying the accesses already done by
+ * the host.
+ *
+ * It emulates an 80186 without a math coprocessor: 286 and 386 instructions
+ * (e.g. 0x0f and 0x66 prefixes) cause an invalid opcode exception (int 6),
+ * and coprocessor (ESC) instructions do nothing, so the CPU and FPU
+ * detection code of DOS programs picks 8086/186 code paths. The trap flag
+ * and hardware interrupts (none in kvikdos) are not emulated.
+ */
+
+#define INTERP_CF 0x0001
+#define INTERP_PF 0x0004
+#define INTERP_AF 0x0010
+#define INTERP_ZF 0x0040
+#define INTERP_SF 0x0080
+#define INTERP_TF 0x0100
+#define INTERP_IF 0x0200
+#define INTERP_DF 0x0400
+#define INTERP_OF 0x0800
+#define INTERP_FLAGS_MASK 0x0fd5  /* Flags which can be changed. Bit 1 is always 1, bits 12..15 read as 1 (pushf) on the 8086 and the 80186. */
+
+/* Register indexes in InterpRegs.r, in the order of the x86 instruction encoding. */
+#define IR_AX 0
+#define IR_CX 1
+#define IR_DX 2
+#define IR_BX 3
+#define IR_SP 4
+#define IR_BP 5
+#define IR_SI 6
+#define IR_DI 7
+
+/* Segment register indexes in InterpRegs.s, in the order of the x86 instruction encoding. */
+#define IS_ES 0
+#define IS_CS 1
+#define IS_SS 2
+#define IS_DS 3
+
+#define INTERP_ACCESS_IO 0x80000000U  /* Flag in InterpAccess.addr: port I/O rather than memory. */
+#define INTERP_ACCESS_LIMIT 4  /* Maximum number of host accesses per instruction. */
+
+typedef struct InterpRegs {
+  unsigned short r[8];  /* IR_... */
+  unsigned short s[4];  /* IS_... */
+  unsigned short ip, flags;
+} InterpRegs;
+
+/* A memory access or port I/O done by the host for the current instruction. */
+typedef struct InterpAccess {
+  unsigned addr;  /* Linear address, or port | INTERP_ACCESS_IO. */
+  unsigned char size;  /* 1 or 2. */
+  unsigned char data[2];  /* Data read by the host. */
+} InterpAccess;
+
+typedef struct InterpCpu {
+  InterpRegs regs;
+  InterpRegs saved;  /* At the beginning of the current instruction (or of the current iteration of a rep string instruction). */
+  struct kvm_run *run;  /* Allocated by reset_emu(...), INTERP_IO_DATA_SIZE bytes of port I/O data follow it. */
+  unsigned char *mem;
+  unsigned hi_ram_limit;  /* Guest memory is mapped at [HMA_START, hi_ram_limit). */
+  unsigned access_count;  /* Number of accesses completed by the host for the current instruction. */
+  unsigned access_idx;  /* Number of accesses replayed so far by the current execution of the instruction. */
+  char is_access_pending;  /* Has the host been asked to do accesses[access_count]? */
+  InterpAccess accesses[INTERP_ACCESS_LIMIT];
+  jmp_buf exit_jmp;  /* For exits in the middle of an instruction. */
+} InterpCpu;
+
+#define INTERP_IO_DATA_SIZE 8
+
+typedef struct InterpEa {
+  unsigned char mod, reg, rm;
+  unsigned sbase;  /* Linear address of the segment of the memory operand. */
+  unsigned short ofs;
+} InterpEa;
+
+static unsigned char interp_parity[0x100];  /* INTERP_PF iff the number of 1 bits is even. */
+
+static void init_interp_cpu(InterpCpu *cpu, struct kvm_run *run, void *mem, unsigned mem_size) {
+  unsigned u;
+  for (u = 0; u < 0x100; ++u) {
+    interp_parity[u] = ((u ^ u >> 1 ^ u >> 2 ^ u >> 3 ^ u >> 4 ^ u >> 5 ^ u >> 6 ^ u >> 7) & 1) ? 0 : INTERP_PF;
+  }
+  memset(cpu, '\0', sizeof(*cpu));
+  cpu->run = run;
+  cpu->mem = (unsigned char*)mem;
+  cpu->hi_ram_limit = mem_size > DOS_MEM_LIMIT ? mem_size : HMA_START;
+}
+
+/* Is addr in the guest memory mapped by reset_emu(...), with the same
+ * memory map as with KVM? If not, the host does the access.
+ */
+static char is_interp_readable(const InterpCpu *cpu, unsigned addr) {
+  return addr < DOS_MEM_LIMIT || addr - (INT_OUT_PARA << 4) < INT_OUT_LIMIT - (INT_OUT_PARA << 4) || addr - HMA_START < cpu->hi_ram_limit - HMA_START;
+}
+
+static char is_interp_writable(const InterpCpu *cpu, unsigned addr) {
+  return addr - GUEST_MEM_MODULE_START < DOS_MEM_LIMIT - GUEST_MEM_MODULE_START || addr - HMA_START < cpu->hi_ram_limit - HMA_START;
+}
+
+static void store_interp_regs(InterpCpu *cpu) {
+  const InterpRegs *g = &cpu->regs;
+  struct kvm_regs *regs = &cpu->run->s.regs.regs;
+  struct kvm_sregs *sregs = &cpu->run->s.regs.sregs;
+  *(unsigned short*)&regs->rax = g->r[IR_AX];
+  *(unsigned short*)&regs->rcx = g->r[IR_CX];
+  *(unsigned short*)&regs->rdx = g->r[IR_DX];
+  *(unsigned short*)&regs->rbx = g->r[IR_BX];
+  *(unsigned short*)&regs->rsp = g->r[IR_SP];
+  *(unsigned short*)&regs->rbp = g->r[IR_BP];
+  *(unsigned short*)&regs->rsi = g->r[IR_SI];
+  *(unsigned short*)&regs->rdi = g->r[IR_DI];
+  regs->rip = g->ip;
+  *(unsigned short*)&regs->rflags = g->flags;
+  sregs->es.base = (sregs->es.selector = g->s[IS_ES]) << 4;
+  sregs->cs.base = (sregs->cs.selector = g->s[IS_CS]) << 4;
+  sregs->ss.base = (sregs->ss.selector = g->s[IS_SS]) << 4;
+  sregs->ds.base = (sregs->ds.selector = g->s[IS_DS]) << 4;
+}
+
+static void load_interp_regs(InterpCpu *cpu) {
+  InterpRegs *g = &cpu->regs;
+  const struct kvm_regs *regs = &cpu->run->s.regs.regs;
+  const struct kvm_sregs *sregs = &cpu->run->s.regs.sregs;
+  g->r[IR_AX] = (unsigned short)regs->rax;
+  g->r[IR_CX] = (unsigned short)regs->rcx;
+  g->r[IR_DX] = (unsigned short)regs->rdx;
+  g->r[IR_BX] = (unsigned short)regs->rbx;
+  g->r[IR_SP] = (unsigned short)regs->rsp;
+  g->r[IR_BP] = (unsigned short)regs->rbp;
+  g->r[IR_SI] = (unsigned short)regs->rsi;
+  g->r[IR_DI] = (unsigned short)regs->rdi;
+  g->ip = (unsigned short)regs->rip;
+  g->flags = ((unsigned)regs->rflags & INTERP_FLAGS_MASK) | 1 << 1;
+  g->s[IS_ES] = sregs->es.selector;
+  g->s[IS_CS] = sregs->cs.selector;
+  g->s[IS_SS] = sregs->ss.selector;
+  g->s[IS_DS] = sregs->ds.selector;
+}
+
+/* Lets the host do a memory access or port I/O: replays it if the host
+ * has already done it for the current instruction, otherwise aborts the
+ * instruction and exits with KVM_EXIT_MMIO or KVM_EXIT_IO.
+ */
+static void interp_host_access(InterpCpu *cpu, unsigned addr, unsigned size, char is_write, unsigned char *data) {
+  struct kvm_run * const run = cpu->run;
+  if (cpu->access_idx < cpu->access_count) {
+    const InterpAccess *access = &cpu->accesses[cpu->access_idx++];
+    if (!is_write) memcpy(data, access->data, size);
+    return;
+  }
+  if (cpu->access_count == INTERP_ACCESS_LIMIT) {
+    run->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+    run->internal.suberror = 0;
+  } else {
+    InterpAccess *access = &cpu->accesses[cpu->access_count];
+    access->addr = addr;
+    access->size = size;
+    cpu->is_access_pending = 1;
+    if (addr & INTERP_ACCESS_IO) {
+      run->exit_reason = KVM_EXIT_IO;
+      run->io.direction = is_write ? KVM_EXIT_IO_OUT : KVM_EXIT_IO_IN;
+      run->io.size = size;
+      run->io.port = addr;
+      run->io.count = 1;
+      run->io.data_offset = sizeof(struct kvm_run);
+      memset((char*)run + sizeof(struct kvm_run), '\0', INTERP_IO_DATA_SIZE);
+      if (is_write) memcpy((char*)run + sizeof(struct kvm_run), data, size);
+    } else {
+      run->exit_reason = KVM_EXIT_MMIO;
+      run->mmio.phys_addr = addr;
+      memset(run->mmio.data, '\0', sizeof(run->mmio.data));
+      if (is_write) memcpy(run->mmio.data, data, size);
+      run->mmio.len = size;
+      run->mmio.is_write = is_write;
+    }
+  }
+  longjmp(cpu->exit_jmp, 1);
+}
+
+static unsigned interp_read(InterpCpu *cpu, unsigned sbase, unsigned ofs, char is_word) {
+  const unsigned addr = sbase + (ofs &= 0xffff);
+  unsigned char data[2];
+  if (!is_word) {
+    if (is_interp_readable(cpu, addr)) return cpu->mem[addr];
+    interp_host_access(cpu, addr, 1, 0, data);
+    return data[0];
+  }
+  if (ofs == 0xffff) return interp_read(cpu, sbase, 0xffff, 0) | interp_read(cpu, sbase, 0, 0) << 8;  /* Wraps around within the segment. */
+  if (is_interp_readable(cpu, addr) && is_interp_readable(cpu, addr + 1)) return *(const unsigned short*)(cpu->mem + addr);
+  interp_host_access(cpu, addr, 2, 0, data);
+  return data[0] | data[1] << 8;
+}
+
+static void interp_write(InterpCpu *cpu, unsigned sbase, unsigned ofs, unsigned value, char is_word) {
+  const unsigned addr = sbase + (ofs &= 0xffff);
+  unsigned char data[2];
+  data[0] = value; data[1] = value >> 8;
+  if (!is_word) {
+    if (is_interp_writable(cpu, addr)) {
+      cpu->mem[addr] = value;
+    } else {
+      interp_host_access(cpu, addr, 1, 1, data);
+    }
+  } else if (ofs == 0xffff) {  /* Wraps around within the segment. */
+    interp_write(cpu, sbase, 0xffff, value, 0);
+    interp_write(cpu, sbase, 0, value >> 8, 0);
+  } else if (is_interp_writable(cpu, addr) && is_interp_writable(cpu, addr + 1)) {
+    *(unsigned short*)(cpu->mem + addr) = value;
+  } else {
+    interp_host_access(cpu, addr, 2, 1, data);
+  }
+}
+
+static unsigned interp_in(InterpCpu *cpu, unsigned port, char is_word) {
+  unsigned char data[2];
+  interp_host_access(cpu, (port & 0xffff) | INTERP_ACCESS_IO, is_word ? 2 : 1, 0, data);
+  return is_word ? data[0] | data[1] << 8 : data[0];
+}
+
+static void interp_out(InterpCpu *cpu, unsigned port, unsigned value, char is_word) {
+  unsigned char data[2];
+  data[0] = value; data[1] = value >> 8;
+  interp_host_access(cpu, (port & 0xffff) | INTERP_ACCESS_IO, is_word ? 2 : 1, 1, data);
+}
+
+static unsigned interp_fetch8(InterpCpu *cpu) {
+  const unsigned addr = (cpu->regs.s[IS_CS] << 4) + cpu->regs.ip;
+  if (addr < DOS_MEM_LIMIT) {  /* Fast path. */
+    ++cpu->regs.ip;
+    return cpu->mem[addr];
+  }
+  return interp_read(cpu, cpu->regs.s[IS_CS] << 4, cpu->regs.ip++, 0);
+}
+
+static unsigned interp_fetch16(InterpCpu *cpu) {
+  const unsigned addr = (cpu->regs.s[IS_CS] << 4) + cpu->regs.ip;
+  unsigned value;
+  if (addr + 1 < DOS_MEM_LIMIT && cpu->regs.ip != 0xffff) {  /* Fast path. */
+    value = *(const unsigned short*)(cpu->mem + addr);
+  } else {
+    value = interp_read(cpu, cpu->regs.s[IS_CS] << 4, cpu->regs.ip, 1);
+  }
+  cpu->regs.ip += 2;
+  return value;
+}
+
+static void interp_push(InterpCpu *cpu, unsigned value) {
+  interp_write(cpu, cpu->regs.s[IS_SS] << 4, cpu->regs.r[IR_SP] -= 2, value, 1);
+}
+
+static unsigned interp_pop(InterpCpu *cpu) {
+  const unsigned value = interp_read(cpu, cpu->regs.s[IS_SS] << 4, cpu->regs.r[IR_SP], 1);
+  cpu->regs.r[IR_SP] += 2;
+  return value;
+}
+
+/* Calls interrupt handler int_num. cpu->regs.ip is the return address. */
+static void interp_int(InterpCpu *cpu, unsigned int_num) {
+  const unsigned new_ip = interp_read(cpu, 0, int_num << 2, 1);
+  const unsigned new_cs = interp_read(cpu, 0, (int_num << 2) + 2, 1);
+  interp_push(cpu, cpu->regs.flags | 0xf000);
+  interp_push(cpu, cpu->regs.s[IS_CS]);
+  interp_push(cpu, cpu->regs.ip);
+  cpu->regs.flags &= ~(INTERP_IF | INTERP_TF);
+  cpu->regs.s[IS_CS] = new_cs;
+  cpu->regs.ip = new_ip;
+}
+
+/* Exception int_num (e.g. 0 for division error, 6 for invalid opcode), with the address of the instruction as return address. */
+static void interp_fault(InterpCpu *cpu, unsigned int_num) {
+  cpu->regs.ip = cpu->saved.ip;
+  interp_int(cpu, int_num);
+}
+
+static unsigned interp_get_reg(const InterpCpu *cpu, unsigned i, char is_word) {
+  return is_word ? cpu->regs.r[i] : ((const unsigned char*)cpu->regs.r)[(i & 3) << 1 | i >> 2];  /* al, cl, dl, bl, ah, ch, dh, bh. Little-endian host. */
+}
+
+static void interp_set_reg(InterpCpu *cpu, unsigned i, unsigned value, char is_word) {
+  if (is_word) {
+    cpu->regs.r[i] = value;
+  } else {
+    ((unsigned char*)cpu->regs.r)[(i & 3) << 1 | i >> 2] = value;
+  }
+}
+
+/* Decodes the ModRM byte and the displacement at cs:ip. seg is the segment override prefix (IS_...) or -1. */
+static void interp_decode_modrm(InterpCpu *cpu, int seg, InterpEa *ea) {
+  const unsigned modrm = interp_fetch8(cpu);
+  const unsigned short *r = cpu->regs.r;
+  unsigned ofs;
+  int default_seg = IS_DS;
+  ea->mod = modrm >> 6;
+  ea->reg = (modrm >> 3) & 7;
+  ea->rm = modrm & 7;
+  if (ea->mod == 3) return;
+  switch (ea->rm) {
+   case 0: ofs = r[IR_BX] + r[IR_SI]; break;
+   case 1: ofs = r[IR_BX] + r[IR_DI]; break;
+   case 2: ofs = r[IR_BP] + r[IR_SI]; default_seg = IS_SS; break;
+   case 3: ofs = r[IR_BP] + r[IR_DI]; default_seg = IS_SS; break;
+   case 4: ofs = r[IR_SI]; break;
+   case 5: ofs = r[IR_DI]; break;
+   case 6: if (ea->mod == 0) { ofs = interp_fetch16(cpu); } else { ofs = r[IR_BP]; default_seg = IS_SS; } break;
+   default: ofs = r[IR_BX]; break;
+  }
+  if (ea->mod == 1) {
+    ofs += (interp_fetch8(cpu) ^ 0x80) - 0x80;  /* Sign-extended. */
+  } else if (ea->mod == 2) {
+    ofs += interp_fetch16(cpu);
+  }
+  ea->ofs = ofs;
+  ea->sbase = cpu->regs.s[seg >= 0 ? seg : default_seg] << 4;
+}
+
+static unsigned interp_get_ea(InterpCpu *cpu, const InterpEa *ea, char is_word) {
+  return ea->mod == 3 ? interp_get_reg(cpu, ea->rm, is_word) : interp_read(cpu, ea->sbase, ea->ofs, is_word);
+}
+
+static void interp_set_ea(InterpCpu *cpu, const InterpEa *ea, unsigned value, char is_word) {
+  if (ea->mod == 3) {
+    interp_set_reg(cpu, ea->rm, value, is_word);
+  } else {
+    interp_write(cpu, ea->sbase, ea->ofs, value, is_word);
+  }
+}
+
+static void interp_set_szp(InterpCpu *cpu, unsigned result, char is_word) {
+  unsigned flags = cpu->regs.flags & ~(INTERP_ZF | INTERP_SF | INTERP_PF);
+  if (!(result & (is_word ? 0xffff : 0xff))) flags |= INTERP_ZF;
+  if (result & (is_word ? 0x8000 : 0x80)) flags |= INTERP_SF;
+  cpu->regs.flags = flags | interp_parity[result & 0xff];
+}
+
+/* Arithmetic and logic operation op (0: add, 1: or, 2: adc, 3: sbb, 4: and, 5: sub, 6: xor, 7: cmp) on a and b, sets the flags. Returns the result. */
+static unsigned interp_alu(InterpCpu *cpu, unsigned op, unsigned a, unsigned b, char is_word) {
+  const unsigned mask = is_word ? 0xffff : 0xff, sign = is_word ? 0x8000 : 0x80;
+  unsigned result, flags;
+  switch (op) {
+   case 0: case 2:  /* add, adc */
+    result = a + b + (op == 2 && (cpu->regs.flags & INTERP_CF));
+    flags = (result > mask ? INTERP_CF : 0) | ((a ^ b ^ result) & INTERP_AF) | ((a ^ result) & (b ^ result) & sign ? INTERP_OF : 0);
+    break;
+   case 3: case 5: case 7:  /* sbb, sub, cmp */
+    result = a - b - (op == 3 && (cpu->regs.flags & INTERP_CF));
+    flags = (result > mask ? INTERP_CF : 0) | ((a ^ b ^ result) & INTERP_AF) | ((a ^ b) & (a ^ result) & sign ? INTERP_OF : 0);
+    break;
+   default:  /* or, and, xor */
+    result = op == 1 ? a | b : op == 4 ? a & b : a ^ b;
+    flags = 0;
+  }
+  cpu->regs.flags = (cpu->regs.flags & ~(INTERP_CF | INTERP_AF | INTERP_OF)) | flags;
+  interp_set_szp(cpu, result, is_word);
+  return result & mask;
+}
+
+/* inc (is_dec == 0) or dec (is_dec == 1), keeps CF. */
+static unsigned interp_inc_dec(InterpCpu *cpu, unsigned value, char is_dec, char is_word) {
+  const unsigned cf = cpu->regs.flags & INTERP_CF;
+  value = interp_alu(cpu, is_dec ? 5 : 0, value, 1, is_word);
+  cpu->regs.flags = (cpu->regs.flags & ~INTERP_CF) | cf;
+  return value;
+}
+
+/* Rotate or shift operation op (0: rol, 1: ror, 2: rcl, 3: rcr, 4: shl, 5: shr, 6: shl, 7: sar), sets the flags. Returns the result. */
+static unsigned interp_shift(InterpCpu *cpu, unsigned op, unsigned value, unsigned count, char is_word) {
+  const unsigned bits = is_word ? 16 : 8, mask = is_word ? 0xffff : 0xff, sign = is_word ? 0x8000 : 0x80;
+  unsigned flags = cpu->regs.flags & ~(INTERP_CF | INTERP_OF), cf = cpu->regs.flags & INTERP_CF;
+  if ((count &= 0x1f) == 0) return value;  /* The 80186 masks the count to 5 bits. */
+  switch (op) {
+   case 0:  /* rol */
+    for (; count != 0; --count) value = ((value << 1) | (cf = (value & sign) != 0)) & mask;
+    cpu->regs.flags = flags | cf | (((value & sign) != 0) ^ cf ? INTERP_OF : 0);
+    return value;
+   case 1:  /* ror */
+    for (; count != 0; --count) value = (value >> 1) | ((cf = value & 1) ? sign : 0);
+    cpu->regs.flags = flags | cf | ((value ^ value << 1) & sign ? INTERP_OF : 0);
+    return value;
+   case 2:  /* rcl */
+    for (; count != 0; --count) { const unsigned new_cf = (value & sign) != 0; value = ((value << 1) | cf) & mask; cf = new_cf; }
+    cpu->regs.flags = flags | cf | (((value & sign) != 0) ^ cf ? INTERP_OF : 0);
+    return value;
+   case 3:  /* rcr */
+    for (; count != 0; --count) { const unsigned new_cf = value & 1; value = (value >> 1) | (cf ? sign : 0); cf = new_cf; }
+    cpu->regs.flags = flags | cf | ((value ^ value << 1) & sign ? INTERP_OF : 0);
+    return value;
+   case 5:  /* shr */
+    cf = (value >> (count - 1)) & 1;
+    flags |= value & sign ? INTERP_OF : 0;
+    value >>= count;
+    break;
+   case 7:  /* sar */
+    if (count > bits) count = bits;
+    if (value & sign) value |= ~mask;
+    cf = (value >> (count - 1)) & 1;
+    value = (value >> count) & mask;
+    break;
+   default:  /* shl */
+    cf = ((value << (count - 1)) & sign) != 0;
+    value = (value << count) & mask;
+    flags |= ((value & sign) != 0) ^ cf ? INTERP_OF : 0;
+  }
+  cpu->regs.flags = (flags & ~INTERP_AF) | cf;
+  interp_set_szp(cpu, value, is_word);
+  return value;
+}
+
+/* Is the condition of jcc (0x70 | cc) true? */
+static char interp_cond(unsigned flags, unsigned cc) {
+  char result;
+  switch (cc >> 1) {
+   case 0: result = (flags & INTERP_OF) != 0; break;  /* jo */
+   case 1: result = (flags & INTERP_CF) != 0; break;  /* jc */
+   case 2: result = (flags & INTERP_ZF) != 0; break;  /* jz */
+   case 3: result = (flags & (INTERP_CF | INTERP_ZF)) != 0; break;  /* jbe */
+   case 4: result = (flags & INTERP_SF) != 0; break;  /* js */
+   case 5: result = (flags & INTERP_PF) != 0; break;  /* jp */
+   case 6: result = !(flags & INTERP_SF) != !(flags & INTERP_OF); break;  /* jl */
+   default: result = (flags & INTERP_ZF) || !(flags & INTERP_SF) != !(flags & INTERP_OF); break;  /* jle */
+  }
+  return result ^ (cc & 1);
+}
+
+/* Executes string instruction op (0xa4..0xa7, 0xaa..0xaf, 0x6c..0x6f), rep is 0 or the rep prefix (0xf2 or 0xf3). */
+static void interp_string(InterpCpu *cpu, unsigned op, int seg, unsigned rep) {
+  InterpRegs * const g = &cpu->regs;
+  const char is_word = op & 1;
+  const unsigned delta = (g->flags & INTERP_DF) ? -1U - is_word : 1U + is_word;
+  const unsigned src_sbase = g->s[seg >= 0 ? seg : IS_DS] << 4;
+  unsigned value;
+  for (;;) {
+    if (rep && g->r[IR_CX] == 0) break;
+    switch (op & ~1) {
+     case 0xa4:  /* movs */
+      interp_write(cpu, g->s[IS_ES] << 4, g->r[IR_DI], interp_read(cpu, src_sbase, g->r[IR_SI], is_word), is_word);
+      g->r[IR_SI] += delta; g->r[IR_DI] += delta;
+      break;
+     case 0xa6:  /* cmps */
+      value = interp_read(cpu, src_sbase, g->r[IR_SI], is_word);
+      interp_alu(cpu, 7, value, interp_read(cpu, g->s[IS_ES] << 4, g->r[IR_DI], is_word), is_word);
+      g->r[IR_SI] += delta; g->r[IR_DI] += delta;
+      break;
+     case 0xaa:  /* stos */
+      interp_write(cpu, g->s[IS_ES] << 4, g->r[IR_DI], interp_get_reg(cpu, IR_AX, is_word), is_word);
+      g->r[IR_DI] += delta;
+      break;
+     case 0xac:  /* lods */
+      interp_set_reg(cpu, IR_AX, interp_read(cpu, src_sbase, g->r[IR_SI], is_word), is_word);
+      g->r[IR_SI] += delta;
+      break;
+     case 0xae:  /* scas */
+      interp_alu(cpu, 7, interp_get_reg(cpu, IR_AX, is_word), interp_read(cpu, g->s[IS_ES] << 4, g->r[IR_DI], is_word), is_word);
+      g->r[IR_DI] += delta;
+      break;
+     case 0x6c:  /* ins */
+      interp_write(cpu, g->s[IS_ES] << 4, g->r[IR_DI], interp_in(cpu, g->r[IR_DX], is_word), is_word);
+      g->r[IR_DI] += delta;
+      break;
+     default:  /* outs */
+      interp_out(cpu, g->r[IR_DX], interp_read(cpu, src_sbase, g->r[IR_SI], is_word), is_word);
+      g->r[IR_SI] += delta;
+    }
+    if (!rep) break;
+    if (--g->r[IR_CX] == 0) break;
+    if ((op & ~9) == 0xa6 && (rep == 0xf3) != ((g->flags & INTERP_ZF) != 0)) break;  /* cmps or scas: repe or repne terminates. */
+    { /* Commit the iteration, so that an exit to the host restarts at the next iteration. */
+      const unsigned short ip = g->ip;
+      g->ip = cpu->saved.ip;
+      cpu->saved = *g;
+      g->ip = ip;
+      cpu->access_count = cpu->access_idx = 0;
+    }
+  }
+}
+
+/* Executes one instruction at cs:ip. Returns 0, or KVM_EXIT_HLT after a hlt instruction. */
+static unsigned interp_step(InterpCpu *cpu) {
+  InterpRegs * const g = &cpu->regs;
+  InterpEa ea;
+  int seg = -1;
+  unsigned rep = 0, op, value, value2;
+  char is_word;
+  for (;;) {  /* Prefixes. */
+    op = interp_fetch8(cpu);
+    if ((op & 0xe7) == 0x26) {  /* es:, cs:, ss:, ds: */
+      seg = (op >> 3) & 3;
+    } else if ((op & 0xfe) == 0xf2) {  /* repne, rep */
+      rep = op;
+    } else if (op != 0xf0) {  /* lock */
+      break;
+    }
+  }
+  is_word = op & 1;
+  if (op < 0x40 && (op & 7) < 6) {  /* add, or, adc, sbb, and, sub, xor, cmp */
+    const unsigned alu_op = op >> 3;
+    if (op & 4) {  /* al or ax, immediate. */
+      value = interp_alu(cpu, alu_op, interp_get_reg(cpu, IR_AX, is_word), is_word ? interp_fetch16(cpu) : interp_fetch8(cpu), is_word);
+      if (alu_op != 7) interp_set_reg(cpu, IR_AX, value, is_word);
+    } else {
+      interp_decode_modrm(cpu, seg, &ea);
+      if (op & 2) {  /* reg, r/m */
+        value = interp_alu(cpu, alu_op, interp_get_reg(cpu, ea.reg, is_word), interp_get_ea(cpu, &ea, is_word), is_word);
+        if (alu_op != 7) interp_set_reg(cpu, ea.reg, value, is_word);
+      } else {  /* r/m, reg */
+        value = interp_alu(cpu, alu_op, interp_get_ea(cpu, &ea, is_word), interp_get_reg(cpu, ea.reg, is_word), is_word);
+        if (alu_op != 7) interp_set_ea(cpu, &ea, value, is_word);
+      }
+    }
+    return 0;
+  }
+  switch (op) {
+   case 0x06: case 0x0e: case 0x16: case 0x1e:  /* push sreg */
+    interp_push(cpu, g->s[op >> 3]);
+    break;
+   case 0x07: case 0x17: case 0x1f:  /* pop sreg */
+    g->s[op >> 3] = interp_pop(cpu);
+    break;
+   case 0x27: case 0x2f:  /* daa, das */
+    { const unsigned old_al = g->r[IR_AX] & 0xff, old_cf = g->flags & INTERP_CF, old_af = g->flags & INTERP_AF;
+      unsigned al = old_al;
+      g->flags &= ~(INTERP_CF | INTERP_AF);
+      if ((al & 0xf) > 9 || old_af) {
+        al = op == 0x27 ? al + 6 : al - 6;
+        g->flags |= INTERP_AF | (old_cf || al > 0xff ? INTERP_CF : 0);
+      }
+      if (old_al > 0x99 || old_cf) {
+        al = op == 0x27 ? al + 0x60 : al - 0x60;
+        g->flags |= INTERP_CF;
+      }
+      interp_set_reg(cpu, IR_AX, al, 0);
+      interp_set_szp(cpu, al, 0);
+    }
+    break;
+   case 0x37: case 0x3f:  /* aaa, aas */
+    { unsigned al = g->r[IR_AX] & 0xff, ah = g->r[IR_AX] >> 8;
+      if ((al & 0xf) > 9 || (g->flags & INTERP_AF)) {
+        if (op == 0x37) { al += 6; ++ah; } else { al -= 6; --ah; }
+        g->flags |= INTERP_AF | INTERP_CF;
+      } else {
+        g->flags &= ~(INTERP_AF | INTERP_CF);
+      }
+      g->r[IR_AX] = (ah & 0xff) << 8 | (al & 0xf);
+    }
+    break;
+   case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:  /* inc reg */
+   case 0x48: case 0x49: case 0x4a: case 0x4b: case 0x4c: case 0x4d: case 0x4e: case 0x4f:  /* dec reg */
+    g->r[op & 7] = interp_inc_dec(cpu, g->r[op & 7], op >= 0x48, 1);
+    break;
+   case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:  /* push reg */
+    g->r[IR_SP] -= 2;
+    interp_write(cpu, g->s[IS_SS] << 4, g->r[IR_SP], op == 0x54 ? g->r[IR_SP] : g->r[op & 7], 1);  /* push sp pushes the new value on the 8086 and the 80186. */
+    break;
+   case 0x58: case 0x59: case 0x5a: case 0x5b: case 0x5c: case 0x5d: case 0x5e: case 0x5f:  /* pop reg */
+    value = interp_pop(cpu);
+    g->r[op & 7] = value;
+    break;
+   case 0x60:  /* pusha */
+    value = g->r[IR_SP];
+    interp_push(cpu, g->r[IR_AX]); interp_push(cpu, g->r[IR_CX]); interp_push(cpu, g->r[IR_DX]); interp_push(cpu, g->r[IR_BX]);
+    interp_push(cpu, value); interp_push(cpu, g->r[IR_BP]); interp_push(cpu, g->r[IR_SI]); interp_push(cpu, g->r[IR_DI]);
+    break;
+   case 0x61:  /* popa */
+    g->r[IR_DI] = interp_pop(cpu); g->r[IR_SI] = interp_pop(cpu); g->r[IR_BP] = interp_pop(cpu); g->r[IR_SP] += 2;
+    g->r[IR_BX] = interp_pop(cpu); g->r[IR_DX] = interp_pop(cpu); g->r[IR_CX] = interp_pop(cpu); g->r[IR_AX] = interp_pop(cpu);
+    break;
+   case 0x62:  /* bound */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.mod == 3) goto invalid_opcode;
+    { const short index = g->r[ea.reg];
+      if (index < (short)interp_read(cpu, ea.sbase, ea.ofs, 1) || index > (short)interp_read(cpu, ea.sbase, ea.ofs + 2, 1)) interp_fault(cpu, 5);
+    }
+    break;
+   case 0x68:  /* push imm16 */
+    interp_push(cpu, interp_fetch16(cpu));
+    break;
+   case 0x6a:  /* push imm8 */
+    interp_push(cpu, (interp_fetch8(cpu) ^ 0x80) - 0x80);
+    break;
+   case 0x69: case 0x6b:  /* imul reg, r/m, imm */
+    interp_decode_modrm(cpu, seg, &ea);
+    { const int product = (short)interp_get_ea(cpu, &ea, 1) * (op == 0x69 ? (short)interp_fetch16(cpu) : (signed char)interp_fetch8(cpu));
+      g->r[ea.reg] = product;
+      g->flags = (g->flags & ~(INTERP_CF | INTERP_OF)) | (product != (short)product ? INTERP_CF | INTERP_OF : 0);
+    }
+    break;
+   case 0x6c: case 0x6d: case 0x6e: case 0x6f:  /* ins, outs */
+   case 0xa4: case 0xa5: case 0xa6: case 0xa7: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:  /* movs, cmps, stos, lods, scas */
+    interp_string(cpu, op, seg, rep);
+    break;
+   case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:  /* jcc rel8 */
+   case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+    value = interp_fetch8(cpu);
+    if (interp_cond(g->flags, op & 0xf)) g->ip += (value ^ 0x80) - 0x80;
+    break;
+   case 0x80: case 0x81: case 0x82: case 0x83:  /* alu r/m, imm */
+    interp_decode_modrm(cpu, seg, &ea);
+    value = interp_get_ea(cpu, &ea, is_word);
+    value2 = op == 0x81 ? interp_fetch16(cpu) : op == 0x83 ? ((interp_fetch8(cpu) ^ 0x80) - 0x80) & 0xffff : interp_fetch8(cpu);
+    value = interp_alu(cpu, ea.reg, value, value2, is_word);
+    if (ea.reg != 7) interp_set_ea(cpu, &ea, value, is_word);
+    break;
+   case 0x84: case 0x85:  /* test r/m, reg */
+    interp_decode_modrm(cpu, seg, &ea);
+    interp_alu(cpu, 4, interp_get_ea(cpu, &ea, is_word), interp_get_reg(cpu, ea.reg, is_word), is_word);
+    break;
+   case 0x86: case 0x87:  /* xchg r/m, reg */
+    interp_decode_modrm(cpu, seg, &ea);
+    value = interp_get_ea(cpu, &ea, is_word);
+    interp_set_ea(cpu, &ea, interp_get_reg(cpu, ea.reg, is_word), is_word);
+    interp_set_reg(cpu, ea.reg, value, is_word);
+    break;
+   case 0x88: case 0x89:  /* mov r/m, reg */
+    interp_decode_modrm(cpu, seg, &ea);
+    interp_set_ea(cpu, &ea, interp_get_reg(cpu, ea.reg, is_word), is_word);
+    break;
+   case 0x8a: case 0x8b:  /* mov reg, r/m */
+    interp_decode_modrm(cpu, seg, &ea);
+    interp_set_reg(cpu, ea.reg, interp_get_ea(cpu, &ea, is_word), is_word);
+    break;
+   case 0x8c:  /* mov r/m, sreg */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.reg > 3) goto invalid_opcode;
+    interp_set_ea(cpu, &ea, g->s[ea.reg], 1);
+    break;
+   case 0x8d:  /* lea */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.mod == 3) goto invalid_opcode;
+    g->r[ea.reg] = ea.ofs;
+    break;
+   case 0x8e:  /* mov sreg, r/m */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.reg > 3 || ea.reg == IS_CS) goto invalid_opcode;
+    g->s[ea.reg] = interp_get_ea(cpu, &ea, 1);
+    break;
+   case 0x8f:  /* pop r/m */
+    interp_decode_modrm(cpu, seg, &ea);
+    value = interp_pop(cpu);
+    interp_set_ea(cpu, &ea, value, 1);
+    break;
+   case 0x90:  /* nop */
+    break;
+   case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:  /* xchg ax, reg */
+    value = g->r[op & 7]; g->r[op & 7] = g->r[IR_AX]; g->r[IR_AX] = value;
+    break;
+   case 0x98:  /* cbw */
+    g->r[IR_AX] = ((g->r[IR_AX] & 0xff) ^ 0x80) - 0x80;
+    break;
+   case 0x99:  /* cwd */
+    g->r[IR_DX] = g->r[IR_AX] & 0x8000 ? 0xffff : 0;
+    break;
+   case 0x9a:  /* call far */
+    value = interp_fetch16(cpu);
+    value2 = interp_fetch16(cpu);
+    interp_push(cpu, g->s[IS_CS]);
+    interp_push(cpu, g->ip);
+    g->s[IS_CS] = value2; g->ip = value;
+    break;
+   case 0x9b:  /* wait */
+    break;
+   case 0x9c:  /* pushf */
+    interp_push(cpu, g->flags | 0xf000);
+    break;
+   case 0x9d:  /* popf */
+    g->flags = (interp_pop(cpu) & INTERP_FLAGS_MASK) | 1 << 1;
+    break;
+   case 0x9e:  /* sahf */
+    g->flags = (g->flags & ~0xff) | ((g->r[IR_AX] >> 8) & (INTERP_FLAGS_MASK & 0xff)) | 1 << 1;
+    break;
+   case 0x9f:  /* lahf */
+    interp_set_reg(cpu, 4, g->flags, 0);
+    break;
+   case 0xa0: case 0xa1:  /* mov al or ax, [moffs] */
+    value = interp_fetch16(cpu);
+    interp_set_reg(cpu, IR_AX, interp_read(cpu, g->s[seg >= 0 ? seg : IS_DS] << 4, value, is_word), is_word);
+    break;
+   case 0xa2: case 0xa3:  /* mov [moffs], al or ax */
+    value = interp_fetch16(cpu);
+    interp_write(cpu, g->s[seg >= 0 ? seg : IS_DS] << 4, value, interp_get_reg(cpu, IR_AX, is_word), is_word);
+    break;
+   case 0xa8: case 0xa9:  /* test al or ax, imm */
+    interp_alu(cpu, 4, interp_get_reg(cpu, IR_AX, is_word), is_word ? interp_fetch16(cpu) : interp_fetch8(cpu), is_word);
+    break;
+   case 0xb0: case 0xb1: case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7:  /* mov reg8, imm8 */
+    interp_set_reg(cpu, op & 7, interp_fetch8(cpu), 0);
+    break;
+   case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf:  /* mov reg16, imm16 */
+    g->r[op & 7] = interp_fetch16(cpu);
+    break;
+   case 0xc0: case 0xc1: case 0xd0: case 0xd1: case 0xd2: case 0xd3:  /* rotate or shift r/m by imm8, 1 or cl */
+    interp_decode_modrm(cpu, seg, &ea);
+    value = interp_get_ea(cpu, &ea, is_word);
+    value2 = op < 0xd0 ? interp_fetch8(cpu) : op < 0xd2 ? 1 : g->r[IR_CX] & 0xff;
+    interp_set_ea(cpu, &ea, interp_shift(cpu, ea.reg, value, value2, is_word), is_word);
+    break;
+   case 0xc2: case 0xc3:  /* ret near */
+    value = op == 0xc2 ? interp_fetch16(cpu) : 0;
+    g->ip = interp_pop(cpu);
+    g->r[IR_SP] += value;
+    break;
+   case 0xc4: case 0xc5:  /* les, lds */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.mod == 3) goto invalid_opcode;
+    value = interp_read(cpu, ea.sbase, ea.ofs, 1);
+    g->s[op == 0xc4 ? IS_ES : IS_DS] = interp_read(cpu, ea.sbase, ea.ofs + 2, 1);
+    g->r[ea.reg] = value;
+    break;
+   case 0xc6: case 0xc7:  /* mov r/m, imm */
+    interp_decode_modrm(cpu, seg, &ea);
+    interp_set_ea(cpu, &ea, is_word ? interp_fetch16(cpu) : interp_fetch8(cpu), is_word);
+    break;
+   case 0xc8:  /* enter */
+    value = interp_fetch16(cpu);
+    value2 = interp_fetch8(cpu) & 0x1f;
+    interp_push(cpu, g->r[IR_BP]);
+    { const unsigned short frame = g->r[IR_SP];
+      if (value2 > 0) {
+        while (--value2 > 0) interp_push(cpu, interp_read(cpu, g->s[IS_SS] << 4, g->r[IR_BP] -= 2, 1));
+        interp_push(cpu, frame);
+      }
+      g->r[IR_BP] = frame;
+      g->r[IR_SP] -= value;
+    }
+    break;
+   case 0xc9:  /* leave */
+    g->r[IR_SP] = g->r[IR_BP];
+    g->r[IR_BP] = interp_pop(cpu);
+    break;
+   case 0xca: case 0xcb:  /* retf */
+    value = op == 0xca ? interp_fetch16(cpu) : 0;
+    g->ip = interp_pop(cpu);
+    g->s[IS_CS] = interp_pop(cpu);
+    g->r[IR_SP] += value;
+    break;
+   case 0xcc:  /* int3 */
+    interp_int(cpu, 3);
+    break;
+   case 0xcd:  /* int imm8 */
+    interp_int(cpu, interp_fetch8(cpu));
+    break;
+   case 0xce:  /* into */
+    if (g->flags & INTERP_OF) interp_int(cpu, 4);
+    break;
+   case 0xcf:  /* iret */
+    g->ip = interp_pop(cpu);
+    g->s[IS_CS] = interp_pop(cpu);
+    g->flags = (interp_pop(cpu) & INTERP_FLAGS_MASK) | 1 << 1;
+    break;
+   case 0xd4:  /* aam */
+    value = interp_fetch8(cpu);
+    if (value == 0) { interp_fault(cpu, 0); break; }
+    value2 = g->r[IR_AX] & 0xff;
+    g->r[IR_AX] = (value2 / value) << 8 | value2 % value;
+    interp_set_szp(cpu, g->r[IR_AX], 0);
+    break;
+   case 0xd5:  /* aad */
+    value = interp_fetch8(cpu);
+    g->r[IR_AX] = ((g->r[IR_AX] >> 8) * value + g->r[IR_AX]) & 0xff;
+    interp_set_szp(cpu, g->r[IR_AX], 0);
+    break;
+   case 0xd6:  /* salc, undocumented. */
+    interp_set_reg(cpu, IR_AX, g->flags & INTERP_CF ? 0xff : 0, 0);
+    break;
+   case 0xd7:  /* xlat */
+    interp_set_reg(cpu, IR_AX, interp_read(cpu, g->s[seg >= 0 ? seg : IS_DS] << 4, g->r[IR_BX] + (g->r[IR_AX] & 0xff), 0), 0);
+    break;
+   case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde: case 0xdf:  /* ESC: no coprocessor. */
+    interp_decode_modrm(cpu, seg, &ea);
+    break;
+   case 0xe0: case 0xe1: case 0xe2:  /* loopnz, loopz, loop */
+    value = interp_fetch8(cpu);
+    if (--g->r[IR_CX] != 0 && (op == 0xe2 || ((g->flags & INTERP_ZF) != 0) == (op == 0xe1))) g->ip += (value ^ 0x80) - 0x80;
+    break;
+   case 0xe3:  /* jcxz */
+    value = interp_fetch8(cpu);
+    if (g->r[IR_CX] == 0) g->ip += (value ^ 0x80) - 0x80;
+    break;
+   case 0xe4: case 0xe5: case 0xec: case 0xed:  /* in */
+    value = op < 0xe8 ? interp_fetch8(cpu) : g->r[IR_DX];
+    interp_set_reg(cpu, IR_AX, interp_in(cpu, value, is_word), is_word);
+    break;
+   case 0xe6: case 0xe7: case 0xee: case 0xef:  /* out */
+    value = op < 0xe8 ? interp_fetch8(cpu) : g->r[IR_DX];
+    interp_out(cpu, value, interp_get_reg(cpu, IR_AX, is_word), is_word);
+    break;
+   case 0xe8:  /* call near */
+    value = interp_fetch16(cpu);
+    interp_push(cpu, g->ip);
+    g->ip += value;
+    break;
+   case 0xe9:  /* jmp near */
+    value = interp_fetch16(cpu);
+    g->ip += value;
+    break;
+   case 0xea:  /* jmp far */
+    value = interp_fetch16(cpu);
+    g->s[IS_CS] = interp_fetch16(cpu);
+    g->ip = value;
+    break;
+   case 0xeb:  /* jmp short */
+    value = interp_fetch8(cpu);
+    g->ip += (value ^ 0x80) - 0x80;
+    break;
+   case 0xf4:  /* hlt */
+    return KVM_EXIT_HLT;
+   case 0xf5:  /* cmc */
+    g->flags ^= INTERP_CF;
+    break;
+   case 0xf6: case 0xf7:  /* test, not, neg, mul, imul, div, idiv */
+    interp_decode_modrm(cpu, seg, &ea);
+    value = interp_get_ea(cpu, &ea, is_word);
+    switch (ea.reg) {
+     case 0: case 1:  /* test r/m, imm */
+      interp_alu(cpu, 4, value, is_word ? interp_fetch16(cpu) : interp_fetch8(cpu), is_word);
+      break;
+     case 2:  /* not */
+      interp_set_ea(cpu, &ea, ~value, is_word);
+      break;
+     case 3:  /* neg */
+      interp_set_ea(cpu, &ea, interp_alu(cpu, 5, 0, value, is_word), is_word);
+      break;
+     case 4:  /* mul */
+      if (is_word) {
+        const unsigned product = g->r[IR_AX] * value;
+        g->r[IR_AX] = product; g->r[IR_DX] = product >> 16;
+        value2 = product >> 16;
+      } else {
+        g->r[IR_AX] = (g->r[IR_AX] & 0xff) * value;
+        value2 = g->r[IR_AX] >> 8;
+      }
+      g->flags = (g->flags & ~(INTERP_CF | INTERP_OF)) | (value2 ? INTERP_CF | INTERP_OF : 0);
+      break;
+     case 5:  /* imul */
+      if (is_word) {
+        const int product = (short)g->r[IR_AX] * (short)value;
+        g->r[IR_AX] = product; g->r[IR_DX] = (unsigned)product >> 16;
+        value2 = product != (short)product;
+      } else {
+        const int product = (signed char)g->r[IR_AX] * (signed char)value;
+        g->r[IR_AX] = product;
+        value2 = product != (signed char)product;
+      }
+      g->flags = (g->flags & ~(INTERP_CF | INTERP_OF)) | (value2 ? INTERP_CF | INTERP_OF : 0);
+      break;
+     case 6:  /* div */
+      if (is_word) {
+        const unsigned dividend = (unsigned)g->r[IR_DX] << 16 | g->r[IR_AX];
+        if (value == 0 || dividend / value > 0xffff) { interp_fault(cpu, 0); break; }
+        g->r[IR_AX] = dividend / value; g->r[IR_DX] = dividend % value;
+      } else {
+        const unsigned dividend = g->r[IR_AX];
+        if (value == 0 || dividend / value > 0xff) { interp_fault(cpu, 0); break; }
+        g->r[IR_AX] = (dividend % value) << 8 | dividend / value;
+      }
+      break;
+     default:  /* idiv */
+      if (is_word) {
+        const int dividend = (int)((unsigned)g->r[IR_DX] << 16 | g->r[IR_AX]), divisor = (short)value;
+        int quotient;
+        if (divisor == 0 || (divisor == -1 && dividend == (int)0x80000000U)) { interp_fault(cpu, 0); break; }
+        quotient = dividend / divisor;
+        if (quotient != (short)quotient) { interp_fault(cpu, 0); break; }
+        g->r[IR_AX] = quotient; g->r[IR_DX] = dividend % divisor;
+      } else {
+        const int dividend = (short)g->r[IR_AX], divisor = (signed char)value;
+        int quotient;
+        if (divisor == 0) { interp_fault(cpu, 0); break; }
+        quotient = dividend / divisor;
+        if (quotient != (signed char)quotient) { interp_fault(cpu, 0); break; }
+        g->r[IR_AX] = (dividend % divisor & 0xff) << 8 | (quotient & 0xff);
+      }
+    }
+    break;
+   case 0xf8: case 0xf9:  /* clc, stc */
+    g->flags = (g->flags & ~INTERP_CF) | (op & 1);
+    break;
+   case 0xfa: case 0xfb:  /* cli, sti */
+    g->flags = (g->flags & ~INTERP_IF) | (op & 1 ? INTERP_IF : 0);
+    break;
+   case 0xfc: case 0xfd:  /* cld, std */
+    g->flags = (g->flags & ~INTERP_DF) | (op & 1 ? INTERP_DF : 0);
+    break;
+   case 0xfe:  /* inc or dec r/m8 */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.reg > 1) goto invalid_opcode;
+    interp_set_ea(cpu, &ea, interp_inc_dec(cpu, interp_get_ea(cpu, &ea, 0), ea.reg, 0), 0);
+    break;
+   case 0xff:  /* inc, dec, call, call far, jmp, jmp far, push r/m16 */
+    interp_decode_modrm(cpu, seg, &ea);
+    if (ea.reg == 7 || ((ea.reg == 3 || ea.reg == 5) && ea.mod == 3)) goto invalid_opcode;
+    value = interp_get_ea(cpu, &ea, 1);
+    switch (ea.reg) {
+     case 0: case 1:  /* inc, dec */
+      interp_set_ea(cpu, &ea, interp_inc_dec(cpu, value, ea.reg, 1), 1);
+      break;
+     case 2:  /* call near */
+      interp_push(cpu, g->ip);
+      g->ip = value;
+      break;
+     case 3:  /* call far */
+      value2 = interp_read(cpu, ea.sbase, ea.ofs + 2, 1);
+      interp_push(cpu, g->s[IS_CS]);
+      interp_push(cpu, g->ip);
+      g->s[IS_CS] = value2; g->ip = value;
+      break;
+     case 4:  /* jmp near */
+      g->ip = value;
+      break;
+     case 5:  /* jmp far */
+      g->s[IS_CS] = interp_read(cpu, ea.sbase, ea.ofs + 2, 1);
+      g->ip = value;
+      break;
+     default:  /* push */
+      interp_push(cpu, value);
+    }
+    break;
+   default:  /* 0x0f, 0x63..0x67, 0xf1 etc. */
+   invalid_opcode:
+    interp_fault(cpu, 6);
+  }
+  return 0;
+}
+
+static void run_interp_loop(InterpCpu *cpu) {
+  struct kvm_run * const run = cpu->run;
+  unsigned step_count, exit_reason;
+  for (step_count = 1;; ++step_count) {
+    if ((step_count & 0xfff) == 0 && run->immediate_exit) {  /* Signal, e.g. SIGPROF of --sample-hz=.... */
+      run->exit_reason = 0;
+      return;
+    }
+    cpu->saved = cpu->regs;
+    cpu->access_idx = 0;
+    exit_reason = interp_step(cpu);
+    cpu->access_count = 0;
+    if (exit_reason) {
+      run->exit_reason = exit_reason;
+      return;
+    }
+  }
+}
+
+/* Runs the guest until an exit to the host. Returns 0 (with
+ * cpu->run->exit_reason set) or -1 (with errno == EINTR), like
+ * ioctl(vcpu_fd, KVM_RUN, 0).
+ */
+static int run_interp_cpu(InterpCpu *cpu) {
+  struct kvm_run * const run = cpu->run;
+  load_interp_regs(cpu);
+  if (cpu->is_access_pending) {  /* Get the data of the access done by the host. */
+    InterpAccess *access = &cpu->accesses[cpu->access_count++];
+    memcpy(access->data, access->addr & INTERP_ACCESS_IO ? (const unsigned char*)run + sizeof(struct kvm_run) : run->mmio.data, access->size);
+    cpu->is_access_pending = 0;
+  }
+  if (cpu->regs.s[IS_CS] != cpu->saved.s[IS_CS] || cpu->regs.ip != cpu->saved.ip) cpu->access_count = 0;  /* The host has jumped away from the instruction, e.g. int call from `out' in trampoline. */
+  if (run->immediate_exit) { errno = EINTR; return -1; }
+  if (setjmp(cpu->exit_jmp) == 0) {
+    run_interp_loop(cpu);
+    store_interp_regs(cpu);
+    if (run->exit_reason == 0) { errno = EINTR; return -1; }
+  } else {  /* Exit in the middle of an instruction. */
+    cpu->regs = cpu->saved;
+    store_interp_regs(cpu);
+  }
+  return 0;
+}
+
+/* A snapshot file in --snapshot-dir=... contains the state of the emulator
+ * right after load_dos_executable_program(...), before the command-line
+ * arguments and the environment are populated. The file starts with a
+ * SnapshotHeader padded to SNAPSHOT_HEADER_SIZE, followed by guest memory
+ * from SNAPSHOT_MEM_START, up to the last nonzero page. Memory below
+ * SNAPSHOT_MEM_START (interrupt table, BIOS data area, environment) is
+ * cheap to set up, and it's not part of the snapshot, so that DOS exec()
+ * can pass the environment there.
+ *
+ * The filename contains the device, inode, size and mtime of the program
+ * file, so a changed program file gets a different snapshot file.
+ */
+#define SNAPSHOT_HEADER_SIZE 0x1000
+#define SNAPSHOT_MEM_START (PSP_PARA << 4)
+#define SNAPSHOT_MAGIC "kvdsnap1"
+
+typedef struct EmuState {
+  struct kvm_fds kvm_fds;
+  struct kvm_sregs initial_sregs;
+  struct kvm_run *kvm_run;
+  void *mem;
+  unsigned mem_size;  /* Size of the guest memory at mem: DOS_MEM_LIMIT, or more for XMS (--mem-mb=<n>). */
+  unsigned mem_map_size;  /* Size of the mapping at mem, at least GET_MEM_MAP_SIZE(mem_size). */
+  char mem_backing;  /* MEM_BACKING_... */
+  char is_mem_file_backed;  /* Is part of mem mapped from a snapshot file? See load_snapshot(...). */
+  char is_sync_regs;  /* Does KVM support KVM_CAP_SYNC_REGS for regs and sregs? If so, no KVM_GET_REGS etc. ioctl calls are needed. */
+  int kvm_run_mmap_size;
+  InterpCpu *interp;  /* Software CPU used instead of KVM, or NULL. */
+  char is_vm_new;  /* Has the last reset_emu(...) created the VM (rather than reusing a warm one)? */
+  /* Temporary pathname buffers used by run_dos_prog(...) and run_dos_batch(...). */
+  char fnbuf[LINUX_PATH_SIZE], fnbuf2[LINUX_PATH_SIZE], exec_fnbuf[LINUX_PATH_SIZE], snapshot_fnbuf[LINUX_PATH_SIZE];
+  char dosfnbuf[DOS_PATH_SIZE];
+  DosRunState *run_state;  /* Owned. NULL until select_run_state(...). */
+} EmuState;
+
+/* Size of the mapping at mem, it also contains the INT_OUT_PARA page. */
+#define GET_MEM_MAP_SIZE(mem_size) ((mem_size) > INT_OUT_LIMIT ? (mem_size) : INT_OUT_LIMIT)
+
+#define HUGEPAGE_SIZE 0x200000  /* 2 MiB, of x86 transparent hugepages. */
+
+/* Forgets the KVM VM and vCPU (or the software CPU) of emu, without closing them. */
+static void init_emu_vm(struct EmuState *emu) {
+  emu->kvm_fds.kvm_fd = emu->kvm_fds.vm_fd = emu->kvm_fds.vcpu_fd = -1;
+  emu->mem = NULL;
+  emu->mem_size = 0;
+  emu->mem_map_size = 0;
+  emu->mem_backing = MEM_BACKING_LAZY;
+  emu->is_mem_file_backed = 0;
+  emu->is_sync_regs = 0;
+  emu->interp = NULL;
+  emu->is_vm_new = 0;
+}
+
+/* It's a cheap call, the real initialization is done in reset_emu. */
+static void init_emu(struct EmuState *emu) {
+  init_emu_vm(emu);
+  emu->run_state = NULL;
+}
+
+/* Closes the KVM VM and vCPU (or frees the software CPU) of emu (if any), and unmaps its memory. */
+static void free_emu_vm(struct EmuState *emu) {
+  if (emu->interp) {
+    free(emu->interp);
+    free(emu->kvm_run);
+    munmap(emu->mem, emu->mem_map_size);  /* Also unmaps the snapshot file, if any. */
+    init_emu_vm(emu);
+  } else if (emu->kvm_fds.kvm_fd >= 0) {
+    munmap(emu->kvm_run, emu->kvm_run_mmap_size);
+    munmap(emu->mem, emu->mem_map_size);  /* Also unmaps the snapshot file, if any. */
+    close(emu->kvm_fds.vcpu_fd);
+    close(emu->kvm_fds.vm_fd);
+    close(emu->kvm_fds.kvm_fd);
+    init_emu_vm(emu);
+  }
+}
+
+/* Must be preceded by init_emu(emu).
+ * After this call, the caller should also call ioctl(kvm_fds.vcpu_fd, KVM_SET_SREGS, &emu->initial_sregs);
+ * With mem_mb > 1, it maps mem_mb MiB of guest memory (including HMA and
+ * XMS), otherwise only the conventional memory (DOS_MEM_LIMIT).
+ *
+ * With mem_backing != MEM_BACKING_LAZY, all guest memory is faulted in when
+ * the VM is created, so the DOS program doesn't have to take a host page
+ * fault on the first touch of each page, and subsequent calls keep these
+ * pages instead of dropping them.
+ *
+ * With cpu == CPU_AUTO, it uses KVM if available, and the software CPU
+ * (see run_interp_cpu(...)) otherwise. With the software CPU, emu->interp
+ * is not NULL, and emu->kvm_run is a plain struct used for the exits of
+ * run_interp_cpu(...).
+ */
+static void reset_emu(struct EmuState *emu, unsigned mem_mb, char mem_backing, char cpu) {
+  void *mem;
+  const unsigned mem_size = mem_mb > 1 ? mem_mb << 20 : DOS_MEM_LIMIT;
+  if (emu->mem && (emu->mem_size != mem_size || emu->mem_backing != mem_backing ||
+      (cpu != CPU_AUTO && (cpu == CPU_INTERP) != (emu->interp != NULL)))) free_emu_vm(emu);  /* Different --mem-mb=..., --prefault or --cpu=... than in the previous job of --serve. */
+  emu->is_vm_new = !emu->mem;
+  if (!emu->mem) {
+    int kvm_fd = -1, vm_fd = -1, vcpu_fd;
+    int kvm_run_mmap_size, api_version;
+    struct kvm_userspace_memory_region region;
+    struct kvm_regs dummy_regs;
+    if (cpu != CPU_INTERP) {
+      if ((kvm_fd = open("/dev/kvm", O_RDWR)) < 0) {
+        if (cpu == CPU_KVM) {
+          perror("fatal: failed to open /dev/kvm");
+          exit(252);
+        }
+      } else {
+        if ((api_version = ioctl(kvm_fd, KVM_GET_API_VERSION, 0)) < 0) {
+          perror("fatal: failed to create KVM vm");
+          exit(252);
+        }
+        if (api_version != KVM_API_VERSION) {
+          fprintf(stderr, "fatal: KVM API version mismatch: kernel=%d user=%d\n",
+                  api_version, KVM_API_VERSION);
+        }
+        if ((vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0)) < 0) {
+          if (cpu == CPU_KVM) {
+            perror("fatal: failed to create KVM vm");
+            exit(252);
+          }
+          close(kvm_fd);  /* E.g. in a nested VM without nested virtualization. */
+          kvm_fd = -1;
+        }
+      }
+      if (kvm_fd < 0 && DEBUG) fprintf(stderr, "debug: KVM not available, using the software CPU\n");
+    }
+    if (mem_backing == MEM_BACKING_HUGEPAGES) {
+      /* Linux backs only 2 MiB aligned ranges of 2 MiB with transparent
+       * hugepages, so we map and unmap extra space for aligning. hugetlbfs
+       * (MAP_HUGETLB) wouldn't work, because load_snapshot(...) and the
+       * KVM memory slots need 4 KiB granularity.
+       */
+      const unsigned map_size = (GET_MEM_MAP_SIZE(mem_size) + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+      char *p, *aligned_p;
+      if ((p = mmap(NULL, map_size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+        perror("fatal: mmap");
+        exit(252);
+      }
+      aligned_p = (char*)(((uintptr_t)p + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+      if (aligned_p != p) munmap(p, aligned_p - p);
+      if (aligned_p != p + HUGEPAGE_SIZE) munmap(aligned_p + map_size, p + HUGEPAGE_SIZE - aligned_p);
+      if (madvise(aligned_p, map_size, MADV_HUGEPAGE) != 0 && DEBUG) perror("debug: madvise MADV_HUGEPAGE");  /* Not fatal, e.g. EINVAL without CONFIG_TRANSPARENT_HUGEPAGE. */
+      for (p = aligned_p; p != aligned_p + map_size; p += 0x1000) {
+        *(volatile char*)p = '\0';  /* Fault it in. A single fault populates an entire hugepage. */
+      }
+      emu->mem = mem = aligned_p;
+      emu->mem_map_size = map_size;
+    } else {
+      if ((emu->mem = mem = mmap(NULL, GET_MEM_MAP_SIZE(mem_size), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | (mem_backing == MEM_BACKING_LAZY ? MAP_NORESERVE : MAP_POPULATE), -1, 0)) ==
+          MAP_FAILED) {
+        perror("fatal: mmap");
+        exit(252);
+      }
+      emu->mem_map_size = GET_MEM_MAP_SIZE(mem_size);
+    }
+    emu->mem_size = mem_size;
+    emu->mem_backing = mem_backing;
+
+    if (kvm_fd < 0) {  /* Software CPU. */
+      if ((emu->kvm_run = (struct kvm_run*)calloc(1, sizeof(struct kvm_run) + INTERP_IO_DATA_SIZE)) == NULL ||
+          (emu->interp = (InterpCpu*)malloc(sizeof(InterpCpu))) == NULL) {
+        fprintf(stderr, "fatal: out of memory for the software CPU\n");
+        exit(252);
+      }
+      init_interp_cpu(emu->interp, emu->kvm_run, mem, mem_size);
+      memset(&emu->initial_sregs, '\0', sizeof(emu->initial_sregs));
+      emu->is_sync_regs = 1;  /* run_interp_cpu(...) takes and returns the registers in emu->kvm_run->s.regs. */
+      emu->kvm_run_mmap_size = 0;
+    } else {
+      memset(&region, 0, sizeof(region));
+      region.slot = 0;
+      region.guest_phys_addr = GUEST_MEM_MODULE_START;  /* Must be a multiple of the Linux page size (0x1000), otherwise KVM_SET_USER_MEMORY_REGION returns EINVAL. */
+      region.memory_size = DOS_MEM_LIMIT - GUEST_MEM_MODULE_START;
+      region.userspace_addr = (uintptr_t)mem + GUEST_MEM_MODULE_START;
+      /*region.flags = KVM_MEM_READONLY;*/  /* Not needed, read-write is default. */
+      if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION");
+        exit(252);
+      }
+      if (GUEST_MEM_MODULE_START != 0) {
+        memset(&region, 0, sizeof(region));
+        region.slot = 1;
+        region.guest_phys_addr = 0;
+        region.memory_size = 0x1000;  /* Magic interrupt table: 0x500 bytes, rounded up to page boundary. */
+        region.userspace_addr = (uintptr_t)mem;
+        region.flags = KVM_MEM_READONLY;
+        if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+          perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION");
+          exit(252);
+        }
+      }
+      memset(&region, 0, sizeof(region));
+      region.slot = 3;
+      region.guest_phys_addr = INT_OUT_PARA << 4;
+      region.memory_size = INT_OUT_LIMIT - (INT_OUT_PARA << 4);
+      region.userspace_addr = (uintptr_t)mem + (INT_OUT_PARA << 4);
+      region.flags = KVM_MEM_READONLY;
+      if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION for trampoline");
+        exit(252);
+      }
+      if (mem_size > DOS_MEM_LIMIT) {  /* HMA and XMS. Nothing else is mapped between DOS_MEM_LIMIT and HMA_START. */
+        memset(&region, 0, sizeof(region));
+        region.slot = 2;
+        region.guest_phys_addr = HMA_START;
+        region.memory_size = mem_size - HMA_START;
+        region.userspace_addr = (uintptr_t)mem + HMA_START;
+        if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+          perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION for XMS");
+          exit(252);
+        }
+      }
+      if ((vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, 0)) < 0) {
+        perror("fatal: can not create KVM vcpu");
+        exit(252);
+      }
+      kvm_run_mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+      if (kvm_run_mmap_size < 0) {
+        perror("fatal: ioctl KVM_GET_VCPU_MMAP_SIZE");
+        exit(252);
+      }
+      if ((emu->kvm_run = (struct kvm_run *)mmap(
+          NULL, kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu_fd, 0)) == NULL) {
+        perror("fatal: mmap kvm_run");
+        exit(252);
+      }
+      if (ioctl(vcpu_fd, KVM_GET_REGS, &dummy_regs) < 0) {  /* We don't use the result; but we just check here that ioctl KVM_GET_REGS works. */
+        perror("fatal: KVM_GET_REGS");
+        exit(252);
+      }
+      if (ioctl(vcpu_fd, KVM_GET_SREGS, &emu->initial_sregs) < 0) {  /* Will be reused by DOS exec(). */
+        perror("fatal: KVM_GET_SREGS");
+        exit(252);
+      }
+      /* With KVM_CAP_SYNC_REGS, KVM_RUN copies regs and sregs to and from
+       * emu->kvm_run->s.regs, saving 2--4 ioctl(...) calls per exit. Available
+       * since Linux 4.16 on x86.
+       */
+      { const int sync_regs = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+        emu->is_sync_regs = sync_regs > 0 && (sync_regs & (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)) == (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS);
+      }
+      if (DEBUG) fprintf(stderr, "debug: KVM sync_regs: %d\n", emu->is_sync_regs);
+      emu->kvm_fds.kvm_fd = kvm_fd; emu->kvm_fds.vm_fd = vm_fd; emu->kvm_fds.vcpu_fd = vcpu_fd;
+      emu->kvm_run_mmap_size = kvm_run_mmap_size;
+    }
+  } else {
+    mem = emu->mem;
+    if (emu->is_mem_file_backed) {  /* madvise(...) below would reload the snapshot file contents instead of zeroing. */
+      if (mmap((char*)mem + SNAPSHOT_MEM_START, DOS_MEM_LIMIT - SNAPSHOT_MEM_START, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | (mem_backing == MEM_BACKING_LAZY ? MAP_NORESERVE : MAP_POPULATE), -1, 0) == MAP_FAILED) {
+        perror("fatal: mmap over snapshot");
+        exit(252);
+      }
+      emu->is_mem_file_backed = 0;
+    }
+    if (emu->interp) emu->interp->access_count = emu->interp->is_access_pending = 0;  /* Drop the pending exit of the previous program. */
+    if (mem_backing != MEM_BACKING_LAZY) {
+      /* Keep the pages (and the hugepages) mapped. For the <1 MiB of
+       * DOS_MEM_LIMIT, a memset(...) is faster than faulting the pages in
+       * again after madvise(...).
+       */
+      memset((char*)mem + (PSP_PARA << 4), '\0', DOS_MEM_LIMIT - (PSP_PARA << 4));
+    } else if (madvise((char*)mem + (((PSP_PARA << 4) + 0xfff) & ~0xfff), DOS_MEM_LIMIT - (((PSP_PARA << 4) + 0xfff) & ~0xfff), MADV_DONTNEED) != 0) {
+      perror("fatal: madvise MADV_DONTNEED");
+      exit(252);
+    }
+    if ((PSP_PARA << 4) & 0xfff && mem_backing == MEM_BACKING_LAZY) memset((char*) mem + (PSP_PARA << 4), '\0', -(PSP_PARA << 4) & 0xfff);  /* Partial page not cleared by madvise() above. */
+    if (*(const unsigned*)((char*)mem + (PSP_PARA << 4)) != 0) {
+      fprintf(stderr, "madvise failed to zero PSP\n");
+      exit(252);
+    }
+    memset(mem, '\0', ENV_PARA << 4);
+    memset((char*)mem + ENV_LIMIT, '\0', (PSP_PARA << 4) - ENV_LIMIT);
+  }
+}
+
+typedef struct SnapshotHeader {
+  char magic[8];
+  unsigned header_struct_size;  /* sizeof(SnapshotHeader), to detect snapshots created by other builds of kvikdos. */
+  unsigned data_size;  /* Number of bytes of guest memory after the header, a multiple of 0x1000. */
+  unsigned long prog_dev, prog_ino, prog_size, prog_mtime, prog_mtime_nsec;  /* Of the program file. */
+  unsigned short mcb_size_para;
+  unsigned short cs, ds, es, ss;  /* Segment selectors. */
+  struct kvm_regs regs;
+} SnapshotHeader;
+
+/* Fills key->prog_... from the program file img_fd. Returns 0 on success. */
+static int get_snapshot_key(int img_fd, SnapshotHeader *key) {
+  struct stat st;
+  if (fstat(img_fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+  key->prog_dev = st.st_dev;
+  key->prog_ino = st.st_ino;
+  key->prog_size = st.st_size;
+  key->prog_mtime = st.st_mtime;
+  key->prog_mtime_nsec = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/* Fills snapshot_fnbuf (of size LINUX_PATH_SIZE). Returns 0 on success. */
+static int get_snapshot_filename(const char *snapshot_dir, const SnapshotHeader *key, char *snapshot_fnbuf) {
+  const size_t dir_size = strlen(snapshot_dir);
+  if (dir_size + 100 > LINUX_PATH_SIZE) return -1;
+  sprintf(snapshot_fnbuf, "%s%s%lx-%lx-%lx-%lx-%lx.kvdsnap", snapshot_dir, snapshot_dir[dir_size - 1] == '/' ? "" : "/",
+          key->prog_dev, key->prog_ino, key->prog_size, key->prog_mtime, key->prog_mtime_nsec);
+  return 0;
+}
+
+/* Maps the snapshot in fd to emu->mem, and loads regs and sregs from it.
+ * Returns 1 on success, 0 if the snapshot is not usable or it doesn't
+ * match key (then emu->mem is unchanged).
+ */
+static char map_snapshot(EmuState *emu, int fd, const SnapshotHeader *key, struct kvm_regs *regs, struct kvm_sregs *sregs) {
+  SnapshotHeader hdr;
+  struct stat st;
+  char *mem = (char*)emu->mem;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != (int)sizeof(hdr) || fstat(fd, &st) != 0 ||
+      memcmp(hdr.magic, SNAPSHOT_MAGIC, 8) != 0 || hdr.header_struct_size != sizeof(hdr) ||
+      (hdr.data_size & 0xfff) != 0 || hdr.data_size > DOS_MEM_LIMIT - SNAPSHOT_MEM_START ||
+      st.st_size != (off_t)(SNAPSHOT_HEADER_SIZE + hdr.data_size) ||
+      hdr.prog_dev != key->prog_dev || hdr.prog_ino != key->prog_ino || hdr.prog_size != key->prog_size ||
+      hdr.prog_mtime != key->prog_mtime || hdr.prog_mtime_nsec != key->prog_mtime_nsec) {
+    return 0;
+  }
+  /* Copy-on-write mapping, the snapshot file remains intact. reset_emu(...) will replace it by anonymous memory again. */
+  if (hdr.data_size != 0 && mmap(mem + SNAPSHOT_MEM_START, hdr.data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, SNAPSHOT_HEADER_SIZE) == MAP_FAILED) {
+    perror("fatal: mmap snapshot");  /* Not recoverable, the previous mapping of mem is lost. */
+    exit(252);
+  }
+  emu->is_mem_file_backed = 1;
+  MCB_SIZE_PARA(mem + (PROGRAM_MCB_PARA << 4)) = hdr.mcb_size_para;
+  *regs = hdr.regs;
+  sregs->cs.selector = hdr.cs;
+  sregs->ds.selector = hdr.ds;
+  sregs->es.selector = hdr.es;
+  sregs->ss.selector = hdr.ss;
+  return 1;
+}
+
+/* Loads the snapshot of the program img_fd to emu->mem, regs and sregs,
+ * from emu_params->snapshot_fd or emu_params->snapshot_dir.
+ * Returns 1 on success, 0 if there is no usable snapshot (then
+ * emu->mem is unchanged).
+ */
+static char load_snapshot(EmuState *emu, const EmuParams *emu_params, int img_fd, struct kvm_regs *regs, struct kvm_sregs *sregs) {
+  SnapshotHeader key;
+  int fd;
+  char result;
+  if (get_snapshot_key(img_fd, &key) != 0) return 0;
+  if (emu_params->snapshot_fd >= 0 && map_snapshot(emu, emu_params->snapshot_fd, &key, regs, sregs)) {
+    if (DEBUG) fprintf(stderr, "debug: loaded preloaded snapshot\n");
+    return 1;
+  }
+  if (!emu_params->snapshot_dir || get_snapshot_filename(emu_params->snapshot_dir, &key, emu->snapshot_fnbuf) != 0) return 0;
+  if ((fd = open(emu->snapshot_fnbuf, O_RDONLY)) < 0) return 0;
+  result = map_snapshot(emu, fd, &key, regs, sregs);
+  close(fd);
+  if (DEBUG) fprintf(stderr, "debug: %s snapshot: %s\n", result ? "loaded" : "ignoring bad", emu->snapshot_fnbuf);
+  return result;
+}
+
+/* Writes the snapshot of the program just loaded to mem, regs and sregs to
+ * fd, starting at the current file position. hdr->prog_... must be filled
+ * by the caller. Returns 0 on success.
+ */
+static int write_snapshot(int fd, const char *mem, SnapshotHeader *hdr, const struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  static char header_page[SNAPSHOT_HEADER_SIZE];
+  const char *data_end = mem + DOS_MEM_LIMIT;
+  const char *p;
+  { struct SA { int StaticAssert_SnapshotHeaderSize : sizeof(SnapshotHeader) <= SNAPSHOT_HEADER_SIZE; }; }
+  { struct SA { int StaticAssert_SnapshotMemStartAligned : (SNAPSHOT_MEM_START & 0xfff) == 0; }; }
+  for (; data_end != mem + SNAPSHOT_MEM_START; data_end -= 0x1000) {  /* Find the last nonzero page. */
+    for (p = data_end - 0x1000; p != data_end && *(const unsigned*)p == 0; p += 4) {}
+    if (p != data_end) break;
+  }
+  memcpy(hdr->magic, SNAPSHOT_MAGIC, 8);
+  hdr->header_struct_size = sizeof(*hdr);
+  hdr->data_size = data_end - (mem + SNAPSHOT_MEM_START);
+  hdr->mcb_size_para = MCB_SIZE_PARA(mem + (PROGRAM_MCB_PARA << 4));
+  hdr->cs = sregs->cs.selector;
+  hdr->ds = sregs->ds.selector;
+  hdr->es = sregs->es.selector;
+  hdr->ss = sregs->ss.selector;
+  hdr->regs = *regs;
+  memcpy(header_page, hdr, sizeof(*hdr));
+  if (write(fd, header_page, SNAPSHOT_HEADER_SIZE) != SNAPSHOT_HEADER_SIZE ||
+      write(fd, mem + SNAPSHOT_MEM_START, hdr->data_size) != (int)hdr->data_size) return -1;
+  return 0;
+}
+
+/* Saves the snapshot of the program img_fd, just loaded to emu->mem, regs
+ * and sregs, to snapshot_dir. Failures are ignored, the snapshot is just a
+ * cache.
+ */
+static void save_snapshot(EmuState *emu, const char *snapshot_dir, int img_fd, const struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  SnapshotHeader hdr;
+  char tmp_fnbuf[LINUX_PATH_SIZE + 16];
+  int fd;
+  if (get_snapshot_key(img_fd, &hdr) != 0 || get_snapshot_filename(snapshot_dir, &hdr, emu->snapshot_fnbuf) != 0) return;
+  sprintf(tmp_fnbuf, "%s.tmp%d", emu->snapshot_fnbuf, (int)getpid());  /* Concurrent kvikdos processes may create the same snapshot. */
+  if ((fd = open(tmp_fnbuf, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    if (DEBUG) fprintf(stderr, "debug: cannot create snapshot: %s: %s\n", tmp_fnbuf, strerror(errno));
+    return;
+  }
+  if (write_snapshot(fd, (const char*)emu->mem, &hdr, regs, sregs) != 0 ||
+      close(fd) != 0 || rename(tmp_fnbuf, emu->snapshot_fnbuf) != 0) {
+    if (DEBUG) fprintf(stderr, "debug: cannot write snapshot: %s: %s\n", tmp_fnbuf, strerror(errno));
+    unlink(tmp_fnbuf);
+    return;
+  }
+  if (DEBUG) fprintf(stderr, "debug: saved snapshot: %s\n", emu->snapshot_fnbuf);
+}
+
+static void process_key(TtyState *tty_state, unsigned char ah, unsigned short *ax, unsigned short *flags) {
+  if (tty_state->tty_in_fd == -3) {  /* Fake keys. */
+    *ax = *tty_state->next_fake_key;
+    if (ah & 1) {
+      *flags &= ~(1 << 6);  /* ZF=0, key available in buffer. */
+    } else {
+      if (++tty_state->next_fake_key == fake_keys + sizeof(fake_keys) / sizeof(fake_keys[0])) tty_state->next_fake_key = fake_keys;
+    }
+  } else {
+    /* TODO(pts): Disable line buffering if isatty(0). Enable it again at exit if needed. */
+    int got;
+    struct termios tio;
+    tcflag_t old_lflag = 0;
+    if (tty_state->tty_in_fd == -1) {
+      if ((tty_state->tty_in_fd = open("/dev/tty", O_RDWR)) < 0) {  /* Current controlling terminal. */
+        tty_state->tty_in_fd = -2;
+      } else {
+        tty_state->tty_in_fd = ensure_fd_is_at_least(tty_state->tty_in_fd, 5);
+      }
+    }
+    if (!tty_state->is_tty_in_error) {
+      if (tcgetattr(tty_state->tty_in_fd, &tio) != 0) {
+        tty_state->is_tty_in_error = 1;
+      } else {
+        old_lflag = tio.c_lflag;
+        /* TODO(pts): Handle Ctrl-<C> and other signals. */
+        tio.c_lflag &= ~(ICANON | ECHO);  /* As a side effect, ECHOCTL is also disabled, so Ctrl-<C> won't show up as ^C, but it will still send SIGINT. */
+        if (tcsetattr(tty_state->tty_in_fd, 0, &tio) != 0) {
+          tty_state->is_tty_in_error = 1;
+        }
+      }
+    }
+    if (ah & 1) {
+      struct pollfd pollfd0;
+      int got;
+      pollfd0.fd = 0;
+      pollfd0.events = POLLIN;
+      got = poll(&pollfd0, 1  /* pollfd count */, 0 /* timeout */);  /* Like select(2), but faster. Easier to setup than epoll(2). */
+      if (got < 0) {
+        perror("poll stdin");
+        exit(252);
+      } else if (got) {
+        *ax =  0x011b;  /* Fake <Esc> in keyboard buffer. */
+        *flags &= ~(1 << 6);  /* ZF=0, key available. */
+      } else {
+        *flags |= (1 << 6);  /* ZF=1. */
+      }
+    } else {
+      char c;
+      flush_stdout_buf(tty_state);  /* Show the prompt. */
+      if ((got = read(tty_state->tty_in_fd == -2 ? 0 : tty_state->tty_in_fd, &c, 1)) < 1) c = 26;  /* Ctrl-<Z>, simulate EOF. Most programs won't recognize it. */
+      *ax = (c & ~0x7f ? 0x3f : scancodes[(int)c]) << 8 | (c & 0xff);
+    }
+    if (!tty_state->is_tty_in_error) {
+      tio.c_lflag = old_lflag;
+      /* Since we set ECHO back here, a call with ah == 0x01
+       * followed by a call with ah == 0x00 will echo the character
+       * to the Linux terminal.
+       *
+       * TODO(pts): Fix it by not setting ECHO back here, only at exit.
+       */
+      /* TODO(pts): Also change it back upon exit. Even if it's a signal exit. */
+      if (tcsetattr(tty_state->tty_in_fd, 0, &tio) != 0) {
+        tty_state->is_tty_in_error = 1;
+      }
+    }
+  }
+}
+
+/* Uses fnbuf (of size LINUX_PATH_SIZE) as temporary storage. */
+static int open_dos_file(const char *dos_filename, const char *dos_prog_abs, int flags, DirState *dir_state, char *fnbuf) {
+  const int flags3 = (flags & 3);
+  int fd;
+  const char *linux_filename;
+  char *linux_lastc;  /* Last component of linux_filename. */
+  dir_state->dos_prog_abs = flags3 == O_RDONLY ? dos_prog_abs : NULL;  /* For loading the overlay from prog_filename, even if not mounted. */
+  linux_filename = get_linux_filename_r(dos_filename, dir_state, fnbuf, &linux_lastc);
+  dir_state->dos_prog_abs = NULL;  /* For security. */
+  /* There is some code duplication here with open() in run_dos_prog(). */
+  if (is_same_ascii_nocase(linux_lastc, "nul", 3) && (linux_lastc[3] == '.' || linux_lastc[3] == '\0')) {
+    strcpy(fnbuf, "/dev/null");
+  } else if (is_same_ascii_nocase(linux_lastc, "aux", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) {
+    if (flags3 != O_WRONLY) { eacces: /* Don't let the user open aux for non-writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
+      errno = EACCES; return -1;  /* Permission denied. */
+    } else {
+      if ((fd = dup(2)) < 0) { einval: errno = EINVAL; return -1; }
+    }
+    goto after_open;
+  } else if ((is_same_ascii_nocase(linux_lastc, "con", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
+             (is_same_ascii_nocase(linux_lastc, "prn", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
+             (is_same_ascii_nocase(linux_lastc, "lpt1", 4) && (linux_lastc[4] == '\0' || linux_lastc[4] == '.'))) {
+    if (flags3 == O_RDONLY) {
+      if ((fd = dup(0)) < 0) goto einval;
+    } else if (flags3 == O_WRONLY) {
+      if ((fd = dup(1)) < 0) goto einval;
+    } else {
+      goto eacces;  /* Don't let the user open prn for both reading and writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
+    }
+    goto after_open;
+  }
+  if ((fd = open_file(linux_filename, flags)) < 0) return -1;
+ after_open:
+  return fd;
+}
+
+/* 8086 code of the in-guest int 0x21 and int 0x16 front-ends, loaded to
+ * INT_STUB_PARA:INT21_STUB_OFS. The calls which only read state known in
+ * advance (from the ISS_... state block, the IVT or the BDA) are answered
+ * without a VM exit, the others are passed on to the host trampoline (the
+ * hlt instruction in the INT_HLT_PARA table by default, see
+ * INT21_STUB_HOST_OFS), as if the program had called the int directly.
+ * The flags are restored by iret, like kvikdos does.
+ */
+static const unsigned char int_stub_code[] = {
+    /* 0x28: int21: */
+    0x80, 0xfc, 0x19,  /* cmp ah, 0x19 */
+    0x74, 0x1e,  /* je f19 */
+    0x80, 0xfc, 0x2f,  /* cmp ah, 0x2f */
+    0x74, 0x1e,  /* je f2f */
+    0x80, 0xfc, 0x35,  /* cmp ah, 0x35 */
+    0x74, 0x3d,  /* je f35 */
+    0x80, 0xfc, 0x51,  /* cmp ah, 0x51 */
+    0x74, 0x1a,  /* je f62 */
+    0x80, 0xfc, 0x62,  /* cmp ah, 0x62 */
+    0x74, 0x15,  /* je f62 */
+    0x80, 0xfc, 0x30,  /* cmp ah, 0x30 */
+    0x74, 0x16,  /* je f30 */
+    /* 0x46: host21: Let kvikdos (host) handle the int 0x21 call. INT21_STUB_HOST_OFS. */
+    0xea, 0x21, 0x00, INT_HLT_PARA & 0xff, INT_HLT_PARA >> 8,  /* jmp INT_HLT_PARA:0x21 */
+    /* 0x4b: f19: */
+    0x2e, 0xa0, 0x06, 0x00,  /* mov al, [cs:ISS_DRIVE] */
+    0xcf,  /* iret */
+    /* 0x50: f2f: */
+    0x2e, 0xc4, 0x1e, 0x00, 0x00,  /* les bx, [cs:ISS_DTA] */
+    0xcf,  /* iret */
+    /* 0x56: f62: */
+    0x2e, 0x8b, 0x1e, 0x04, 0x00,  /* mov bx, [cs:ISS_PSP] */
+    0xcf,  /* iret */
+    /* 0x5c: f30: */
+    0x2e, 0xf6, 0x06, 0x07, 0x00, 0x01,  /* test byte [cs:ISS_FLAGS], ISF_VERSION */
+    0x74, 0xe2,  /* jz host21 */
+    0xbb, 0x00, 0xff,  /* mov bx, 0xff00 */
+    0x3c, 0x01,  /* cmp al, 1 */
+    0x75, 0x03,  /* jne f30v */
+    0xbb, 0x00, 0x10,  /* mov bx, 0x1000 */
+    /* 0x6e: f30v: */
+    0xb8, 0x05, 0x00,  /* mov ax, 5 */
+    0x31, 0xc9,  /* xor cx, cx */
+    0xcf,  /* iret */
+    /* 0x74: f35: */
+    0x53,  /* push bx */
+    0x51,  /* push cx */
+    0x88, 0xc1,  /* mov cl, al */
+    0x80, 0xe1, 0x07,  /* and cl, 7 */
+    0x88, 0xc3,  /* mov bl, al */
+    0x30, 0xff,  /* xor bh, bh */
+    0xd1, 0xeb,  /* shr bx, 1 */
+    0xd1, 0xeb,  /* shr bx, 1 */
+    0xd1, 0xeb,  /* shr bx, 1 */
+    0x2e, 0x8a, 0x9f, 0x08, 0x00,  /* mov bl, [cs:bx+ISS_GET_INTS] */
+    0xd2, 0xeb,  /* shr bl, cl */
+    0xf6, 0xc3, 0x01,  /* test bl, 1 */
+    0x59,  /* pop cx */
+    0x5b,  /* pop bx */
+    0x74, 0xb3,  /* jz host21 */
+    0x31, 0xdb,  /* xor bx, bx */
+    0x8e, 0xc3,  /* mov es, bx */
+    0x88, 0xc3,  /* mov bl, al */
+    0xd1, 0xe3,  /* shl bx, 1 */
+    0xd1, 0xe3,  /* shl bx, 1 */
+    0x26, 0xc4, 0x1f,  /* les bx, [es:bx] */
+    0xcf,  /* iret */
+    /* 0xa1: int16: */
+    0x80, 0xfc, 0x02,  /* cmp ah, 2 */
+    0x74, 0x0a,  /* je k02 */
+    0x80, 0xfc, 0x12,  /* cmp ah, 0x12 */
+    0x74, 0x11,  /* je k12 */
+    0xea, 0x16, 0x00, INT_HLT_PARA & 0xff, INT_HLT_PARA >> 8,  /* jmp INT_HLT_PARA:0x16 */  /* INT16_STUB_HOST_OFS. */
+    /* 0xb0: k02: */
+    0x1e,  /* push ds */
+    0x53,  /* push bx */
+    0x31, 0xdb,  /* xor bx, bx */
+    0x8e, 0xdb,  /* mov ds, bx */
+    0xa0, 0x17, 0x04,  /* mov al, [0x417] */
+    0x5b,  /* pop bx */
+    0x1f,  /* pop ds */
+    0xcf,  /* iret */
+    /* 0xbc: k12: */
+    0x1e,  /* push ds */
+    0x31, 0xc0,  /* xor ax, ax */
+    0x8e, 0xd8,  /* mov ds, ax */
+    0xa1, 0x17, 0x04,  /* mov ax, [0x417] */
+    0x1f,  /* pop ds */
+    0xcf,  /* iret */
+    /* 0xc6: xms: The XMS specification requires a short jump and 3 nops at the entry point, for hooking. */
+    0xeb, 0x03,  /* jmp short xmsh */
+    0x90, 0x90, 0x90,  /* nop ++ nop ++ nop */
+    /* 0xcb: xmsh: */
+    0x9c,  /* pushf */
+    0x9a, 0x2f, 0x00, INT_HLT_PARA & 0xff, INT_HLT_PARA >> 8,  /* call INT_HLT_PARA:0x2f */  /* XMS_STUB_HOST_OFS. */
+    /* 0xd1: */
+    0xcb,  /* retf */
+};
+
+#define INT_STUB_STATE(mem) ((unsigned char*)(mem) + (INT_STUB_PARA << 4))
+
+/* --- Profiling of the host-side work (--profile=<file>).
+ *
+ * For each (int_num, ah) pair handled in the KVM_EXIT_HLT branch of
+ * run_dos_prog(...) the host time is measured from the end of KVM_RUN to
+ * the beginning of the next KVM_RUN. KVM_EXIT_IO and KVM_EXIT_MMIO exits are
+ * only counted (by port and address). The data is accumulated over DOS
+ * exec(...) calls and batch file lines, and it's written at exit.
+ */
+
+typedef struct ProfileIntEntry {
+  unsigned long count;
+  unsigned long byte_count;  /* Only for int 0x21 ah == 0x3f and ah == 0x40. */
+  double total_sec, max_sec;
+} ProfileIntEntry;
+
+#define PROFILE_EXIT_COUNT 64
+#define PROFILE_EXIT_IO 0x80000000U  /* Flag in ProfileExitEntry.key. */
+
+typedef struct ProfileExitEntry {
+  unsigned key;  /* PROFILE_EXIT_IO | port, or MMIO physical address. */
+  unsigned long count;
+} ProfileExitEntry;
+
+typedef struct ProfileState {
+  const char *filename;
+  double start_sec, run_start_sec, exit_sec, guest_sec;
+  unsigned long run_count;
+  unsigned long other_exit_count;  /* Not fitting to exits. */
+  ProfileIntEntry *pending;  /* The int call being handled, or NULL. */
+  ProfileIntEntry ints[0x100 << 8];  /* Indexed by int_num << 8 | ah. */
+  unsigned exit_count;
+  ProfileExitEntry exits[PROFILE_EXIT_COUNT];
+} ProfileState;
+
+/* Called before KVM_RUN. */
+static void profile_run_start(void) {
+  const double now = get_monotonic_sec();
+  ProfileIntEntry *pie = run_state->profile->pending;
+  if (pie) {
+    const double sec = now - run_state->profile->exit_sec;
+    pie->total_sec += sec;
+    if (pie->max_sec < sec) pie->max_sec = sec;
+    run_state->profile->pending = NULL;
+  }
+  run_state->profile->run_start_sec = now;
+}
+
+/* Called after KVM_RUN. */
+static void profile_run_end(void) {
+  const double now = get_monotonic_sec();
+  run_state->profile->guest_sec += now - run_state->profile->run_start_sec;
+  run_state->profile->exit_sec = now;
+  ++run_state->profile->run_count;
+}
+
+static void profile_int(unsigned char int_num, unsigned char ah) {
+  ProfileIntEntry *pie = run_state->profile->pending = &run_state->profile->ints[int_num << 8 | ah];
+  ++pie->count;
+}
+
+static void profile_exit(unsigned key) {
+  ProfileExitEntry *pee = run_state->profile->exits, *pee_end = pee + run_state->profile->exit_count;
+  for (; pee != pee_end && pee->key != key; ++pee) {}
+  if (pee == pee_end) {
+    if (run_state->profile->exit_count == PROFILE_EXIT_COUNT) { ++run_state->profile->other_exit_count; return; }
+    ++run_state->profile->exit_count;
+    pee->key = key;
+    pee->count = 0;
+  }
+  ++pee->count;
+}
+
+static int compare_profile_ints(const void *a, const void *b) {
+  const ProfileIntEntry *pa = &run_state->profile->ints[*(const unsigned*)a], *pb = &run_state->profile->ints[*(const unsigned*)b];
+  return pa->total_sec > pb->total_sec ? -1 : pa->total_sec < pb->total_sec ? 1 : (int)(*(const unsigned*)a - *(const unsigned*)b);
+}
+
+/* Writes the profile to profile->filename, and stops profiling. */
+static void write_profile(void) {
+  static unsigned order[0x100 << 8];
+  ProfileState * const profile = run_state ? run_state->profile : NULL;  /* run_state is NULL after kvikdos_vm_destroy(...). */
+  FILE *f;
+  unsigned u, order_size;
+  ProfileExitEntry *pee, *pee_end;
+  double host_sec;
+  if (!profile) return;
+  if (profile->pending) profile_run_start();  /* Account for the exiting int call. */
+  if ((f = fopen(profile->filename, "w")) == NULL) {
+    fprintf(stderr, "error: cannot open profile file: %s: %s\n", profile->filename, strerror(errno));
+    goto done;
+  }
+  host_sec = get_monotonic_sec() - profile->start_sec - profile->guest_sec;
+  fprintf(f, "# kvikdos profile: kvm_runs=%lu guest_sec=%.6f host_sec=%.6f\n", profile->run_count, profile->guest_sec, host_sec);
+  for (order_size = u = 0; u < (0x100 << 8); ++u) {
+    if (profile->ints[u].count) order[order_size++] = u;
+  }
+  qsort(order, order_size, sizeof(order[0]), compare_profile_ints);
+  fprintf(f, "# int ah        count    total_ms       max_us        bytes\n");
+  for (u = 0; u < order_size; ++u) {
+    const ProfileIntEntry *pie = &profile->ints[order[u]];
+    fprintf(f, "int 0x%02x:%02x %10lu %11.3f %12.1f %12lu\n", order[u] >> 8, order[u] & 0xff, pie->count, pie->total_sec * 1e3, pie->max_sec * 1e6, pie->byte_count);
+  }
+  fprintf(f, "# exit address      count\n");
+  for (pee = profile->exits, pee_end = pee + profile->exit_count; pee != pee_end; ++pee) {
+    if (pee->key & PROFILE_EXIT_IO) {
+      fprintf(f, "io   0x%04x   %10lu\n", pee->key & 0xffff, pee->count);
+    } else {
+      fprintf(f, "mmio 0x%06x %10lu\n", pee->key, pee->count);
+    }
+  }
+  if (profile->other_exit_count) fprintf(f, "other          %10lu\n", profile->other_exit_count);
+  if (ferror(f) | fclose(f)) fprintf(stderr, "error: cannot write profile file: %s\n", profile->filename);
+ done:
+  free(profile);
+  run_state->profile = NULL;
+}
+
+/* Starts profiling, unless already started. The profile is written by
+ * write_profile(...) or at exit.
+ */
+static void start_profile(const char *filename) {
+  static char had_atexit;
+  if (run_state->profile) return;
+  if ((run_state->profile = calloc(1, sizeof(*run_state->profile))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for profile\n");
+    exit(252);
+  }
+  run_state->profile->filename = filename;
+  run_state->profile->start_sec = get_monotonic_sec();
+  if (!had_atexit) {
+    atexit(write_profile);  /* For exit(252) after fatal errors. */
+    had_atexit = 1;
+  }
+}
+
+/* --- Sampling of the guest CS:IP (--sample-hz=<n>).
+ *
+ * An ITIMER_PROF timer sends SIGPROF <n> times per second of CPU time. If
+ * it arrives during KVM_RUN, KVM_RUN fails with EINTR, otherwise the signal
+ * handler sets immediate_exit, so that the next KVM_RUN fails with EINTR
+ * without running the guest. (The latter samples are attributed to the host,
+ * as a [kvikdos] frame on top of the guest stack.) At each such EINTR,
+ * run_dos_prog(...) records the linear address of CS:IP, and those of the
+ * return addresses found by walking the BP chain on the stack, as long as
+ * the instruction before them is a (near or far) call. At exit, the samples
+ * are aggregated and written as collapsed stacks (one `root;...;leaf count'
+ * line per stack, the input format of flamegraph.pl), with the addresses
+ * as hex numbers, or as `symbol+offset' if --sample-map=<file> (a linker
+ * .map file of the main DOS .exe program, e.g. by tlink /m) is specified.
+ */
+
+#define SAMPLE_DEPTH 16  /* Maximum number of frames in a sample. */
+#define SAMPLE_HOST 0x80000000U  /* Flag in Sample.depth. */
+
+typedef struct Sample {
+  unsigned depth;  /* Number of entries used in addrs, maybe | SAMPLE_HOST. */
+  unsigned addrs[SAMPLE_DEPTH];  /* Linear addresses, leaf first. Unused entries are 0. */
+} Sample;
+
+typedef struct SampleSymbol {
+  unsigned addr;  /* Linear address. */
+  char name[60];
+} SampleSymbol;
+
+typedef struct SampleState {
+  const char *filename, *map_filename;
+  Sample *samples;
+  unsigned long sample_count, sample_capacity;
+} SampleState;
+
+static struct kvm_run *volatile sample_kvm_run;  /* Of the running vCPU, or NULL. */
+static volatile sig_atomic_t is_in_kvm_run, is_sample_in_host;
+
+static void handle_sigprof(int signum) {
+  struct kvm_run * const run = sample_kvm_run;
+  (void)signum;
+  if (run) {
+    if (!is_in_kvm_run) is_sample_in_host = 1;
+    run->immediate_exit = 1;
+  }
+}
+
+/* Returns true iff there is a call instruction (far iff is_far) in mem
+ * just before linear address addr (return address).
+ */
+static char is_call_before(const unsigned char *mem, unsigned addr, char is_far) {
+  unsigned size;
+  if (addr < 5 || addr > DOS_MEM_LIMIT) return 0;
+  if (mem[addr - (is_far ? 5 : 3)] == (is_far ? 0x9a : 0xe8)) return 1;  /* call ptr16:16 or call rel16. */
+  for (size = 2; size <= 4; ++size) {  /* call with ModRM: FF /2 (near) or FF /3 (far). */
+    const unsigned char modrm = mem[addr - size + 1];
+    if (mem[addr - size] == 0xff && (modrm >> 3 & 7) == (is_far ? 3U : 2U) &&
+        size == ((modrm >> 6) == 3 ? 2 : (modrm >> 6) == 1 ? 3 : (modrm >> 6) == 2 || (modrm & 0xc7) == 6 ? 4 : 2)) return 1;
+  }
+  return 0;
+}
+
+static void record_sample(const unsigned char *mem, const struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  SampleState * const sampler = run_state->sampler;
+  Sample *sample;
+  unsigned cs = sregs->cs.selector, bp = (unsigned short)regs->rbp, depth = 0, frame;
+  const unsigned ss_base = (unsigned)sregs->ss.selector << 4;
+  if (sampler->sample_count == sampler->sample_capacity) {
+    sampler->sample_capacity = sampler->sample_capacity ? sampler->sample_capacity << 1 : 1024;
+    if ((sample = realloc(sampler->samples, sampler->sample_capacity * sizeof(Sample))) == NULL) {
+      fprintf(stderr, "fatal: out of memory for samples\n");
+      exit(252);
+    }
+    sampler->samples = sample;
+  }
+  sample = sampler->samples + sampler->sample_count++;
+  memset(sample, '\0', sizeof(*sample));
+  sample->addrs[depth++] = (cs << 4) + (unsigned short)regs->rip;
+  while (depth < SAMPLE_DEPTH && (frame = ss_base + bp) + 6 <= DOS_MEM_LIMIT) {
+    const unsigned next_bp = *(const unsigned short*)(mem + frame);
+    const unsigned ret_ip = *(const unsigned short*)(mem + frame + 2);
+    const unsigned ret_cs = *(const unsigned short*)(mem + frame + 4);
+    if (is_call_before(mem, (cs << 4) + ret_ip, 0)) {
+    } else if (is_call_before(mem, (ret_cs << 4) + ret_ip, 1)) {
+      cs = ret_cs;
+    } else {
+      break;
+    }
+    sample->addrs[depth++] = (cs << 4) + ret_ip;
+    if (next_bp <= bp) break;  /* The BP chain must go up the stack. */
+    bp = next_bp;
+  }
+  sample->depth = depth | (is_sample_in_host ? SAMPLE_HOST : 0);
+  is_sample_in_host = 0;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(Sample));
+}
+
+static int compare_sample_symbols(const void *a, const void *b) {
+  const unsigned aa = ((const SampleSymbol*)a)->addr, ba = ((const SampleSymbol*)b)->addr;
+  return aa < ba ? -1 : aa > ba ? 1 : 0;
+}
+
+/* Reads the public symbols from the linker .map file (lines like
+ * ` 0000:0123       _main') of the main DOS .exe program, loaded at
+ * PSP_PARA + 0x10. Returns the symbols sorted by address, and sets
+ * *count_out.
+ */
+static SampleSymbol *read_sample_map(const char *filename, unsigned *count_out) {
+  FILE *f;
+  char line[256], name[sizeof(((SampleSymbol*)0)->name)], name2[sizeof(name)];
+  unsigned seg, ofs, count = 0, capacity = 0;
+  SampleSymbol *symbols = NULL, *ss;
+  int field_count;
+  if ((f = fopen(filename, "r")) == NULL) {
+    fprintf(stderr, "fatal: cannot open sample map file: %s: %s\n", filename, strerror(errno));
+    exit(252);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if ((field_count = sscanf(line, " %x:%x %59s %59s", &seg, &ofs, name, name2)) < 3) continue;
+    if (field_count == 4) {
+      if (strcmp(name, "Abs") == 0) continue;  /* Absolute symbol, not an address. */
+      strcpy(name, name2);  /* E.g. `Idle' or `Res' before the name. */
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity << 1 : 256;
+      if ((ss = realloc(symbols, capacity * sizeof(SampleSymbol))) == NULL) {
+        fprintf(stderr, "fatal: out of memory for sample map\n");
+        exit(252);
+      }
+      symbols = ss;
+    }
+    symbols[count].addr = ((PSP_PARA + 0x10 + seg) << 4) + ofs;
+    strcpy(symbols[count++].name, name);
+  }
+  fclose(f);
+  qsort(symbols, count, sizeof(SampleSymbol), compare_sample_symbols);
+  *count_out = count;
+  return symbols;
+}
+
+/* Writes the samples to sampler->filename, and stops sampling. */
+static void write_samples(void) {
+  static const struct itimerval itv_zero;
+  SampleState * const sampler = run_state ? run_state->sampler : NULL;  /* run_state is NULL after kvikdos_vm_destroy(...). */
+  FILE *f;
+  const Sample *sample, *sample_end, *sample2;
+  SampleSymbol *symbols = NULL;
+  unsigned symbol_count = 0, u, lo, hi;
+  if (!sampler) return;
+  setitimer(ITIMER_PROF, &itv_zero, NULL);
+  sample_kvm_run = NULL;
+  if (sampler->map_filename) symbols = read_sample_map(sampler->map_filename, &symbol_count);
+  if ((f = fopen(sampler->filename, "w")) == NULL) {
+    fprintf(stderr, "error: cannot open sample file: %s: %s\n", sampler->filename, strerror(errno));
+    goto done;
+  }
+  qsort(sampler->samples, sampler->sample_count, sizeof(Sample), compare_samples);
+  for (sample = sampler->samples, sample_end = sample + sampler->sample_count; sample != sample_end; sample = sample2) {
+    for (sample2 = sample + 1; sample2 != sample_end && memcmp(sample, sample2, sizeof(Sample)) == 0; ++sample2) {}
+    for (u = sample->depth & ~SAMPLE_HOST; u-- > 0;) {
+      const unsigned addr = sample->addrs[u];
+      for (lo = 0, hi = symbol_count; lo < hi;) {  /* Find the last symbol with .addr <= addr. */
+        const unsigned mid = (lo + hi) >> 1;
+        if (symbols[mid].addr <= addr) { lo = mid + 1; } else { hi = mid; }
+      }
+      if (lo > 0) {
+        fprintf(f, "%s+0x%x", symbols[lo - 1].name, addr - symbols[lo - 1].addr);
+      } else {
+        fprintf(f, "0x%05x", addr);
+      }
+      if (u > 0) putc(';', f);
+    }
+    fprintf(f, "%s %lu\n", sample->depth & SAMPLE_HOST ? ";[kvikdos]" : "", (unsigned long)(sample2 - sample));
+  }
+  if (ferror(f) | fclose(f)) fprintf(stderr, "error: cannot write sample file: %s\n", sampler->filename);
+ done:
+  free(symbols);
+  free(sampler->samples);
+  free(sampler);
+  run_state->sampler = NULL;
+}
+
+static void start_sampling(unsigned hz, const char *filename, const char *map_filename) {
+  static char had_atexit;
+  struct sigaction sa;
+  struct itimerval itv;
+  if (run_state->sampler) return;
+  if ((run_state->sampler = calloc(1, sizeof(*run_state->sampler))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for samples\n");
+    exit(252);
+  }
+  run_state->sampler->filename = filename;
+  run_state->sampler->map_filename = map_filename;
+  memset(&sa, '\0', sizeof(sa));
+  sa.sa_handler = handle_sigprof;
+  sa.sa_flags = SA_RESTART;  /* Only KVM_RUN should fail with EINTR. */
+  sigemptyset(&sa.sa_mask);
+  itv.it_interval.tv_sec = 0;
+  itv.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+  itv.it_value = itv.it_interval;
+  if (sigaction(SIGPROF, &sa, NULL) != 0 || setitimer(ITIMER_PROF, &itv, NULL) != 0) {
+    perror("fatal: setitimer");
+    exit(252);
+  }
+  if (!had_atexit) {
+    atexit(write_samples);  /* For exit(252) after fatal errors. */
+    had_atexit = 1;
+  }
+}
+
+/* --- XMS (eXtended Memory Specification) 3.0 driver.
+ *
+ * With --mem-mb=<n> (n >= 2), n MiB of guest memory is mapped: the
+ * conventional memory as usual, nothing between DOS_MEM_LIMIT and 1 MiB
+ * (so that the BIOS ROM reads etc. in KVM_EXIT_MMIO keep working), the
+ * high memory area (HMA) and the extended memory blocks (EMBs) above it.
+ * A20 is always enabled, KVM doesn't wrap addresses at 1 MiB. The driver
+ * entry point (returned by int 0x2f ax == 0x4310) is the far-callable XMS
+ * stub in int_stub_code, which calls the hlt of int 0x2f, and then
+ * handle_xms_call(...) does the work on the host: an EMB move is a single
+ * memmove(...) between the two guest regions.
+ */
+
+#define XMS_HANDLE_COUNT 64
+
+typedef struct XmsBlock {
+  unsigned start;  /* Linear address. */
+  unsigned size_kb;
+  unsigned char lock_count;
+  char is_used;
+} XmsBlock;
+
+/* Shared by the DOS program and its nested exec children. */
+typedef struct XmsState {
+  char is_hma_allocated;
+  char is_mem_clean;  /* Have the HMA and the EMBs been zeroed since the start of the first DOS program? */
+  XmsBlock blocks[XMS_HANDLE_COUNT];  /* The block of handle h is blocks[h - 1]. */
+} XmsState;
+
+static void init_xms(XmsState *xms) {
+  memset(xms, '\0', sizeof(*xms));
+}
+
+/* Returns the first-fit start address for size bytes, or 0 if there is no room. Ignores the block `ignored'. */
+static unsigned find_xms_gap(const XmsState *xms, unsigned mem_size, unsigned size, const XmsBlock *ignored) {
+  unsigned start = XMS_START;
+  const XmsBlock *b;
+  char is_moved;
+  do {
+    is_moved = 0;
+    for (b = xms->blocks; b != xms->blocks + XMS_HANDLE_COUNT; ++b) {
+      if (b->is_used && b != ignored && b->size_kb != 0 && b->start < start + size && start < b->start + (b->size_kb << 10)) {
+        start = b->start + (b->size_kb << 10);
+        is_moved = 1;
+      }
+    }
+  } while (is_moved);
+  return start <= mem_size && size <= mem_size - start ? start : 0;
+}
+
+/* Returns the total free extended memory in KiB, and sets *largest_kb_out to the size of the largest free block. */
+static unsigned get_xms_free_kb(const XmsState *xms, unsigned mem_size, unsigned *largest_kb_out) {
+  unsigned start = XMS_START, total_kb = 0, largest_kb = 0, end, gap_kb;
+  const XmsBlock *b, *next;
+  for (;;) {  /* Iterate over the gaps between the used blocks, in increasing address order. */
+    next = NULL;
+    for (b = xms->blocks; b != xms->blocks + XMS_HANDLE_COUNT; ++b) {
+      if (b->is_used && b->size_kb != 0 && b->start >= start && (!next || b->start < next->start)) next = b;
+    }
+    end = next ? next->start : mem_size;
+    gap_kb = (end - start) >> 10;
+    total_kb += gap_kb;
+    if (gap_kb > largest_kb) largest_kb = gap_kb;
+    if (!next) break;
+    start = next->start + (next->size_kb << 10);
+  }
+  *largest_kb_out = largest_kb;
+  return total_kb;
+}
+
+/* Returns the XmsBlock of an allocated handle, or NULL. */
+static XmsBlock *get_xms_block(XmsState *xms, unsigned handle) {
+  XmsBlock * const b = xms->blocks + (handle - 1);
+  return handle - 1 < XMS_HANDLE_COUNT && b->is_used ? b : NULL;
+}
+
+/* Returns the host pointer for an EMB move source or destination, or NULL if out of bounds. */
+static char *get_xms_move_ptr(XmsState *xms, char *mem, unsigned mem_size, unsigned handle, unsigned offset, unsigned length, char is_dst) {
+  if (handle == 0) {  /* Conventional memory or HMA, offset is segment:offset. */
+    const unsigned linear = (offset >> 16 << 4) + (offset & 0xffff);
+    if (linear + length <= DOS_MEM_LIMIT && length <= DOS_MEM_LIMIT) {
+      if (is_dst && linear < (ENV_PARA << 4)) return NULL;  /* Don't let the program overwrite the magic interrupt table and our stubs. */
+      return mem + linear;
+    }
+    if (mem_size > DOS_MEM_LIMIT && linear >= HMA_START && linear + length <= HMA_START + HMA_SIZE && length <= HMA_SIZE) return mem + linear;
+    return NULL;
+  } else {
+    const XmsBlock * const b = get_xms_block(xms, handle);
+    if (!b || offset > b->size_kb << 10 || length > (b->size_kb << 10) - offset) return NULL;
+    return mem + b->start + offset;
+  }
+}
+
+/* Zeroes the HMA and the EMBs, once. mem_backing is MEM_BACKING_..., like in reset_emu(...). */
+static void clear_xms_mem(XmsState *xms, char *mem, unsigned mem_size, char mem_backing) {
+  if (!xms->is_mem_clean) {
+    if (mem_backing != MEM_BACKING_LAZY) {
+      memset(mem + HMA_START, '\0', mem_size - HMA_START);  /* Keep the pages (and the hugepages) mapped, the program is going to use them. */
+    } else if (madvise(mem + HMA_START, mem_size - HMA_START, MADV_DONTNEED) != 0) {
+      perror("fatal: madvise MADV_DONTNEED for XMS");
+      exit(252);
+    }
+    xms->is_mem_clean = 1;
+  }
+}
+
+/* Handles a call to the XMS driver entry point. The function number is in ah.
+ * http://www.phatcode.net/res/219/files/xms30.txt
+ */
+static void handle_xms_call(XmsState *xms, char *mem, unsigned mem_size, char mem_backing, struct kvm_regs *regs, const struct kvm_sregs *sregs) {
+  const unsigned char ah = ((unsigned)regs->rax >> 8) & 0xff;
+  unsigned char error;
+  XmsBlock *b;
+  if (DEBUG) fprintf(stderr, "debug: XMS call ah:%02x dx:%04x\n", ah, *(unsigned short*)&regs->rdx);
+  if (ah == 0x00) {  /* Get XMS version number. */
+    *(unsigned short*)&regs->rax = 0x300;  /* XMS 3.00. */
+    *(unsigned short*)&regs->rbx = 0x100;  /* Driver revision. */
+    *(unsigned short*)&regs->rdx = 1;  /* HMA exists. */
+    return;
+  } else if (ah == 0x01) {  /* Request HMA. */
+    if (xms->is_hma_allocated) { error = 0x91; goto error; }  /* HMA is already in use. */
+    clear_xms_mem(xms, mem, mem_size, mem_backing);
+    xms->is_hma_allocated = 1;
+  } else if (ah == 0x02) {  /* Release HMA. */
+    if (!xms->is_hma_allocated) { error = 0x93; goto error; }  /* HMA was not allocated. */
+    xms->is_hma_allocated = 0;
+  } else if (ah == 0x03 || ah == 0x05) {  /* Global or local enable A20. */
+  } else if (ah == 0x04 || ah == 0x06) {  /* Global or local disable A20. */
+    error = 0x94; goto error;  /* A20 line still enabled. */
+  } else if (ah == 0x07) {  /* Query A20. */
+    *(unsigned short*)&regs->rax = 1;  /* Enabled. */
+    *(unsigned char*)&regs->rbx = 0;
+    return;
+  } else if (ah == 0x08 || ah == 0x88) {  /* Query free extended memory. */
+    unsigned largest_kb;
+    const unsigned total_kb = get_xms_free_kb(xms, mem_size, &largest_kb);
+    if (ah == 0x88) {
+      *(unsigned*)&regs->rax = largest_kb;
+      *(unsigned*)&regs->rcx = mem_size - 1;  /* Highest ending address of any memory block. */
+      *(unsigned*)&regs->rdx = total_kb;
+    } else {
+      *(unsigned short*)&regs->rax = largest_kb > 0xffff ? 0xffff : largest_kb;
+      *(unsigned short*)&regs->rdx = total_kb > 0xffff ? 0xffff : total_kb;
+    }
+    *(unsigned char*)&regs->rbx = largest_kb == 0 ? 0xa0 : 0;  /* 0xa0: All extended memory is allocated. */
+    return;
+  } else if (ah == 0x09 || ah == 0x89) {  /* Allocate extended memory block. */
+    const unsigned size_kb = ah == 0x89 ? *(unsigned*)&regs->rdx : *(unsigned short*)&regs->rdx;
+    unsigned start;
+    for (b = xms->blocks; b != xms->blocks + XMS_HANDLE_COUNT && b->is_used; ++b) {}
+    if (b == xms->blocks + XMS_HANDLE_COUNT) { error = 0xa1; goto error; }  /* All handles are in use. */
+    if (size_kb > (mem_size - XMS_START) >> 10 || (start = find_xms_gap(xms, mem_size, size_kb << 10, NULL)) == 0) { error = 0xa0; goto error; }  /* All extended memory is allocated. */
+    clear_xms_mem(xms, mem, mem_size, mem_backing);
+    b->start = start;
+    b->size_kb = size_kb;
+    b->lock_count = 0;
+    b->is_used = 1;
+    *(unsigned short*)&regs->rdx = b - xms->blocks + 1;  /* Handle. */
+  } else if (ah == 0x0a) {  /* Free extended memory block. */
+    if ((b = get_xms_block(xms, *(unsigned short*)&regs->rdx)) == NULL) { error = 0xa2; goto error; }  /* Invalid handle. */
+    if (b->lock_count) { error = 0xab; goto error; }  /* Block is locked. */
+    b->is_used = 0;
+  } else if (ah == 0x0b) {  /* Move extended memory block. */
+    const unsigned linear = ((unsigned)sregs->ds.selector << 4) + *(unsigned short*)&regs->rsi;
+    const char *p;
+    unsigned length;
+    char *src, *dst;
+    if (linear + 16 > DOS_MEM_LIMIT) { error = 0xa7; goto error; }  /* Invalid length. */
+    p = mem + linear;
+    length = *(const unsigned*)p;
+    if (length & 1) { error = 0xa7; goto error; }  /* Invalid length. */
+    if (*(const unsigned short*)(p + 4) != 0 && !get_xms_block(xms, *(const unsigned short*)(p + 4))) { error = 0xa3; goto error; }  /* Invalid source handle. */
+    if ((src = get_xms_move_ptr(xms, mem, mem_size, *(const unsigned short*)(p + 4), *(const unsigned*)(p + 6), length, 0)) == NULL) { error = 0xa4; goto error; }  /* Invalid source offset. */
+    if (*(const unsigned short*)(p + 10) != 0 && !get_xms_block(xms, *(const unsigned short*)(p + 10))) { error = 0xa5; goto error; }  /* Invalid destination handle. */
+    if ((dst = get_xms_move_ptr(xms, mem, mem_size, *(const unsigned short*)(p + 10), *(const unsigned*)(p + 12), length, 1)) == NULL) { error = 0xa6; goto error; }  /* Invalid destination offset. */
+    memmove(dst, src, length);
+  } else if (ah == 0x0c) {  /* Lock extended memory block. */
+    if ((b = get_xms_block(xms, *(unsigned short*)&regs->rdx)) == NULL) { error = 0xa2; goto error; }  /* Invalid handle. */
+    if (b->lock_count == 0xff) { error = 0xac; goto error; }  /* Lock count overflow. */
+    ++b->lock_count;
+    *(unsigned short*)&regs->rdx = b->start >> 16;
+    *(unsigned short*)&regs->rbx = b->start;  /* DX:BX is the 32-bit linear address. */
+  } else if (ah == 0x0d) {  /* Unlock extended memory block. */
+    if ((b = get_xms_block(xms, *(unsigned short*)&regs->rdx)) == NULL) { error = 0xa2; goto error; }  /* Invalid handle. */
+    if (b->lock_count == 0) { error = 0xaa; goto error; }  /* Block is not locked. */
+    --b->lock_count;
+  } else if (ah == 0x0e || ah == 0x8e) {  /* Get EMB handle information. */
+    unsigned free_handle_count = 0;
+    const XmsBlock *b2;
+    if ((b = get_xms_block(xms, *(unsigned short*)&regs->rdx)) == NULL) { error = 0xa2; goto error; }  /* Invalid handle. */
+    for (b2 = xms->blocks; b2 != xms->blocks + XMS_HANDLE_COUNT; ++b2) {
+      if (!b2->is_used) ++free_handle_count;
+    }
+    ((unsigned char*)&regs->rbx)[1] = b->lock_count;  /* BH. */
+    if (ah == 0x8e) {
+      *(unsigned short*)&regs->rcx = free_handle_count;
+      *(unsigned*)&regs->rdx = b->size_kb;
+    } else {
+      *(unsigned char*)&regs->rbx = free_handle_count;
+      *(unsigned short*)&regs->rdx = b->size_kb > 0xffff ? 0xffff : b->size_kb;
+    }
+  } else if (ah == 0x0f || ah == 0x8f) {  /* Reallocate extended memory block. */
+    const unsigned size_kb = ah == 0x8f ? *(unsigned*)&regs->rbx : *(unsigned short*)&regs->rbx;
+    unsigned start;
+    if ((b = get_xms_block(xms, *(unsigned short*)&regs->rdx)) == NULL) { error = 0xa2; goto error; }  /* Invalid handle. */
+    if (b->lock_count) { error = 0xab; goto error; }  /* Block is locked. */
+    if (size_kb > (mem_size - XMS_START) >> 10 || (start = find_xms_gap(xms, mem_size, size_kb << 10, b)) == 0) { error = 0xa0; goto error; }  /* All extended memory is allocated. */
+    if (start != b->start) memmove(mem + start, mem + b->start, (size_kb < b->size_kb ? size_kb : b->size_kb) << 10);  /* The block is unlocked, so it can be moved. */
+    b->start = start;
+    b->size_kb = size_kb;
+  } else {  /* 0x10, 0x11 and 0x12 are UMB functions, and we don't have UMBs. */
+    error = 0x80; goto error;  /* Function not implemented. */
+  }
+  *(unsigned short*)&regs->rax = 1;  /* Success. */
+  return;
+ error:
+  if (DEBUG) fprintf(stderr, "debug: XMS call ah:%02x error:%02x\n", ah, error);
+  *(unsigned short*)&regs->rax = 0;  /* Failure. */
+  *(unsigned char*)&regs->rbx = error;
+}
+
+/* --- Nested exec (int 0x21 ah == 0x4b with al == 0).
+ *
+ * A DOS program (e.g. a compiler driver) can run a child program, and it
+ * continues running after the child exits, getting the exit code of the
+ * child by int 0x21 ah == 0x4d. kvikdos runs the child in the same VM, like
+ * DOS: it allocates an environment block and (the largest free) program
+ * block from the free memory of the parent, both owned by the PSP of the
+ * child, which is at the start of the program block and points to the PSP
+ * of the parent. It saves the CPU registers and the DOS state of the
+ * parent to an ExecFrame on the host, and it restores them when the child
+ * exits. Memory is not saved, so the parent has to shrink its own block
+ * first (int 0x21 ah == 0x4a), as in DOS. When the child exits, its memory
+ * blocks are freed, and the Linux fds opened by it are closed, like DOS
+ * does. Program snapshots are used only for the main program.
+ */
+
+#define EXEC_FRAME_LIMIT 128  /* Maximum nesting depth of exec. The command tail shrinks in a recursive exec. */
+#define EXEC_FD_LIMIT 256  /* Only the Linux fds below this are tracked for closing. */
+
+typedef struct ExecFrame {
+  struct ExecFrame *parent;
+  struct kvm_regs regs;  /* Of the parent, after returning from int 0x21. */
+  struct kvm_sregs sregs;
+  unsigned short psp_para, env_para;  /* Of the parent. */
+  unsigned env_limit;
+  unsigned dta_seg_ofs;
+  unsigned malloc_strategy;
+  unsigned short last_dos_error_code;
+  char had_get_ints, had_get_first_mcb, ctrl_break_checking;
+  unsigned char sphinx_cmm_flags;
+  unsigned char fd_bits[EXEC_FD_LIMIT >> 3];  /* Linux fds open in the parent. */
+  char prog_filename[LINUX_PATH_SIZE];
+  char dos_prog_abs[DOS_PATH_SIZE];
+} ExecFrame;
+
+/* Returns the minimum size of the memory block (in paragraphs, including
+ * the PSP) needed to load the DOS program with the header detected by
+ * detect_dos_executable_program(...).
+ */
+static unsigned get_dos_program_min_para(const char *header, int header_size) {
+  if (header_size >= 24 && (('M' | 'Z' << 8) == ((unsigned short*)header)[EXE_SIGNATURE] || ('M' << 8 | 'Z') == ((unsigned short*)header)[EXE_SIGNATURE])) {
+    const unsigned short * const exehdr = (const unsigned short*)header;
+    return ((exehdr[EXE_NBLOCKS] & 0x7ff) << 5) - exehdr[EXE_HDRSIZE] + exehdr[EXE_MINALLOC] + 0x10;  /* Same as memsize_min_para in load_dos_executable_program(...). */
+  }
+  return COM_MIN_PARA;
+}
+
+/* Finds the largest free memory block in the MCB chain, also considering
+ * the unallocated area after the last block. Returns its block_para (or 0
+ * if there is no free memory or the MCB chain is bad), and sets
+ * *size_para_out and *last_block_para_out (the last block in the chain).
+ */
+static unsigned find_largest_free_dos_block(void *mem, unsigned *size_para_out, unsigned *last_block_para_out) {
+  unsigned block_para = PSP_PARA, result = 0;
+  *size_para_out = 0;
+  for (;;) {
+    const char * const mcb = (const char*)mem + (block_para << 4) - 16;
+    if (is_mcb_bad(mem, block_para)) return 0;
+    if (MCB_PID(mcb) == 0 && MCB_SIZE_PARA(mcb) > *size_para_out) {
+      result = block_para;
+      *size_para_out = MCB_SIZE_PARA(mcb);
+    }
+    if (MCB_TYPE(mcb) == 'Z') break;
+    block_para += 1 + MCB_SIZE_PARA(mcb);
+  }
+  *last_block_para_out = block_para;
+  block_para += 1 + MCB_SIZE_PARA((const char*)mem + (block_para << 4) - 16);  /* The unallocated area. */
+  if (block_para < DOS_ALLOC_PARA_LIMIT && DOS_ALLOC_PARA_LIMIT - block_para > *size_para_out) {
+    result = block_para;
+    *size_para_out = DOS_ALLOC_PARA_LIMIT - block_para;
+  }
+  return result;
+}
+
+/* Allocates a memory block of (at least) size_para paragraphs for pid, at
+ * the beginning of the free block (or unallocated area) block_para, as
+ * returned by find_largest_free_dos_block(...) together with
+ * last_block_para. Returns the last block after the allocation.
+ */
+static unsigned alloc_dos_block_at(void *mem, unsigned block_para, unsigned size_para, unsigned short pid, unsigned last_block_para) {
+  char * const mcb = (char*)mem + (block_para << 4) - 16;
+  if (block_para > last_block_para) {  /* Append after the last block. */
+    char * const last_mcb = (char*)mem + (last_block_para << 4) - 16;
+    memcpy(mcb, default_program_mcb, 16);  /* 'Z' (last). */
+    MCB_SIZE_PARA(mcb) = size_para;
+    MCB_PSIZE_PARA(mcb) = MCB_SIZE_PARA(last_mcb);
+    MCB_TYPE(last_mcb) = 'M';
+    last_block_para = block_para;
+  } else if (MCB_SIZE_PARA(mcb) > size_para + 1) {  /* Not an exact fit, append a free block. */
+    char * const free_mcb = mcb + 16 + (size_para << 4);
+    char * const next_mcb = mcb + 16 + (MCB_SIZE_PARA(mcb) << 4);  /* Exists, because a free block is never the last. */
+    memcpy(free_mcb, default_program_mcb, 16);
+    MCB_TYPE(free_mcb) = 'M';
+    MCB_PID(free_mcb) = 0;
+    MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) - size_para - 1;
+    MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = size_para;
+  }  /* Otherwise use the entire free block, a free block must not be empty. */
+  MCB_PID(mcb) = pid;
+  run_state->mcb_index->is_valid = 0;  /* Rebuild it in the next malloc(). */
+  return last_block_para;
+}
+
+/* Shrinks the memory block block_para to new_size_para paragraphs, making
+ * the rest free (unless it would be too small for a free block).
+ */
+static void shrink_dos_block(void *mem, unsigned block_para, unsigned new_size_para) {
+  char * const mcb = (char*)mem + (block_para << 4) - 16;
+  const unsigned old_size_para = MCB_SIZE_PARA(mcb);
+  if (new_size_para >= old_size_para) return;
+  if (MCB_TYPE(mcb) == 'Z') {
+    MCB_SIZE_PARA(mcb) = new_size_para;  /* The rest becomes part of the unallocated area. */
+  } else if (old_size_para - new_size_para >= 2) {  /* The next block is in use, because free blocks are never adjacent. */
+    char * const free_mcb = mcb + 16 + (new_size_para << 4);
+    memcpy(free_mcb, default_program_mcb, 16);
+    MCB_TYPE(free_mcb) = 'M';
+    MCB_PID(free_mcb) = 0;
+    MCB_SIZE_PARA(free_mcb) = MCB_PSIZE_PARA(mcb + 16 + (old_size_para << 4)) = old_size_para - new_size_para - 1;
+    MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = new_size_para;
+  }
+  run_state->mcb_index->is_valid = 0;
+}
+
+/* Frees all memory blocks owned by pid, merging adjacent free blocks, and
+ * moving a free block at the end to the unallocated area. Does nothing if
+ * the MCB chain is bad.
+ */
+static void free_dos_blocks(void *mem, unsigned short pid) {
+  unsigned block_para;
+  for (block_para = PSP_PARA;;) {  /* Check the chain first, the loop below assumes it's good. */
+    const char * const mcb = (const char*)mem + (block_para << 4) - 16;
+    if (is_mcb_bad(mem, block_para)) return;
+    if (MCB_TYPE(mcb) == 'Z') break;
+    block_para += 1 + MCB_SIZE_PARA(mcb);
+  }
+  for (block_para = PSP_PARA;;) {
+    char *mcb = (char*)mem + (block_para << 4) - 16;
+    if (MCB_PID(mcb) == pid) MCB_PID(mcb) = 0;  /* Never the first block, it's owned by PROCESS_ID. */
+    if (MCB_PID(mcb) == 0) {
+      char * const prev_mcb = mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4);
+      if (MCB_PID(prev_mcb) == 0) {  /* Merge it with the preceding free block. */
+        MCB_SIZE_PARA(prev_mcb) += 1 + MCB_SIZE_PARA(mcb);
+        MCB_TYPE(prev_mcb) = MCB_TYPE(mcb);
+        if (MCB_TYPE(mcb) != 'Z') MCB_PSIZE_PARA(mcb + 16 + (MCB_SIZE_PARA(mcb) << 4)) = MCB_SIZE_PARA(prev_mcb);
+        block_para -= 1 + MCB_PSIZE_PARA(mcb);
+        memcpy(mcb, freed_mcb, 16);
+        mcb = prev_mcb;
+      }
+      if (MCB_TYPE(mcb) == 'Z') {  /* The last block must not be free. */
+        MCB_TYPE(mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4)) = 'Z';
+        memcpy(mcb, freed_mcb, 16);
+        break;
+      }
+    }
+    if (MCB_TYPE(mcb) == 'Z') break;
+    block_para += 1 + MCB_SIZE_PARA(mcb);
+  }
+  run_state->mcb_index->is_valid = 0;
+}
+
+/* Sets bits in fd_bits for the Linux fds (from 5) open in the parent. */
+static void get_open_fd_bits(unsigned char *fd_bits) {
+  int fd;
+  memset(fd_bits, '\0', EXEC_FD_LIMIT >> 3);
+  for (fd = 5; fd < EXEC_FD_LIMIT; ++fd) {
+    if (fcntl(fd, F_GETFD) >= 0) fd_bits[fd >> 3] |= 1 << (fd & 7);
+  }
+}
+
+/* Closes the Linux fds opened by the child, i.e. not in fd_bits. */
+static void close_child_fds(const unsigned char *fd_bits, const struct kvm_fds *kvm_fds) {
+  int fd;
+  for (fd = 5; fd < EXEC_FD_LIMIT; ++fd) {
+    if (!(fd_bits[fd >> 3] & (1 << (fd & 7))) && fcntl(fd, F_GETFD) >= 0 &&
+        fd != kvm_fds->kvm_fd && fd != kvm_fds->vm_fd && fd != kvm_fds->vcpu_fd && !is_hidden_fd(fd)) {
+      run_state->handle_nocache_bits[fd >> 3] &= ~(1 << (fd & 7));
+      run_state->handle_error_bits[fd >> 3] &= ~(1 << (fd & 7));  /* Nobody to report it to. */
+      stamp_written_file(fd);
+      close(fd);
+    }
+  }
+}
+
+/* --- Timings of the startup phases and the runtime (--timings).
+ *
+ * Each DOS program run (the main program, each DOS exec(...) child and each
+ * line of a batch file) gets its own section, and at its exit a
+ * `timings: exec=...' line is written to stderr, with the wall time
+ * (CLOCK_MONOTONIC) of its phases in milliseconds: find_prog (searching
+ * %PATH% for a batch file line), reset_emu (creating the KVM VM and vCPU
+ * (vm=new) or resetting a warm one (vm=warm)), load (detecting and loading
+ * the program, or its snapshot (snapshot=1), and the command tail), env
+ * (the environment), to_first_run (from the start of the section to the
+ * first KVM_RUN), guest (in KVM_RUN), child (of the nested exec children)
+ * and host (the rest). At exit, a `timings: process' line follows, with
+ * parse_args (including find_prog) and teardown (from the exit of the DOS
+ * program). The cost is 2 clock_gettime(...) (vDSO) calls per KVM_RUN, so
+ * it's fine to use it in production.
+ */
+
+typedef struct TimingsExec {
+  unsigned index;  /* 1 for the first section. */
+  char is_vm_new, is_snapshot;
+  double start_sec, phase_sec;  /* phase_sec: Start of the current phase. */
+  double find_prog_sec, reset_emu_sec, load_sec, env_sec, to_first_run_sec, guest_sec, child_sec;
+  double run_start_sec;
+  unsigned long run_count;
+  char prog[DOS_PATH_SIZE];  /* DOS absolute pathname, or "?" before the environment is built. */
+} TimingsExec;
+
+typedef struct TimingsState {
+  double main_start_sec;  /* 0 if not started from main(...). */
+  double parse_args_sec, find_prog_sec, run_end_sec;
+  double pending_find_prog_sec;  /* Of the next section. */
+  unsigned exec_count;
+  unsigned depth;  /* Number of active sections in execs. */
+  TimingsExec execs[EXEC_FRAME_LIMIT + 1];
+} TimingsState;
+
+/* Starts a section at do_exec in run_dos_prog(...). */
+static void start_timings_exec(void) {
+  TimingsState * const timings = run_state->timings;
+  TimingsExec *te;
+  if (timings->depth > EXEC_FRAME_LIMIT) {  /* This shouldn't happen, run_dos_prog(...) checks the exec depth. */
+    fprintf(stderr, "assert: too many nested timings sections\n");
+    exit(252);
+  }
+  te = &timings->execs[timings->depth++];
+  memset(te, '\0', sizeof(*te));
+  te->index = ++timings->exec_count;
+  te->start_sec = te->phase_sec = get_monotonic_sec();
+  te->find_prog_sec = timings->pending_find_prog_sec;
+  timings->pending_find_prog_sec = 0;
+  strcpy(te->prog, "?");
+}
+
+/* Ends the current phase of the current section, and adds its time to *phase_sec. */
+static void end_timings_phase(double *phase_sec) {
+  TimingsExec * const te = &run_state->timings->execs[run_state->timings->depth - 1];
+  const double now = get_monotonic_sec();
+  *phase_sec += now - te->phase_sec;
+  te->phase_sec = now;
+}
+
+/* Called before KVM_RUN. */
+static void timings_run_start(void) {
+  TimingsExec * const te = &run_state->timings->execs[run_state->timings->depth - 1];
+  te->run_start_sec = get_monotonic_sec();
+  if (te->run_count == 0) te->to_first_run_sec = te->run_start_sec - te->start_sec;
+}
+
+/* Called after KVM_RUN. */
+static void timings_run_end(void) {
+  TimingsExec * const te = &run_state->timings->execs[run_state->timings->depth - 1];
+  te->guest_sec += get_monotonic_sec() - te->run_start_sec;
+  ++te->run_count;
+}
+
+/* Ends the current section, and writes its timings line to stderr. status is
+ * the exit code of the DOS program, or -1 for a fatal error.
+ */
+static void end_timings_exec(int status) {
+  TimingsState * const timings = run_state->timings;
+  TimingsExec * const te = &timings->execs[--timings->depth];
+  const double now = get_monotonic_sec();
+  const double total_sec = now - te->start_sec;
+  char status_buf[8];
+  if (status < 0) {
+    strcpy(status_buf, "fatal");
+  } else {
+    sprintf(status_buf, "%d", status);
+  }
+  fprintf(stderr, "timings: exec=%u depth=%u prog=%s vm=%s snapshot=%d exit=%s find_prog_ms=%.3f reset_emu_ms=%.3f load_ms=%.3f env_ms=%.3f to_first_run_ms=%.3f guest_ms=%.3f child_ms=%.3f host_ms=%.3f total_ms=%.3f kvm_runs=%lu\n",
+          te->index, timings->depth, te->prog, te->is_vm_new ? "new" : "warm", te->is_snapshot, status_buf,
+          te->find_prog_sec * 1e3, te->reset_emu_sec * 1e3, te->load_sec * 1e3, te->env_sec * 1e3, te->to_first_run_sec * 1e3, te->guest_sec * 1e3, te->child_sec * 1e3,
+          (total_sec - te->reset_emu_sec - te->load_sec - te->env_sec - te->guest_sec - te->child_sec) * 1e3, total_sec * 1e3, te->run_count);
+  if (timings->depth) timings->execs[timings->depth - 1].child_sec += total_sec;
+  timings->run_end_sec = now;
+}
+
+/* Writes the timings of the sections not ended (because of a fatal error)
+ * and the process, and stops timing.
+ */
+static void write_timings(void) {
+  TimingsState * const timings = run_state ? run_state->timings : NULL;  /* run_state is NULL after kvikdos_vm_destroy(...). */
+  if (!timings) return;
+  while (timings->depth) end_timings_exec(-1);
+  if (timings->main_start_sec) {
+    const double now = get_monotonic_sec();
+    fprintf(stderr, "timings: process execs=%u parse_args_ms=%.3f find_prog_ms=%.3f teardown_ms=%.3f total_ms=%.3f\n",
+            timings->exec_count, timings->parse_args_sec * 1e3, timings->find_prog_sec * 1e3,
+            timings->run_end_sec ? (now - timings->run_end_sec) * 1e3 : 0.0, (now - timings->main_start_sec) * 1e3);
+  }
+  fflush(stderr);
+  free(timings);
+  run_state->timings = NULL;
+}
+
+/* Starts timing, unless already started. The process line is written by
+ * write_timings(...) at exit.
+ */
+static void start_timings(void) {
+  static char had_atexit;
+  if (run_state->timings) return;
+  if ((run_state->timings = calloc(1, sizeof(*run_state->timings))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for timings\n");
+    exit(252);
+  }
+  if (!had_atexit) {
+    atexit(write_timings);  /* Also for exit(252) after fatal errors. */
+    had_atexit = 1;
+  }
+}
+
+/* --- DOS and BIOS services (int 0x21, int 0x10 etc.).
+ *
+ * Each service is implemented as a DosCallHandler function, found by
+ * indexing a table with the int number (int_call_handlers) and then with
+ * AH (e.g. dos_call_handlers for int 0x21), so the dispatch doesn't get
+ * slower with the number of services. Each handler gets the call context
+ * in a DosCallCtx, which also contains the DOS state of the program being
+ * run, shared with run_dos_prog(...). A handler returns 0 on success
+ * (with the results set in ctx->regs, usually with CF=0), a nonzero DOS
+ * error code (only for int 0x21, which dos_call(...) reports the same way
+ * for all services: CF=1, AX and the error code for ah == 0x59), or one of
+ * the DCR_... codes below, for the actions done by run_dos_prog(...).
+ */
+
+enum dos_call_result_t {
+  DCR_UNSUPPORTED = 0x1000,  /* Function not supported, report it to the program. */
+  DCR_EXIT,  /* Exit the program with the exit code in AL. */
+  DCR_EXEC,  /* Load the program prepared in the DosCallCtx. */
+  DCR_FATAL,  /* The handler has already reported the fatal error. */
+  DCR_FATAL_INT  /* Unsupported int call. */
+};
+
+enum malloc_strategy_t { MS_FIRST_FIT = 0, MS_BEST_FIT = 1, MS_LAST_FIT = 2 };
+
+typedef struct DosCallCtx {
+  struct kvm_regs *regs;
+  struct kvm_sregs *sregs;
+  char *mem;
+  EmuState *emu;  /* For emu->fnbuf. */
+  DirState *dir_state;
+  TtyState *tty_state;
+  const struct kvm_fds *kvm_fds;
+  XmsState *xms;
+  /* Of the int call being handled. */
+  const unsigned short *csip_ptr;  /* Return address and flags on the stack. */
+  unsigned short int_ip, int_cs;  /* Return address. */
+  /* Of the program being run (or loaded by exec). */
+  const char *prog_filename;
+  const char *args_str;
+  const char *dos_prog_abs;  /* Owned externally: either in args or in emu->dosfnbuf or (after exec) within mem. */
+  int img_fd;
+  char header[PROGRAM_HEADER_SIZE];
+  unsigned header_size;
+  ExecFrame *exec_frame;  /* Of the parent program, NULL if not running a child. */
+  unsigned exec_depth;
+  char is_exec_child;  /* Is do_exec loading a child to the blocks allocated at psp_para and env_para? */
+  unsigned short psp_para, env_para;  /* Of the current program. */
+  unsigned env_limit;  /* End of the environment block of the current program. */
+  unsigned short child_exit_code;  /* For int 0x21 ah == 0x4d. */
+  /* DOS state of the program being run, saved to the ExecFrame by exec. */
+  unsigned dta_seg_ofs;  /* Disk transfer address (DTA). */
+  unsigned malloc_strategy;
+  unsigned short last_dos_error_code;
+  char had_get_ints, had_get_first_mcb;
+  char ctrl_break_checking;  /* 0 or 1. Just a flag, doesn't have any use case. */
+  unsigned char sphinx_cmm_flags;
+  /* BIOS state. */
+  unsigned tick_count;
+  unsigned char video_write_step;
+  char video_byte_written;
+  char is_stdout_write_cursor;
+  unsigned ivt_shadow[0x100];  /* Interrupt vectors checked by set_int(...), see check_ivt_changes(...). */
+} DosCallCtx;
+
+typedef unsigned short (*DosCallHandler)(DosCallCtx *ctx);
+
+/* Returns the DOS error code of the failed Linux call in errno. */
+static unsigned short get_dos_call_linux_error(void) {
+  return get_dos_error_code(errno, 0x1f);  /* By default: General failure. */
+}
+
+/* Calls the handler in handlers[ah], or returns DCR_FATAL_INT if there
+ * isn't any.
+ */
+static unsigned short dispatch_int_call(DosCallCtx *ctx, const DosCallHandler *handlers, unsigned handler_count) {
+  const unsigned ah = ((unsigned)ctx->regs->rax >> 8) & 0xff;
+  return ah < handler_count && handlers[ah] ? handlers[ah](ctx) : DCR_FATAL_INT;
+}
+
+/* Reports an unsupported int call (for the BIOS services selected by AX). */
+static unsigned short report_unsupported_int_ax(unsigned char int_num, const struct kvm_regs *regs) {
+  fprintf(stderr, "fatal: unsupported int 0x%02x ax:%04x\n", int_num, *(const unsigned short*)&regs->rax);
+  return DCR_FATAL_INT;
+}
+
+/* Writes to stdout of the DOS program, also tracking the cursor column
+ * (for int 0x10 ah == 0x03) after the program has used the cursor.
+ */
+static void write_dos_stdout(DosCallCtx *ctx, const char *p, unsigned size) {
+  if (ctx->is_stdout_write_cursor) {
+    const char *q = p, * const q_end = p + size;
+    unsigned short *cursor = (unsigned short*)(ctx->mem + 0x450) + 0 /* page */;  /* DH := row (0..24); DL := column (0..79). Both 0 by default. */
+    if (*cursor <= 0xff) {
+      while (q != q_end) {
+        const char c = *q++;
+        if (c - 32U <= 126U - 32U && *cursor < 0xff) {  /* Printable ASCII. Avoid control characters and non-ASCII UTF-8. */
+          ++*cursor;
+        } else {
+          *cursor = 0;
+        }
+      }
+    }
+  }
+  write_stdout_buf(ctx->tty_state, p, size);
+}
+
+/* int 0x21 ah == 0x3d (open to handle) and ah == 0x3c (create to handle). */
+static unsigned short dos_call_open(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  DirState * const dir_state = ctx->dir_state;
+  char * const fnbuf = ctx->emu->fnbuf;
+  const char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  const int flags = (((unsigned)regs->rax >> 8) & 0xff) == 0x3c ? O_RDWR | O_CREAT | O_TRUNC :
+      *(unsigned char*)&regs->rax & 3;  /* O_RDONLY == 0, O_WRONLY == 1, O_RDWR == 2 same in DOS and Linux. */
+  const unsigned char flags3 = (flags & 3);
+  /* For create, CX contains attributes (read-only, hidden, system, archive), we just ignore it.
+   * https://stanislavs.org/helppc/file_attributes.html
+   */
+  int fd;
+  const char *linux_filename;
+  char *linux_lastc;  /* Last component of linux_filename. */
+  char is_truncated = 0;  /* Was a file created or truncated with CLOCK_FIXED or CLOCK_VIRTUAL? */
+  if (DEBUG) fprintf(stderr, "debug: dos_open(%s) flags=0x%x\n", p, flags);
+  sync_handle_bufs(HBM_WRITE);  /* The new fd must see the data written to other fds. */
+  dir_state->dos_prog_abs = flags3 == O_RDONLY ? ctx->dos_prog_abs : NULL;  /* For loading the overlay from prog_filename, even if not mounted. */
+  linux_filename = get_linux_filename_cached_r(p, dir_state, fnbuf, &linux_lastc);
+  dir_state->dos_prog_abs = NULL;  /* For security. */
+  if (DEBUG) fprintf(stderr, "debug: dos_open(%s) linux_filename=(%s) current_drive=%c:\n", p, linux_filename, dir_state->drive);
+  /* There is some code duplication here with "type" in run_dos_batch(). */
+  /* Since we check linux_lastc rather than linux_filename, we
+   * recognize foo\aux.bar as aux. DOSBox 0.74-4 and MS-DOS 6.22
+   * do the same, but they also fail if directory foo doesn't exist.
+   */
+  if (is_same_ascii_nocase(linux_lastc, "nul", 3) && (linux_lastc[3] == '.' || linux_lastc[3] == '\0')) {
+    strcpy(fnbuf, "/dev/null");
+  } else if (is_same_ascii_nocase(linux_lastc, "aux", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) {
+    if (flags3 != O_WRONLY) { /* Don't let the user open aux for non-writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
+      return 5;  /* Access denied. */
+    } else {
+      if ((fd = dup(2)) < 0) return get_dos_call_linux_error();
+    }
+    goto after_open;
+  } else if ((is_same_ascii_nocase(linux_lastc, "con", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
+             (is_same_ascii_nocase(linux_lastc, "prn", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
+             (is_same_ascii_nocase(linux_lastc, "lpt1", 4) && (linux_lastc[4] == '\0' || linux_lastc[4] == '.'))) {
+    if (flags3 == O_RDONLY) {
+      if ((fd = dup(0)) < 0) return get_dos_call_linux_error();
+    } else if (flags3 == O_WRONLY) {
+      if ((fd = dup(1)) < 0) return get_dos_call_linux_error();
+    } else {
+      return 5;  /* Access denied. Don't let the user open prn for both reading and writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
+    }
+    goto after_open;
+  }
+  if (flags & O_CREAT) {
+    note_dir_change();
+  } else if (is_last_fn_enoent()) {
+    errno = ENOENT;
+    return get_dos_call_linux_error();
+  }
+  if ((fd = open_file(linux_filename, flags)) < 0) {
+    if (errno == ENOENT) set_last_fn_enoent();
+    return get_dos_call_linux_error();
+  }
+  is_truncated = (flags & O_TRUNC) && run_state->clock_mode != CLOCK_HOST;
+  /*dup2(fd, 20); close(fd); fd = 20;*/  /* !!! TODO(pts): This breaks .exe files created by `owcc -bdos', which allows fs <= 20. Do some fd remapping. */
+ after_open:
+  if (fd < 5) fd = ensure_fd_is_at_least(fd, 5);  /* Skip the first 5 DOS standard handles. */
+  if ((fd + 0U) >> 16) return 4;  /* Too many open files. */
+  if (is_truncated) {  /* Give it the mtime of the clock at close, even if it isn't written. */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) run_state->clock_written_fd_bits[fd >> 3] |= 1 << (fd & 7);  /* Not for nul. */
+  }
+  if (DEBUG) fprintf(stderr, "debug: dos_open(%s) dos_fd=%d\n", p, fd);
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  *(unsigned short*)&regs->rax = fd;
+  return 0;
+}
+
+/* int 0x21 ah == 0x3e: Close using handle. */
+static unsigned short dos_call_close(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned dos_handle = *(unsigned short*)&regs->rbx;
+  if (dos_handle >= 5) {  /* Don't close the standard handles, just pretend. */
+    const int fd = get_linux_handle(dos_handle, ctx->kvm_fds);
+    int sync_result;
+    if (fd < 0) return 6;  /* Invalid handle. Not strictly needed, close(...) would check. */
+    drop_handle_buf(fd);
+    sync_result = take_handle_error(fd);  /* Also from earlier syncs, e.g. when the buffer was evicted. */
+    run_state->handle_nocache_bits[fd >> 3] &= ~(1 << (fd & 7));
+    stamp_written_file(fd);
+    if (close(fd) != 0) return get_dos_call_linux_error();
+    if (sync_result != 0) return 0x1d;  /* Write fault. */
+  }
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x3f: Read using handle. */
+static unsigned short dos_call_read(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+  char *p;
+  int size, got;
+  if (fd < 0) return 6;  /* Invalid handle. */
+  p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  size = (int)*(unsigned short*)&regs->rcx;
+  if (fd == 0) flush_stdout_buf(ctx->tty_state);  /* Show the prompt. */
+  got = read_handle_buf(fd, p, size);
+  if (got < 0) return 0x1e;  /* Read fault. */
+  if (run_state->profile) run_state->profile->pending->byte_count += got;
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  *(unsigned short*)&regs->rax = got;
+  return 0;
+}
+
+/* int 0x21 ah == 0x40: Write using handle or truncate. */
+static unsigned short dos_call_write(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+  const char *p;
+  int size, got;
+  if (fd < 0) return 6;  /* Invalid handle. */
+  p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  size = (int)*(unsigned short*)&regs->rcx;
+  flush_stdout_buf(ctx->tty_state);  /* fd may be a dup of stdout or stderr. */
+  if (fd >= 5) {
+    ++run_state->find_dir_epoch;  /* The size and mtime in the findfirst listings may change. */
+    if (run_state->clock_mode != CLOCK_HOST) run_state->clock_written_fd_bits[fd >> 3] |= 1 << (fd & 7);
+  }
+  if (size == 0) {  /* Truncate. */
+    const int got1 = (sync_handle_bufs(HBM_NONE), lseek_handle_buf(fd, 0, SEEK_CUR));
+    got = got1 < 0 ? got1 : ftruncate(fd, got1);
+    if (got != 0) return 0x1d;  /* Write fault. */
+  } else {
+    got = write_handle_buf(fd, p, size);
+    if (got < 0) return 0x1d;  /* Write fault. */
+    if (run_state->profile) run_state->profile->pending->byte_count += got;
+    if (run_state->tracer && (fd == 1 || fd == 2)) add_trace_record(fd == 1 ? TR_STDOUT : TR_STDERR, p, got);
+  }
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  *(unsigned short*)&regs->rax = got;
+  return 0;
+}
+
+/* int 0x21 ah == 0x42: Seek using handle. */
+static unsigned short dos_call_seek(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+  const unsigned whence = *(unsigned char*)&regs->rax;  /* SEEK_SET == 0, SEEK_CUR == 1, SEEK_END == 2, same in DOS and Linux. */
+  const int offset = *(unsigned short*)&regs->rcx << 16 | *(unsigned short*)&regs->rdx;  /* It's important that this is signed, because we may want to pass -1 to lseek() even on 64-bit systems. */
+  int got;
+  if (fd < 0) return 6;  /* Invalid handle. */
+  if (whence > 2) return 0x57;  /* Invalid parameter. */
+  got = lseek_handle_buf(fd, offset, whence);
+  if (got < 0) return 0x19;  /* Seek error. (Is this the relevant code?) */
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  *(unsigned short*)&regs->rdx = (unsigned)got >> 16;
+  *(unsigned short*)&regs->rax = got;
+  return 0;
+}
+
+
+/* int 0x21 ah == 0x01: Keyboard input with echo. */
+static unsigned short dos_call_read_key_echo(DosCallCtx *ctx) {
+  char c;
+  flush_stdout_buf(ctx->tty_state);  /* Show the prompt. */
+  if (read(0, &c, 1) <= 0) {  /* STDIN_FILENO. */
+    c = 0x1a;  /* Ctrl-<Z>, EOF. */
+  } else if (c == '\0') {
+    c = '\1';  /* Never report control keys: '\0' + another character. */
+  }
+  *(unsigned char*)&ctx->regs->rax = c;
+  return 0;
+}
+
+/* int 0x21 ah == 0x02: Display output. */
+static unsigned short dos_call_display_char(DosCallCtx *ctx) {
+  write_dos_stdout(ctx, (const char*)&ctx->regs->rdx, 1);
+  return 0;
+}
+
+/* int 0x21 ah == 0x04: Output to STDAUX. */
+static unsigned short dos_call_write_aux(DosCallCtx *ctx) {
+  const char c = (unsigned char)ctx->regs->rdx;
+  flush_stdout_buf(ctx->tty_state);
+  (void)!write(2, &c, 1);  /* Emulate STDAUX with stderr. */
+  if (run_state->tracer) add_trace_record(TR_STDERR, &c, 1);
+  return 0;
+}
+
+/* int 0x21 ah == 0x05: Output to STDPRN. */
+static unsigned short dos_call_write_prn(DosCallCtx *ctx) {
+  const char c = (unsigned char)ctx->regs->rdx;
+  write_stdout_buf(ctx->tty_state, &c, 1);  /* Emulate STDPRN with stdout. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x06: Direct console I/O. */
+static unsigned short dos_call_console_io(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  if ((unsigned char)regs->rdx != 0xff) {  /* Output. */
+    write_dos_stdout(ctx, (const char*)&regs->rdx, 1);
+  } else {  /* Input. */
+    unsigned short result_ax;
+    process_key(ctx->tty_state, 1, &result_ax, (unsigned short*)&regs->rflags);  /* Check availability without reading. */
+    if (*(unsigned short*)&regs->rflags & (1 << 6)) {  /* ZF==1. */
+      process_key(ctx->tty_state, 0, &result_ax, (unsigned short*)&regs->rflags);  /* Read. */
+      *(unsigned char*)&regs->rax = (unsigned char)result_ax;  /* Return only the keycode. */
+    }
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x07 and ah == 0x08: Wait for console input without echo. */
+static unsigned short dos_call_read_key(DosCallCtx *ctx) {
+  unsigned short result_ax;
+  /* We should check Ctrl-<Break> with ah == 0x08, but the
+   * difference doesn't matter, bcause in kvikdos Ctrl-<Break> is
+   * never delivered.
+   */
+  process_key(ctx->tty_state, 0, &result_ax, (unsigned short*)&ctx->regs->rflags);  /* Read. */
+  *(unsigned char*)&ctx->regs->rax = (unsigned char)result_ax;  /* Return only the keycode. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x09: Print string. */
+static unsigned short dos_call_print_string(DosCallCtx *ctx) {
+  unsigned short dx = *(unsigned short*)&ctx->regs->rdx, dx0 = dx;
+  const char *p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4);
+  for (;;) {
+    if (p[dx] == '$') break;
+    ++dx;
+    if (dx == 0) {
+      fprintf(stderr, "fatal: !! offset overflow in print\n");  /* TODO(pts): Implement it.  */
+      exit(252);
+    }
+  }
+  write_dos_stdout(ctx, p + dx0, dx - dx0);
+  return 0;
+}
+
+/* int 0x21 ah == 0x0a: Buffered keyboard input. */
+static unsigned short dos_call_read_line(DosCallCtx *ctx) {
+  char *p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&ctx->regs->rdx);  /* !! Security: check bounds. */
+  unsigned size = *(unsigned char*)p++;
+  char *q = ++p, *q_end = q + size;
+  flush_stdout_buf(ctx->tty_state);  /* Show the prompt. */
+  for (; q != q_end; ++q) {
+    const int got = read(0, q, 1);  /* STDIN_FILENO. */
+    char c;
+    if (got <= 0) break;
+    if ((c = *q) == '\n') {
+      *q++ = '\r'; break;
+    } else if (c == '\0') {
+      *q = '\1';  /* Never report control keys: '\0' + another character. */
+    }
+  }
+  p[-1] = q - p;  /* Return number of bytes read. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x0b: Check input status. */
+static unsigned short dos_call_input_status(DosCallCtx *ctx) {
+  *(unsigned char*)&ctx->regs->rax = 0;  /* No input ready. 0xff would be input. */
+  /* If we detect Ctrl-<Break>, we should run `int 0x23'. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x0c: Clear keyboard buffer and invoke keyboard function. */
+static unsigned short dos_call_flush_and_read(DosCallCtx *ctx) {
+  const unsigned char al = (unsigned char)ctx->regs->rax;
+  if (al == 0x01) {
+    return dos_call_read_key_echo(ctx);
+  } else if (al == 0x06) {
+    return dos_call_console_io(ctx);
+  } else if (al == 0x07 || al == 0x08) {
+    return dos_call_read_key(ctx);
+  } else if (al == 0x0a) {
+    return dos_call_read_line(ctx);
+  } else {
+    *(unsigned char*)&ctx->regs->rax = 0;  /* DOSBox 0.74-4 does this. What should we do? */
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x0e: Select disk. */
+static unsigned short dos_call_select_disk(DosCallCtx *ctx) {
+  /* TODO(pts): Use the default drive specified here (dl + 'A') in get_linux_filename_r(...). */
+  const unsigned char dl = (unsigned char)ctx->regs->rdx;
+  if (dl < DRIVE_COUNT && ctx->dir_state->linux_mount_dir[dl]) ctx->dir_state->drive = dl + 'A';
+  *(unsigned char*)&ctx->regs->rax = 26;  /* 26 drives: 'A' .. 'Z'. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x19: Get current drive. */
+static unsigned short dos_call_get_drive(DosCallCtx *ctx) {
+  *(unsigned char*)&ctx->regs->rax = ctx->dir_state->drive - 'A';
+  return 0;
+}
+
+/* int 0x21 ah == 0x1a: Set disk transfer address (DTA). */
+static unsigned short dos_call_set_dta(DosCallCtx *ctx) {
+  ctx->dta_seg_ofs = *(unsigned short*)&ctx->regs->rdx | ctx->sregs->ds.selector << 16;
+  return 0;
+}
+
+/* int 0x21 ah == 0x25: Set interrupt vector. */
+static unsigned short dos_call_set_int(DosCallCtx *ctx) {
+  const unsigned char set_int_num = (unsigned char)ctx->regs->rax;
+  if (set_int(set_int_num, *(unsigned short*)&ctx->regs->rdx | ctx->sregs->ds.selector << 16, ctx->mem, ctx->had_get_ints)) return DCR_FATAL;
+  ctx->ivt_shadow[set_int_num] = ((unsigned*)ctx->mem)[set_int_num];
+  return 0;
+}
+
+/* int 0x21 ah == 0x29: Parse filename for FCB. */
+static unsigned short dos_call_parse_fcb_name(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const struct kvm_sregs * const sregs = ctx->sregs;
+  const char * const p = ctx->mem + ((unsigned)sregs->ds.selector << 4) + (*(unsigned short*)&regs->rsi);  /* !! Security: check bounds. */
+  if (*p == '\0' || *p == '\r' || *p == '\n') {
+    char *q = ctx->mem + ((unsigned)sregs->es.selector << 4) + (*(unsigned short*)&regs->rdi);  /* !! Security: check bounds. */
+    /* al == 1, *p == '\r' in Microsoft Macro Assembler 6.00B driver masm.exe. */
+    /* al == 0, *p == '\n' in Power C 2.2.0 compiler pc.exe. */
+    *(unsigned char*)&regs->rax = 0;  /* No wildchar characters present. */
+    *q++ = '\0';  /* Drive: 0 is default. */
+    memset(q, ' ', 12);  /* Filename (8) and extension (3). */
+    /* Don't update SI. */
+  } else {
+    fprintf(stderr, "fatal: unsupported parsing of filename: %s\n", p);  /* For ml.exe, this filename is completely broken, it starts with \r, also in DOSBox. */
+    return DCR_FATAL_INT;
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x2a: Get date. */
+static unsigned short dos_call_get_date(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  unsigned char hundredths;
+  const struct tm *tm = get_clock_tm(&hundredths);
+  *(unsigned char*)&regs->rax = tm->tm_wday;
+  *(unsigned short*)&regs->rcx = tm->tm_year + 1900;
+  *(unsigned short*)&regs->rdx = (tm->tm_mon + 1) << 8 | tm->tm_mday;
+  return 0;
+}
+
+/* int 0x21 ah == 0x2c: Get time. */
+static unsigned short dos_call_get_time(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  unsigned char hundredths;
+  const struct tm *tm = get_clock_tm(&hundredths);
+  *(unsigned short*)&regs->rcx = tm->tm_hour << 8 | tm->tm_min;
+  *(unsigned short*)&regs->rdx = tm->tm_sec << 8 | hundredths;
+  return 0;
+}
+
+/* int 0x21 ah == 0x2f: Get disk transfer address (DTA). */
+static unsigned short dos_call_get_dta(DosCallCtx *ctx) {
+  ctx->sregs->es.base = (ctx->sregs->es.selector = ctx->dta_seg_ofs >> 16) << 4;
+  *(unsigned short*)&ctx->regs->rbx = ctx->dta_seg_ofs;
+  return 0;
+}
+
+/* int 0x21 ah == 0x30: Get DOS version number. */
+static unsigned short dos_call_get_version(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (DEBUG || DEBUG_INTVEC) fprintf(stderr, "debug: get DOS version\n");
+  if (!(ctx->had_get_ints & 8)) memset(INT_STUB_STATE(ctx->mem) + ISS_GET_INTS, '\0', 32);  /* Subsequent int 0x21 ah == 0x35 calls may behave differently. */
+  ctx->had_get_ints |= 8;
+  INT_STUB_STATE(ctx->mem)[ISS_FLAGS] |= ISF_VERSION;  /* Further calls don't change had_get_ints. */
+  *(unsigned short*)&regs->rax = 5 | 0 << 8;  /* 5.0. */
+  *(unsigned short*)&regs->rbx = al == 1 ? 0x1000 :  /* DOS in HMA. */
+      0xff00;  /* MS-DOS with high 8 bits of OEM serial number in BL. */
+  *(unsigned short*)&regs->rcx = 0;  /* Low 16 bits of OEM serial number in CX. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x33: Get/set system values. */
+static unsigned short dos_call_system_values(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  const unsigned char dl = (unsigned char)regs->rdx;
+  if (al == 0) {
+    *(unsigned char*)&regs->rdx = ctx->ctrl_break_checking;  /* 0 or 1. */
+  } else if (al == 1) {
+    ctx->ctrl_break_checking = (dl > 0);
+  } else if (al == 2) {
+    const unsigned char old = ctx->ctrl_break_checking;
+    ctx->ctrl_break_checking = (dl > 0);
+    *(unsigned char*)&regs->rdx = old;
+  } else if (al == 5) {
+    *(unsigned char*)&regs->rdx = 'C' - 'A' + 1;  /* Boot drive. */
+  } else if (al == 6) {
+    *(unsigned short*)&regs->rbx = 0x500;  /* DOS 5.0. */
+    *(unsigned short*)&regs->rdx = 0x100;  /* DL contains DOS revision number 0. */
+  } else {
+    fprintf(stderr, "fatal: unimplemented: get/set system values: al:%04x dl:%04x\n", al, dl);
+    return DCR_FATAL;
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x35: Get interrupt vector. */
+static unsigned short dos_call_get_int(DosCallCtx *ctx) {
+  const unsigned char get_int_num = (unsigned char)ctx->regs->rax;
+  const char old_had_get_ints = ctx->had_get_ints;
+  if (DEBUG || DEBUG_INTVEC) fprintf(stderr, "debug: get interrupt vector int:%02x\n", get_int_num);
+  if (get_int_num == 0) ctx->had_get_ints |= 1;  /* Turbo Pascal 7.0 programs start with this. */
+  if (get_int_num == 0x18) ctx->had_get_ints |= 2;  /* TASM 3.2, Borland C++ 2.0 compiler bcc.exe for memory allocation. */
+  if (get_int_num == 0x06) ctx->had_get_ints |= 4;  /* TLINK 4.0. */
+  if ((ctx->had_get_ints & 8) && get_int_num == 0x34) ctx->had_get_ints |= 0x10;  /* JWasm 2.11a jwasmr.exe */
 
-typedef struct EmuState {
-  struct kvm_fds kvm_fds;
-  struct kvm_sregs initial_sregs;
-  struct kvm_run *kvm_run;
-  void *mem;
-} EmuState;
+  /* !!! TODO(pts): Make the default permissive in general, and enable these protections only on a flag. */
+  if ((ctx->had_get_ints & 1) ||
+      get_int_num - 0x22 + 0U <= 0x24 - 0x22 + 0U ||  /* Microsoft BASIC Professional Development System 7.10 linker pblink.exe gets interrupt vector 0x24. */
+      get_int_num == 0x18 ||  /* TASM 3.2, used for memory allocation. */
+      get_int_num == 0x06 ||  /* TLINK 4.0. */
+      get_int_num == 0x67 ||  /* WLINK 7.0. */
+      ((ctx->had_get_ints & 0x10) && (get_int_num - 0x34 + 0U <= 0x3d - 0x34 + 0U || get_int_num == 0x02 || get_int_num == 0x1b)) ||  /* JWasm 2.11a jwasmr.exe */
+      ((ctx->had_get_ints & 2) && (get_int_num == 0x1b || get_int_num == 0x3f)) ||  /* Borland Turbo C++ 1.01 compiler tcc.exe, Borland C++ 2.0 complier bcc.exe */
+     0) {
+    const unsigned short *pp = (const unsigned short*)(ctx->mem + (get_int_num << 2));
+    if (DEBUG) fprintf(stderr, "debug: get interrupt vector int:%02x is cs:%04x ip:%04x\n", get_int_num, pp[1], pp[0]);
+    (*(unsigned short*)&ctx->regs->rbx) = pp[0];
+    ctx->sregs->es.base = (ctx->sregs->es.selector = pp[1]) << 4;
+    /* Let the guest answer further calls for get_int_num, unless had_get_ints has just changed. */
+    if (ctx->had_get_ints != old_had_get_ints) memset(INT_STUB_STATE(ctx->mem) + ISS_GET_INTS, '\0', 32);
+    INT_STUB_STATE(ctx->mem)[ISS_GET_INTS + (get_int_num >> 3)] |= 1 << (get_int_num & 7);
+  } else {
+    fprintf(stderr, "fatal: unsupported get interrupt vector int:%02x\n", get_int_num);
+    return DCR_FATAL;
+  }
+  return 0;
+}
 
-/* It's a cheap call, the real initialization is done in reset_emu. */
-static void init_emu(struct EmuState *emu) {
-  emu->kvm_fds.kvm_fd = -1;
-  emu->mem = NULL;
+/* int 0x21 ah == 0x37: Get/set switch character (for command-line flags). */
+static unsigned short dos_call_switch_char(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (al == 0x00) {  /* Get. */
+    *(unsigned char*)&regs->rax = 0;  /* Success. */
+    *(unsigned char*)&regs->rdx = '/';
+  } else if (al == 0x02) {  /* Get device prefix flag. */
+    *(unsigned char*)&regs->rdx = 0xff;  /* Device prefix /dev/... not needed. */
+  } else {
+    fprintf(stderr, "fatal: unsupported subcall for switch character: 0x%02x\n", al);
+    return DCR_FATAL;
+  }
+  return 0;
 }
 
-/* Must be preceded by init_emu(emu).
- * After this call, the caller should also call ioctl(kvm_fds.vcpu_fd, KVM_SET_SREGS, &emu->initial_sregs);
- */
-static void reset_emu(struct EmuState *emu) {
-  void *mem;
-  if (emu->kvm_fds.kvm_fd < 0) {
-    int kvm_fd, vm_fd, vcpu_fd;
-    int kvm_run_mmap_size, api_version;
-    struct kvm_userspace_memory_region region;
-    struct kvm_regs dummy_regs;
-    if ((kvm_fd = open("/dev/kvm", O_RDWR)) < 0) {
-      perror("fatal: failed to open /dev/kvm");
-      exit(252);
+/* int 0x21 ah == 0x38: Get/set country dependent information. */
+static unsigned short dos_call_country_info(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  if (al == 0x00) {  /* Get. */
+    memcpy(p, &country_info, 0x18);
+    *(unsigned short*)&regs->rax = *(unsigned short*)&regs->rbx = 1;
+  } else {
+    fprintf(stderr, "fatal: unsupported subcall for country: 0x%02x\n", al);
+    return DCR_FATAL;
+  }
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x39: Create subdirectory (mkdir). */
+static unsigned short dos_call_mkdir(DosCallCtx *ctx) {
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&ctx->regs->rdx);  /* !! Security: check bounds. */
+  const int result = make_dir(get_linux_filename(p));
+  note_dir_change();
+  if (result < 0) return get_dos_call_linux_error();
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x3a: Remove subdirectory (rmdir). */
+static unsigned short dos_call_rmdir(DosCallCtx *ctx) {
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&ctx->regs->rdx);  /* !! Security: check bounds. */
+  const int result = remove_dir(get_linux_filename(p));
+  note_dir_change();
+  if (result < 0) return get_dos_call_linux_error();
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x41: Delete file. */
+static unsigned short dos_call_delete(DosCallCtx *ctx) {
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&ctx->regs->rdx);  /* !! Security: check bounds. */
+  const int fd = unlink_file(get_linux_filename(p));
+  note_dir_change();
+  if (fd < 0) return get_dos_call_linux_error();
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x43: Get/set file attributes. */
+static unsigned short dos_call_file_attrs(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const unsigned char al = (unsigned char)regs->rax;
+  const char * const p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  const char *fn;
+  if (al > 1) return 0x57;  /* Invalid parameter. */
+  fn = get_linux_filename(p);
+  if (al == 0) {  /* Get. */
+    struct stat st;
+    if (is_last_fn_enoent()) {
+      errno = ENOENT;
+      return get_dos_call_linux_error();
+    }
+    if (stat_file(fn, &st) != 0) {
+      if (errno == ENOENT) set_last_fn_enoent();
+      return get_dos_call_linux_error();
+    }
+    *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+    *(unsigned short*)&regs->rax = (st.st_mode & 0200) ? 0 : 1;  /* Indicate DOS read-only flag if owner doesn't have write permissions on Linux. */
+  } else {  /* Set. */
+    fprintf(stderr, "fatal: unimplemented: set file attributes: attr=0x%04x filename=%s\n", *(unsigned short*)&regs->rcx, fn);
+    return DCR_FATAL;
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x44: I/O control (ioctl). */
+static unsigned short dos_call_ioctl(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (al == 1 && (*(unsigned short*)&regs->rdx >> 8)) return 0x57;  /* Invalid parameter. */
+  if (al < 2) {  /* Get device information (1), set device information (2). */
+    const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+    struct stat st;
+    if (fd < 0) return 6;  /* Invalid handle. */
+    if (fstat(fd, &st) != 0) return get_dos_call_linux_error();
+    if (al == 0) {  /* Get. */
+      /* DOSBox 0.74-4 PRN: 0x80a0; DOSBox 0.74-4 CON: 0x80d3; DOSBox 0.74-4 file on drive C: 0x0002. */
+      static const char fake_drive = 'C';
+      /* Without the 1 << 15 bit, the VAL 1995-05-27 linker val.exe fprintf(stdout, ...) function wouldn't write anything to stdout. DOSBox 0.74-4 doesn't set 1 << 15 on regular files. */
+      *(unsigned short*)&regs->rdx = S_ISCHR(st.st_mode) ? 1 << 15 /* reserved */ | 1 << 5  /* binary */ | 1 << 7  /* character device */ : 1 << 15 | (fake_drive - 'A') /* regular file on block device */;
+      if (DEBUG) fprintf(stderr, "debug: ioctl get_device_info dos_fd=%d linux_fd=%d result=0x%04x\n", *(unsigned short*)&regs->rbx, fd, *(unsigned short*)&regs->rdx);
+      *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+    } else {
+      if (DEBUG) fprintf(stderr, "debug: ioctl get_device_info dos_fd=%d linux_fd=%d value=0x%04x\n", *(unsigned short*)&regs->rbx, fd, *(unsigned short*)&regs->rdx);
+      if (!S_ISCHR(st.st_mode)) return 0xf;  /* Invalid drive specified. We want to indicate that it's not a character device. */
+      /* TLIB 3.01 sets (dx & 0x80) to zero, to disable binary mode (and enable translation). */
+      /* We just ignore the setting. */
+    }
+  } else if (al == 8) {  /* Get whether drive is removable. */
+    unsigned char bl = (unsigned char)regs->rax;
+    if (bl == 0) bl = ctx->dir_state->drive - 'A' + 1;
+    if (bl > DRIVE_COUNT || !ctx->dir_state->linux_mount_dir[(int)bl - 1]) return 0xf;  /* Invalid drive specified. */
+    *(unsigned char*)&regs->rax = bl > 2;  /* A: (1) and B: (2) are removable (0), C: (3) etc. aren't (1). */
+  } else if (al == 0x0a) {  /* Get whether handle is local or remote. */
+    const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+    if (fd < 0) return 6;  /* Invalid handle. */
+    *(unsigned short*)&regs->rdx = 0;  /* Drive is local. */
+#if 0
+  } else if (al == 6) {
+    const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+    if (fd < 0) return 6;  /* Invalid handle. */
+#if 0
+    return 0xd;  /* Invalid data. */
+#endif
+    *(unsigned short*)&regs->rax = 0xff;  /* Input is ready (0xff). */
+#endif
+  } else {
+    fprintf(stderr, "fatal: unsupported DOS ioctl call: call=0x%02x dos_fd=%d\n", al, *(unsigned short*)&regs->rbx);
+    return DCR_FATAL;
+  }
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x45: Duplicate handle (dup()). */
+static unsigned short dos_call_dup(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+  int fd2;
+  if (fd < 0) return 6;  /* Invalid handle. */
+  if (fd >= 5) drop_handle_buf(fd);
+  fd2 = dup(fd);
+  if (fd2 < 0) return get_dos_error_code(errno, 4);  /* By default: Too many open files. */
+  if (fd2 < 5) fd2 = ensure_fd_is_at_least(fd2, 5);  /* Skip the first 5 DOS standard handles. */
+  if ((fd2 + 0U) >> 16) return 4;  /* Too many open files. */
+  if (fd >= 5) set_handle_dup(fd, fd2);  /* They share the file offset. */
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  *(unsigned short*)&regs->rax = fd2;
+  return 0;
+}
+
+/* int 0x21 ah == 0x47: Get current directory. */
+static unsigned short dos_call_get_cwd(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const DirState * const dir_state = ctx->dir_state;
+  char *p, *p0, *pend;
+  const char *s;
+  /* Input: DL: 0 = current drive, 1: A: */
+  if (*(unsigned char*)&regs->rdx != 0) return 0xf;  /* Invalid drive specified. */
+  p0 = p = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + *(unsigned short*)&regs->rsi;
+  pend = p + 63;
+  s = dir_state->current_dir[dir_state->drive - 'A'];
+  for (; *s != '\0' && p != pend; ++s, ++p) {
+    *p = *s;
+  }
+  if (p != p0 && p[-1] == '/') --p;  /* Remove trailing '/'. */
+  *p = '\0';  /* Silently truncate to 64 bytes. */
+  if (DEBUG) fprintf(stderr, "debug: get current directory on drive %c: (%s)\n", dir_state->drive, p0);
+  *(unsigned short*)&regs->rax = 0x100;  /* DOSBox 0.74-4 also does this. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x48: Allocate memory (malloc()). */
+static unsigned short dos_call_malloc(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  char * const mem = ctx->mem;
+  const unsigned malloc_strategy = ctx->malloc_strategy;
+  const unsigned alloc_size_para = *(unsigned short*)&regs->rbx;
+  unsigned fit_block_para = 0;
+  unsigned fit_prev_block_para = 0;  /* Preceding block. */
+  unsigned fit_size_para = 0, index_start_para, index_end_para;
+  unsigned short fit_node;
+  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc(0x%04x)\n", alloc_size_para);
+  DEBUG_CHECK_ALL_MCBS(mem);
+  { /* Try to find best match. */
+    char is_rebuilt = 0;
+    if (!run_state->mcb_index->is_valid) {
+      if (rebuild_mcb_index(mem)) return 7;  /* Memory control blocks destroyed. */
+      is_rebuilt = 1;
+    }
+    for (;;) {
+      fit_node = malloc_strategy == MS_FIRST_FIT ? find_mcb_index_first_fit(alloc_size_para, 0) : malloc_strategy == MS_BEST_FIT ? find_mcb_index_best_fit(alloc_size_para) : /* malloc_strategy >= MS_LAST_FIT ? */ find_mcb_index_first_fit(alloc_size_para, 1);
+      if (!fit_node) {
+        if (is_rebuilt) break;
+        /* The program may have grown a free block (or freed one) by editing its MCB directly, which the index doesn't know about. */
+        if (rebuild_mcb_index(mem)) return 7;  /* Memory control blocks destroyed. */
+        is_rebuilt = 1;
+        continue;
+      }
+      fit_block_para = MI_NODE(fit_node)->block_para;
+      fit_size_para = MI_NODE(fit_node)->size_para;
+      if (fit_block_para == run_state->mcb_index->tail_para) {  /* After the last block. */
+        const char * const prev_mcb = (const char*)mem + (run_state->mcb_index->last_block_para << 4) - 16;
+        fit_prev_block_para = run_state->mcb_index->last_block_para;
+        if (!is_mcb_bad(mem, fit_prev_block_para) && MCB_TYPE(prev_mcb) == 'Z' && fit_prev_block_para + 1 + MCB_SIZE_PARA(prev_mcb) == fit_block_para) break;
+      } else {  /* A free block. */
+        const char * const mcb = (const char*)mem + (fit_block_para << 4) - 16;
+        fit_prev_block_para = fit_block_para - 1 - MCB_PSIZE_PARA(mcb);
+        if (!is_mcb_bad(mem, fit_block_para) && MCB_PID(mcb) == 0 && MCB_SIZE_PARA(mcb) == fit_size_para) break;
+      }
+      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc index mismatch block=0x%04x\n", fit_block_para);
+      if (is_rebuilt || rebuild_mcb_index(mem)) return 7;  /* Memory control blocks destroyed. The program has changed the MCB chain. */
+      is_rebuilt = 1;
+    }
+  }
+  if (!fit_node) {
+    const unsigned largest_available_para = run_state->mcb_index->root[MI_ADDR] ? MI_NODE(run_state->mcb_index->root[MI_ADDR])->max_size_para : 0;
+    *(unsigned short*)&regs->rbx = largest_available_para - (largest_available_para > 0);
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc insufficient memory\n");
+    return 8;  /* Insufficient memory. */
+  } else {
+    char * const prev_mcb = (char*)mem + (fit_prev_block_para << 4) - 16;
+    char * const mcb = (char*)mem + (fit_block_para << 4) - 16;
+    char * const free_mcb = (char*)mem + ((fit_block_para + alloc_size_para) << 4);
+    char mcb_error;
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc fit prev_block=0x%04x block=0x%04x size=0x%04x\n", fit_prev_block_para, fit_block_para, fit_size_para);
+    index_start_para = fit_block_para == run_state->mcb_index->tail_para ? fit_prev_block_para : fit_block_para;
+    index_end_para = fit_block_para + 1 + fit_size_para;
+    if (MCB_TYPE(prev_mcb) == 'Z') {  /* Append after last block. */
+      if (DEBUG || DEBUG_ALLOC) {
+        fprintf(stderr, "debug: malloc append prev_block=0x%04x block=0x%04x free=0x%04x strategy=%u\n",
+                fit_prev_block_para, fit_block_para, fit_block_para + alloc_size_para + 1, malloc_strategy);
+      }
+      memcpy(mcb, default_program_mcb, 16);
+      /*MCB_TYPE(mcb) = 'Z';*/  /* Already set. */
+      MCB_PID(mcb) = ctx->psp_para;  /* Owned by the current program. */
+      MCB_TYPE(prev_mcb) = 'M';
+      MCB_PSIZE_PARA(mcb) = MCB_SIZE_PARA(prev_mcb);
+      if (malloc_strategy != MS_LAST_FIT ||
+         DOS_ALLOC_PARA_LIMIT - fit_block_para == alloc_size_para) {  /* Perfect fit, no need to split. */
+        MCB_SIZE_PARA(mcb) = alloc_size_para;
+        goto malloc_done;
+      }
+      /* Create free block, split it below. At this point we have enough paras to do a split. */
+      MCB_SIZE_PARA(mcb) = DOS_ALLOC_PARA_LIMIT - fit_block_para;
+      MCB_PID(mcb) = 0;  /* Mark it as free. */
+      MCB_PSIZE_PARA(mcb) = MCB_SIZE_PARA(prev_mcb);
+    }
+    {  /* Change existing free block. */
+      char * const next_mcb = mcb + (MCB_SIZE_PARA(mcb) << 4) + 16;
+      MCB_PID(mcb) = ctx->psp_para;  /* Mark as in use. */
+      if (DEBUG || DEBUG_ALLOC) {
+        fprintf(stderr, "debug: malloc middle prev_block=0x%04x block=0x%04x next=0x%04x free=0x%04x is_exact_fit=%d strategy=%u\n",
+                fit_prev_block_para, fit_block_para, fit_block_para + MCB_SIZE_PARA(mcb) + 1, fit_block_para + alloc_size_para + 1,
+                fit_block_para + MCB_SIZE_PARA(mcb) + 1 == fit_block_para + alloc_size_para + 1, malloc_strategy);
+      }
+      if (free_mcb == next_mcb) {  /* Exact fit. */
+        if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc exact fit\n");
+      } else if (malloc_strategy == MS_LAST_FIT) {  /* Not an exact fit, prepend a free block. */
+        char * const after_mcb = mcb + ((MCB_SIZE_PARA(mcb) - alloc_size_para) << 4);
+        memcpy(after_mcb, default_program_mcb, 16);  /* 'Z' (last) by default. */
+        MCB_PID(after_mcb) = ctx->psp_para;
+        MCB_SIZE_PARA(after_mcb) = alloc_size_para;
+        if (fit_block_para + alloc_size_para < DOS_ALLOC_PARA_LIMIT) MCB_PSIZE_PARA(next_mcb) = alloc_size_para;
+        MCB_PSIZE_PARA(after_mcb) = MCB_SIZE_PARA(mcb) -= alloc_size_para + 1;
+        MCB_TYPE(after_mcb) = MCB_TYPE(mcb);
+        MCB_PID(mcb) = 0;  /* Free. */
+        MCB_TYPE(mcb) = 'M';  /* Non-last. */
+        mcb_error = is_mcb_bad(mem, fit_block_para);
+        if (mcb_error) {  /* mcb, which is free now. */
+          fprintf(stderr, "fatal: bad pre-free MCB after malloc(): %d\n", mcb_error);
+          exit(252);
+        }
+        fit_block_para += MCB_SIZE_PARA(mcb) + 1;
+        if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc last block=0x%04x\n", fit_block_para);
+      } else {  /* Not an exact fit, append a free block. */
+        const unsigned size_para = MCB_SIZE_PARA(mcb);
+        memcpy(free_mcb, default_program_mcb, 16);
+        /*MCB_TYPE(mcb) = 'M';*/  /* Not needed, already set. */
+        MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = alloc_size_para;
+        /* MCB_PSIZE_PARA(mcb) is already correct. */
+        MCB_TYPE(free_mcb) = 'M';
+        MCB_PID(free_mcb) = 0;
+        MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(free_mcb) = size_para - alloc_size_para - 1;
+        mcb_error = is_mcb_bad(mem, fit_block_para + alloc_size_para + 1);
+        if (mcb_error) {  /* free_mcb. */
+          fprintf(stderr, "fatal: bad free MCB after malloc(): %d\n", mcb_error);
+          exit(252);
+        }
+      }
     }
-    if ((api_version = ioctl(kvm_fd, KVM_GET_API_VERSION, 0)) < 0) {
-      perror("fatal: failed to create KVM vm");
+   malloc_done:
+    mcb_error = is_mcb_bad(mem, fit_block_para);
+    if (mcb_error) {
+      fprintf(stderr, "fatal: bad MCB after malloc(): %d\n", mcb_error);
       exit(252);
     }
-    if (api_version != KVM_API_VERSION) {
-      fprintf(stderr, "fatal: KVM API version mismatch: kernel=%d user=%d\n",
-              api_version, KVM_API_VERSION);
+    update_mcb_index(mem, index_start_para, index_end_para);
+  }
+  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc(0x%04x) == 0x%04x\n", alloc_size_para, fit_block_para);
+  *(unsigned short*)&regs->rax = fit_block_para;
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x49: Free allocated memory (free()). */
+static unsigned short dos_call_free(DosCallCtx *ctx) {
+  char * const mem = ctx->mem;
+  const unsigned block_para = (unsigned short)ctx->sregs->es.selector;
+  char *mcb = (char*)mem + (block_para << 4) - 16;
+  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free(0x%04x)\n", block_para);
+  DEBUG_CHECK_ALL_MCBS(mem);
+  if (block_para == ctx->psp_para) {  /* It's not allowed to free the program image. */
+    return 0x57;  /* Invalid parameter. */
+  } else if (block_para > PSP_PARA && block_para < DOS_ALLOC_PARA_LIMIT && mcb[0] == freed_mcb[0] && memcmp(mcb, freed_mcb, 16) == 0) {  /* Already free, has been freed. Succeed as noop just like DOSBox 0.74 and MS-DOS 6.22 do. */
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: already freed\n");
+  } else if (is_mcb_bad(mem, block_para)) {
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad MCB para=0x%04x: %d\n", block_para, is_mcb_bad(mem, block_para));
+    return 7;  /* Memory control blocks destroyed. */
+  } else if (MCB_PID(mcb) == 0) {  /* Already free. Succeed as noop just like DOSBox 0.74 and MS-DOS 6.22 do. */
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: already free\n");
+  } else if (is_mcb_bad(mem, block_para - MCB_PSIZE_PARA(mcb) - 1)) {
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad prev MCB para=0x%04x: %d\n", block_para - MCB_PSIZE_PARA(mcb) - 1, is_mcb_bad(mem, block_para - MCB_PSIZE_PARA(mcb) - 1));
+    return 7;  /* Memory control blocks destroyed. */
+  } else if (MCB_TYPE(mcb) != 'Z' && is_mcb_bad(mem, block_para + MCB_SIZE_PARA(mcb) + 1)) {
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad next MCB para=0x%04x: %d\n", block_para + MCB_SIZE_PARA(mcb) + 1, is_mcb_bad(mem, block_para + MCB_SIZE_PARA(mcb) + 1));
+    return 7;  /* Memory control blocks destroyed. */
+  } else {
+    char *prev_mcb = mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4);  /* Always exists since block_para != PSP_PARA. */
+    char *next_mcb = mcb + 16 + (MCB_SIZE_PARA(mcb) << 4);
+    unsigned index_start_para = block_para - MCB_PSIZE_PARA(mcb) - 1;
+    const unsigned index_end_para = MCB_TYPE(mcb) == 'Z' ? DOS_ALLOC_PARA_LIMIT + 1 : block_para + 1 + MCB_SIZE_PARA(mcb) + (MCB_PID(next_mcb) != 0 ? 0 : 1 + MCB_SIZE_PARA(next_mcb));
+    if (MCB_TYPE(mcb) != 'Z' && MCB_PID(next_mcb) == 0) {  /* Merge it with the following free block. */
+      char *next_mcb2 = next_mcb + 16 + (MCB_SIZE_PARA(next_mcb) << 4);
+      const unsigned next_para2 = block_para + MCB_SIZE_PARA(mcb) + 1 + MCB_SIZE_PARA(next_mcb) + 1;
+      const char next_type = MCB_TYPE(next_mcb);
+      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: merge with next free\n");
+      if (next_type != 'Z' && is_mcb_bad(mem, next_para2)) {
+        if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad next2 MCB block_para=%04x next_para=0x%04x next_para2=0x%04x: %d\n", block_para, block_para + MCB_SIZE_PARA(mcb) + 1, next_para2, is_mcb_bad(mem, next_para2));
+        return 7;  /* Memory control blocks destroyed. */
+      }
+      MCB_SIZE_PARA(mcb) += 1 + MCB_SIZE_PARA(next_mcb);
+      memset(next_mcb, 0, 16);
+      if (next_type != 'Z') MCB_PSIZE_PARA(next_mcb2) = MCB_SIZE_PARA(mcb);
+      MCB_TYPE(mcb) = next_type;
+      next_mcb = next_mcb2;  /* For the merge with the preceding free block below. */
+    }
+    MCB_PID(mcb) = 0;  /* Mark it as free. */
+    if (MCB_PID(prev_mcb) == 0) {  /* Merge it with the preceding free block. */
+      const char mcb_type = MCB_TYPE(mcb);
+      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: merge with prev free\n");
+      MCB_SIZE_PARA(prev_mcb) += 1 + MCB_SIZE_PARA(mcb);
+      memcpy(mcb, freed_mcb, 16);
+      if (mcb_type != 'Z') MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(prev_mcb);
+      MCB_TYPE(prev_mcb) = mcb_type;
+      mcb = prev_mcb;
+    }
+    if (MCB_TYPE(mcb) == 'Z') {  /* Delete it as last free MCB. */
+      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: delete last\n");
+      prev_mcb = mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4);
+      memcpy(mcb, freed_mcb, 16);
+      MCB_TYPE(prev_mcb) = 'Z';
+      index_start_para = (unsigned)((prev_mcb - (char*)mem) >> 4) + 1;
+    }
+    update_mcb_index(mem, index_start_para, index_end_para);
+  }
+  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free(0x%04x) OK\n", block_para);
+  DEBUG_CHECK_ALL_MCBS(mem);
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x4a: Modify allocated memory block (inplace_realloc()). */
+static unsigned short dos_call_realloc(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  char * const mem = ctx->mem;
+  const unsigned new_size_para = *(unsigned short*)&regs->rbx;
+  const unsigned short block_para = ctx->sregs->es.selector;
+  unsigned available_para, old_size_para, index_end_para;
+  char * const mcb = (char*)mem + (block_para << 4) - 16;
+  char *next_mcb;
+  if (is_mcb_bad(mem, block_para) || MCB_PID(mcb) == 0) {
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc bad block_para=0x%04x new_size_para=0x%04x\n", block_para, new_size_para);
+   error_bad_mcb:
+    /*fprintf(stderr, "fatal: bad MCB\n"); return DCR_FATAL;*/
+    return 7;  /* Memory control blocks destroyed. */ /* !! anasm.com reports this. From where? */
+  }
+  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc block_para=0x%04x new_size_para=0x%04x old_size_para=0x%04x\n", block_para, new_size_para, MCB_SIZE_PARA(mcb));
+  DEBUG_CHECK_ALL_MCBS(mem);
+  old_size_para = MCB_SIZE_PARA(mcb);
+  if (old_size_para != new_size_para) {
+    next_mcb = MCB_TYPE(mcb) != 'Z' ? (mcb + 16 + (old_size_para << 4)) : NULL;
+    if (next_mcb && is_mcb_bad(mem, block_para + 1 + old_size_para)) goto error_bad_mcb;
+    available_para = !next_mcb ? (unsigned)(DOS_ALLOC_PARA_LIMIT - block_para) : MCB_PID(next_mcb) != 0 ? old_size_para : old_size_para + 1 + MCB_SIZE_PARA(next_mcb);
+    if (new_size_para > available_para) {
+      *(unsigned short*)&regs->rbx = available_para;
+      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc insufficient memory\n");
+      return 8;  /* Insufficient memory. */
+    }
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc block_para=0x%04x new_size_para=0x%04x available_para=0x%04x\n", block_para, new_size_para, available_para);
+    index_end_para = !next_mcb ? DOS_ALLOC_PARA_LIMIT + 1 : block_para + 1 + old_size_para + (MCB_PID(next_mcb) != 0 ? 0 : 1 + MCB_SIZE_PARA(next_mcb));
+    if (!next_mcb) {
+      MCB_SIZE_PARA(mcb) = new_size_para;
+    } else if (MCB_PID(next_mcb) != 0) {  /* Insert a free block after the current block. */
+      char * const free_mcb = mcb + 16 + (new_size_para << 4);
+      memcpy(free_mcb, default_program_mcb, 16);
+      MCB_TYPE(free_mcb) = 'M';
+      MCB_PID(free_mcb) = 0;  /* Mark as free. */
+      MCB_SIZE_PARA(free_mcb) = MCB_PSIZE_PARA(next_mcb) = old_size_para - new_size_para - 1;
+      MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = new_size_para;
+    } else if (new_size_para == available_para) {  /* Exact size match. Merge the following free block into the current block. */
+      const unsigned next_mcb_size_para = MCB_SIZE_PARA(next_mcb);
+      memset(next_mcb, 0, 16);
+      next_mcb = next_mcb + 16 + (next_mcb_size_para << 4);
+      MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(mcb) = available_para;
+    } else {  /* Make the following free block smaller or larger. */
+      char * const next_mcb2 = mcb + 16 + (new_size_para << 4);
+      memcpy(next_mcb2, default_program_mcb, 16);
+      MCB_TYPE(next_mcb2) = 'M';
+      MCB_PID(next_mcb2) = 0;  /* Mark as free. */
+      MCB_PSIZE_PARA(next_mcb + 16 + (MCB_SIZE_PARA(next_mcb) << 4)) =
+          MCB_SIZE_PARA(next_mcb2) = MCB_SIZE_PARA(next_mcb) + old_size_para - new_size_para;
+      MCB_PSIZE_PARA(next_mcb2) = MCB_SIZE_PARA(mcb) = new_size_para;
+      memset(next_mcb, 0, 16);
     }
-    if ((vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0)) < 0) {
-      perror("fatal: failed to create KVM vm");
+    if (is_mcb_bad(mem, block_para)) {
+      fprintf(stderr, "fatal: bad MCB after inplace_realloc()\n");
       exit(252);
     }
-    /* If emu_params->mem_mb > 1, then we have allocate more. */
-    if ((emu->mem = mem = mmap(NULL, DOS_MEM_LIMIT, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) ==
-        NULL) {
-      perror("fatal: mmap");
+    if (next_mcb && is_mcb_bad(mem, available_para = block_para + 1 + MCB_SIZE_PARA((char*)mem + (block_para << 4) - 16))) {
+      fprintf(stderr, "fatal: bad next/free MCB after inplace_realloc(): %d\n", is_mcb_bad(mem, available_para));
       exit(252);
     }
+    update_mcb_index(mem, block_para, index_end_para);
+  }
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
 
-    memset(&region, 0, sizeof(region));
-    region.slot = 0;
-    region.guest_phys_addr = GUEST_MEM_MODULE_START;  /* Must be a multiple of the Linux page size (0x1000), otherwise KVM_SET_USER_MEMORY_REGION returns EINVAL. */
-    region.memory_size = DOS_MEM_LIMIT - GUEST_MEM_MODULE_START;
-    region.userspace_addr = (uintptr_t)mem + GUEST_MEM_MODULE_START;
-    /*region.flags = KVM_MEM_READONLY;*/  /* Not needed, read-write is default. */
-    if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
-      perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION");
-      exit(252);
+/* int 0x21 ah == 0x4b: Load or execute program (exec).
+ * On success, it returns DCR_EXEC, and run_dos_prog(...) loads the
+ * program in ctx->img_fd.
+ */
+static unsigned short dos_call_exec(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const struct kvm_sregs * const sregs = ctx->sregs;
+  char * const mem = ctx->mem;
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const unsigned char al = (unsigned char)regs->rax;
+  const char * const dos_filename = (char*)mem + ((unsigned)sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  if (al == 0 || al == 3) {  /* Microsoft Macro Assembler 6.00B driver masm.exe uses it with al == 3. */
+    const char * const params = (char*)mem + ((unsigned)sregs->es.selector << 4) + (*(unsigned short*)&regs->rbx);  /* !! Security: check bounds. */
+    const unsigned short load_para = al != 0 ? ((unsigned short*)params)[0] : 0;
+    /*const unsigned short relocation_factor = *(unsigned short*)(params + 2);*/
+    char * const psp = (al != 0 && load_para >= PSP_PARA + 0x10 && load_para < DOS_ALLOC_PARA_LIMIT) ? (char*)mem + ((unsigned)(load_para - 0x10) << 4) : NULL;
+    const unsigned short exec_env_para = al == 0 ? (((unsigned short*)params)[0] ? ((unsigned short*)params)[0] : ctx->env_para) : psp ? *(const unsigned short*)(psp + 0x2c) : 0;
+    char * const env = ((al == 0 && exec_env_para == ENV_PARA) || (exec_env_para >= PSP_PARA + 0x10 && exec_env_para < DOS_ALLOC_PARA_LIMIT)) ? (char*)mem + (exec_env_para << 4) : NULL;
+    const char *env_end = env ? env + (((PROGRAM_MCB_PARA - ENV_PARA < DOS_ALLOC_PARA_LIMIT - exec_env_para) ? PROGRAM_MCB_PARA - ENV_PARA : DOS_ALLOC_PARA_LIMIT - exec_env_para) << 4) : NULL;
+    char * const args = al == 0 ?  (char*)mem + (((unsigned short*)params)[2] << 4) + ((unsigned short*)params)[1] + 1  /* (args - 1) is Pascal string with terminating '\r'. */
+                      : psp ? psp + 0x81 : NULL;
+    const unsigned char args_size = args ? (unsigned char)args[-1] : 0;
+    const char is_args_normal = args && (args_size < 0x7f && (args[args_size] == '\r' || args[args_size] == '\0')); /* '\0' for al == 0 when Borland C++ 2.0 compiler bcc.exe is running tlink.exe */
+    const char is_args_ok = is_args_normal || (args && args_size == '\n' && args[0] == '\n' && args[1] == '.');  /* Power C 2.2.0 compiler pc.exe. Copy all 128 bytes to new PSP. */
+    const char is_dos_filename_high = sregs->ds.selector + (*(unsigned short*)&regs->rdx >> 4) >= PSP_PARA;  /* So that dos_filename won't overlap new_env below. */
+    char *new_env;
+    char new_prog_drive;
+    const char *new_prog_filename;
+    int reason;
+    unsigned exec_env_block_para = 0, exec_env_size_para = 0;  /* Of the child, if is_exec_child. */
+    if (!(env && is_args_ok && is_dos_filename_high)) {
+      fprintf(stderr, "fatal: bounds check failed (env_ok=%d args_ok=%d, fn_ok=%d) env when loading program=(%s) with args=(%.*s)\n",
+              env != NULL, is_args_ok, is_dos_filename_high,
+              dos_filename, is_args_normal ? args_size : 0, is_args_normal ? args : "");
+      return DCR_FATAL_INT;
     }
-    if (GUEST_MEM_MODULE_START != 0) {
-      memset(&region, 0, sizeof(region));
-      region.slot = 1;
-      region.guest_phys_addr = 0;
-      region.memory_size = 0x1000;  /* Magic interrupt table: 0x500 bytes, rounded up to page boundary. */
-      region.userspace_addr = (uintptr_t)mem;
-      region.flags = KVM_MEM_READONLY;
-      if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
-        perror("fatal: ioctl KVM_SET_USER_MEMORY_REGION");
+    if (!is_args_normal) {
+      fprintf(stderr, "fatal: bad args when loading: %s\n", dos_filename);
+      return DCR_FATAL_INT;
+    }
+    memcpy(emu->fnbuf2, args, args_size);  /* Large enough to hold 0x7f bytes. */
+    emu->fnbuf2[args_size] = '\0';
+    /* With al == 0, the parent program (e.g. Borland C++ 2.0
+     * compiler bcc.exe) is resumed after the child (e.g. TLINK
+     * 4.0 linker tlink.exe) exits, see ExecFrame. With al == 3,
+     * kvikdos is not smart enough to load an overlay, so it just
+     * runs the new program and forgets about the current one (but
+     * not about its parent), for the few programs whitelisted by
+     * should_skip_exec_program(...).
+     */
+    if (al == 3 && (reason = should_skip_exec_program(dos_filename, emu->fnbuf2, env, &env_end, ctx->had_get_first_mcb)) > 0) {
+      fprintf(stderr, "fatal: unsupported program to load: al:%02x reason=%d program=(%s) args=(%s)\n", al, reason, dos_filename, emu->fnbuf2);
+      return DCR_FATAL_INT;
+    }
+    if (al == 0 && ctx->exec_depth >= EXEC_FRAME_LIMIT) {
+      fprintf(stderr, "fatal: too many nested exec calls: %s\n", dos_filename);
+      return DCR_FATAL_INT;
+    }
+    dir_state->dos_prog_abs = ctx->dos_prog_abs;  /* For loading the overlay from prog_filename, even if not mounted. */
+    new_prog_filename = get_linux_filename_r(dos_filename, dir_state, emu->fnbuf, NULL);
+    dir_state->dos_prog_abs = NULL;  /* For security. */
+    new_prog_drive = get_dos_filename_drive(dos_filename, dir_state);
+    if (new_prog_filename[0] == '\0' || new_prog_drive == '\0') {
+      if (al == 0) { errno = ENOENT; return get_dos_call_linux_error(); }
+      fprintf(stderr, "fatal: bad program filename for loading: %s\n", dos_filename);
+      return DCR_FATAL_INT;
+    }
+    if ((ctx->img_fd = open_file(new_prog_filename, O_RDONLY)) < 0) {
+      if (al == 0) return get_dos_call_linux_error();
+      fprintf(stderr, "fatal: cannot open DOS executable program for loading: %s: %s\n", new_prog_filename, strerror(errno));
+      return DCR_FATAL_INT;
+    }
+    flush_stdout_buf(ctx->tty_state);
+    reset_handle_bufs();  /* Make the writes of the parent visible to the child. */
+    if (al == 0 || ctx->exec_frame) {  /* Allocate the blocks of the child from the free memory, see ExecFrame. */
+      const char *p;
+      unsigned env_size, env_size_para, block_para, block_size_para, last_block_para;
+      for (p = env; p < env_end && *p != '\0'; ++p) {  /* Find the end of the variables. */
+        if ((p = memchr(p, '\0', env_end - p)) == NULL) p = env_end - 1;
+      }
+      if (p >= env_end) {
+        fprintf(stderr, "fatal: exec environment too large\n");
         exit(252);
       }
+      env_size = p - env;
+      env_size_para = (env_size + 6 /* "$=", "", "\1" */ + DOS_PATH_SIZE + 0xf) >> 4;
+      ctx->header_size = detect_dos_executable_program(ctx->img_fd, new_prog_filename, ctx->header);
+      block_para = find_largest_free_dos_block(mem, &block_size_para, &last_block_para);
+      if (block_para == 0 || block_size_para < env_size_para + 1 + get_dos_program_min_para(ctx->header, ctx->header_size)) {
+        close(ctx->img_fd);
+        if (al == 0) return 8;  /* Insufficient memory. */
+        fprintf(stderr, "fatal: not enough memory for loading: %s\n", dos_filename);
+        return DCR_FATAL_INT;
+      }
+      last_block_para = alloc_dos_block_at(mem, block_para, env_size_para, block_para + env_size_para + 1, last_block_para);
+      alloc_dos_block_at(mem, block_para + env_size_para + 1, block_size_para - env_size_para - 1, block_para + env_size_para + 1, last_block_para);
+      memcpy((char*)mem + (block_para << 4), env, env_size);
+      ((char*)mem)[(block_para << 4) + env_size] = '\0';  /* Empty var marks end of env. */
+      if (al != 0) free_dos_blocks(mem, ctx->psp_para);  /* Of the current child, replaced by the new one. */
+      ctx->is_exec_child = 1;
+      exec_env_block_para = block_para;
+      exec_env_size_para = env_size_para;
     }
-    if ((vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, 0)) < 0) {
-      perror("fatal: can not create KVM vcpu");
-      exit(252);
+    if (al == 0) {  /* Save the parent, before the environment and the command tail are changed below. */
+      ExecFrame * const frame = malloc(sizeof(ExecFrame));
+      if (!frame) {
+        fprintf(stderr, "fatal: out of memory for exec: %s\n", dos_filename);
+        exit(252);
+      }
+      frame->parent = ctx->exec_frame;
+      frame->regs = *regs;
+      frame->sregs = *sregs;
+      /* Return from the interrupt, like in run_dos_prog(...). */
+      frame->sregs.cs.base = (frame->sregs.cs.selector = ctx->int_cs) << 4;
+      frame->regs.rip = ctx->int_ip;
+      if (ctx->csip_ptr[2] & (1 << 9)) *(unsigned short*)&frame->regs.rflags |= (1 << 9);
+      *(unsigned short*)&frame->regs.rsp += 6;
+      *(unsigned short*)&frame->regs.rflags &= ~(1 << 0);  /* CF=0, exec succeeded. */
+      frame->psp_para = ctx->psp_para;
+      frame->env_para = ctx->env_para;
+      frame->env_limit = ctx->env_limit;
+      frame->dta_seg_ofs = ctx->dta_seg_ofs;
+      frame->malloc_strategy = ctx->malloc_strategy;
+      frame->last_dos_error_code = ctx->last_dos_error_code;
+      frame->had_get_ints = ctx->had_get_ints;
+      frame->had_get_first_mcb = ctx->had_get_first_mcb;
+      frame->ctrl_break_checking = ctx->ctrl_break_checking;
+      frame->sphinx_cmm_flags = ctx->sphinx_cmm_flags;
+      get_open_fd_bits(frame->fd_bits);
+      strcpy(frame->prog_filename, ctx->prog_filename);
+      strcpy(frame->dos_prog_abs, ctx->dos_prog_abs);
+      ctx->exec_frame = frame;
+      ++ctx->exec_depth;
+      if (DEBUG) fprintf(stderr, "debug: saved parent program for exec: depth=%u\n", ctx->exec_depth);
     }
-    kvm_run_mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (kvm_run_mmap_size < 0) {
-      perror("fatal: ioctl KVM_GET_VCPU_MMAP_SIZE");
-      exit(252);
+    if (ctx->is_exec_child) {
+      ctx->env_para = exec_env_block_para;
+      ctx->env_limit = (exec_env_block_para + exec_env_size_para) << 4;
+      ctx->psp_para = exec_env_block_para + exec_env_size_para + 1;
+    } else {  /* al == 3 in the main program: reset_emu(...) clears the memory. */
+      *(char*)env_end = '\0';  /* Hide counter for absolute program pathname. */
+      memcpy(new_env = (char*)mem + (ENV_PARA << 4), env, env_end + 2 - env);
     }
-    if ((emu->kvm_run = (struct kvm_run *)mmap(
-        NULL, kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu_fd, 0)) == NULL) {
-      perror("fatal: mmap kvm_run");
+    ctx->prog_filename = strcpy(emu->exec_fnbuf, new_prog_filename);
+    ctx->args_str = emu->fnbuf2;
+    ctx->dos_prog_abs = get_dos_abs_filename_r(ctx->prog_filename, new_prog_drive, dir_state, emu->dosfnbuf);
+    if (DEBUG) fprintf(stderr, "debug: exec prog_filename=(%s) dos_prog_abs=(%s) dos_prog_drive=%c\n", ctx->prog_filename, ctx->dos_prog_abs, new_prog_drive);
+    if (ctx->dos_prog_abs[0] == '\0') {
+      fprintf(stderr, "fatal: error getting DOS absolute filename for exec on drive %c: %s\n", new_prog_drive, ctx->prog_filename);
       exit(252);
     }
-    if (ioctl(vcpu_fd, KVM_GET_REGS, &dummy_regs) < 0) {  /* We don't use the result; but we just check here that ioctl KVM_GET_REGS works. */
-      perror("fatal: KVM_GET_REGS");
-      exit(252);
+    return DCR_EXEC;
+  } else {
+    fprintf(stderr, "fatal: unsupported loading of program with al:%02x: %s\n", al, dos_filename);
+    return DCR_FATAL_INT;
+  }
+}
+
+/* int 0x21 ah == 0x4c: Exit to DOS. */
+static unsigned short dos_call_exit(DosCallCtx *ctx) {
+  (void)ctx;
+  return DCR_EXIT;
+}
+
+/* int 0x21 ah == 0x4d: Get return code of child process. */
+static unsigned short dos_call_get_child_exit_code(DosCallCtx *ctx) {
+  *(unsigned short*)&ctx->regs->rax = ctx->child_exit_code;
+  ctx->child_exit_code = 0;  /* DOS returns it only once. */
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x4e: Find first matching file (findfirst). */
+static unsigned short dos_call_findfirst(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const unsigned short attrs = *(unsigned short*)&regs->rcx;
+  const char * const pattern = ctx->mem + ((unsigned)ctx->sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  const char *fn, *fnb, *pattern_basename;
+  const unsigned dta_linear = (ctx->dta_seg_ofs & 0xffff) + (ctx->dta_seg_ofs >> 16 << 4);
+  char *dta;
+  if (DEBUG) fprintf(stderr, "debug: findfirst pattern=(%s) attrs=0x%04x\n", pattern, attrs);
+  sync_handle_bufs(HBM_WRITE);  /* For the correct file size. */
+  if (!is_linear_byte_user_writable(dta_linear) || !is_linear_byte_user_writable(dta_linear + 0x2b - 1)) return 0x57;  /* Invalid parameter. */
+  if (attrs & 8) return 0x12;  /* No more files. Volume label requested. */
+  dta = ctx->mem + dta_linear;  /* May overlap pattern (e.g. both in the PSP), so we write it only after parsing pattern. */
+  pattern_basename = get_dos_basename(pattern);
+  if (strchr(pattern_basename, '*') || strchr(pattern_basename, '?')) {
+    const FindDir *fdir;
+    char fcb_pattern[11];
+    char *pattern_dir = emu->fnbuf2;  /* pattern with the basename replaced by "A", to get the Linux directory name. */
+    const size_t dir_size = pattern_basename - pattern;
+    char *fnp;
+    if (run_state->tracer) trace_uncacheable("directory listing (findfirst with wildcards)");
+    if (memchr(pattern, '*', dir_size) || memchr(pattern, '?', dir_size)) {  /* TODO(pts): What happens if there are wildcards in earlier pathname components? */
+      fprintf(stderr, "fatal: unsupported wildcards in findfirst directory: %s\n", pattern);
+      return DCR_FATAL;
     }
-    if (ioctl(vcpu_fd, KVM_GET_SREGS, &emu->initial_sregs) < 0) {  /* Will be reused by DOS exec(). */
-      perror("fatal: KVM_GET_SREGS");
-      exit(252);
+    if (dir_size + 2 > sizeof(emu->fnbuf2)) return 3;  /* Path not found. */
+    memcpy(pattern_dir, pattern, dir_size);
+    strcpy(pattern_dir + dir_size, "A");
+    fn = get_linux_filename(pattern_dir);
+    if (*fn == '\0') return 3;  /* Path not found. */
+    for (fnp = emu->fnbuf + strlen(emu->fnbuf); fnp != emu->fnbuf && fnp[-1] != '/'; --fnp) {}
+    *fnp = '\0';  /* Keep the trailing '/'. */
+    fdir = get_find_dir(emu->fnbuf, dir_state->case_mode[get_dos_filename_drive(pattern, dir_state) - 'A'] == CASE_MODE_LOWERCASE ? 32 : 0);
+    if (!fdir) {
+      if (errno == ENOENT || errno == ENOTDIR) return 3;  /* Path not found. */
+      return get_dos_call_linux_error();
     }
-    emu->kvm_fds.kvm_fd = kvm_fd; emu->kvm_fds.vm_fd = vm_fd; emu->kvm_fds.vcpu_fd = vcpu_fd;
+    get_fcb_pattern(pattern_basename, fcb_pattern);
+    memset(dta, '\0', 0x15);
+    *(unsigned*)dta = FINDFIRST_MAGIC;  /* Just a random value which findnext can identify. */
+    *(unsigned*)(dta + DTA_FIND_ID) = fdir->id;
+    *(unsigned short*)(dta + DTA_FIND_CURSOR) = (attrs & 0x10) ? FIND_CURSOR_DIRS : 0;
+    memcpy(dta + DTA_FIND_PATTERN, fcb_pattern, 11);
+    if (find_next_in_dta(dta) != 0) return 0x12;  /* No more files. */
+    if (DEBUG) fprintf(stderr, "debug: found dos_file=(%s) in linux_dir=(%s)\n", dta + 0x1e, fdir->linux_dir);
   } else {
-    mem = emu->mem;
-    if (madvise((char*)mem + (((PSP_PARA << 4) + 0xfff) & ~0xfff), DOS_MEM_LIMIT - (((PSP_PARA << 4) + 0xfff) & ~0xfff), MADV_DONTNEED) != 0) {
-      perror("fatal: madvise MADV_DONTNEED");
-      exit(252);
+    FindEntry fe;
+    struct stat st;
+    if (!is_dos_filename_83(pattern_basename)) return 0x12;  /* No more files. */
+    fn = get_linux_filename(pattern);
+    fnb = get_linux_basename(fn);
+    if (DEBUG) fprintf(stderr, "debug: findfirst fn=(%s) fnb=(%s)\n", fn, fnb);
+    if (strlen(fnb) > 12) return 0x12;  /* No more files. is_dos_filename_83 ensures this, but let's double check for security of the copy below. */
+    if (is_last_fn_enoent()) return 0x12;  /* No more files. */
+    if (stat_file(fn, &st) != 0) {
+      if (errno == ENOENT) { set_last_fn_enoent(); return 0x12; }  /* No more files. */
+      return get_dos_call_linux_error();
     }
-    if ((PSP_PARA << 4) & 0xfff) memset((char*) mem + (PSP_PARA << 4), '\0', -(PSP_PARA << 4) & 0xfff);  /* Partial page not cleared by madvise() above. */
-    if (*(const unsigned*)((char*)mem + (PSP_PARA << 4)) != 0) {
-      fprintf(stderr, "madvise failed to zero PSP\n");
-      exit(252);
+    if (S_ISDIR(st.st_mode) && !(attrs & 0x10)) return 0x12;  /* No more files. */
+    set_find_entry_stat(&fe, &st);
+    { const char *p = fnb;
+      char *q = fe.name, c;
+      do {  /* Secure because of the strlen(fnb) check above. */
+        c = *p++;
+        *q++ = c - 'a' + 0U <= 'z' - 'a' + 0U ? c - 32 : c;  /* Convert to uppercase. */
+      } while (c != '\0');
     }
-    memset(mem, '\0', ENV_PARA << 4);
-    memset((char*)mem + ENV_LIMIT, '\0', (PSP_PARA << 4) - ENV_LIMIT);
+    memset(dta, '\0', 0x15);  /* DTA_FIND_ID is 0, findnext will report no more files. */
+    *(unsigned*)dta = FINDFIRST_MAGIC;
+    set_find_dta(dta, &fe);
+    if (DEBUG) fprintf(stderr, "debug: found linux_file=(%s) dos_file=(%s)\n", fnb, dta + 0x1e);
   }
+  *(unsigned short*)&regs->rax = 0;  /* Undocumented, but necessary and used as a success indicator by the VAL 1995-05-27 linker val.exe. DOSBox also sets it. */
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
 }
 
-static void process_key(TtyState *tty_state, unsigned char ah, unsigned short *ax, unsigned short *flags) {
-  if (tty_state->tty_in_fd == -3) {  /* Fake keys. */
-    *ax = *tty_state->next_fake_key;
-    if (ah & 1) {
-      *flags &= ~(1 << 6);  /* ZF=0, key available in buffer. */
-    } else {
-      if (++tty_state->next_fake_key == fake_keys + sizeof(fake_keys) / sizeof(fake_keys[0])) tty_state->next_fake_key = fake_keys;
+/* int 0x21 ah == 0x4f: Find next matching file (findnext). */
+static unsigned short dos_call_findnext(DosCallCtx *ctx) {
+  const unsigned dta_linear = (ctx->dta_seg_ofs & 0xffff) + (ctx->dta_seg_ofs >> 16 << 4);
+  if (!is_linear_byte_user_writable(dta_linear) || !is_linear_byte_user_writable(dta_linear + 0x2b - 1)) return 0x57;  /* Invalid parameter. */
+  { char * const dta = ctx->mem + dta_linear;
+    if (*(unsigned*)dta != FINDFIRST_MAGIC) return 0x57;  /* Invalid parameter. */
+    if (run_state->tracer && *(unsigned*)(dta + DTA_FIND_ID) != 0) trace_uncacheable("directory listing (findnext)");
+    if (find_next_in_dta(dta) != 0) return 0x12;  /* No more files. */
+  }
+  *(unsigned short*)&ctx->regs->rax = 0;
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x51 and ah == 0x62: Get process ID (PSP) (0x51). Get PSP (0x62). */
+static unsigned short dos_call_get_psp(DosCallCtx *ctx) {
+  *(unsigned short*)&ctx->regs->rbx = ctx->psp_para;
+  return 0;
+}
+
+/* int 0x21 ah == 0x52: Get pointer to INVARS. */
+static unsigned short dos_call_get_invars(DosCallCtx *ctx) {
+  /* Microsoft Macro Assembler 6.00B driver masm.exe. */
+  (*(unsigned short*)&ctx->regs->rbx) = 0x80;
+  ctx->sregs->es.base = (ctx->sregs->es.selector = 0xfff0) << 4;
+  return 0;
+}
+
+/* int 0x21 ah == 0x56: Rename file. */
+static unsigned short dos_call_rename(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const struct kvm_sregs * const sregs = ctx->sregs;
+  EmuState * const emu = ctx->emu;
+  DirState * const dir_state = ctx->dir_state;
+  const char * const p_old = ctx->mem + ((unsigned)sregs->ds.selector << 4) + (*(unsigned short*)&regs->rdx);  /* !! Security: check bounds. */
+  const char * const p_new = ctx->mem + ((unsigned)sregs->es.selector << 4) + (*(unsigned short*)&regs->rdi);  /* !! Security: check bounds. */
+  int fd = rename_file(get_linux_filename(p_old), get_linux_filename_cached_r(p_new, dir_state, emu->fnbuf2, NULL));
+  note_dir_change();
+  if (fd < 0) return get_dos_call_linux_error();
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x57: Get/set file date and time using handle. */
+static unsigned short dos_call_file_time(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (al < 2 ) {
+    const int fd = get_linux_handle(*(unsigned short*)&regs->rbx, ctx->kvm_fds);
+    if (fd < 0) return 6;  /* Invalid handle. */
+    if (al == 0) {  /* Get. */
+      struct stat st;
+      struct tm *tm;
+      if (run_state->tracer) trace_uncacheable("file date and time query by handle");
+      sync_handle_bufs(HBM_WRITE);  /* For the correct mtime. */
+      if (fstat(fd, &st) != 0) return get_dos_call_linux_error();
+      tm = convert_clock_time(&st.st_mtime);
+      *(unsigned short*)&regs->rcx = tm->tm_sec >> 1 | tm->tm_min << 5 | tm->tm_hour << 11;
+      *(unsigned short*)&regs->rdx = tm->tm_mday | (tm->tm_mon + 1) << 5 | (tm->tm_year - 80) << 9;
+    } else {  /* Set. */
+      struct timespec tss[2];
+      sync_handle_bufs(HBM_WRITE);  /* Pending writes would change the mtime later. */
+      tss[0].tv_sec = 0;
+      tss[0].tv_nsec = UTIME_OMIT;  /* Keep the atime. */
+      tss[1].tv_sec = get_clock_dos_timestamp(*(unsigned short*)&regs->rdx, *(unsigned short*)&regs->rcx);
+      tss[1].tv_nsec = 0;
+      if (futimens(fd, tss) != 0) return get_dos_call_linux_error();
+      run_state->clock_written_fd_bits[fd >> 3] &= ~(1 << (fd & 7));  /* Don't change it at close. */
     }
+    *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
   } else {
-    /* TODO(pts): Disable line buffering if isatty(0). Enable it again at exit if needed. */
-    int got;
-    struct termios tio;
-    tcflag_t old_lflag = 0;
-    if (tty_state->tty_in_fd == -1) {
-      if ((tty_state->tty_in_fd = open("/dev/tty", O_RDWR)) < 0) {  /* Current controlling terminal. */
-        tty_state->tty_in_fd = -2;
-      } else {
-        tty_state->tty_in_fd = ensure_fd_is_at_least(tty_state->tty_in_fd, 5);
-      }
+    return 0x57;  /* Invalid parameter. */
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x58: Get/set memory allocation strategy. */
+static unsigned short dos_call_malloc_strategy(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (al == 0x00) {  /* Get. */
+    *(unsigned short*)&regs->rax = 1;  /* Best fit. */
+    *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  } else if (al == 0x01) {  /* Set. */
+    /* Programs compiled by Borland C++ 5.02 compiler bcc.exe set it with BX == MS_LAST_FIT, and return ``Out of memory'' if not implemented correctly. */
+    /* See mallocs.nasm for a test of MS_LAST_FIT functionality. */
+    *(unsigned short*)&regs->rax = *(unsigned short*)&regs->rbx;
+    *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+    ctx->malloc_strategy = *(unsigned short*)&regs->rbx;
+    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: set malloc strategy=%u\n", ctx->malloc_strategy);
+  } else {
+    return 0x57;  /* Invalid parameter. */
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x59: Get extended error information. */
+static unsigned short dos_call_get_error_info(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  *(unsigned short*)&regs->rax = ctx->last_dos_error_code;
+  if (ctx->last_dos_error_code == 0)  {  /* No error. */
+    *(unsigned short*)&regs->rbx = 0xd << 8  /* error class: unknown */ | 6  /* ignore */;
+    *(unsigned short*)&regs->rcx = *(unsigned char*)&regs->rcx | 1 << 8;  /* CH: Locus: unknown. */
+  } else {
+    *(unsigned short*)&regs->rbx = 6 << 8  /* error class: system failure */ | 4  /* abort with cleanup */;
+    *(unsigned short*)&regs->rcx = *(unsigned char*)&regs->rcx | 2 << 8;  /* CH: Locus: block device. */
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x60: Get fully qualified filename. */
+static unsigned short dos_call_get_abspath(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const struct kvm_sregs * const sregs = ctx->sregs;
+  const char * const fn = ctx->mem + ((unsigned)sregs->ds.selector << 4) + (*(unsigned short*)&regs->rsi);  /* !! Security: check bounds. */
+  char * const path_out = ctx->mem + ((unsigned)sregs->es.selector << 4) + (*(unsigned short*)&regs->rdi);  /* 128 bytes of buffer. */  /* !! Security: check bounds. */
+  get_dos_abspath_r(fn, ctx->dir_state, path_out, 128);
+  if (*path_out == '\0') return 0x100;  /* We set AH to some arbitrary error code. */
+  *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x63: Get lead byte table. Multibyte support in MS-DOS 2.25. */
+static unsigned short dos_call_get_lead_bytes(DosCallCtx *ctx) {
+  (void)ctx;
+  return DCR_UNSUPPORTED;
+}
+
+/* int 0x21 ah == 0x66: Get/set global code page. */
+static unsigned short dos_call_code_page(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char al = (unsigned char)regs->rax;
+  if (al == 1) {
+    *(unsigned short*)&regs->rbx = *(unsigned short*)&regs->rdx = 437;  /* CP-437: https://en.wikipedia.org/wiki/Code_page_437 */
+  } else {
+    return DCR_FATAL_INT;
+  }
+  return 0;
+}
+
+/* int 0x21 ah == 0x67: Set handle count. */
+static unsigned short dos_call_set_handle_count(DosCallCtx *ctx) {
+  /* https://stanislavs.org/helppc/int_21-67.html Says that only the first 20 handles are copied to the child process. */
+  *(unsigned short*)&ctx->regs->rflags &= ~(1 << 0);  /* CF=0. */
+  return 0;
+}
+
+/* int 0x21 ah == 0x71: Long filename functions (starting from Windows 95). */
+static unsigned short dos_call_lfn(DosCallCtx *ctx) {
+  const unsigned char al = (unsigned char)ctx->regs->rax;
+  if (al == 0x0d || al - 0x39 + 0U <= 0x4f - 0x39 + 0U || al == 0x56 || al == 0x60 || al == 0x6c || al - 0xa0 + 0U <= 0xaa - 0xa0 + 0U) {  /* http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/int-21.htm */
+     /* ax == 0x716c. Open or create with long file name (starting from Windows 95). http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/rb-3209.htm */
+    return DCR_UNSUPPORTED;  /* flat assembler 1.73.24 fasmlite.exe relies on this. */
+  } else {
+    return DCR_FATAL_INT;
+  }
+}
+
+static const DosCallHandler dos_call_handlers[0x100] = {
+  /* 0x00 */ NULL, dos_call_read_key_echo, dos_call_display_char, NULL, dos_call_write_aux, dos_call_write_prn, dos_call_console_io, dos_call_read_key,
+  /* 0x08 */ dos_call_read_key, dos_call_print_string, dos_call_read_line, dos_call_input_status, dos_call_flush_and_read, NULL, dos_call_select_disk, NULL,
+  /* 0x10 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x18 */ NULL, dos_call_get_drive, dos_call_set_dta, NULL, NULL, NULL, NULL, NULL,
+  /* 0x20 */ NULL, NULL, NULL, NULL, NULL, dos_call_set_int, NULL, NULL,
+  /* 0x28 */ NULL, dos_call_parse_fcb_name, dos_call_get_date, NULL, dos_call_get_time, NULL, NULL, dos_call_get_dta,
+  /* 0x30 */ dos_call_get_version, NULL, NULL, dos_call_system_values, NULL, dos_call_get_int, NULL, dos_call_switch_char,
+  /* 0x38 */ dos_call_country_info, dos_call_mkdir, dos_call_rmdir, NULL, dos_call_open, dos_call_open, dos_call_close, dos_call_read,
+  /* 0x40 */ dos_call_write, dos_call_delete, dos_call_seek, dos_call_file_attrs, dos_call_ioctl, dos_call_dup, NULL, dos_call_get_cwd,
+  /* 0x48 */ dos_call_malloc, dos_call_free, dos_call_realloc, dos_call_exec, dos_call_exit, dos_call_get_child_exit_code, dos_call_findfirst, dos_call_findnext,
+  /* 0x50 */ NULL, dos_call_get_psp, dos_call_get_invars, NULL, NULL, NULL, dos_call_rename, dos_call_file_time,
+  /* 0x58 */ dos_call_malloc_strategy, dos_call_get_error_info, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x60 */ dos_call_get_abspath, NULL, dos_call_get_psp, dos_call_get_lead_bytes, NULL, NULL, dos_call_code_page, dos_call_set_handle_count,
+  /* 0x68 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x70 */ NULL, dos_call_lfn,
+};
+
+/* int 0x21: DOS services. Reports the error of the handler to the program. */
+static unsigned short dos_call(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  /* !! Should we set CF=0 by default? What does MS-DOS do? */
+  const unsigned short result = dispatch_int_call(ctx, dos_call_handlers, sizeof(dos_call_handlers) / sizeof(dos_call_handlers[0]));
+  if (result == 0 || result > DCR_UNSUPPORTED) return result;
+  if (result == DCR_UNSUPPORTED) {
+    *(unsigned char*)&regs->rax = 0;  /* Indicate function not supported. MS-DOS 2.0 and 6.22 also do this: AL := 0, CF := 1. */
+  } else {
+    ctx->last_dos_error_code = result;
+    *(unsigned short*)&regs->rax = result > 0x12 ? 0x0d : result;  /* Invalid data. Use int 0x21 call with ah == 0x59 to get the real error. */
+    if (DEBUG) fprintf(stderr, "debug: int 0x21 call error\n");
+  }
+  *(unsigned short*)&regs->rflags |= 1 << 0;  /* CF=1. */
+  return 0;
+}
+
+/* int 0x10 ah == 0x01: Set cursor type. */
+static unsigned short video_call_set_cursor_type(DosCallCtx *ctx) {
+  *(unsigned short*)(ctx->mem + 0x460) = *(unsigned short*)&ctx->regs->rcx;
+  return 0;
+}
+
+/* int 0x10 ah == 0x02: Set cursor position. */
+static unsigned short video_call_set_cursor(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char page = *(unsigned short*)&regs->rbx >> 8;  /* Page in BH. */
+  unsigned short * const cursor_at_ptr = (unsigned short*)(ctx->mem + 0x450) + page;
+  if (page == 0) {
+    ctx->is_stdout_write_cursor = 1;
+    if (ctx->video_write_step == 2 && *cursor_at_ptr + 1 == *(unsigned short*)&regs->rdx) {  /* Move the cursor by 1 to the right. */
+      /* Write byte to stdout if it was written by int 0x10 (ah == 0x09 or ah == 0x0a), then ah == 0x03, then ah == 0x02.
+       * This is done by ASM32 1.1 assembler asm32.exe
+       */
+      write_dos_stdout(ctx, &ctx->video_byte_written, 1);
+      return 0;
     }
-    if (!tty_state->is_tty_in_error) {
-      if (tcgetattr(tty_state->tty_in_fd, &tio) != 0) {
-        tty_state->is_tty_in_error = 1;
-      } else {
-        old_lflag = tio.c_lflag;
-        /* TODO(pts): Handle Ctrl-<C> and other signals. */
-        tio.c_lflag &= ~(ICANON | ECHO);  /* As a side effect, ECHOCTL is also disabled, so Ctrl-<C> won't show up as ^C, but it will still send SIGINT. */
-        if (tcsetattr(tty_state->tty_in_fd, 0, &tio) != 0) {
-          tty_state->is_tty_in_error = 1;
+    if (*(unsigned short*)&regs->rdx <= 0xff && *cursor_at_ptr <= 0xff) {
+      if (*(unsigned short*)&regs->rdx == 0) {
+        write_stdout_buf(ctx->tty_state, "\r", 1);  /* On Linux, move to the beginning of the line. */
+      } else if (*(unsigned short*)&regs->rdx < *cursor_at_ptr) {
+        unsigned count = *cursor_at_ptr - *(unsigned short*)&regs->rdx;
+        const char * const backs = "\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08";  /* Works on TERM=xterm and TERM=linux. */
+        while (count > 0x10) {
+          write_stdout_buf(ctx->tty_state, backs, 0x10);
+          count -= 0x10;
         }
+        write_stdout_buf(ctx->tty_state, backs, count);
       }
     }
-    if (ah & 1) {
-      struct pollfd pollfd0;
-      int got;
-      pollfd0.fd = 0;
-      pollfd0.events = POLLIN;
-      got = poll(&pollfd0, 1  /* pollfd count */, 0 /* timeout */);  /* Like select(2), but faster. Easier to setup than epoll(2). */
-      if (got < 0) {
-        perror("poll stdin");
-        exit(252);
-      } else if (got) {
-        *ax =  0x011b;  /* Fake <Esc> in keyboard buffer. */
-        *flags &= ~(1 << 6);  /* ZF=0, key available. */
-      } else {
-        *flags |= (1 << 6);  /* ZF=1. */
-      }
-    } else {
-      char c;
-      if ((got = read(tty_state->tty_in_fd == -2 ? 0 : tty_state->tty_in_fd, &c, 1)) < 1) c = 26;  /* Ctrl-<Z>, simulate EOF. Most programs won't recognize it. */
-      *ax = (c & ~0x7f ? 0x3f : scancodes[(int)c]) << 8 | (c & 0xff);
+  }
+  ctx->video_write_step = 0;
+  if (page < 8) {
+     *cursor_at_ptr = *(unsigned short*)&regs->rdx;  /* DH := row; DL := column. */
+  }
+  return 0;
+}
+
+/* int 0x10 ah == 0x03: Read Cursor Position and Size. */
+static unsigned short video_call_get_cursor(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char page = *(unsigned short*)&regs->rbx >> 8;  /* Page in BH. */
+  *(unsigned short*)&regs->rcx = *(unsigned short*)(ctx->mem + 0x460);
+  *(unsigned short*)&regs->rdx = *((unsigned short*)(ctx->mem + 0x450) + page);  /* DH := row (0..24); DL := column (0..79). Both 0 by default. */
+  if (page == 0) {
+    if (!ctx->is_stdout_write_cursor) {
+      *(unsigned short*)&regs->rdx = *(unsigned short*)(ctx->mem + 0x450) = 1;  /* Report nonzero column, so subsequent "\x08" in ah == 0x2 (Set cursor position) would work. */
+      ctx->is_stdout_write_cursor = 1;
     }
-    if (!tty_state->is_tty_in_error) {
-      tio.c_lflag = old_lflag;
-      /* Since we set ECHO back here, a call with ah == 0x01
-       * followed by a call with ah == 0x00 will echo the character
-       * to the Linux terminal.
-       *
-       * TODO(pts): Fix it by not setting ECHO back here, only at exit.
-       */
-      /* TODO(pts): Also change it back upon exit. Even if it's a signal exit. */
-      if (tcsetattr(tty_state->tty_in_fd, 0, &tio) != 0) {
-        tty_state->is_tty_in_error = 1;
-      }
+    if (ctx->video_write_step == 1) {
+      ++ctx->video_write_step;  /* = 2. */
+    } else {
+       ctx->video_write_step = 0;
     }
   }
+  return 0;
+}
+
+/* int 0x10 ah == 0x08: Read character and attribute at cursor. */
+static unsigned short video_call_read_char(DosCallCtx *ctx) {
+  *(unsigned short*)&ctx->regs->rax = 0;  /* AH == attribute, AL == character. */
+  return 0;
+}
+
+/* int 0x10 ah == 0x09: Write Character and Attribute at Cursor Position (it does not move the cursor).
+ * int 0x10 ah == 0x0a: Write Character Only at Current Cursor Position.
+ */
+static unsigned short video_call_write_char(DosCallCtx *ctx) {
+  const unsigned char page = *(unsigned short*)&ctx->regs->rbx >> 8;  /* Page in BH. */
+  if (page == 0) {
+    ++ctx->video_write_step;
+    ctx->video_byte_written = *(char*)&ctx->regs->rax;
+  }
+  /* TODO(pts): Record multiple characters (CX > 1). */
+  return 0;
+}
+
+/* int 0x10 ah == 0x0e: Teletype output. */
+static unsigned short video_call_teletype(DosCallCtx *ctx) {
+  write_dos_stdout(ctx, (const char*)&ctx->regs->rax, 1);
+  return 0;
+}
+
+/* int 0x10 ah == 0x0f: Get video state. https://stanislavs.org/helppc/int_10-f.html */
+static unsigned short video_call_get_state(DosCallCtx *ctx) {
+  ctx->sphinx_cmm_flags |= 1;
+  *(unsigned short*)&ctx->regs->rax = 80 << 8 | 3;  /* 80x25. */
+  ((unsigned char*)&ctx->regs->rbx)[1] = 0;  /* BH := page (0). */
+  return 0;
+}
+
+/* int 0x10 ah == 0x12: Video subsystem configuration. https://stanislavs.org/helppc/int_10-12.html */
+static unsigned short video_call_get_config(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char bl = (unsigned char)regs->rbx;
+  if (bl == 0x10) {  /* Get video configuration information. */
+    ctx->sphinx_cmm_flags |= 2;
+    *(unsigned short*)&regs->rbx = 1 << 8 | 0;  /* Mono, 64 KiB EGA memory. */
+    *(unsigned short*)&regs->rcx = 0;  /* Feature bits and switch settings. */
+  } else {
+    fprintf(stderr, "fatal: unsupported subcall for video subsystem configuration: 0x%02x\n", bl);
+    return DCR_FATAL;
+  }
+  *(unsigned short*)&regs->rax = 80 << 8 | 3;  /* 80x25. */
+  ((unsigned char*)&regs->rbx)[1] = 0;  /* BH := page (0). */
+  return 0;
+}
+
+static const DosCallHandler video_call_handlers[] = {
+  /* 0x00 */ NULL, video_call_set_cursor_type, video_call_set_cursor, video_call_get_cursor, NULL, NULL, NULL, NULL,
+  /* 0x08 */ video_call_read_char, video_call_write_char, video_call_write_char, NULL, NULL, NULL, video_call_teletype, video_call_get_state,
+  /* 0x10 */ NULL, NULL, video_call_get_config,
+};
+
+/* int 0x10: Video output. */
+static unsigned short video_call(DosCallCtx *ctx) {
+  const unsigned char ah = ((unsigned)ctx->regs->rax >> 8) & 0xff;
+  if (ah != 0x03 && ah != 0x02) ctx->video_write_step = 0;
+  return dispatch_int_call(ctx, video_call_handlers, sizeof(video_call_handlers) / sizeof(video_call_handlers[0]));
+}
+
+/* int 0x16 ah == 0x00, 0x01, 0x10 and 0x11: Wait for keystroke and read, check buffer (do not clear). */
+static unsigned short keyboard_call_read_key(DosCallCtx *ctx) {
+  process_key(ctx->tty_state, ((unsigned)ctx->regs->rax >> 8) & 0xff, (unsigned short*)&ctx->regs->rax, (unsigned short*)&ctx->regs->rflags);
+  return 0;
+}
+
+/* int 0x16 ah == 0x02: Get keyboard status. */
+static unsigned short keyboard_call_get_status(DosCallCtx *ctx) {
+  *(unsigned char*)&ctx->regs->rax = *(const unsigned char*)(ctx->mem + 0x417);  /* In BDA, 0 by default, no modifier keys pressed. */
+  return 0;
+}
+
+/* int 0x16 ah == 0x12: Get extended keyboard status. */
+static unsigned short keyboard_call_get_ext_status(DosCallCtx *ctx) {
+  *(unsigned short*)&ctx->regs->rax = *(const unsigned short*)(ctx->mem + 0x417);  /* In BDA, 0 by default, no modifier keys pressed. */
+  return 0;
+}
+
+static const DosCallHandler keyboard_call_handlers[] = {
+  /* 0x00 */ keyboard_call_read_key, keyboard_call_read_key, keyboard_call_get_status, NULL, NULL, NULL, NULL, NULL,
+  /* 0x08 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x10 */ keyboard_call_read_key, keyboard_call_read_key, keyboard_call_get_ext_status,
+};
+
+/* int 0x16: Keyboard. */
+static unsigned short keyboard_call(DosCallCtx *ctx) {
+  return dispatch_int_call(ctx, keyboard_call_handlers, sizeof(keyboard_call_handlers) / sizeof(keyboard_call_handlers[0]));
+}
+
+/* int 0x1a ah == 0x00: Read system clock counter. */
+static unsigned short timer_call_read_clock(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  if (run_state->clock_mode == CLOCK_VIRTUAL) {
+    ctx->tick_count = get_clock_ticks();
+  } else {
+    ++ctx->tick_count;  /* We don't emulate a real clock, we just increment the tick counter whenever queried. */
+  }
+  *(unsigned char*)&regs->rax = 0;  /* No midnight yet. */
+  *(unsigned short*)&regs->rcx = ctx->tick_count >> 16;
+  *(unsigned short*)&regs->rdx = ctx->tick_count;
+  return 0;
 }
 
-static int open_dos_file(const char *dos_filename, const char *dos_prog_abs, int flags, DirState *dir_state) {
-  const int flags3 = (flags & 3);
-  int fd;
-  const char *linux_filename;
-  char *linux_lastc;  /* Last component of linux_filename. */
-  dir_state->dos_prog_abs = flags3 == O_RDONLY ? dos_prog_abs : NULL;  /* For loading the overlay from prog_filename, even if not mounted. */
-  linux_filename = get_linux_filename_r(dos_filename, dir_state, fnbuf, &linux_lastc);
-  dir_state->dos_prog_abs = NULL;  /* For security. */
-  /* There is some code duplication here with open() in run_dos_prog(). */
-  if (is_same_ascii_nocase(linux_lastc, "nul", 3) && (linux_lastc[3] == '.' || linux_lastc[3] == '\0')) {
-    strcpy(fnbuf, "/dev/null");
-  } else if (is_same_ascii_nocase(linux_lastc, "aux", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) {
-    if (flags3 != O_WRONLY) { eacces: /* Don't let the user open aux for non-writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
-      errno = EACCES; return -1;  /* Permission denied. */
-    } else {
-      if ((fd = dup(2)) < 0) { einval: errno = EINVAL; return -1; }
-    }
-    goto after_open;
-  } else if ((is_same_ascii_nocase(linux_lastc, "con", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
-             (is_same_ascii_nocase(linux_lastc, "prn", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
-             (is_same_ascii_nocase(linux_lastc, "lpt1", 4) && (linux_lastc[4] == '\0' || linux_lastc[4] == '.'))) {
-    if (flags3 == O_RDONLY) {
-      if ((fd = dup(0)) < 0) goto einval;
-    } else if (flags3 == O_WRONLY) {
-      if ((fd = dup(1)) < 0) goto einval;
-    } else {
-      goto eacces;  /* Don't let the user open prn for both reading and writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
-    }
-    goto after_open;
+static const DosCallHandler timer_call_handlers[] = {
+  /* 0x00 */ timer_call_read_clock,
+};
+
+/* int 0x1a: Timer. */
+static unsigned short timer_call(DosCallCtx *ctx) {
+  return dispatch_int_call(ctx, timer_call_handlers, sizeof(timer_call_handlers) / sizeof(timer_call_handlers[0]));
+}
+
+/* int 0x2f: Installation checks. Most services are selected by AX rather than AH. */
+static unsigned short multiplex_call(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned char ah = ((unsigned)regs->rax >> 8) & 0xff;
+  const unsigned char al = (unsigned char)regs->rax;
+  const unsigned mem_size = ctx->emu->mem_size;
+  if (ctx->int_cs == INT_STUB_PARA && ctx->int_ip == XMS_STUB_RET_OFS && mem_size > DOS_MEM_LIMIT) {  /* Called from the XMS stub. */
+    handle_xms_call(ctx->xms, ctx->mem, mem_size, ctx->emu->mem_backing, regs, ctx->sregs);
+  } else if (*(unsigned short*)&regs->rax == 0x4300 && mem_size > DOS_MEM_LIMIT) {  /* XMS installation check. */
+    *(unsigned char*)&regs->rax = 0x80;  /* Installed. */
+  } else if (*(unsigned short*)&regs->rax == 0x4310 && mem_size > DOS_MEM_LIMIT) {  /* Get XMS driver entry point. */
+    ctx->sregs->es.base = (ctx->sregs->es.selector = INT_STUB_PARA) << 4;
+    *(unsigned short*)&regs->rbx = XMS_STUB_OFS;
+  } else if (al == 0x00) {  /* Installation check. */
+    if (ah < 2 || ah == 0x15) return report_unsupported_int_ax(0x2f, regs);  /* Doesn't follow the standard format. */
+    /* ah == 0x43: XMS. */
+    *(unsigned char*)&regs->rax = 0;  /* Not installed, OK to install. */
+  } else if (*(unsigned short*)&regs->rax == 0x1687) {  /* DPMI. */
+    /* Keep it as is, DPMI not installed. */
+#if 0  /* TLINK 5.1 tlink.exe loading dpmi16bi.ovl */
+  } else if (*(unsigned short*)&regs->rax == 0xfb42) {
+  } else if (*(unsigned short*)&regs->rax == 0xfb43) {
+#endif
+  } else {
+    return report_unsupported_int_ax(0x2f, regs);
   }
-  if ((fd = open(linux_filename, flags, 0644)) < 0) return -1;
- after_open:
-  return fd;
+  return 0;
+}
+
+/* int 0x00: Division by zero.
+ * This is called only if the program doesn't override the interrupt vector.
+ * Example instructions: `xor ax, ax', `div ax'.
+ */
+static unsigned short divide_error_call(DosCallCtx *ctx) {
+  fprintf(stderr, "fatal: unhandled division by zero cs:%04x ip:%04x\n", ctx->int_cs, ctx->int_ip);
+  return 0;
+}
+
+/* int 0x11: Get BIOS equipment flags. */
+static unsigned short equipment_call(DosCallCtx *ctx) {
+  *(unsigned short*)&ctx->regs->rax = *(const unsigned short*)(ctx->mem + 0x410);
+  return 0;
+}
+
+/* int 0x15: System BIOS. */
+static unsigned short system_call(DosCallCtx *ctx) {
+  struct kvm_regs * const regs = ctx->regs;
+  const unsigned short ax = (unsigned short)regs->rax;
+  if (ax == 0xe801) {  /* Check for large free extended memory (XMS). */
+    *(unsigned short*)&regs->rflags |= 1 << 0;  /* CF=1. */  /* No large free extended memory. */
+  } else if (ax >> 8 == 0x88) {  /* Get extended memory (XMS) size. */
+    *(unsigned short*)&regs->rax = 0;  /* No extended memory. */
+    *(unsigned short*)&regs->rflags &= ~(1 << 0);  /* CF=0. */
+  } else {
+    return report_unsupported_int_ax(0x15, regs);
+  }
+  return 0;
+}
+
+/* int 0x20: Terminate program. */
+static unsigned short terminate_call(DosCallCtx *ctx) {
+  *(unsigned char*)&ctx->regs->rax = 0;  /* EXIT_SUCCESS. */
+  return DCR_EXIT;
+}
+
+/* int 0x29: Fast console output. */
+static unsigned short fast_output_call(DosCallCtx *ctx) {
+  write_dos_stdout(ctx, (const char*)&ctx->regs->rax, 1);
+  return 0;
+}
+
+/* int 0x2a: Network. */
+static unsigned short network_call(DosCallCtx *ctx) {
+  if ((((unsigned)ctx->regs->rax >> 8) & 0xff) == 0x00) {  /* Network installation query. */
+    /* By returning ah == 0x00 we indicate that the network is not installed. */
+  } else {
+    return DCR_FATAL_INT;
+  }
+  return 0;
+}
+
+/* int 0x67: Various. */
+static unsigned short ems_call(DosCallCtx *ctx) {
+  if ((unsigned short)ctx->regs->rax == 0xde00) {  /* VCPI installation check. http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/rb-7491.htm */
+    /* Doing nothing means it's not installed. */
+  } else {
+    return report_unsupported_int_ax(0x67, ctx->regs);
+  }
+  return 0;
 }
 
-static char exec_fnbuf[LINUX_PATH_SIZE];  /* Used temporarily by run_dos_prog. */
+/* Indexed by the int number. */
+static const DosCallHandler int_call_handlers[0x100] = {
+  /* 0x00 */ divide_error_call, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x08 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x10 */ video_call, equipment_call, NULL, NULL, NULL, system_call, keyboard_call, NULL,
+  /* 0x18 */ NULL, NULL, timer_call, NULL, NULL, NULL, NULL, NULL,
+  /* 0x20 */ terminate_call, dos_call, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x28 */ NULL, fast_output_call, network_call, NULL, NULL, NULL, NULL, multiplex_call,
+  /* 0x30 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x38 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x40 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x48 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x50 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x58 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x60 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, ems_call,
+};
 
 /* Runs a DOS .com or .exe program in `emu'. Cannot run DOS .bat batch files.
  * Must be preceded by init_emu(emu).
@@ -1936,67 +8812,99 @@ static char exec_fnbuf[LINUX_PATH_SIZE];  /* Used temporarily by run_dos_prog. *
  * As a side effect, sets dir_state->dos_prog_abs = NULL, and may change dir_state and tty_state.
  */
 static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filename, const char *args_str, const char* const *args, DirState *dir_state, TtyState *tty_state, const EmuParams *emu_params, const char* const *envp0) {
-  int img_fd;
   struct kvm_fds kvm_fds;
   void *mem;
   struct kvm_run *run;
+  InterpCpu *interp;  /* Software CPU, or NULL for KVM. */
   struct kvm_regs regs;
   struct kvm_sregs sregs;
-  char header[PROGRAM_HEADER_SIZE];
-  unsigned header_size;
-  char had_get_ints, had_get_first_mcb;
-  const char *dos_prog_abs;  /* Owned externally: either in args or in dosfnbuf or (after exec) within mem. */
-  unsigned tick_count;
-  unsigned char sphinx_cmm_flags;
-  char ctrl_break_checking;  /* 0 or 1. Just a flag, doesn't have any use case. */
-  unsigned dta_seg_ofs;  /* Disk transfer address (DTA). */
+  struct kvm_sregs known_sregs;  /* Copy of the vCPU sregs within KVM, valid iff is_sregs_known. Used for skipping KVM_SET_SREGS if unchanged. */
+  char is_sregs_known;
+  char is_regs_fetched;  /* Are regs and sregs up-to-date with the vCPU after KVM_RUN? */
+  /* Of the int call being handled (KVM_EXIT_HLT or KVM_EXIT_IO from a trampoline). */
+  unsigned char int_num, ah;
+  char is_sync_regs;
   unsigned ongoing_set_int;
-  unsigned short last_dos_error_code;
   const char is_hlt_ok = emu_params->is_hlt_ok;
   char port_0x40_tick;
-  unsigned char video_write_step;
-  char video_byte_written;
-  const char *stdout_write_p;
-  const char *stdout_write_end;
-  char is_stdout_write_cursor;
-  enum malloc_strategy_t { MS_FIRST_FIT = 0, MS_BEST_FIT = 1, MS_LAST_FIT = 2 };
-  unsigned malloc_strategy;
-  char cleanup_fn[16];
+  XmsState xms;
+  DosCallCtx ctx;  /* Also the DOS state of the program being run. */
 
   { struct SA { int StaticAssert_AllocParaLimits : DOS_ALLOC_PARA_LIMIT <= (DOS_MEM_LIMIT >> 4); }; }
   { struct SA { int StaticAssert_CountryInfoSize : sizeof(country_info) == 0x18; }; }
+  { struct SA { int StaticAssert_IntStubSize : INT21_STUB_OFS + sizeof(int_stub_code) <= (ENV_PARA - INT_STUB_PARA) << 4; }; }
+  { struct SA { int StaticAssert_IntStubState : ISS_SIZE <= INT21_STUB_OFS && ISS_GET_INTS + 32 <= ISS_SIZE; }; }
+  { struct SA { int StaticAssert_XmsStubOfs : INT21_STUB_OFS + sizeof(int_stub_code) == XMS_STUB_RET_OFS + 1; }; }
   { struct SA { int StaticAssert_ShortSize : sizeof(short) == 2; }; }  /* Assumed by *(unsigned short*)... in many places. */
   { struct SA { int StaticAssert_IntSize : sizeof(int) == 4; }; }  /* Assumed by *(unsigned*)... in many places. */
 
-  if ((img_fd = open(prog_filename, O_RDONLY)) < 0) {
-    fprintf(stderr, "fatal: cannot open DOS executable program: %s: %s\n", prog_filename, strerror(errno));
+  ctx.regs = &regs;
+  ctx.sregs = &sregs;
+  ctx.emu = emu;
+  ctx.dir_state = dir_state;
+  ctx.tty_state = tty_state;
+  ctx.kvm_fds = &kvm_fds;
+  ctx.xms = &xms;
+  ctx.prog_filename = prog_filename;
+  ctx.args_str = args_str;
+  if ((ctx.img_fd = open(ctx.prog_filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "fatal: cannot open DOS executable program: %s: %s\n", ctx.prog_filename, strerror(errno));
     exit(252);
   }
-  dos_prog_abs = dir_state->dos_prog_abs;
-  if (!dos_prog_abs) dos_prog_abs = "";
+  ctx.dos_prog_abs = dir_state->dos_prog_abs;
+  if (!ctx.dos_prog_abs) ctx.dos_prog_abs = "";
   dir_state->dos_prog_abs = NULL;  /* For security, use dos_prog_abs mapping only for read-only opens below. */
 
-  video_write_step = 0;
-  video_byte_written = 0;  /* Pacify uninitialized warnings. */
-  stdout_write_p = NULL;  /* Pacify uninitialized warnings. */
-  stdout_write_end = NULL;  /* Pacify uninitialized warnings. */
-  cleanup_fn[0] = '\0';
+  ctx.video_write_step = 0;
+  ctx.exec_frame = NULL;
+  ctx.exec_depth = 0;
+  ctx.is_exec_child = 0;
+  ctx.child_exit_code = 0;
+  init_xms(&xms);  /* Not for each exec, the EMBs are kept. */
 
  do_exec:
-  header_size = detect_dos_executable_program(img_fd, prog_filename, header);
-  reset_emu(emu);
+  if (run_state->timings) start_timings_exec();
+  if (!ctx.is_exec_child) {  /* A child keeps the memory (and the interrupt vectors) of the parent. */
+    reset_emu(emu, emu_params->mem_mb, emu_params->mem_backing, emu_params->cpu);
+    if (run_state->timings) {
+      run_state->timings->execs[run_state->timings->depth - 1].is_vm_new = emu->is_vm_new;
+      end_timings_phase(&run_state->timings->execs[run_state->timings->depth - 1].reset_emu_sec);
+    }
+  }
   sregs = emu->initial_sregs;
   kvm_fds = emu->kvm_fds;
-  mem = emu->mem;
+  ctx.mem = mem = emu->mem;
   run = emu->kvm_run;
+  interp = emu->interp;
   memset(&regs, '\0', sizeof(regs));
+  is_sync_regs = emu->is_sync_regs;
+  is_sregs_known = 0;  /* Force KVM_SET_SREGS below. */
+  is_regs_fetched = 1;
+  known_sregs = sregs;  /* Pacify uninitialized warnings. */
+  if (is_sync_regs) run->kvm_valid_regs = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
 
   /* Any read/write outside the regions above will trigger a KVM_EXIT_MMIO. */
   /* Fill magic interrupt table. */
-  { unsigned u;
+  if (!ctx.is_exec_child) {
+    unsigned u;
+    unsigned char * const iss = INT_STUB_STATE(mem);
+    unsigned char * const int_out = (unsigned char*)mem + (INT_OUT_PARA << 4);
+    run_state->int_trampoline = emu_params->trampoline;
+    run_state->clock_mode = emu_params->clock_mode;
+    run_state->clock_epoch = emu_params->clock_epoch;
+    run_state->is_async_io = emu_params->is_async_io;
     for (u = 0; u < 0x100; ++u) { ((unsigned*)mem)[u] = MAGIC_INT_VALUE(u); }
     memset((char*)mem + (INT_HLT_PARA << 4), 0xf4, 0x100);  /* 256 hlt instructions, one for each int. TODO(pts): Is hlt+iret faster? */
+    for (u = 0; u < 0x100; ++u) { int_out[u << 1] = 0xe6; int_out[(u << 1) + 1] = u; }  /* 256 `out int_num, al' instructions. Both kinds of trampolines work, the IVT selects one. */
+    int_out[INT_OUT_RET_OFS] = 0xca; int_out[INT_OUT_RET_OFS + 1] = 2; int_out[INT_OUT_RET_OFS + 2] = 0;  /* `retf 2', keeps the flags set by kvikdos. */
+    memcpy(iss + INT21_STUB_OFS, int_stub_code, sizeof(int_stub_code));  /* The state block is 0 after reset_emu(...). */
+    *(unsigned*)(iss + INT21_STUB_HOST_OFS) = INT_TRAMPOLINE_VALUE(0x21);
+    *(unsigned*)(iss + INT16_STUB_HOST_OFS) = INT_TRAMPOLINE_VALUE(0x16);
+    *(unsigned*)(iss + XMS_STUB_HOST_OFS) = INT_TRAMPOLINE_VALUE(0x2f);
+    memcpy(ctx.ivt_shadow, mem, sizeof(ctx.ivt_shadow));
   }
+  clear_fn_cache(emu_params->is_enoent_cache);  /* dir_state may have changed since the previous DOS program. */
+  ++run_state->find_dir_epoch;  /* Other Linux processes may have changed the directories since the previous DOS program. */
   /* !! Initialize more BIOS data area until 0x534, move magic interrupt table later.
    * https://stanislavs.org/helppc/bios_data_area.html
    */
@@ -2006,30 +8914,50 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
   /*memcpy(initial_sregs, &sregs, sizeof(sregs));*/  /* Not completely 0, but sregs.Xs.selector is 0. */
   sregs.fs.selector = sregs.gs.selector = ENV_PARA;  /* Random value after magic interrupt table. */
 
-  memcpy((char*)mem + (PROGRAM_MCB_PARA << 4), default_program_mcb, 16);
-  { char *psp_args = load_dos_executable_program(img_fd, prog_filename, mem, header, header_size, &regs, &sregs, &MCB_SIZE_PARA((char*)mem + (PROGRAM_MCB_PARA << 4))) + 0x80;
+  if (!ctx.is_exec_child) {
+    memcpy((char*)mem + (PROGRAM_MCB_PARA << 4), default_program_mcb, 16);
+    ctx.psp_para = PSP_PARA;
+    ctx.env_para = ENV_PARA;
+    ctx.env_limit = ENV_LIMIT;
+  }
+  { char *psp_args;
+    if (ctx.is_exec_child) {  /* The header has already been detected. */
+      unsigned short block_size_para = MCB_SIZE_PARA((char*)mem + (ctx.psp_para << 4) - 16);
+      memset((char*)mem + (ctx.psp_para << 4), '\0', 0x100);  /* The PSP. The free memory of the parent may contain anything. */
+      psp_args = load_dos_executable_program(ctx.img_fd, ctx.prog_filename, mem, ctx.header, ctx.header_size, ctx.psp_para, ctx.env_para, &regs, &sregs, &block_size_para) + 0x80;
+      shrink_dos_block(mem, ctx.psp_para, block_size_para);
+      *(unsigned short*)(psp_args - 0x80 + 0x16) = ctx.exec_frame->psp_para;  /* PSP of the parent. */
+      ctx.is_exec_child = 0;
+    } else if ((emu_params->snapshot_dir || emu_params->snapshot_fd >= 0) && load_snapshot(emu, emu_params, ctx.img_fd, &regs, &sregs)) {
+      psp_args = (char*)mem + (PSP_PARA << 4) + 0x80;
+      if (run_state->timings) run_state->timings->execs[run_state->timings->depth - 1].is_snapshot = 1;
+    } else {
+      ctx.header_size = detect_dos_executable_program(ctx.img_fd, ctx.prog_filename, ctx.header);
+      psp_args = load_dos_executable_program(ctx.img_fd, ctx.prog_filename, mem, ctx.header, ctx.header_size, PSP_PARA, ENV_PARA, &regs, &sregs, &MCB_SIZE_PARA((char*)mem + (PROGRAM_MCB_PARA << 4))) + 0x80;
+      if (emu_params->snapshot_dir) save_snapshot(emu, emu_params->snapshot_dir, ctx.img_fd, &regs, &sregs);
+    }
     if (args) {
       copy_args_to_dos_args(psp_args, args);
       args = NULL;  /* DOS exec() shouldn't copy them later. */
     } else {
-      const unsigned size = strlen(args_str);
+      const unsigned size = strlen(ctx.args_str);
       if (size > 0x7e) {  /* This shouldn't happen, that was checked before. */
         fprintf(stderr, "assert: exec command-line args too long\n");
         exit(252);
       }
       *psp_args++ = (char)size;
-      memcpy(psp_args, args_str, size);
+      memcpy(psp_args, ctx.args_str, size);
       psp_args[size] = '\r';
     }
   }
-  close(img_fd);
+  close(ctx.img_fd);
+  if (run_state->timings) end_timings_phase(&run_state->timings->execs[run_state->timings->depth - 1].load_sec);
 
   /* http://www.techhelpmanual.com/346-dos_environment.html */
-  { char *env = (char*)mem + (ENV_PARA << 4), *env0 = env;
-    char * const env_end = (char*)mem + ENV_LIMIT;
+  { char *env = (char*)mem + (ctx.env_para << 4), *env0 = env;
+    char * const env_end = (char*)mem + ctx.env_limit;
     char do_set_dos_path = 1;  /* This is smart, but an accasional chdir may ruin it: !(dos_prog_abs[0] == dir_state->drive && dos_prog_abs[1] == ':' && dos_prog_abs[2] == '\\' && strchr(dos_prog_abs + 3, '\\') == 0); */
-    char do_clear_after_env = envp0 == NULL;
-    if (do_clear_after_env) {
+    if (envp0 == NULL) {  /* DOS exec(...): reuse the environment of the parent. */
       while (*env++ != '\0') {
         if (DEBUG) fprintf(stderr, "debug: reusing env var (%s)\n", env - 1);
         if (!(env = memchr(env, '\0', env_end - env))) {
@@ -2038,6 +8966,7 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
         }
         ++env;
       }
+      --env;  /* Overwrite the empty variable at the end below. */
     } else {
 #if 0
       env = add_env(env, env_end, "PATH=D:\\foo;C:\\bar", 1);
@@ -2052,20 +8981,20 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
       }
       if (do_set_dos_path) {  /* Set %PATH% to the directory of dos_prog_abs. Set once. */
         size_t size;
-        if (dos_prog_abs[0] == '\0') {
+        if (ctx.dos_prog_abs[0] == '\0') {
           size = 0;
         } else {
-          const char *p = dos_prog_abs + strlen(dos_prog_abs);
-          const char *p_base = dos_prog_abs + 3;
+          const char *p = ctx.dos_prog_abs + strlen(ctx.dos_prog_abs);
+          const char *p_base = ctx.dos_prog_abs + 3;
           for (; p != p_base && p[-1] != '\\'; --p) {}
           if (p != p_base) --p;
-          if ((size_t)(env_end - env) < (size = p - dos_prog_abs) + 1 + 5) {
+          if ((size_t)(env_end - env) < (size = p - ctx.dos_prog_abs) + 1 + 5) {
             fprintf(stderr, "fatal: DOS environment too long for PATH\n");
             exit(252);
           }
         }
         memcpy(env, "PATH=", 5);
-        memcpy(env += 5, dos_prog_abs, size);
+        memcpy(env += 5, ctx.dos_prog_abs, size);
         env += size;
         *env++ = '\0';
       }
@@ -2074,9 +9003,13 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
     if (env == env0) env = add_env(env, env_end, "$=", 1);  /* Some programs such as pbc.exe would fail with an empty environment, so we create a fake variable. */
     env = add_env(env, env_end, "", 0);  /* Empty var marks end of env. */
     env = add_env(env, env_end, "\1", 0);  /* Number of subsequent variables (1). */
-    if (dos_prog_abs[0] == '\0') dos_prog_abs = "C:\\KVIKPROG.COM";  /* Not the same as in default_program_mcb. */
-    env = add_env(env, env_end, dos_prog_abs, 0);  /* Full program pathname. */
-    if (do_clear_after_env) memset(env, '\0', env_end - env);
+    if (ctx.dos_prog_abs[0] == '\0') ctx.dos_prog_abs = "C:\\KVIKPROG.COM";  /* Not the same as in default_program_mcb. */
+    env = add_env(env, env_end, ctx.dos_prog_abs, 0);  /* Full program pathname. */
+    memset(env, '\0', env_end - env);  /* The previous DOS program may have written there. */
+  }
+  if (run_state->timings) {
+    sprintf(run_state->timings->execs[run_state->timings->depth - 1].prog, "%.*s", DOS_PATH_SIZE - 1, ctx.dos_prog_abs);
+    end_timings_phase(&run_state->timings->execs[run_state->timings->depth - 1].env_sec);
   }
 
 /* We have to set both selector and base, otherwise it won't work. A `mov
@@ -2084,6 +9017,11 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
  */
 #define FIX_SREG(name) do { sregs.name.base = sregs.name.selector << 4; } while(0)
 #define SET_SREG(name, value) do { sregs.name.base = (sregs.name.selector = (value)) << 4; } while(0)
+/* Fetches regs and sregs from the vCPU after KVM_RUN if not done yet. */
+#define FETCH_REGS() do { if (!is_regs_fetched) { \
+    if (ioctl(kvm_fds.vcpu_fd, KVM_GET_REGS, &regs) < 0) { perror("fatal: KVM_GET_REGS"); exit(252); } \
+    if (ioctl(kvm_fds.vcpu_fd, KVM_GET_SREGS, &sregs) < 0) { perror("fatal: KVM_GET_SREGS"); exit(252); } \
+    known_sregs = sregs; is_sregs_known = 1; is_regs_fetched = 1; } } while (0)
   FIX_SREG(cs);
   FIX_SREG(ds);
   FIX_SREG(es);
@@ -2094,1184 +9032,183 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
   *(unsigned short*)&regs.rflags |= 1 << 1;  /* Reserved bit in EFLAGS. */
   /**(unsigned short*)&regs.rflags |= 1 << 9;*/  /* IF=1, enable interrupts. */
 
-  had_get_ints = 0;  /* 1 << 0: int 0x00; 1 << 1: int 0x18; 1 << 2: int 0x06, 1 << 3: Get DOS version, 1 << 4: 0x34. */
-  had_get_first_mcb = 0;
-  tick_count = 0;
-  sphinx_cmm_flags = 0;
-  ctrl_break_checking = 0;
-  dir_state->linux_prog = prog_filename;
-  dta_seg_ofs = 0x80 | PSP_PARA << 16;
+  ctx.had_get_ints = 0;  /* 1 << 0: int 0x00; 1 << 1: int 0x18; 1 << 2: int 0x06, 1 << 3: Get DOS version, 1 << 4: 0x34. */
+  ctx.had_get_first_mcb = 0;
+  ctx.tick_count = 0;
+  ctx.sphinx_cmm_flags = 0;
+  ctx.ctrl_break_checking = 0;
+  dir_state->linux_prog = ctx.prog_filename;
+  ctx.dta_seg_ofs = 0x80 | (unsigned)ctx.psp_para << 16;
   ongoing_set_int = 0;  /* No set_int operation ongoing. */
-  last_dos_error_code = 0;
+  ctx.last_dos_error_code = 0;
   port_0x40_tick = 0;
-  is_stdout_write_cursor = 0;
-  malloc_strategy = MS_BEST_FIT;  /* Doesn't matter which. */
+  ctx.is_stdout_write_cursor = 0;
+  ctx.malloc_strategy = MS_BEST_FIT;  /* Doesn't matter which. */
+  run_state->mcb_index->is_valid = 0;  /* Rebuild it from the new MCB chain in the first malloc(). */
 
   if (DEBUG) dump_regs("debug", &regs, &sregs);
 
   /* !! Security: close all filehandles except for 0, 1, 2 and kvm_fds, so that read and write from DOS won't be able to touch them. */
 
  set_sregs_regs_and_continue:
-  if (ioctl(kvm_fds.vcpu_fd, KVM_SET_SREGS, &sregs) < 0) {
-    perror("fatal: KVM_SET_SREGS");
-    exit(252);
+  { unsigned char * const iss = INT_STUB_STATE(mem);  /* Cheap, so do it instead of tracking changes. */
+    *(unsigned*)(iss + ISS_DTA) = ctx.dta_seg_ofs;
+    *(unsigned short*)(iss + ISS_PSP) = ctx.psp_para;
+    iss[ISS_DRIVE] = dir_state->drive - 'A';
   }
-  if (ioctl(kvm_fds.vcpu_fd, KVM_SET_REGS, &regs) < 0) {
-    perror("fatal: KVM_SET_REGS\n");
-    exit(252);
-  }
-
-  /* !! Trap it if it tries to enter protected mode (cr0 |= 1). Is this possible? */
-  for (;;) {
-    int ret = ioctl(kvm_fds.vcpu_fd, KVM_RUN, 0);
-    if (ret < 0) {
-      fprintf(stderr, "KVM_RUN failed");
-      exit(252);
+  /* Most interrupt handlers change only cs among sregs, but
+   * KVM_SET_SREGS is much more expensive in the kernel (it reloads all
+   * segment descriptors and control registers) than KVM_SET_REGS, so it's
+   * worth skipping it if unchanged.
+   */
+  if (is_sync_regs) {
+    run->s.regs.regs = regs;
+    run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+    if (!is_sregs_known || memcmp(&sregs, &known_sregs, sizeof(sregs)) != 0) {
+      run->s.regs.sregs = sregs;
+      run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
     }
-    if (ioctl(kvm_fds.vcpu_fd, KVM_GET_REGS, &regs) < 0) {
-      perror("fatal: KVM_GET_REGS");
-      exit(252);
+  } else {
+    if (!is_sregs_known || memcmp(&sregs, &known_sregs, sizeof(sregs)) != 0) {
+      if (ioctl(kvm_fds.vcpu_fd, KVM_SET_SREGS, &sregs) < 0) {
+        perror("fatal: KVM_SET_SREGS");
+        exit(252);
+      }
     }
-    if (ioctl(kvm_fds.vcpu_fd, KVM_GET_SREGS, &sregs) < 0) {
-      perror("fatal: KVM_GET_REGS");
+    if (ioctl(kvm_fds.vcpu_fd, KVM_SET_REGS, &regs) < 0) {
+      perror("fatal: KVM_SET_REGS\n");
       exit(252);
     }
-    if (DEBUG) dump_regs("debug", &regs, &sregs);
+  }
 
-    switch (run->exit_reason) {
-     case KVM_EXIT_IO:
-      { char *p = (char*)run + run->io.data_offset;
-        if (run->io.port == 0x40 && run->io.size == 1 && run->io.direction == 0) {
-          *p = port_0x40_tick++;  /* Simulate some timer ticks. */
-          break;
-        } else {
-          fprintf(stderr, "fatal: IO port: port=0x%02x data=%08x size=%d direction=%s\n", run->io.port, *(const unsigned*)p, run->io.size, run->io.direction ? "out" : "in");
-          goto fatal;
-        }
-      }
-     case KVM_EXIT_SHUTDOWN:  /* How do we trigger it? */
-      fprintf(stderr, "fatal: shutdown\n");
-      exit(252);
-     case KVM_EXIT_HLT:
-      if (sregs.cs.selector == INT_HLT_PARA && (unsigned)((unsigned)regs.rip - 1) < 0x100) {  /* hlt caused by int through our magic interrupt table. */
-        const unsigned char int_num = ((unsigned)regs.rip - 1) & 0xff;
-        const unsigned short *csip_ptr = (const unsigned short*)((char*)mem + ((unsigned)sregs.ss.selector << 4) + (*(unsigned short*)&regs.rsp));  /* !! What if rsp wraps around 64 KiB boundary? Test it. Also calculate int_cs again. */
-        const unsigned short int_ip = csip_ptr[0], int_cs = csip_ptr[1];  /* Return address. */  /* !! Security: check bounds, also check that rsp <= 0xfffe. */
-        const unsigned char ah = ((unsigned)regs.rax >> 8) & 0xff;
-        if (DEBUG) fprintf(stderr, "debug: int 0x%02x ah:%02x cs:%04x ip:%04x\n", int_num, ah, int_cs, int_ip);
-        fflush(stdout);
-        (void)ah;
-        /* Documentation about DOS and BIOS int calls: https://stanislavs.org/helppc/idx_interrupt.html */
-        if (int_num == 0x29) {
-         do_stdout_write_al:
-          stdout_write_p = (const char*)&regs.rax;
-         do_stdout_write1:
-          stdout_write_end = stdout_write_p + 1;
-         do_stdout_write:
-          if (is_stdout_write_cursor) {
-            const char *p = stdout_write_p;
-            unsigned short *cursor = (unsigned short*)((char*)mem + 0x450) + 0 /* page */;  /* DH := row (0..24); DL := column (0..79). Both 0 by default. */
-            if (*cursor <= 0xff) {
-              while (p != stdout_write_end) {
-                const char c = *p++;
-                if (c - 32U <= 126U - 32U && *cursor < 0xff) {  /* Printable ASCII. Avoid control characters and non-ASCII UTF-8. */
-                  ++*cursor;
-                } else {
-                  *cursor = 0;
-                }
-              }
-            }
-          }
-          (void)!write(1, stdout_write_p, stdout_write_end - stdout_write_p);
-        } else if (int_num == 0x20) {
-          *(unsigned char*)&regs.rax = 0;  /* EXIT_SUCCESS. */
-          goto do_exit;
-        } else if (int_num == 0x21) {  /* DOS file and memory sevices. */
-          /* !! Should we set CF=0 by default? What does MS-DOS do? */
-          if (ah == 0x4c) {  /* Exit to DOS. */
-            if (cleanup_fn[0] != '\0') unlink(get_linux_filename(cleanup_fn));
-           do_exit:
-            return (unsigned char)regs.rax;
-          } else if (ah == 0x06) {  /* Direct console I/O. */
-           func_0x06:
-            if ((unsigned char)regs.rdx != 0xff) {  /* Output. */
-              stdout_write_p = (const char*)&regs.rdx;
-              goto do_stdout_write1;
-            } else {  /* Input. */
-              unsigned short result_ax;
-              process_key(tty_state, 1, &result_ax, (unsigned short*)&regs.rflags);  /* Check availability without reading. */
-              if (*(unsigned short*)&regs.rflags & (1 << 6)) {  /* ZF==1. */
-                process_key(tty_state, 0, &result_ax, (unsigned short*)&regs.rflags);  /* Read. */
-                *(unsigned char*)&regs.rax = (unsigned char)result_ax;  /* Return only the keycode. */
-              }
-            }
-          } else if (ah == 0x07 || ah == 0x08) {  /* Wait for console input without echo. */
-            unsigned short result_ax;
-           func_0x07_or_0x08:
-            /* We should check Ctrl-<Break> with ah == 0x08, but the
-             * difference doesn't matter, bcause in kvikdos Ctrl-<Break> is
-             * never delivered.
-             */
-            process_key(tty_state, 0, &result_ax, (unsigned short*)&regs.rflags);  /* Read. */
-            *(unsigned char*)&regs.rax = (unsigned char)result_ax;  /* Return only the keycode. */
-          } else if (ah == 0x02) {  /* Display output. */
-            stdout_write_p = (const char*)&regs.rdx;
-            goto do_stdout_write1;
-          } else if (ah == 0x04) {  /* Output to STDAUX. */
-            const char c = (unsigned char)regs.rdx;
-            (void)!write(2, &c, 1);  /* Emulate STDAUX with stderr. */
-          } else if (ah == 0x05) {  /* Output to STDPRN. */
-            const char c = (unsigned char)regs.rdx;
-            (void)!write(1, &c, 1);  /* Emulate STDPRN with stdout. */
-          } else if (ah == 0x30) {  /* Get DOS version number. */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (DEBUG || DEBUG_INTVEC) fprintf(stderr, "debug: get DOS version\n");
-            had_get_ints |= 8;
-            *(unsigned short*)&regs.rax = 5 | 0 << 8;  /* 5.0. */
-            *(unsigned short*)&regs.rbx = al == 1 ? 0x1000 :  /* DOS in HMA. */
-                0xff00;  /* MS-DOS with high 8 bits of OEM serial number in BL. */
-            *(unsigned short*)&regs.rcx = 0;  /* Low 16 bits of OEM serial number in CX. */
-          } else if (ah == 0x40) {  /* Write using handle or truncate. */
-            const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-            if (fd < 0) {
-             error_invalid_handle:
-              *(unsigned short*)&regs.rax = 6;  /* Invalid handle. */
-             error_on_21:
-              { last_dos_error_code = *(unsigned short*)&regs.rax;
-                if (last_dos_error_code > 0x12) *(unsigned short*)&regs.rax = 0x0d;  /* Invalid data. Use int 0x21 call with ah == 0x59 to get the real error. */
-              }
-              *(unsigned short*)&regs.rflags |= 1 << 0;  /* CF=1. */
-              if (DEBUG) fprintf(stderr, "debug: int 0x21 call error\n");
-            } else {
-              const char *p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-              const int size = (int)*(unsigned short*)&regs.rcx;
-              int got;
-              if (size == 0) {  /* Truncate. */
-                const int got1 = lseek(fd, 0, SEEK_CUR);
-                got = got1 < 0 ? got1 : ftruncate(fd, got1);
-                if (got != 0) goto write_fault;
-              } else {
-                got = write(fd, p, size);
-                if (got < 0) { write_fault:
-                  *(unsigned short*)&regs.rax = 0x1d;  /* Write fault. */
-                  goto error_on_21;
-                }
-              }
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              *(unsigned short*)&regs.rax = got;
-            }
-          } else if (ah == 0x3f) {  /* Read using handle. */
-            const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-            if (fd < 0) {
-              goto error_invalid_handle;
-            } else {
-              char *p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-              const int size = (int)*(unsigned short*)&regs.rcx;
-              const int got = read(fd, p, size);
-              if (got < 0) {
-                *(unsigned short*)&regs.rax = 0x1e;  /* Read fault. */
-                goto error_on_21;
-              }
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              *(unsigned short*)&regs.rax = got;
-            }
-          } else if (ah == 0x09) {  /* Print string. */
-            unsigned short dx = *(unsigned short*)&regs.rdx, dx0 = dx;
-            const char *p = (char*)mem + ((unsigned)sregs.ds.selector << 4);
-            for (;;) {
-              if (p[dx] == '$') break;
-              ++dx;
-              if (dx == 0) {
-                fprintf(stderr, "fatal: !! offset overflow in print\n");  /* TODO(pts): Implement it.  */
-                exit(252);
-              }
-            }
-            stdout_write_p = p + dx0;
-            stdout_write_end = p + dx;
-            goto do_stdout_write;
-          } else if (ah == 0x2c) {  /* Get time. */
-            time_t ts = time(0);
-            struct tm *tm = localtime(&ts);
-            const unsigned char hundredths = 0;  /* TODO(pts): Use gettimeofday(2) to get it. */
-            *(unsigned short*)&regs.rcx = tm->tm_hour << 8 | tm->tm_min;
-            *(unsigned short*)&regs.rdx = tm->tm_sec << 8 | hundredths;
-          } else if (ah == 0x2a) {  /* Get date. */
-            time_t ts = time(0);
-            struct tm *tm = localtime(&ts);
-            *(unsigned char*)&regs.rax = tm->tm_wday;
-            *(unsigned short*)&regs.rcx = tm->tm_year + 1900;
-            *(unsigned short*)&regs.rdx = (tm->tm_mon + 1) << 8 | tm->tm_mday;
-          } else if (ah == 0x19) {  /* Get current drive. */
-            *(unsigned char*)&regs.rax = dir_state->drive - 'A';
-          } else if (ah == 0x47) {  /* Get current directory. */
-            char *p, *p0, *pend;
-            const char *s;
-            /* Input: DL: 0 = current drive, 1: A: */
-            if (*(unsigned char*)&regs.rdx != 0) { error_invalid_drive:
-              *(unsigned short*)&regs.rax = 0xf;  /* Invalid drive specified. */
-              goto error_on_21;
-            }
-            p0 = p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + *(unsigned short*)&regs.rsi;
-            pend = p + 63;
-            s = dir_state->current_dir[dir_state->drive - 'A'];
-            for (; *s != '\0' && p != pend; ++s, ++p) {
-              *p = *s;
-            }
-            if (p != p0 && p[-1] == '/') --p;  /* Remove trailing '/'. */
-            *p = '\0';  /* Silently truncate to 64 bytes. */
-            if (DEBUG) fprintf(stderr, "debug: get current directory on drive %c: (%s)\n", dir_state->drive, p0);
-            *(unsigned short*)&regs.rax = 0x100;  /* DOSBox 0.74-4 also does this. */
-          } else if (ah == 0x3d || ah == 0x3c) {  /* Open to handle (open()). Create to handle (creat()). */
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const int flags = (ah == 0x3c) ? O_RDWR | O_CREAT | O_TRUNC :
-                *(unsigned char*)&regs.rax & 3;  /* O_RDONLY == 0, O_WRONLY == 1, O_RDWR == 2 same in DOS and Linux. */
-            const unsigned char flags3 = (flags & 3);
-            /* For create, CX contains attributes (read-only, hidden, system, archive), we just ignore it.
-             * https://stanislavs.org/helppc/file_attributes.html
-             */
-            int fd;
-            const char *linux_filename;
-            char *linux_lastc;  /* Last component of linux_filename. */
-            if (DEBUG) fprintf(stderr, "debug: dos_open(%s) flags=0x%x\n", p, flags);
-            dir_state->dos_prog_abs = flags3 == O_RDONLY ? dos_prog_abs : NULL;  /* For loading the overlay from prog_filename, even if not mounted. */
-            linux_filename = get_linux_filename_r(p, dir_state, fnbuf, &linux_lastc);
-            dir_state->dos_prog_abs = NULL;  /* For security. */
-            if (DEBUG) fprintf(stderr, "debug: dos_open(%s) linux_filename=(%s) current_drive=%c:\n", p, linux_filename, dir_state->drive);
-            /* There is some code duplication here with "type" in run_dos_batch(). */
-            /* Since we check linux_lastc rather than linux_filename, we
-             * recognize foo\aux.bar as aux. DOSBox 0.74-4 and MS-DOS 6.22
-             * do the same, but they also fail if directory foo doesn't exist.
-             */
-            if (is_same_ascii_nocase(linux_lastc, "nul", 3) && (linux_lastc[3] == '.' || linux_lastc[3] == '\0')) {
-              strcpy(fnbuf, "/dev/null");
-            } else if (is_same_ascii_nocase(linux_lastc, "aux", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) {
-              if (flags3 != O_WRONLY) { /* Don't let the user open aux for non-writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
-                error_access_denied:
-                *(unsigned short*)&regs.rax = 5;  /* Access denied. */
-                goto error_on_21;
-              } else {
-                if ((fd = dup(2)) < 0) goto error_from_linux;
-              }
-              goto after_open;
-            } else if ((is_same_ascii_nocase(linux_lastc, "con", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
-                       (is_same_ascii_nocase(linux_lastc, "prn", 3) && (linux_lastc[3] == '\0' || linux_lastc[3] == '.')) ||
-                       (is_same_ascii_nocase(linux_lastc, "lpt1", 4) && (linux_lastc[4] == '\0' || linux_lastc[4] == '.'))) {
-              if (flags3 == O_RDONLY) {
-                if ((fd = dup(0)) < 0) goto error_from_linux;
-              } else if (flags3 == O_WRONLY) {
-                if ((fd = dup(1)) < 0) goto error_from_linux;
-              } else {
-                goto error_access_denied;  /* Don't let the user open prn for both reading and writing. This is for (partial) comaptibility with `pts-fast-dosbox. */
-              }
-              goto after_open;
-            }
-            if ((fd = open(linux_filename, flags, 0644)) < 0) { error_from_linux:
-              *(unsigned short*)&regs.rax = get_dos_error_code(errno, 0x1f);  /* By default: General failure. */
-              goto error_on_21;
-            }
-            /*dup2(fd, 20); close(fd); fd = 20;*/  /* !!! TODO(pts): This breaks .exe files created by `owcc -bdos', which allows fs <= 20. Do some fd remapping. */
-           after_open:
-            if (fd < 5) fd = ensure_fd_is_at_least(fd, 5);  /* Skip the first 5 DOS standard handles. */
-            if ((fd + 0U) >> 16) {
-              *(unsigned short*)&regs.rax = 4;  /* Too many open files. */
-              goto error_on_21;
-            }
-            if (DEBUG) fprintf(stderr, "debug: dos_open(%s) dos_fd=%d\n", p, fd);
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-            *(unsigned short*)&regs.rax = fd;
-          } else if (ah == 0x57) {  /* Get/set file date and time using handle. */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al < 2 ) {
-              const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-              if (fd < 0) goto error_invalid_handle;
-              if (al == 0) {  /* Get. */
-                struct stat st;
-                struct tm *tm;
-                if (fstat(fd, &st) != 0) goto error_from_linux;
-                tm = localtime(&st.st_mtime);
-                *(unsigned short*)&regs.rcx = tm->tm_sec >> 1 | tm->tm_min << 5 | tm->tm_hour << 11;
-                *(unsigned short*)&regs.rdx = tm->tm_mday | (tm->tm_mon + 1) << 5 | (tm->tm_year - 1980) << 9;
-              } else if (al == 0) {  /* Set. */
-                /* !! Implement this with utime(2). */
-                fprintf(stderr, "fatal: unimplemented: set file date and time: fd=%d cx:%04x dx:%04x\n", fd, *(unsigned short*)&regs.rcx, *(unsigned short*)&regs.rdx);
-                goto fatal;
-              }
-            } else { error_invalid_parameter:
-              *(unsigned short*)&regs.rax = 0x57;  /* Invalid parameter. */
-              goto error_on_21;
-            }
-          } else if (ah == 0x3e) {  /* Close using handle. */
-            const unsigned dos_handle = *(unsigned short*)&regs.rbx;
-            if (dos_handle >= 5) {  /* Don't close the standard handles, just pretend. */
-              const int fd = get_linux_handle(dos_handle, &kvm_fds);
-              if (fd < 0) goto error_invalid_handle;  /* Not strictly needed, close(...) would check. */
-              if (close(fd) != 0) goto error_from_linux;
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x45) {  /* Duplicate handle (dup()). */
-            const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-            int fd2;
-            if (fd < 0) goto error_invalid_handle;
-            fd2 = dup(fd);
-            if (fd < 0) {
-              *(unsigned short*)&regs.rax = get_dos_error_code(errno, 4);  /* By default: Too many open files. */
-              goto error_on_21;
-            }
-            if (fd2 < 5) fd2 = ensure_fd_is_at_least(fd2, 5);  /* Skip the first 5 DOS standard handles. */
-            if ((fd2 + 0U) >> 16) {
-              *(unsigned short*)&regs.rax = 4;  /* Too many open files. */
-              goto error_on_21;
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-            *(unsigned short*)&regs.rax = fd2;
-          } else if (ah == 0x39) {  /* Create subdirectory (mkdir). */
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const int result = mkdir(get_linux_filename(p), 0755);
-            if (result < 0) goto error_from_linux;
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x3a) {  /* Remove subdirectory (rmdir). */
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const int result = rmdir(get_linux_filename(p));
-            if (result < 0) goto error_from_linux;
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x41) {  /* Delete file. */
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const int fd = unlink(get_linux_filename(p));
-            if (fd < 0) goto error_from_linux;
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x56) {  /* Rename file. */
-            const char * const p_old = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const char * const p_new = (char*)mem + ((unsigned)sregs.es.selector << 4) + (*(unsigned short*)&regs.rdi);  /* !! Security: check bounds. */
-            int fd = rename(get_linux_filename(p_old), get_linux_filename_r(p_new, dir_state, fnbuf2, NULL));
-            if (fd < 0) goto error_from_linux;
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x25) {  /* Set interrupt vector. */
-            if (set_int((unsigned char)regs.rax, *(unsigned short*)&regs.rdx | sregs.ds.selector << 16, mem, had_get_ints)) goto fatal;
-          } else if (ah == 0x35) {  /* Get interrupt vector. */
-            const unsigned char get_int_num = (unsigned char)regs.rax;
-            if (DEBUG || DEBUG_INTVEC) fprintf(stderr, "debug: get interrupt vector int:%02x\n", get_int_num);
-            if (get_int_num == 0) had_get_ints |= 1;  /* Turbo Pascal 7.0 programs start with this. */
-            if (get_int_num == 0x18) had_get_ints |= 2;  /* TASM 3.2, Borland C++ 2.0 compiler bcc.exe for memory allocation. */
-            if (get_int_num == 0x06) had_get_ints |= 4;  /* TLINK 4.0. */
-            if ((had_get_ints & 8) && get_int_num == 0x34) had_get_ints |= 0x10;  /* JWasm 2.11a jwasmr.exe */
-
-            /* !!! TODO(pts): Make the default permissive in general, and enable these protections only on a flag. */
-            if ((had_get_ints & 1) ||
-                get_int_num - 0x22 + 0U <= 0x24 - 0x22 + 0U ||  /* Microsoft BASIC Professional Development System 7.10 linker pblink.exe gets interrupt vector 0x24. */
-                get_int_num == 0x18 ||  /* TASM 3.2, used for memory allocation. */
-                get_int_num == 0x06 ||  /* TLINK 4.0. */
-                get_int_num == 0x67 ||  /* WLINK 7.0. */
-                ((had_get_ints & 0x10) && (get_int_num - 0x34 + 0U <= 0x3d - 0x34 + 0U || get_int_num == 0x02 || get_int_num == 0x1b)) ||  /* JWasm 2.11a jwasmr.exe */
-                ((had_get_ints & 2) && (get_int_num == 0x1b || get_int_num == 0x3f)) ||  /* Borland Turbo C++ 1.01 compiler tcc.exe, Borland C++ 2.0 complier bcc.exe */
-               0) {
-              const unsigned short *pp = (const unsigned short*)((char*)mem + (get_int_num << 2));
-              if (DEBUG) fprintf(stderr, "debug: get interrupt vector int:%02x is cs:%04x ip:%04x\n", get_int_num, pp[1], pp[0]);
-              (*(unsigned short*)&regs.rbx) = pp[0];
-              SET_SREG(es, pp[1]);
-            } else {
-              fprintf(stderr, "fatal: unsupported get interrupt vector int:%02x\n", get_int_num);
-              goto fatal;
-            }
-          } else if (ah == 0x0b) {  /* Check input status. */
-            *(unsigned char*)&regs.rax = 0;  /* No input ready. 0xff would be input. */
-            /* If we detect Ctrl-<Break>, we should run `int 0x23'. */
-          } else if (ah == 0x42) {  /* Seek using handle. */
-            const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-            if (fd < 0) goto error_invalid_handle;
-            {
-              const unsigned whence = *(unsigned char*)&regs.rax;  /* SEEK_SET == 0, SEEK_CUR == 1, SEEK_END == 2, same in DOS and Linux. */
-              const int offset = *(unsigned short*)&regs.rcx << 16 | *(unsigned short*)&regs.rdx;  /* It's important that this is signed, because we may want to pass -1 to lseek() even on 64-bit systems. */
-              int got;
-              if (whence > 2) goto error_invalid_parameter;
-              got = lseek(fd, offset, whence);
-              if (got < 0) {
-                *(unsigned short*)&regs.rax = 0x19;  /* Seek error. (Is this the relevant code?) */
-                goto error_on_21;
-              }
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              *(unsigned short*)&regs.rdx = (unsigned)got >> 16;
-              *(unsigned short*)&regs.rax = got;
-            }
-          } else if (ah == 0x44) {  /* I/O control (ioctl). */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 1 && (*(unsigned short*)&regs.rdx >> 8)) goto error_invalid_parameter;
-            if (al < 2) {  /* Get device information (1), set device information (2). */
-              const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-              struct stat st;
-              if (fd < 0) goto error_invalid_handle;
-              if (fstat(fd, &st) != 0) goto error_from_linux;
-              if (al == 0) {  /* Get. */
-                /* DOSBox 0.74-4 PRN: 0x80a0; DOSBox 0.74-4 CON: 0x80d3; DOSBox 0.74-4 file on drive C: 0x0002. */
-                static const char fake_drive = 'C';
-                /* Without the 1 << 15 bit, the VAL 1995-05-27 linker val.exe fprintf(stdout, ...) function wouldn't write anything to stdout. DOSBox 0.74-4 doesn't set 1 << 15 on regular files. */
-                *(unsigned short*)&regs.rdx = S_ISCHR(st.st_mode) ? 1 << 15 /* reserved */ | 1 << 5  /* binary */ | 1 << 7  /* character device */ : 1 << 15 | (fake_drive - 'A') /* regular file on block device */;
-                if (DEBUG) fprintf(stderr, "debug: ioctl get_device_info dos_fd=%d linux_fd=%d result=0x%04x\n", *(unsigned short*)&regs.rbx, fd, *(unsigned short*)&regs.rdx);
-                *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              } else {
-                if (DEBUG) fprintf(stderr, "debug: ioctl get_device_info dos_fd=%d linux_fd=%d value=0x%04x\n", *(unsigned short*)&regs.rbx, fd, *(unsigned short*)&regs.rdx);
-                if (!S_ISCHR(st.st_mode)) goto error_invalid_drive;  /* We want to indicate that it's not a character device. */
-                /* TLIB 3.01 sets (dx & 0x80) to zero, to disable binary mode (and enable translation). */
-                /* We just ignore the setting. */
-              }
-            } else if (al == 8) {  /* Get whether drive is removable. */
-              unsigned char bl = (unsigned char)regs.rax;
-              if (bl == 0) bl = dir_state->drive - 'A' + 1;
-              if (bl > DRIVE_COUNT || !dir_state->linux_mount_dir[(int)bl - 1]) goto error_invalid_drive;
-              *(unsigned char*)&regs.rax = bl > 2;  /* A: (1) and B: (2) are removable (0), C: (3) etc. aren't (1). */
-            } else if (al == 0x0a) {  /* Get whether handle is local or remote. */
-              const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-              if (fd < 0) goto error_invalid_handle;
-              *(unsigned short*)&regs.rdx = 0;  /* Drive is local. */
-#if 0
-            } else if (al == 6) {
-              const int fd = get_linux_handle(*(unsigned short*)&regs.rbx, &kvm_fds);
-              if (fd < 0) goto error_invalid_handle;
-#if 0
-              *(unsigned short*)&regs.rax = 0xd;  /* Invalid data. */
-              goto error_on_21;
-#endif
-              *(unsigned short*)&regs.rax = 0xff;  /* Input is ready (0xff). */
-#endif
-            } else {
-              fprintf(stderr, "fatal: unsupported DOS ioctl call: call=0x%02x dos_fd=%d\n", al, *(unsigned short*)&regs.rbx);
-              goto fatal;
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x4a) {  /* Modify allocated memory block (inplace_realloc()). */
-            const unsigned new_size_para = *(unsigned short*)&regs.rbx;
-            const unsigned short block_para = sregs.es.selector;
-            unsigned available_para, old_size_para;
-            char * const mcb = (char*)mem + (block_para << 4) - 16;
-            char *next_mcb;
-            if (is_mcb_bad(mem, block_para) || MCB_PID(mcb) == 0) {
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc bad block_para=0x%04x new_size_para=0x%04x\n", block_para, new_size_para);
-             error_bad_mcb:
-              /*fprintf(stderr, "fatal: bad MCB\n"); goto fatal;*/
-              *(unsigned short*)&regs.rax = 7;  /* Memory control blocks destroyed. */ /* !! anasm.com reports this. From where? */
-              goto error_on_21;
-            }
-            if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc block_para=0x%04x new_size_para=0x%04x old_size_para=0x%04x\n", block_para, new_size_para, MCB_SIZE_PARA(mcb));
-            DEBUG_CHECK_ALL_MCBS(mem);
-            old_size_para = MCB_SIZE_PARA(mcb);
-            if (old_size_para != new_size_para) {
-              next_mcb = MCB_TYPE(mcb) != 'Z' ? (mcb + 16 + (old_size_para << 4)) : NULL;
-              if (next_mcb && is_mcb_bad(mem, block_para + 1 + old_size_para)) goto error_bad_mcb;
-              available_para = !next_mcb ? (unsigned)(DOS_ALLOC_PARA_LIMIT - block_para) : MCB_PID(next_mcb) != 0 ? old_size_para : old_size_para + 1 + MCB_SIZE_PARA(next_mcb);
-              if (new_size_para > available_para) {
-                *(unsigned short*)&regs.rbx = available_para;
-                if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc insufficient memory\n");
-               error_insufficient_memory:
-                *(unsigned short*)&regs.rax = 8;  /* Insufficient memory. */
-                goto error_on_21;
-              }
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: inplace_realloc block_para=0x%04x new_size_para=0x%04x available_para=0x%04x\n", block_para, new_size_para, available_para);
-              if (!next_mcb) {
-                MCB_SIZE_PARA(mcb) = new_size_para;
-              } else if (MCB_PID(next_mcb) != 0) {  /* Insert a free block after the current block. */
-                char * const free_mcb = mcb + 16 + (new_size_para << 4);
-                memcpy(free_mcb, default_program_mcb, 16);
-                MCB_TYPE(free_mcb) = 'M';
-                MCB_PID(free_mcb) = 0;  /* Mark as free. */
-                MCB_SIZE_PARA(free_mcb) = MCB_PSIZE_PARA(next_mcb) = old_size_para - new_size_para - 1;
-                MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = new_size_para;
-              } else if (new_size_para == available_para) {  /* Exact size match. Merge the following free block into the current block. */
-                const unsigned next_mcb_size_para = MCB_SIZE_PARA(next_mcb);
-                memset(next_mcb, 0, 16);
-                next_mcb = next_mcb + 16 + (next_mcb_size_para << 4);
-                MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(mcb) = available_para;
-              } else {  /* Make the following free block smaller or larger. */
-                char * const next_mcb2 = mcb + 16 + (new_size_para << 4);
-                memcpy(next_mcb2, default_program_mcb, 16);
-                MCB_TYPE(next_mcb2) = 'M';
-                MCB_PID(next_mcb2) = 0;  /* Mark as free. */
-                MCB_PSIZE_PARA(next_mcb + 16 + (MCB_SIZE_PARA(next_mcb) << 4)) =
-                    MCB_SIZE_PARA(next_mcb2) = MCB_SIZE_PARA(next_mcb) + old_size_para - new_size_para;
-                MCB_PSIZE_PARA(next_mcb2) = MCB_SIZE_PARA(mcb) = new_size_para;
-                memset(next_mcb, 0, 16);
-              }
-              if (is_mcb_bad(mem, block_para)) {
-                fprintf(stderr, "fatal: bad MCB after inplace_realloc()\n");
-                exit(252);
-              }
-              if (next_mcb && is_mcb_bad(mem, available_para = block_para + 1 + MCB_SIZE_PARA((char*)mem + (block_para << 4) - 16))) {
-                fprintf(stderr, "fatal: bad next/free MCB after inplace_realloc(): %d\n", is_mcb_bad(mem, available_para));
-                exit(252);
-              }
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x48) {  /* Allocate memory (malloc()). */
-            const unsigned alloc_size_para = *(unsigned short*)&regs.rbx;
-            if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc(0x%04x)\n", alloc_size_para);
-            /*DEBUG_CHECK_ALL_MCBS(mem);*/  /* No need, the is_mcb_bad calls below do all the checks. */
-            {
-              unsigned fit_waste_para = (unsigned)-1;
-              unsigned fit_block_para = 0;
-              unsigned fit_prev_block_para = 0;  /* Preceding block. */
-              unsigned largest_available_para = 0;
-              { /* Try to find best match. */
-                unsigned block_para = PSP_PARA, prev_block_para = 0;
-                for (;;) {
-                  const char * const mcb = (const char*)mem + (block_para << 4) - 16;
-                  unsigned size_para;
-                  if (is_mcb_bad(mem, block_para)) goto error_bad_mcb;
-                  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc find block=0x%04x...0x%04x size=0x%04x psize=0x%04x mcb_type=%c is_used=%d\n", block_para, block_para + MCB_SIZE_PARA(mcb), MCB_SIZE_PARA(mcb), MCB_PSIZE_PARA(mcb), MCB_TYPE(mcb), MCB_PID(mcb) != 0);
-                  size_para = MCB_SIZE_PARA(mcb);
-                  if (MCB_TYPE(mcb) == 'Z') {  /* Last block (must be non-free), try afterwards. */
-                    prev_block_para = block_para;
-                    block_para += 1 + size_para;
-                    if (block_para == DOS_ALLOC_PARA_LIMIT + 1) break;  /* There is nothing after the last block. */
-                    size_para = DOS_ALLOC_PARA_LIMIT - block_para;
-                    goto try_fit;
-                  } else if (MCB_PID(mcb) == 0) {  /* A free block. */
-                   try_fit:
-                    if (size_para >= alloc_size_para) {
-                      const unsigned waste_para = malloc_strategy == MS_FIRST_FIT ? block_para : malloc_strategy == MS_BEST_FIT ? size_para - alloc_size_para : /* malloc_strategy >= MS_LAST_FIT ? */ ~block_para;
-                      if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc fit prev_block=0x%04x block=0x%04x waste=0x%04x\n", prev_block_para, block_para, waste_para);
-                      if (waste_para < fit_waste_para) {
-                        fit_waste_para = waste_para;
-                        fit_block_para = block_para;
-                        fit_prev_block_para = prev_block_para;
-                      }
-                    } else if (size_para > largest_available_para) {
-                      largest_available_para = size_para;
-                    }
-                    if (MCB_PID(mcb) != 0) break;  /* Last block (non-free). */
-                  }
-                  prev_block_para = block_para;
-                  block_para += 1 + size_para;
-                }
-              }
-              if (fit_waste_para == (unsigned)-1) {
-                *(unsigned short*)&regs.rbx = largest_available_para - (largest_available_para > 0);
-                if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc insufficient memory\n");
-                goto error_insufficient_memory;
-              } else {
-                char * const prev_mcb = (char*)mem + (fit_prev_block_para << 4) - 16;
-                char * const mcb = (char*)mem + (fit_block_para << 4) - 16;
-                char * const free_mcb = (char*)mem + ((fit_block_para + alloc_size_para) << 4);
-                char mcb_error;
-                if (MCB_TYPE(prev_mcb) == 'Z') {  /* Append after last block. */
-                  if (DEBUG || DEBUG_ALLOC) {
-                    fprintf(stderr, "debug: malloc append prev_block=0x%04x block=0x%04x free=0x%04x strategy=%u\n",
-                            fit_prev_block_para, fit_block_para, fit_block_para + alloc_size_para + 1, malloc_strategy);
-                  }
-                  memcpy(mcb, default_program_mcb, 16);
-                  /*MCB_TYPE(mcb) = 'Z';*/  /* Already set. */
-                  /*MCB_PID(mcb) = PROCESS_ID;*/  /* Already set. */
-                  MCB_TYPE(prev_mcb) = 'M';
-                  MCB_PSIZE_PARA(mcb) = MCB_SIZE_PARA(prev_mcb);
-                  if (malloc_strategy != MS_LAST_FIT ||
-                     DOS_ALLOC_PARA_LIMIT - fit_block_para == alloc_size_para) {  /* Perfect fit, no need to split. */
-                    MCB_SIZE_PARA(mcb) = alloc_size_para;
-                    goto malloc_done;
-                  }
-                  /* Create free block, split it below. At this point we have enough paras to do a split. */
-                  MCB_SIZE_PARA(mcb) = DOS_ALLOC_PARA_LIMIT - fit_block_para;
-                  MCB_PID(mcb) = 0;  /* Mark it as free. */
-                  MCB_PSIZE_PARA(mcb) = MCB_SIZE_PARA(prev_mcb);
-                }
-                {  /* Change existing free block. */
-                  char * const next_mcb = mcb + (MCB_SIZE_PARA(mcb) << 4) + 16;
-                  MCB_PID(mcb) = PROCESS_ID;  /* Mark as in use. */
-                  if (DEBUG || DEBUG_ALLOC) {
-                    fprintf(stderr, "debug: malloc middle prev_block=0x%04x block=0x%04x next=0x%04x free=0x%04x is_exact_fit=%d strategy=%u\n",
-                            fit_prev_block_para, fit_block_para, fit_block_para + MCB_SIZE_PARA(mcb) + 1, fit_block_para + alloc_size_para + 1,
-                            fit_block_para + MCB_SIZE_PARA(mcb) + 1 == fit_block_para + alloc_size_para + 1, malloc_strategy);
-                  }
-                  if (free_mcb == next_mcb) {  /* Exact fit. */
-                    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc exact fit\n");
-                  } else if (malloc_strategy == MS_LAST_FIT) {  /* Not an exact fit, prepend a free block. */
-                    char * const after_mcb = mcb + ((MCB_SIZE_PARA(mcb) - alloc_size_para) << 4);
-                    memcpy(after_mcb, default_program_mcb, 16);  /* 'Z' (last) by default. */
-                    MCB_SIZE_PARA(after_mcb) = alloc_size_para;
-                    if (fit_block_para + alloc_size_para < DOS_ALLOC_PARA_LIMIT) MCB_PSIZE_PARA(next_mcb) = alloc_size_para;
-                    MCB_PSIZE_PARA(after_mcb) = MCB_SIZE_PARA(mcb) -= alloc_size_para + 1;
-                    MCB_TYPE(after_mcb) = MCB_TYPE(mcb);
-                    MCB_PID(mcb) = 0;  /* Free. */
-                    MCB_TYPE(mcb) = 'M';  /* Non-last. */
-                    mcb_error = is_mcb_bad(mem, fit_block_para);
-                    if (mcb_error) {  /* mcb, which is free now. */
-                      fprintf(stderr, "fatal: bad pre-free MCB after malloc(): %d\n", mcb_error);
-                      exit(252);
-                    }
-                    fit_block_para += MCB_SIZE_PARA(mcb) + 1;
-                    if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc last block=0x%04x\n", fit_block_para);
-                  } else {  /* Not an exact fit, append a free block. */
-                    const unsigned size_para = MCB_SIZE_PARA(mcb);
-                    memcpy(free_mcb, default_program_mcb, 16);
-                    /*MCB_TYPE(mcb) = 'M';*/  /* Not needed, already set. */
-                    MCB_PSIZE_PARA(free_mcb) = MCB_SIZE_PARA(mcb) = alloc_size_para;
-                    /* MCB_PSIZE_PARA(mcb) is already correct. */
-                    MCB_TYPE(free_mcb) = 'M';
-                    MCB_PID(free_mcb) = 0;
-                    MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(free_mcb) = size_para - alloc_size_para - 1;
-                    mcb_error = is_mcb_bad(mem, fit_block_para + alloc_size_para + 1);
-                    if (mcb_error) {  /* free_mcb. */
-                      fprintf(stderr, "fatal: bad free MCB after malloc(): %d\n", mcb_error);
-                      exit(252);
-                    }
-                  }
-                }
-               malloc_done:
-                mcb_error = is_mcb_bad(mem, fit_block_para);
-                if (mcb_error) {
-                  fprintf(stderr, "fatal: bad MCB after malloc(): %d\n", mcb_error);
-                  exit(252);
-                }
-              }
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: malloc(0x%04x) == 0x%04x\n", alloc_size_para, fit_block_para);
-              *(unsigned short*)&regs.rax = fit_block_para;  /* Insufficient memory. */
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-            }
-          } else if (ah == 0x49) {  /* Free allocated memory (free()). */
-            const unsigned block_para = (unsigned short)sregs.es.selector;
-            char *mcb = (char*)mem + (block_para << 4) - 16;
-            if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free(0x%04x)\n", block_para);
-            DEBUG_CHECK_ALL_MCBS(mem);
-            if (block_para == PSP_PARA) {  /* It's not allowed to free the program image. */
-              goto error_invalid_parameter;
-            } else if (block_para > PSP_PARA && block_para < DOS_ALLOC_PARA_LIMIT && mcb[0] == freed_mcb[0] && memcmp(mcb, freed_mcb, 16) == 0) {  /* Already free, has been freed. Succeed as noop just like DOSBox 0.74 and MS-DOS 6.22 do. */
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: already freed\n");
-            } else if (is_mcb_bad(mem, block_para)) {
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad MCB para=0x%04x: %d\n", block_para, is_mcb_bad(mem, block_para));
-              goto error_bad_mcb;
-            } else if (MCB_PID(mcb) == 0) {  /* Already free. Succeed as noop just like DOSBox 0.74 and MS-DOS 6.22 do. */
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: already free\n");
-            } else if (is_mcb_bad(mem, block_para - MCB_PSIZE_PARA(mcb) - 1)) {
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad prev MCB para=0x%04x: %d\n", block_para - MCB_PSIZE_PARA(mcb) - 1, is_mcb_bad(mem, block_para - MCB_PSIZE_PARA(mcb) - 1));
-              goto error_bad_mcb;
-            } else if (MCB_TYPE(mcb) != 'Z' && is_mcb_bad(mem, block_para + MCB_SIZE_PARA(mcb) + 1)) {
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad next MCB para=0x%04x: %d\n", block_para + MCB_SIZE_PARA(mcb) + 1, is_mcb_bad(mem, block_para + MCB_SIZE_PARA(mcb) + 1));
-              goto error_bad_mcb;
-            } else {
-              char *prev_mcb = mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4);  /* Always exists since block_para != PSP_PARA. */
-              char *next_mcb = mcb + 16 + (MCB_SIZE_PARA(mcb) << 4);
-              if (MCB_TYPE(mcb) != 'Z' && MCB_PID(next_mcb) == 0) {  /* Merge it with the following free block. */
-                char *next_mcb2 = next_mcb + 16 + (MCB_SIZE_PARA(next_mcb) << 4);
-                const unsigned next_para2 = block_para + MCB_SIZE_PARA(mcb) + 1 + MCB_SIZE_PARA(next_mcb) + 1;
-                const char next_type = MCB_TYPE(next_mcb);
-                if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: merge with next free\n");
-                if (next_type != 'Z' && is_mcb_bad(mem, next_para2)) {
-                  if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: bad next2 MCB block_para=%04x next_para=0x%04x next_para2=0x%04x: %d\n", block_para, block_para + MCB_SIZE_PARA(mcb) + 1, next_para2, is_mcb_bad(mem, next_para2));
-                  goto error_bad_mcb;
-                }
-                MCB_SIZE_PARA(mcb) += 1 + MCB_SIZE_PARA(next_mcb);
-                memset(next_mcb, 0, 16);
-                if (next_type != 'Z') MCB_PSIZE_PARA(next_mcb2) = MCB_SIZE_PARA(mcb);
-                MCB_TYPE(mcb) = next_type;
-              }
-              MCB_PID(mcb) = 0;  /* Mark it as free. */
-              if (MCB_PID(prev_mcb) == 0) {  /* Merge it with the preceding free block. */
-                const char mcb_type = MCB_TYPE(mcb);
-                if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: merge with prev free\n");
-                MCB_SIZE_PARA(prev_mcb) += 1 + MCB_SIZE_PARA(mcb);
-                memcpy(mcb, freed_mcb, 16);
-                if (mcb_type != 'Z') MCB_PSIZE_PARA(next_mcb) = MCB_SIZE_PARA(prev_mcb);
-                MCB_TYPE(prev_mcb) = mcb_type;
-                mcb = prev_mcb;
-              }
-              if (MCB_TYPE(mcb) == 'Z') {  /* Delete it as last free MCB. */
-                if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free: delete last\n");
-                prev_mcb = mcb - 16 - (MCB_PSIZE_PARA(mcb) << 4);
-                memcpy(mcb, freed_mcb, 16);
-                MCB_TYPE(prev_mcb) = 'Z';
-              }
-            }
-            if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: free(0x%04x) OK\n", block_para);
-            DEBUG_CHECK_ALL_MCBS(mem);
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x43) {  /* Get/set file attributes. */
-            const unsigned char al = (unsigned char)regs.rax;
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const char *fn;
-            if (al > 1) goto error_invalid_parameter;
-            fn = get_linux_filename(p);
-            if (al == 0) {  /* Get. */
-              struct stat st;
-              if (stat(fn, &st) != 0) goto error_from_linux;
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              *(unsigned short*)&regs.rax = (st.st_mode & 0200) ? 0 : 1;  /* Indicate DOS read-only flag if owner doesn't have write permissions on Linux. */
-            } else {  /* Set. */
-              fprintf(stderr, "fatal: unimplemented: set file attributes: attr=0x%04x filename=%s\n", *(unsigned short*)&regs.rcx, fn);
-              goto fatal;
-            }
-          } else if (ah == 0x33) {  /* Get/set system values. */
-            const unsigned char al = (unsigned char)regs.rax;
-            const unsigned char dl = (unsigned char)regs.rdx;
-            if (al == 0) {
-              *(unsigned char*)&regs.rdx = ctrl_break_checking;  /* 0 or 1. */
-            } else if (al == 1) {
-              ctrl_break_checking = (dl > 0);
-            } else if (al == 2) {
-              const unsigned char old = ctrl_break_checking;
-              ctrl_break_checking = (dl > 0);
-              *(unsigned char*)&regs.rdx = old;
-            } else if (al == 5) {
-              *(unsigned char*)&regs.rdx = 'C' - 'A' + 1;  /* Boot drive. */
-            } else if (al == 6) {
-              *(unsigned short*)&regs.rbx = 0x500;  /* DOS 5.0. */
-              *(unsigned short*)&regs.rdx = 0x100;  /* DL contains DOS revision number 0. */
-            } else {
-              fprintf(stderr, "fatal: unimplemented: get/set system values: al:%04x dl:%04x\n", al, dl);
-              goto fatal;
-            }
-          } else if (ah == 0x0e) {  /* Select disk. */
-            /* TODO(pts): Use the default drive specified here (dl + 'A') in get_linux_filename_r(...). */
-            const unsigned char dl = (unsigned char)regs.rdx;
-            if (dl < DRIVE_COUNT && dir_state->linux_mount_dir[dl]) dir_state->drive = dl + 'A';
-            *(unsigned char*)&regs.rax = 26;  /* 26 drives: 'A' .. 'Z'. */
-          } else if (ah == 0x2f) {  /* Get disk transfer address (DTA). */
-            SET_SREG(es, dta_seg_ofs >> 16);
-            *(unsigned short*)&regs.rbx = dta_seg_ofs;
-          } else if (ah == 0x1a) {  /* Set disk transfer address (DTA). */
-            dta_seg_ofs = *(unsigned short*)&regs.rdx | sregs.ds.selector << 16;
-          } else if (ah == 0x63) {  /* Get lead byte table. Multibyte support in MS-DOS 2.25. */
-            goto nonfatal_unknown_int_21_call;
-          } else if (ah == 0x38) {  /* Get/set country dependent information. */
-            const unsigned char al = (unsigned char)regs.rax;
-            char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            if (al == 0x00) {  /* Get. */
-              memcpy(p, &country_info, 0x18);
-              *(unsigned short*)&regs.rax = *(unsigned short*)&regs.rbx = 1;
-            } else {
-              fprintf(stderr, "fatal: unsupported subcall for country: 0x%02x\n", al);
-              goto fatal;
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x37) {  /* Get/set switch character (for command-line flags). */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 0x00) {  /* Get. */
-              *(unsigned char*)&regs.rax = 0;  /* Success. */
-              *(unsigned char*)&regs.rdx = '/';
-            } else if (al == 0x02) {  /* Get device prefix flag. */
-              *(unsigned char*)&regs.rdx = 0xff;  /* Device prefix /dev/... not needed. */
-            } else {
-              fprintf(stderr, "fatal: unsupported subcall for switch character: 0x%02x\n", al);
-              goto fatal;
-            }
-          } else if (ah == 0x4e) {  /* Find first matching file (findfirst). */
-            const unsigned short attrs = *(unsigned short*)&regs.rcx;
-            const char * const pattern = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            const char *fn, *fnb;
-            const unsigned dta_linear = (dta_seg_ofs & 0xffff) + (dta_seg_ofs >> 16 << 4);
-            if (DEBUG) fprintf(stderr, "debug: findfirst pattern=(%s) attrs=0x%04x\n", pattern, attrs);
-            if (!is_linear_byte_user_writable(dta_linear) || !is_linear_byte_user_writable(dta_linear + 0x2b - 1)) goto error_invalid_parameter;
-            if (attrs & 8) {  /* Volume label requested. */
-             no_more_files:
-              *(unsigned short*)&regs.rax = 0x12;  /* No more files. */
-              goto error_on_21;
-            }
-            if (strchr(pattern, '*') || strchr(pattern, '?')) {  /* TODO(pts): What happens if there are wildcards in earlier pathname components? */
-              fprintf(stderr, "fatal: unsupported wildcards in findfirst pattern: %s\n", pattern);
-              goto fatal;
-            }
-            if (!is_dos_filename_83(get_dos_basename(pattern))) goto no_more_files;
-            fn = get_linux_filename(pattern);
-            fnb = get_linux_basename(fn);
-            if (DEBUG) fprintf(stderr, "debug: findfirst fn=(%s) fnb=(%s)\n", fn, fnb);
-            if (strlen(fnb) > 12) {
-              goto no_more_files;  /* is_dos_filename_83 ensures this, but let's double check for security of the strcpy(...) below. */
-            } else {
-              char *dta;
-              struct stat st;
-              struct tm *tm;
-              if (stat(fn, &st) != 0) {
-                if (errno == ENOENT) goto no_more_files;
-                goto error_from_linux;
-              }
-              if (S_ISDIR(st.st_mode) && !(attrs & 0x10)) goto no_more_files;
-              dta = (char*)mem + dta_linear;
-              memset(dta, '\0', 0x16);
-              tm = localtime(&st.st_mtime);
-              *(unsigned*)dta = FINDFIRST_MAGIC;  /* Just a random value which findnext can identify. */
-              *(unsigned short*)(dta + 0x16) = tm->tm_sec >> 1 | tm->tm_min << 5 | tm->tm_hour << 11;
-              *(unsigned short*)(dta + 0x18) = tm->tm_mday | (tm->tm_mon + 1) << 5 | (tm->tm_year - 1980) << 9;
-              *(unsigned*)(dta + 0x1a) = (sizeof(st.st_size) > 4 && st.st_size >> (32 * (sizeof(st.st_size) > 4))) ?
-                  0xffffffffU : st.st_size + (size_t)0;  /* Cap file size at 0xffffffff, no way to return more than 32 bits. */
-              { const char *p = fnb;
-                char *q = dta + 0x1e, c;
-                do {  /* Secure because of the strlen(fnb) check above. */
-                  c = *p++;
-                  *q++ = c - 'a' + 0U <= 'z' - 'a' + 0U ? c - 32 : c;  /* Convert to uppercase. */
-                } while (c != '\0');
-                /*strcpy(dta + 0x1e, fnb);*/  /* Secure because of the strlen(fnb) check above. */
-                /* We use up to 0x1e + 13 == 0x2b bytes in dta. */
-                if (DEBUG) fprintf(stderr, "debug: found linux_file=(%s) dos_file=(%s)\n", fnb, dta + 0x1e);
-              }
-            }
-            *(unsigned short*)&regs.rax = 0;  /* Undocumented, but necessary and used as a success indicator by the VAL 1995-05-27 linker val.exe. DOSBox also sets it. */
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x4f) {  /* Find next matching file (findnext). */
-            const unsigned dta_linear = (dta_seg_ofs & 0xffff) + (dta_seg_ofs >> 16 << 4);
-            if (!is_linear_byte_user_writable(dta_linear) || !is_linear_byte_user_writable(dta_linear + 0x2b - 1)) goto error_invalid_parameter;
-            { char * const dta = (char*)mem + dta_linear;
-              if (*(unsigned*)dta != FINDFIRST_MAGIC) goto error_invalid_parameter;
-              goto no_more_files;
-            }
-          } else if (ah == 0x37) {  /* Get/set switch character (for command-line flags). */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 0x00) {  /* Get. */
-              *(unsigned char*)&regs.rax = 0;  /* Success. */
-              *(unsigned char*)&regs.rdx = '/';
-            } else {
-              fprintf(stderr, "fatal: unsupported subcall for switch character: 0x%02x\n", al);
-              goto fatal;
-            }
-          } else if (ah == 0x51 || ah == 0x62) {  /* Get process ID (PSP) (0x51). Get PSP (0x62). */
-            *(unsigned short*)&regs.rbx = PSP_PARA;
-          } else if (ah == 0x59) {  /* Get extended error information. */
-            *(unsigned short*)&regs.rax = last_dos_error_code;
-            if (last_dos_error_code == 0)  {  /* No error. */
-              *(unsigned short*)&regs.rbx = 0xd << 8  /* error class: unknown */ | 6  /* ignore */;
-              *(unsigned short*)&regs.rcx = *(unsigned char*)&regs.rcx | 1 << 8;  /* CH: Locus: unknown. */
-            } else {
-              *(unsigned short*)&regs.rbx = 6 << 8  /* error class: system failure */ | 4  /* abort with cleanup */;
-              *(unsigned short*)&regs.rcx = *(unsigned char*)&regs.rcx | 2 << 8;  /* CH: Locus: block device. */
-            }
-          } else if (ah == 0x60) {  /* Get fully qualified filename. */
-            const char * const fn = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rsi);  /* !! Security: check bounds. */
-            char * const path_out = (char*)mem + ((unsigned)sregs.es.selector << 4) + (*(unsigned short*)&regs.rdi);  /* 128 bytes of buffer. */  /* !! Security: check bounds. */
-            get_dos_abspath_r(fn, dir_state, path_out, 128);
-            if (*path_out == '\0') {
-              *(unsigned short*)&regs.rax = 0x100;  /* We set AH to some arbitrary error code. */
-              goto error_on_21;
-            }
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x67) {  /* Set handle count. */
-            /* https://stanislavs.org/helppc/int_21-67.html Says that only the first 20 handles are copied to the child process. */
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else if (ah == 0x52) {  /* Get pointer to INVARS. */
-            /* Microsoft Macro Assembler 6.00B driver masm.exe. */
-            (*(unsigned short*)&regs.rbx) = 0x80;
-            SET_SREG(es, 0xfff0);
-          } else if (ah == 0x29) {  /* Parse filename for FCB. */
-            const char * const p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rsi);  /* !! Security: check bounds. */
-            if (*p == '\0' || *p == '\r' || *p == '\n') {
-              char *q = (char*)mem + ((unsigned)sregs.es.selector << 4) + (*(unsigned short*)&regs.rdi);  /* !! Security: check bounds. */
-              /* al == 1, *p == '\r' in Microsoft Macro Assembler 6.00B driver masm.exe. */
-              /* al == 0, *p == '\n' in Power C 2.2.0 compiler pc.exe. */
-              *(unsigned char*)&regs.rax = 0;  /* No wildchar characters present. */
-              *q++ = '\0';  /* Drive: 0 is default. */
-              memset(q, ' ', 12);  /* Filename (8) and extension (3). */
-              /* Don't update SI. */
-            } else {
-              fprintf(stderr, "fatal: unsupported parsing of filename: %s\n", p);  /* For ml.exe, this filename is completely broken, it starts with \r, also in DOSBox. */
-              goto fatal_int;
-            }
-          } else if (ah == 0x58) {  /* Get/set memory allocation strategy. */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 0x00) {  /* Get. */
-              *(unsigned short*)&regs.rax = 1;  /* Best fit. */
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-            } else if (al == 0x01) {  /* Set. */
-              /* Programs compiled by Borland C++ 5.02 compiler bcc.exe set it with BX == MS_LAST_FIT, and return ``Out of memory'' if not implemented correctly. */
-              /* See mallocs.nasm for a test of MS_LAST_FIT functionality. */
-              *(unsigned short*)&regs.rax = *(unsigned short*)&regs.rbx;
-              *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-              malloc_strategy = *(unsigned short*)&regs.rbx;
-              if (DEBUG || DEBUG_ALLOC) fprintf(stderr, "debug: set malloc strategy=%u\n", malloc_strategy);
-            } else {
-              goto error_invalid_parameter;
-            }
-          } else if (ah == 0x4b) {  /* Load or execute program (exec). */
-            const unsigned char al = (unsigned char)regs.rax;
-            const char * const dos_filename = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-            if (al == 0 || al == 3) {  /* Microsoft Macro Assembler 6.00B driver masm.exe uses it with al == 3. */
-              const char * const params = (char*)mem + ((unsigned)sregs.es.selector << 4) + (*(unsigned short*)&regs.rbx);  /* !! Security: check bounds. */
-              const unsigned short load_para = al != 0 ? ((unsigned short*)params)[0] : 0;
-              /*const unsigned short relocation_factor = *(unsigned short*)(params + 2);*/
-              char * const psp = (al != 0 && load_para >= PSP_PARA + 0x10 && load_para < DOS_ALLOC_PARA_LIMIT) ? (char*)mem + ((unsigned)(load_para - 0x10) << 4) : NULL;
-              const unsigned short env_para = al == 0 ? (((unsigned short*)params)[0] ? ((unsigned short*)params)[0] : ENV_PARA) : psp ? *(const unsigned short*)(psp + 0x2c) : 0;
-              char * const env = ((al == 0 && env_para == ENV_PARA) || (env_para >= PSP_PARA + 0x10 && env_para < DOS_ALLOC_PARA_LIMIT)) ? (char*)mem + (env_para << 4) : NULL;
-              const char *env_end = env ? env + (((PROGRAM_MCB_PARA - ENV_PARA < DOS_ALLOC_PARA_LIMIT - env_para) ? PROGRAM_MCB_PARA - ENV_PARA : DOS_ALLOC_PARA_LIMIT - env_para) << 4) : NULL;
-              char * const args = al == 0 ?  (char*)mem + (((unsigned short*)params)[2] << 4) + ((unsigned short*)params)[1] + 1  /* (args - 1) is Pascal string with terminating '\r'. */
-                                : psp ? psp + 0x81 : NULL;
-              const unsigned char args_size = args ? (unsigned char)args[-1] : 0;
-              const char is_args_normal = args && (args_size < 0x7f && args[args_size] == '\0'); /* '\0' for al == 0 when Borland C++ 2.0 compiler bcc.exe is running tlink.exe */
-              const char is_args_ok = is_args_normal || (args && args_size == '\n' && args[0] == '\n' && args[1] == '.');  /* Power C 2.2.0 compiler pc.exe. Copy all 128 bytes to new PSP. */
-              const char is_dos_filename_high = sregs.ds.selector + (*(unsigned short*)&regs.rdx >> 4) >= PSP_PARA;  /* So that dos_filename won't overlap new_env below. */
-              char *new_env;
-              char new_prog_drive;
-              int reason;
-              if (is_args_normal) args[args_size] = '\0';  /* It was '\r'. */
-              if (!(env && is_args_ok && is_dos_filename_high)) {
-                if (is_args_normal) args[args_size] = '\0';
-                fprintf(stderr, "fatal: bounds check failed (env_ok=%d args_ok=%d, fn_ok=%d) env when loading program=(%s) with args=(%s)\n",
-                        env != NULL, is_args_ok, is_dos_filename_high,
-                        dos_filename, is_args_normal ? args : NULL);
-                if (is_args_normal) args[args_size] = '\r';
-                goto fatal_int;
-              }
-              if (0 && al == 0) {  /* TODO(pts): Why stop? */
-                /* Power C 2.2.0 compiler pc.exe. */
-                fprintf(stderr, "fatal: unsupported exec with al:%02d: %s\n", al, dos_filename);
-                goto fatal_int;
-              }
-              /* Even with al == 0, the correct behavior would be resuming
-               * execution of the parent proess (e.g. Borland C++ 2.0
-               * compiler bcc.exe) after the child process (e.g. TLINK 4.0
-               * linker tlink.exe) has finished (and then e.g. print the
-               * ``Available memory'' message and remove the `turboc.$ln'
-               * file). However, kvikdos is not smart enough for that, so it
-               * just does an exec() and forgets about the parent process.
-               */
-              if ((reason = should_skip_exec_program(dos_filename, is_args_normal ? args : NULL, env, &env_end, had_get_first_mcb)) > 0) {
-                fprintf(stderr, "fatal: unsupported program to load: al:%02x reason=%d program=(%s) args=(%s)\n", al, reason, dos_filename, is_args_normal ? args : NULL);
-                goto fatal_int;
-              }
-              if (reason == -1 && is_args_normal && cleanup_fn[0] == '\0' && args[0] == '@' && strlen(args) <= sizeof(cleanup_fn)) {
-                strcpy(cleanup_fn, args + 1);  /* Example args: "@turboc.$ln". */
-                if (DEBUG) fprintf(stderr, "debug: will remove file at exit: %s\n", cleanup_fn);
-              }
-              dir_state->dos_prog_abs = dos_prog_abs;  /* For loading the overlay from prog_filename, even if not mounted. */
-              prog_filename = get_linux_filename_r(dos_filename, dir_state, exec_fnbuf, NULL);
-              dir_state->dos_prog_abs = NULL;  /* For security. */
-              new_prog_drive = get_dos_filename_drive(dos_filename, dir_state);
-              if (prog_filename[0] == '\0' || new_prog_drive == '\0') {
-                fprintf(stderr, "fatal: bad program filename for loading: %s\n", dos_filename);
-                goto fatal_int;
-              }
-              if ((img_fd = open(prog_filename, O_RDONLY)) < 0) {
-                /*goto error_from_linux;*/  /* We don't know how to report the error properly here (it's not a normal int 0x21 call. */
-                fprintf(stderr, "fatal: cannot open DOS executable program for loading: %s: %s\n", prog_filename, strerror(errno));
-                goto fatal_int;
-              }
-              *(char*)env_end = '\0';  /* Hide counter for absolute program pathname. */
-              memcpy(new_env = (char*)mem + (ENV_PARA << 4), env, env_end + 2 - env);
-              if (!is_args_normal) {
-                fprintf(stderr, "fatal: bad args when loading: %s\n", dos_filename);
-                goto fatal_int;
-              }
-              strcpy(fnbuf2, args);  /* Large enough to hold 0x7f bytes. */
-              args_str = fnbuf2;
-              dos_prog_abs = get_dos_abs_filename_r(prog_filename, new_prog_drive, dir_state, dosfnbuf);
-              if (DEBUG) fprintf(stderr, "debug: exec prog_filename=(%s) dos_prog_abs=(%s) dos_prog_drive=%c\n", prog_filename, dos_prog_abs, new_prog_drive);
-              if (dos_prog_abs[0] == '\0') {
-                fprintf(stderr, "fatal: error getting DOS absolute filename for exec on drive %c: %s\n", new_prog_drive, prog_filename);
-                exit(252);
-              }
-              goto do_exec;
-            } else {
-              fprintf(stderr, "fatal: unsupported loading of program with al:%02x: %s\n", al, dos_filename);
-              goto fatal_int;
-            }
-          } else if (ah == 0x0a) {  /* Buffered keyboard input. */
-           func_0x0a: {
-              char *p = (char*)mem + ((unsigned)sregs.ds.selector << 4) + (*(unsigned short*)&regs.rdx);  /* !! Security: check bounds. */
-              unsigned size = *(unsigned char*)p++;
-              char *q = ++p, *q_end = q + size;
-              for (; q != q_end; ++q) {
-                const int got = read(0, q, 1);  /* STDIN_FILENO. */
-                char c;
-                if (got <= 0) break;
-                if ((c = *q) == '\n') {
-                  *q++ = '\r'; break;
-                } else if (c == '\0') {
-                  *q = '\1';  /* Never report control keys: '\0' + another character. */
-                }
-              }
-              p[-1] = q - p;  /* Return number of bytes read. */
-            }
-          } else if (ah == 0x01) {  /* Keyboard input with echo. */
-            char c;
-            int got;
-           func_0x01:
-            if ((got = read(0, &c, 1)) <= 0) {  /* STDIN_FILENO. */
-              c = 0x1a;  /* Ctrl-<Z>, EOF. */
-            } else if (c == '\0') {
-              c = '\1';  /* Never report control keys: '\0' + another character. */
-            }
-            *(unsigned char*)&regs.rax = c;
-          } else if (ah == 0x0c) {  /* Clear keyboard buffer and invoke keyboard function. */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 0x01) {
-              goto func_0x01;
-            } else if (al == 0x06) {
-              goto func_0x06;
-            } else if (al == 0x07 || al == 0x08) {
-              goto func_0x07_or_0x08;
-            } else if (al == 0x0a) {
-              goto func_0x0a;
-            } else {
-              *(unsigned char*)&regs.rax = 0;  /* DOSBox 0.74-4 does this. What should we do? */
-            }
-          } else if (ah == 0x71) {
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 0x0d || al - 0x39 + 0U <= 0x4f - 0x39 + 0U || al == 0x56 || al == 0x60 || al == 0x6c || al - 0xa0 + 0U <= 0xaa - 0xa0 + 0U) {  /* http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/int-21.htm */
-               /* ax == 0x716c. Open or create with long file name (starting from Windows 95). http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/rb-3209.htm */
-              goto nonfatal_unknown_int_21_call;  /* flat assembler 1.73.24 fasmlite.exe relies on this. */
-            } else {
-              goto fatal_int;
-            }
-          } else if (ah == 0x66) {  /* Get/set global code page. */
-            const unsigned char al = (unsigned char)regs.rax;
-            if (al == 1) {
-              *(unsigned short*)&regs.rbx = *(unsigned short*)&regs.rdx = 437;  /* CP-437: https://en.wikipedia.org/wiki/Code_page_437 */
-            } else {
-              goto fatal_int;
-            }
-          } else {
-            goto fatal_int;
-           nonfatal_unknown_int_21_call:
-            *(unsigned char*)&regs.rax = 0;  /* Indicate function not supported. MS-DOS 2.0 and 6.22 also do this: AL := 0, CF := 1. */
-            *(unsigned short*)&regs.rflags |= 1 << 0;  /* CF=1. */
-          }
-        } else if (int_num == 0x10) {  /* Video output. */
-          if (ah != 0x03 && ah != 0x02) video_write_step = 0;
-          if (ah == 0x0e) {  /* Teletype output. */
-            goto do_stdout_write_al;
-          } else if (ah == 0x0f) {  /* Get video state. https://stanislavs.org/helppc/int_10-f.html */
-            sphinx_cmm_flags |= 1;
-            *(unsigned short*)&regs.rax = 80 << 8 | 3;  /* 80x25. */
-            ((unsigned char*)&regs.rbx)[1] = 0;  /* BH := page (0). */
-          } else if (ah == 0x08) {  /* Read character and attribute at cursor. */
-            *(unsigned short*)&regs.rax = 0;  /* AH == attribute, AL == character. */
-          } else if (ah == 0x09 ||  /* Write Character and Attribute at Cursor Position (it does not move the cursor). */
-                     ah == 0x0a) {  /* Write Character Only at Current Cursor Position. */
-            const unsigned char page = *(unsigned short*)&regs.rbx >> 8;  /* Page in BH. */
-            if (page == 0) {
-              ++video_write_step;
-              video_byte_written = *(char*)&regs.rax;
-            }
-            /* TODO(pts): Record multiple characters (CX > 1). */
-          } else if (ah == 0x03) {  /* Read Cursor Position and Size. */
-            const unsigned char page = *(unsigned short*)&regs.rbx >> 8;  /* Page in BH. */
-            *(unsigned short*)&regs.rcx = *(unsigned short*)((char*)mem + 0x460);
-            *(unsigned short*)&regs.rdx = *((unsigned short*)((char*)mem + 0x450) + page);  /* DH := row (0..24); DL := column (0..79). Both 0 by default. */
-            if (page == 0) {
-              if (!is_stdout_write_cursor) {
-                *(unsigned short*)&regs.rdx = *(unsigned short*)((char*)mem + 0x450) = 1;  /* Report nonzero column, so subsequent "\x08" in ah == 0x2 (Set cursor position) would work. */
-                is_stdout_write_cursor = 1;
-              }
-              if (video_write_step == 1) {
-                ++video_write_step;  /* = 2. */
-              } else {
-                 video_write_step = 0;
-              }
-            }
-          } else if (ah == 0x02) {  /* Set cursor position. */
-            const unsigned char page = *(unsigned short*)&regs.rbx >> 8;  /* Page in BH. */
-            unsigned short * const cursor_at_ptr = (unsigned short*)((char*)mem + 0x450) + page;
-            if (page == 0) {
-              is_stdout_write_cursor = 1;
-              if (video_write_step == 2 && *cursor_at_ptr + 1 == *(unsigned short*)&regs.rdx) {  /* Move the cursor by 1 to the right. */
-                /* Write byte to stdout if it was written by int 0x10 (ah == 0x09 or ah == 0x0a), then ah == 0x03, then ah == 0x02.
-                 * This is done by ASM32 1.1 assembler asm32.exe
-                 */
-                stdout_write_p = &video_byte_written;
-                goto do_stdout_write1;
-              }
-              if (*(unsigned short*)&regs.rdx <= 0xff && *cursor_at_ptr <= 0xff) {
-                if (*(unsigned short*)&regs.rdx == 0) {
-                  (void)!write(1, "\r", 1);  /* On Linux, move to the beginning of the line. */
-                } else if (*(unsigned short*)&regs.rdx < *cursor_at_ptr) {
-                  unsigned count = *cursor_at_ptr - *(unsigned short*)&regs.rdx;
-                  const char * const backs = "\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08\x08";  /* Works on TERM=xterm and TERM=linux. */
-                  while (count > 0x10) {
-                    (void)!write(1, backs, 0x10);
-                    count -= 0x10;
-                  }
-                  (void)!write(1, backs, count);
-                }
-              }
-            }
-            video_write_step = 0;
-            if (page < 8) {
-               *cursor_at_ptr = *(unsigned short*)&regs.rdx;  /* DH := row; DL := column. */
-            }
-          } else if (ah == 0x01) {  /* Set cursor type. */
-            *(unsigned short*)((char*)mem + 0x460) = *(unsigned short*)&regs.rcx;
-          } else if (ah == 0x12) {  /* Video subsystem configuration. https://stanislavs.org/helppc/int_10-12.html */
-            const unsigned char bl = (unsigned char)regs.rbx;
-            if (bl == 0x10) {  /* Get video configuration information. */
-              sphinx_cmm_flags |= 2;
-              *(unsigned short*)&regs.rbx = 1 << 8 | 0;  /* Mono, 64 KiB EGA memory. */
-              *(unsigned short*)&regs.rcx = 0;  /* Feature bits and switch settings. */
-            } else {
-              fprintf(stderr, "fatal: unsupported subcall for video subsystem configuration: 0x%02x\n", bl);
-              goto fatal;
-            }
-            *(unsigned short*)&regs.rax = 80 << 8 | 3;  /* 80x25. */
-            ((unsigned char*)&regs.rbx)[1] = 0;  /* BH := page (0). */
-          } else {
-            goto fatal_int;
-          }
-        } else if (int_num == 0x1a) {  /* Timer. */
-          if (ah == 0x00) {  /* Read system clock counter. */
-            ++tick_count;  /* We don't emulate a real clock, we just increment the tick counter whenever queried. */
-            *(unsigned char*)&regs.rax = 0;  /* No midnight yet. */
-            *(unsigned short*)&regs.rcx = tick_count >> 16;
-            *(unsigned short*)&regs.rdx = tick_count;
-          } else {
-            goto fatal_int;
-          }
-        } else if (int_num == 0x16) {  /* Keyboard. */
-          if (ah == 0x12) {  /* Get extended keyboard status. */
-            *(unsigned short*)&regs.rax = *(const unsigned short*)((const char*)mem + 0x417);  /* In BDA, 0 by default, no modifier keys pressed. */
-          } else if (ah == 0x02) {  /* Get keyboard status. */
-            *(unsigned char*)&regs.rax = *(const unsigned char*)((const char*)mem + 0x417);  /* In BDA, 0 by default, no modifier keys pressed. */
-          } else if (ah == 0x01 || ah == 0x11 ||  /* Check buffer, do not clear. */
-                     ah == 0x00 || ah == 0x10) {  /* Wait for keystroke and read. */
-            process_key(tty_state, ah, (unsigned short*)&regs.rax, (unsigned short*)&regs.rflags);
-          } else {
-            goto fatal_int;
-          }
-        } else if (int_num == 0x2a) {  /* Network. */
-          if (ah == 0x00) {  /* Network installation query. */
-            /* By returning ah == 0x00 we indicate that the network is not installed. */
-          } else {
-            goto fatal_int;
-          }
-        } else if (int_num == 0x11) {  /* Get BIOS equipment flags. */
-          *(unsigned short*)&regs.rax = *(const unsigned short*)((const char*)mem + 0x410);
-        } else if (int_num == 0x2f) {  /* Installation checks. */
-          const unsigned char al = (unsigned char)regs.rax;
-          if (al == 0x00) {  /* Installation check. */
-            if (ah < 2 || ah == 0x15) goto fatal_uic;  /* Doesn't follow the standard format. */
-            /* ah == 0x43: XMS. */
-            *(unsigned char*)&regs.rax = 0;  /* Not installed, OK to install. */
-          } else if (*(unsigned short*)&regs.rax == 0x1687) {  /* DPMI. */
-            /* Keep it as is, DPMI not installed. */
-#if 0  /* TLINK 5.1 tlink.exe loading dpmi16bi.ovl */
-          } else if (*(unsigned short*)&regs.rax == 0xfb42) {
-          } else if (*(unsigned short*)&regs.rax == 0xfb43) {
-#endif
-          } else { fatal_uic:
-            fprintf(stderr, "fatal: unsupported int 0x%02x ax:%04x\n", int_num, *(const unsigned short*)&regs.rax);
-            goto fatal_int;
-          }
-        } else if (int_num == 0x15) {  /* System BIOS. */
-          const unsigned short ax = (unsigned short)regs.rax;
-          if (ax == 0xe801) {  /* Check for large free extended memory (XMS). */
-            *(unsigned short*)&regs.rflags |= 1 << 0;  /* CF=1. */  /* No large free extended memory. */
-          } else if (ah == 0x88) {  /* Get extended memory (XMS) size. */
-            *(unsigned short*)&regs.rax = 0;  /* No extended memory. */
-            *(unsigned short*)&regs.rflags &= ~(1 << 0);  /* CF=0. */
-          } else {
-            goto fatal_uic;
-          }
-        } else if (int_num == 0x67) {  /* Various. */
-          const unsigned short ax = (unsigned short)regs.rax;
-          if (ax == 0xde00) {  /* VCPI installation check. http://mirror.cs.msu.ru/oldlinux.org/Linux.old/docs/interrupts/int-html/rb-7491.htm */
-            /* Doing nothing means it's not installed. */
-          } else {
-            goto fatal_uic;
+  if (run_state->sampler) sample_kvm_run = run;
+  /* !! Trap it if it tries to enter protected mode (cr0 |= 1). Is this possible? */
+  for (;;) {
+    int ret;
+    if (run_state->profile) profile_run_start();
+    if (run_state->timings) timings_run_start();
+    if (run_state->tracer && run_state->tracer->is_call_pending) end_trace_int(&regs, &sregs, mem);
+    is_in_kvm_run = 1;
+    ret = interp ? run_interp_cpu(interp) : ioctl(kvm_fds.vcpu_fd, KVM_RUN, 0);
+    is_in_kvm_run = 0;
+    if (run_state->timings) timings_run_end();
+    if (run_state->profile) profile_run_end();
+    if (ret < 0 && errno != EINTR) {
+      fprintf(stderr, "KVM_RUN failed");
+      exit(252);
+    }
+    if (is_sync_regs) {  /* KVM has already copied regs and sregs to run->s.regs. */
+      regs = run->s.regs.regs;
+      known_sregs = sregs = run->s.regs.sregs;
+      is_sregs_known = 1;
+      run->kvm_dirty_regs = 0;
+    } else {
+      is_regs_fetched = is_sregs_known = 0;  /* Fetch them lazily, most MMIO and port I/O exits don't need them. */
+    }
+    if (ret < 0) {  /* EINTR: signal, e.g. SIGPROF of --sample-hz=... */
+      run->immediate_exit = 0;
+      if (run_state->sampler) {
+        FETCH_REGS();
+        record_sample((const unsigned char*)mem, &regs, &sregs);
+      }
+      continue;
+    }
+    ++run_state->clock_exit_count;  /* Not counting EINTR above, it's not deterministic. */
+    if (DEBUG) { FETCH_REGS(); dump_regs("debug", &regs, &sregs); }
+
+    switch (run->exit_reason) {
+     case KVM_EXIT_IO:
+      { char *p = (char*)run + run->io.data_offset;
+        if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 1 && run->io.port < 0x100) {
+          FETCH_REGS();
+          /* Older Linux kernels have already advanced rip past the 2-byte `out' instruction. */
+          if (sregs.cs.selector == INT_OUT_PARA && ((unsigned short)regs.rip - ((unsigned)run->io.port << 1)) <= 2 && !((unsigned)regs.rip & 1)) {  /* out caused by int through our trampoline, with --trampoline=out. */
+            int_num = run->io.port;
+            goto do_int;
           }
-        } else if (int_num == 0x00) {  /* Division by zero. */
-          /* This is called only if the program doesn't override the interrupt vector.
-           * Example instructions: `xor ax, ax', `div ax'.
-           */
-          fprintf(stderr, "fatal: unhandled division by zero cs:%04x ip:%04x\n", int_cs, int_ip);
+        }
+        if (run_state->profile) profile_exit(PROFILE_EXIT_IO | run->io.port);
+        if (run->io.port == 0x40 && run->io.size == 1 && run->io.direction == 0) {
+          *p = run_state->clock_mode == CLOCK_VIRTUAL ? get_clock_pit_byte() : port_0x40_tick++;  /* Simulate some timer ticks. */
+          break;
         } else {
-         fatal_int:
-          fprintf(stderr, "fatal: unsupported int 0x%02x ah:%02x cs:%04x ip:%04x\n", int_num, ah, int_cs, int_ip);
+          fprintf(stderr, "fatal: IO port: port=0x%02x data=%08x size=%d direction=%s\n", run->io.port, *(const unsigned*)p, run->io.size, run->io.direction ? "out" : "in");
+          goto fatal;
+        }
+      }
+     case KVM_EXIT_SHUTDOWN:  /* How do we trigger it? */
+      fprintf(stderr, "fatal: shutdown\n");
+      exit(252);
+     case KVM_EXIT_HLT:
+      FETCH_REGS();
+      if (sregs.cs.selector == INT_HLT_PARA && (unsigned)((unsigned)regs.rip - 1) < 0x100) {  /* hlt caused by int through our magic interrupt table. */
+        int_num = ((unsigned)regs.rip - 1) & 0xff;
+       do_int:
+        ctx.csip_ptr = (const unsigned short*)((char*)mem + ((unsigned)sregs.ss.selector << 4) + (*(unsigned short*)&regs.rsp));  /* !! What if rsp wraps around 64 KiB boundary? Test it. Also calculate int_cs again. */
+        ctx.int_ip = ctx.csip_ptr[0]; ctx.int_cs = ctx.csip_ptr[1];  /* !! Security: check bounds, also check that rsp <= 0xfffe. */
+        ah = ((unsigned)regs.rax >> 8) & 0xff;
+        if (check_ivt_changes(mem, ctx.ivt_shadow, ctx.had_get_ints)) goto fatal;  /* Direct writes to the IVT since the previous int call. */
+        if (DEBUG) fprintf(stderr, "debug: int 0x%02x ah:%02x cs:%04x ip:%04x\n", int_num, ah, ctx.int_cs, ctx.int_ip);
+        if (run_state->profile) profile_int(int_num, ah);
+        if (run_state->tracer) trace_int(int_num, &regs, &sregs);
+        /* Documentation about DOS and BIOS int calls: https://stanislavs.org/helppc/idx_interrupt.html */
+        switch (int_call_handlers[int_num] ? int_call_handlers[int_num](&ctx) : DCR_FATAL_INT) {
+         case 0:
+          break;
+         case DCR_EXIT:  /* Exit to DOS. */
+          flush_stdout_buf(tty_state);
+          reset_handle_bufs();
+          if (run_state->timings) end_timings_exec((unsigned char)regs.rax);
+          if (ctx.exec_frame) {  /* Resume the parent program. */
+            ExecFrame * const frame = ctx.exec_frame;
+            ctx.child_exit_code = (unsigned char)regs.rax;  /* ah == 0: normal termination. */
+            close_child_fds(frame->fd_bits, &kvm_fds);
+            memcpy((unsigned*)mem + 0x22, (char*)mem + (ctx.psp_para << 4) + 0x0a, 12);  /* Restore the int 0x22, 0x23 and 0x24 vectors from the PSP of the child, like DOS. */
+            free_dos_blocks(mem, ctx.psp_para);
+            regs = frame->regs;
+            sregs = frame->sregs;
+            is_sregs_known = 0;  /* Force KVM_SET_SREGS. */
+            ctx.psp_para = frame->psp_para;
+            ctx.env_para = frame->env_para;
+            ctx.env_limit = frame->env_limit;
+            ctx.dta_seg_ofs = frame->dta_seg_ofs;
+            ctx.malloc_strategy = frame->malloc_strategy;
+            ctx.last_dos_error_code = frame->last_dos_error_code;
+            ctx.had_get_ints = frame->had_get_ints;
+            ctx.had_get_first_mcb = frame->had_get_first_mcb;
+            ctx.ctrl_break_checking = frame->ctrl_break_checking;
+            ctx.sphinx_cmm_flags = frame->sphinx_cmm_flags;
+            strcpy(emu->exec_fnbuf, frame->prog_filename);
+            dir_state->linux_prog = ctx.prog_filename = emu->exec_fnbuf;
+            strcpy(emu->dosfnbuf, frame->dos_prog_abs);
+            ctx.dos_prog_abs = emu->dosfnbuf;
+            ctx.exec_frame = frame->parent;
+            --ctx.exec_depth;
+            free(frame);
+            clear_fn_cache(emu_params->is_enoent_cache);  /* The child may have changed dir_state. */
+            ++run_state->find_dir_epoch;
+            if (DEBUG) fprintf(stderr, "debug: resuming parent program after exit code 0x%02x: %s\n", ctx.child_exit_code, ctx.dos_prog_abs);
+            goto set_sregs_regs_and_continue;
+          }
+          stamp_written_files();
+          return (unsigned char)regs.rax;
+         case DCR_EXEC:
+          goto do_exec;
+         case DCR_FATAL:
+          goto fatal;
+         default:  /* DCR_FATAL_INT. */
+          fprintf(stderr, "fatal: unsupported int 0x%02x ah:%02x cs:%04x ip:%04x\n", int_num, ah, ctx.int_cs, ctx.int_ip);
           goto fatal;
         }
         /* Return from the interrupt. */
-        SET_SREG(cs, int_cs);
-        regs.rip = int_ip;
-        if (csip_ptr[2] & (1 << 9)) *(unsigned short*)&regs.rflags |= (1 << 9);  /* Set IF back to 1 if it was 1. */
-        *(unsigned short*)&regs.rsp += 6;  /* pop ip, pop cs, pop flags. */
+        if (sregs.cs.selector == INT_OUT_PARA) {  /* --trampoline=out. The guest pops the return address, cs remains unchanged until then. */
+          regs.rip = INT_OUT_RET_OFS;
+        } else {
+          SET_SREG(cs, ctx.int_cs);
+          regs.rip = ctx.int_ip;
+          *(unsigned short*)&regs.rsp += 6;  /* pop ip, pop cs, pop flags. */
+        }
+        if (ctx.csip_ptr[2] & (1 << 9)) *(unsigned short*)&regs.rflags |= (1 << 9);  /* Set IF back to 1 if it was 1. */
         goto set_sregs_regs_and_continue;
       } else if (is_hlt_ok && sregs.cs.selector >= PSP_PARA && (*(unsigned short*)&regs.rflags & (1 << 9))) {  /* IF == 1. */
         /* The 8253 timer chip increments the counter in each 1 / 1193182s
@@ -3290,15 +9227,16 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
       { const char mmio_len = run->mmio.len;
         const unsigned addr = (unsigned)run->mmio.phys_addr;
         char highmsg[2];
+        if (run_state->profile) profile_exit(addr);
         /* CS:IP points to the instruction doing the memory operation (not after). */
         if (sizeof(run->mmio.phys_addr) > 4 && run->mmio.phys_addr >> (32 * (sizeof(run->mmio.phys_addr) > 4))) {  /* Physical address is larger than 32 bits. */
           highmsg[0] = '+'; highmsg[1] = '\0';
           goto bad_memory_access;
-        } else if (addr == 0xfffea && mmio_len == 1 && !run->mmio.is_write && (sphinx_cmm_flags & 3) == 3) {
+        } else if (addr == 0xfffea && mmio_len == 1 && !run->mmio.is_write && (ctx.sphinx_cmm_flags & 3) == 3) {
           /* SPHiNX C-- 1.04 compiler does this, just ignore. */
         } else if (addr - (ENV_PARA << 4) < (PROGRAM_MCB_PARA - 1 - ENV_PARA) << 4 && run->mmio.is_write && mmio_len <= 16) {  /* Overwrites environment area. */
           /* Microsoft BASIC Professional Development System 7.10 linker pblink.exe. It overwrites length and program name with program name and args. */
-          /* This emulation is a little bit slow (because of the ioctl(... KVM_RUN ...) overhead), but it's called only less than 75 times at startup. */
+          /* This emulation is a little bit slow (because of the ioctl(... KVM_RUN ...) overhead), but it's called only less than 75 times at startup. Only with GUEST_MEM_MODULE_START != 0. */
           memcpy((char*)mem + addr, run->mmio.data, mmio_len);
         } else if (addr == 0xffffe && !run->mmio.is_write && mmio_len == 1) {  /* BASIC programs compiled by Microsoft BASIC Professional Development System 7.10 compiler pbc.exe */
           run->mmio.data[0] = 0xfc;  /* Machine ID is regular OC (0xfc). Same as default in src/ints/bios.cpp in DOSBox 0.74. */
@@ -3306,8 +9244,8 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
           run->mmio.data[0] = "01/01/92"[addr - 0xffff5U];  /* System BIOS date, same as default in src/ints/bios.cpp in DOSBox 0.74. */
         } else if (addr == 0xfff7e && !run->mmio.is_write && mmio_len == 2) {  /* Reading the first MCB pointer in INVARS (see int 0x21 call with ah == 0x52). Used by Microsoft Macro Assembler 6.00B driver masm.exe. */
           *(unsigned short*)run->mmio.data = PROGRAM_MCB_PARA;
-          had_get_first_mcb = 1;
-        } else if (addr < 0x400 && run->mmio.is_write && addr + mmio_len <= 0x400 && ((mmio_len == 2 && (addr & 1) == 0) || (mmio_len == 4 && (addr & 3) == 0))) {  /* Set interrupt vector directly (not via int 0x21 call with ah == 0x25). */
+          ctx.had_get_first_mcb = 1;
+        } else if (addr < 0x400 && run->mmio.is_write && addr + mmio_len <= 0x400 && ((mmio_len == 2 && (addr & 1) == 0) || (mmio_len == 4 && (addr & 3) == 0))) {  /* Set interrupt vector directly (not via int 0x21 call with ah == 0x25). Only with GUEST_MEM_MODULE_START != 0. */
           /* Microsoft BASIC Professional Development System 7.10 compiler pbc.exe */
           const unsigned char set_int_num = addr >> 2;
           if (mmio_len == 2) {  /* There are subsequent sets (segment and offset parts), we buffer them, and call set_int only once. */
@@ -3329,7 +9267,8 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
               }
             }
           } else { do_set_int:
-            if (set_int(set_int_num, *(unsigned*)run->mmio.data, mem, had_get_ints)) goto fatal;
+            if (set_int(set_int_num, *(unsigned*)run->mmio.data, mem, ctx.had_get_ints)) goto fatal;
+            ctx.ivt_shadow[set_int_num] = ((unsigned*)mem)[set_int_num];
           }
         } else if (addr == 0xa003e && mmio_len == 2 && !run->mmio.is_write) {
           /* Microsoft Macro Assembler 6.00B driver masm.exe. */
@@ -3361,6 +9300,8 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
     }
   }
  fatal:
+  flush_stdout_buf(tty_state);
+  FETCH_REGS();
   dump_regs("fatal", &regs, &sregs);
 #if 0  /* The Linux kernel does this at process exit. */
   close(kvm_fds.vcpu_fd);
@@ -3371,6 +9312,304 @@ static unsigned char run_dos_prog(struct EmuState *emu, const char *prog_filenam
   return 0;  /* Not reached. This is just to pacity owcc. */
 }
 
+/* --- Parallel batch jobs (--batch-jobs=<n>).
+ *
+ * With --batch-jobs=<n> (n >= 2), run_dos_batch(...) runs consecutive lines
+ * of the .bat file which run a DOS program (e.g. `tasm foo.asm') in
+ * parallel, at most <n> at a time. Each job is a forked child process with
+ * its own EmuState (a KVM VM can't be used in a forked child), its stdout
+ * and stderr go to memfds, which the parent copies to its stdout and
+ * stderr in line order when the job finishes, so the output is
+ * deterministic. The parent waits for all jobs to finish (barrier) before
+ * running any other line (e.g. `echo', `exit /and'), a
+ * `rem kvikdos:wait' line, after a job has failed (nonzero exit code, it
+ * may be a dependency of later lines) and at the end of the file. Empty
+ * lines and other `rem' lines (with echo off) are not barriers. The DOS
+ * programs run in jobs shouldn't depend on each other or read from the
+ * keyboard (stdin), and they are not counted by --profile.
+ */
+
+#define BATCH_JOB_LIMIT 256
+
+typedef struct BatchJob {
+  pid_t pid;
+  int out_fd, err_fd;  /* memfds with the stdout and stderr of the job. */
+} BatchJob;
+
+typedef struct BatchJobs {
+  BatchJob jobs[BATCH_JOB_LIMIT];  /* jobs[0] is the oldest. */
+  unsigned count;
+} BatchJobs;
+
+static int create_memfd(const char *name) {
+  int fd = -1;
+#ifdef __NR_memfd_create
+  fd = syscall(__NR_memfd_create, name, 0);
+#endif
+  if (fd < 0) {  /* Old Linux kernel without memfd_create(2). */
+    char tmp_fnbuf[32];
+    strcpy(tmp_fnbuf, "/tmp/kvikdos.XXXXXX");
+    if ((fd = mkstemp(tmp_fnbuf)) >= 0) unlink(tmp_fnbuf);
+  }
+  return fd;
+}
+
+static void copy_fd_to_fd(int from_fd, int to_fd) {
+  char fbuf[0x4000];
+  int got;
+  if (lseek(from_fd, 0, SEEK_SET) != 0) return;
+  while ((got = read(from_fd, fbuf, sizeof(fbuf))) > 0) {
+    (void)!write(to_fd, fbuf, got);
+  }
+}
+
+/* Waits for the oldest job, copies its output and removes it. Returns its
+ * exit code. Exits with 252 if the job has failed fatally, like
+ * run_dos_prog(...) would in the parent.
+ */
+static unsigned char wait_batch_job(BatchJobs *bjs, TtyState *tty_state) {
+  BatchJob * const bj = bjs->jobs;
+  int status;
+  unsigned u;
+  while (waitpid(bj->pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      perror("fatal: waitpid");
+      exit(252);
+    }
+  }
+  flush_stdout_buf(tty_state);
+  fflush(stdout);
+  fflush(stderr);
+  copy_fd_to_fd(bj->out_fd, 1);  /* STDOUT_FILENO. */
+  copy_fd_to_fd(bj->err_fd, 2);  /* STDERR_FILENO. */
+  close(bj->out_fd);
+  close(bj->err_fd);
+  --bjs->count;
+  memmove(bjs->jobs, bjs->jobs + 1, bjs->count * sizeof(BatchJob));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 252) {
+    for (u = 0; u < bjs->count; ++u) kill(bjs->jobs[u].pid, SIGKILL);  /* Sequential execution wouldn't have started them. */
+    if (!WIFEXITED(status)) fprintf(stderr, "fatal: DOS program in batch job killed by signal %d\n", WTERMSIG(status));
+    exit(252);
+  }
+  return WEXITSTATUS(status);
+}
+
+static char is_batch_job_finished(const BatchJob *bj) {
+  siginfo_t si;
+  si.si_pid = 0;
+  return waitid(P_PID, bj->pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0 && si.si_pid != 0;
+}
+
+/* Waits for all jobs. Returns the exit code of the last one, or exit_code
+ * if there were no jobs.
+ */
+static unsigned char wait_batch_jobs(BatchJobs *bjs, TtyState *tty_state, unsigned char exit_code) {
+  while (bjs->count != 0) {
+    exit_code = wait_batch_job(bjs, tty_state);
+  }
+  return exit_code;
+}
+
+/* Starts running the DOS program in a new job. echo_msg is printed first to
+ * its stdout. Returns the exit code of the oldest job if it had to be waited
+ * for (because there were already job_limit jobs running), otherwise
+ * exit_code.
+ */
+static unsigned char start_batch_job(BatchJobs *bjs, unsigned job_limit, const char *echo_msg, const char *prog_filename, const char *args_str, DirState *dir_state, TtyState *tty_state, const EmuParams *emu_params, const char* const *envp0, unsigned char exit_code) {
+  BatchJob *bj;
+  pid_t pid;
+  if (job_limit > BATCH_JOB_LIMIT) job_limit = BATCH_JOB_LIMIT;
+  while (bjs->count != 0 && (bjs->count >= job_limit || is_batch_job_finished(bjs->jobs))) {  /* Collect finished jobs early, so that a failure is a barrier as soon as possible. */
+    if ((exit_code = wait_batch_job(bjs, tty_state)) != 0) exit_code = wait_batch_jobs(bjs, tty_state, exit_code);  /* Barrier after a failure. */
+  }
+  bj = bjs->jobs + bjs->count;
+  if ((bj->out_fd = create_memfd("kvikdos-job-stdout")) < 0 || (bj->err_fd = create_memfd("kvikdos-job-stderr")) < 0) {
+    perror("fatal: memfd_create");
+    exit(252);
+  }
+  flush_stdout_buf(tty_state);
+  fflush(stdout);
+  fflush(stderr);
+  if ((pid = fork()) < 0) {
+    perror("fatal: fork");
+    exit(252);
+  }
+  if (pid == 0) {
+    EmuState job_emu;
+    unsigned char job_exit_code;
+    prctl(PR_SET_PDEATHSIG, SIGKILL);  /* Don't keep modifying files if the parent has failed. */
+    if (dup2(bj->out_fd, 1) != 1 || dup2(bj->err_fd, 2) != 2) {
+      perror("fatal: dup2");
+      exit(252);
+    }
+    close(bj->out_fd);
+    close(bj->err_fd);
+    run_state->profile = NULL;  /* Don't overwrite the profile of the parent at exit. */
+    fputs(echo_msg, stdout);
+    fflush(stdout);
+    init_emu(&job_emu);
+    job_exit_code = run_dos_prog(&job_emu, prog_filename, args_str, NULL, dir_state, tty_state, emu_params, envp0);
+    flush_stdout_buf(tty_state);
+    fflush(stdout);
+    _exit(job_exit_code);
+  }
+  bj->pid = pid;
+  ++bjs->count;
+  return exit_code;
+}
+
+/* Commands handled by run_dos_batch(...) itself (rather than running a DOS
+ * program), including the unsupported ones.
+ */
+static const char * const batch_builtin_cmds[] = {
+    "rem", "cls", "echo", "set", "ver", "exit", "cd", "path", "pause", "type",
+    "dir", "chdir", "attrib", "call", "choice", "copy", "del", "delete",
+    "erase", "goto", "help", "if", "loadhigh", "lh", "mkdir", "md", "rmdir",
+    "rd", "rename", "ren", "shift", "subst", NULL };
+
+/* Returns true iff run_dos_batch(...) would run a DOS program for the
+ * lowercase command p_line...p_line+cmd_size.
+ */
+static char is_batch_job_line(const char *p_line, unsigned cmd_size) {
+  const char * const *cmdp;
+  if (cmd_size == 0 || (cmd_size == 1 && (p_line[0] & ~32) - 'A' + 0U <= 'Z' - 'A' + 0U)) return 0;  /* Empty command or drive change. */
+  for (cmdp = batch_builtin_cmds; *cmdp; ++cmdp) {
+    if (0 == memcmp(p_line, *cmdp, cmd_size)) return 0;  /* Same matching as in run_dos_batch(...). */
+  }
+  return 1;
+}
+
+/* Returns true iff the line is `rem kvikdos:wait'. r is the end of the
+ * command in p_line.
+ */
+static char is_batch_wait_line(const char *p_line, unsigned cmd_size, const char *r) {
+  if (!(cmd_size == 3 && 0 == memcmp(p_line, "rem", 3))) return 0;
+  for (; *r == ' ' || *r == '\t'; ++r) {}
+  if (!is_same_ascii_nocase(r, "kvikdos:wait", 12)) return 0;
+  for (r += 12; *r == ' ' || *r == '\t'; ++r) {}
+  return *r == '\0';
+}
+
+/* Waits for all jobs (barrier), then prints echo_msg. Returns the exit code
+ * of the last job, or exit_code if there were no jobs.
+ */
+static unsigned char wait_batch_jobs_and_echo(BatchJobs *bjs, TtyState *tty_state, const char *echo_msg, unsigned char exit_code) {
+  exit_code = wait_batch_jobs(bjs, tty_state, exit_code);
+  fputs(echo_msg, stdout);
+  fflush(stdout);
+  return exit_code;
+}
+
+/* Copies the batch line src to dst (of dst_size bytes), substituting %0
+ * (arg0), %1 ... %9 (args), %NAME% (from envp0, case insensitive, empty if
+ * missing) and %%. Like MS-DOS 6.22, drops a single % not starting any of
+ * these. Returns the size of the result (without the trailing '\0'), or -1
+ * if it doesn't fit.
+ */
+static int expand_batch_line(const char *src, char *dst, size_t dst_size, const char *arg0, const char* const *args, const char* const *envp0) {
+  char *p = dst, * const p_end = dst + dst_size - 1;
+  const char *value, *name_end;
+  size_t size;
+  char c;
+  while ((c = *src++) != '\0') {
+    if (c != '%') {
+      if (p == p_end) return -1;
+      *p++ = c;
+      continue;
+    }
+    value = "";
+    if ((c = *src) == '%') {
+      value = "%";
+      ++src;
+    } else if (c - '0' + 0U <= 9U) {
+      ++src;
+      if (c == '0') {
+        value = arg0;
+      } else if (args) {
+        for (; c != '1' && *args; --c, ++args) {}
+        if (*args) value = *args;
+      }
+    } else if ((name_end = strchr(src, '%')) != NULL) {
+      const char* const *envp;
+      size = name_end - src;
+      for (envp = envp0; *envp && !(is_same_ascii_nocase(*envp, src, size) && (*envp)[size] == '='); ++envp) {}
+      if (*envp) value = *envp + size + 1;
+      src = name_end + 1;
+    }
+    if ((size = strlen(value)) > (size_t)(p_end - p)) return -1;
+    memcpy(p, value, size);
+    p += size;
+  }
+  *p = '\0';
+  return p - dst;
+}
+
+/* Removes the redirections (<file, >file and >>file) from the batch
+ * command line, and copies their filenames to in_fn and out_fn (each of
+ * DOS_PATH_SIZE bytes, empty if not specified). Returns the new end of
+ * line, or NULL if a filename is missing or too long.
+ */
+static char *split_batch_redirects(char *line, char *in_fn, char *out_fn, char *is_append_out) {
+  char *r, *w, *fn, c;
+  size_t size;
+  *in_fn = *out_fn = '\0';
+  *is_append_out = 0;
+  for (r = w = line; (c = *r) != '\0';) {
+    if (c != '<' && c != '>') {
+      *w++ = c;
+      ++r;
+      continue;
+    }
+    fn = c == '<' ? in_fn : out_fn;
+    if (c == '>') *is_append_out = (*++r == '>');
+    if (*r == '>' || *r == '<') ++r;
+    for (; *r == ' ' || *r == '\t'; ++r) {}
+    for (size = 0; (c = r[size]) != '\0' && c != ' ' && c != '\t' && c != '<' && c != '>'; ++size) {}
+    if (size == 0 || size >= DOS_PATH_SIZE) return NULL;
+    memcpy(fn, r, size);
+    fn[size] = '\0';
+    r += size;
+  }
+  *w = '\0';
+  return w;
+}
+
+/* Makes Linux fd (0 or 1) a copy of new_fd for a redirected batch command.
+ * The first call for fd saves the original to *saved_fd_ptr, hidden from
+ * DOS programs, for restore_batch_fds(...).
+ */
+static void redirect_batch_fd(int fd, int new_fd, int *saved_fd_ptr, TtyState *tty_state) {
+  flush_stdout_buf(tty_state);
+  fflush(stdout);
+  if (*saved_fd_ptr < 0) {
+    if ((*saved_fd_ptr = fcntl(fd, F_DUPFD_CLOEXEC, 5)) < 0) {
+      perror("fatal: dup");
+      exit(252);
+    }
+    run_state->hidden_fds[6 + fd] = *saved_fd_ptr;
+  }
+  if (dup2(new_fd, fd) != fd) {
+    perror("fatal: dup2");
+    exit(252);
+  }
+}
+
+static void restore_batch_fds(int *saved_fds, TtyState *tty_state) {
+  int fd;
+  flush_stdout_buf(tty_state);
+  fflush(stdout);
+  for (fd = 0; fd < 2; ++fd) {
+    if (saved_fds[fd] >= 0) {
+      if (dup2(saved_fds[fd], fd) != fd) {
+        perror("fatal: dup2");
+        exit(252);
+      }
+      close(saved_fds[fd]);
+      saved_fds[fd] = run_state->hidden_fds[6 + fd] = -1;
+    }
+  }
+}
+
 static unsigned char run_dos_batch(struct EmuState *emu, const char *prog_filename, const char* const *args, DirState *dir_state, TtyState *tty_state, const EmuParams *emu_params, const char* const *envp0) {
   unsigned char exit_code = 0;
   int batch_fd, got;
@@ -3378,8 +9617,22 @@ static unsigned char run_dos_batch(struct EmuState *emu, const char *prog_filena
   char do_echo = 1;
   size_t size;
   const char *dos_prog_abs = dir_state->dos_prog_abs;  /* Of the .bat file. */
+  const unsigned batch_jobs = has_ram_drive(dir_state) || run_state->overlay_count || run_state->sampler || run_state->tracer ? 1 : emu_params->batch_jobs;  /* The batch jobs (processes) wouldn't see each other's files on the in-memory drives, and their overlay changes, samples and traces would be lost. */
+  BatchJobs *bjs = NULL;  /* Used iff batch_jobs > 1. */
+  char echo_msg[sizeof(buf) + 16];  /* Echo of the current line, printed later if batch_jobs > 1. */
+  char xline[sizeof(buf)];  /* The current line after percent substitution. */
+  char redirect_fns[2][DOS_PATH_SIZE];  /* DOS filenames of `<' and `>' of the current command, or empty. */
+  int saved_fds[2] = { -1, -1 };  /* Original Linux fds 0 and 1 while the current command is redirected, or -1. */
+  int pipe_fd = -1;  /* Output of the previous command in a `|' pipeline (a memfd), or -1. */
+  const char * const arg0 = dos_prog_abs ? dos_prog_abs : prog_filename;  /* %0. */
   dir_state->dos_prog_abs = NULL;
-  (void)args;
+  if (batch_jobs > 1) {
+    if ((bjs = malloc(sizeof(*bjs))) == NULL) {
+      fprintf(stderr, "fatal: out of memory for batch jobs\n");
+      exit(252);
+    }
+    bjs->count = 0;
+  }
   if ((batch_fd = open(prog_filename, O_RDONLY)) < 0) {
     fprintf(stderr, "fatal: cannot open DOS .bat batch file: %s: %s\n", prog_filename, strerror(errno));
     exit(252);
@@ -3418,40 +9671,93 @@ static unsigned char run_dos_batch(struct EmuState *emu, const char *prog_filena
         p_line = buf;
       }
     } else {  /* End-of-line reached, line is p_line...q. */
-      char c, c_endarg, do_echo_line = do_echo;
-      char *r, *arg, *endarg;
+      char c, c_endarg, do_echo_line = do_echo, is_append_out, is_pipe_out;
+      char *r, *arg, *endarg, *line_end, *pipe_next;
       unsigned cmd_size;
+      int xline_size;
       *q = '\0';  /* Make it ASCIIZ (terminated by \0). */
       if (DEBUG) fprintf(stderr, "debug: batch line: (%s)\n", p_line);
+      if ((xline_size = expand_batch_line(p_line, xline, sizeof(xline), arg0, args, envp0)) < 0) goto line_too_long;
+      p_line = xline;  /* The original line in buf is kept for finding the next line. */
+      line_end = xline + xline_size;
       for (; *p_line == ' ' || *p_line == '\t'; ++p_line) {}  /* MS-DOS 6.22 doesn't ignore leading whitespace, at least not before `rem'. */
       if (*p_line == '@') { do_echo_line = 0; ++p_line; }
+      echo_msg[0] = '\0';
       if (do_echo_line) {
         const char *current_dir = dir_state->current_dir[dir_state->drive - 'A'];
-        fprintf(stdout, "\r\n%c:%s>%s\r\n", dir_state->drive, *current_dir == '\0' ? "\\" : current_dir, p_line);
-        fflush(stdout);
+        sprintf(echo_msg, "\r\n%c:%s>%s\r\n", dir_state->drive, *current_dir == '\0' ? "\\" : current_dir, p_line);  /* Fits, p_line is shorter than buf. */
+        if (!bjs) {
+          fputs(echo_msg, stdout);
+          fflush(stdout);
+        }
       }
       for (r = p_line; ((c = *r) + 0U > 31U && c != '\x7f') || c == ' ' || c == '\t'; ++r) {}
       if (c != '\0') {
         fprintf(stderr, "fatal: invalid character in DOS .bat batch file: %s\n", prog_filename);
         exit(252);
       }
-      if (strchr(p_line, '<') || strchr(p_line, '>') || strchr(p_line, '|')) {
-        fprintf(stderr, "fatal: redirection not supported in DOS .bat batch file: %s\n", prog_filename);
-        exit(252);
-      }
-      if (strchr(p_line, '%')) {
-        fprintf(stderr, "fatal: percent substitution not supported in DOS .bat batch file: %s\n", prog_filename);
-        exit(252);  /* !! add support */
+     next_pipe_command:  /* Each command of a `|' pipeline starts here, reading the output of the previous one from pipe_fd. */
+      is_pipe_out = 0;
+      if ((pipe_next = strchr(p_line, '|')) != NULL) *pipe_next++ = '\0';
+      if ((line_end = split_batch_redirects(p_line, redirect_fns[0], redirect_fns[1], &is_append_out)) == NULL) {
+        fprintf(stderr, "Syntax error\r\n");  /* Like: MS-DOS 6.22. */
+        exit_code = 1;
+        pipe_next = NULL;  /* Abandon the rest of the pipeline. */
+        if (pipe_fd >= 0) {  /* The output of the previous command, not read by anyone. */
+          close(pipe_fd);
+          pipe_fd = -1;
+        }
+        goto done_command;
       }
+      for (; *p_line == ' ' || *p_line == '\t'; ++p_line) {}
       /* MS-DOS 6.22 terminator characters. */
       for (r = p_line; (c = *r) != '\0' && c != ' ' && c != '\t' && c != '+' && c != '=' && c != '[' && c != ']' && c != '"' && c != '\\' && c != ':' && c != ';' /* && c != '|' && c != '<' && c != '>' */ && c != ',' && c != '.' && c != '/'; ++r) {}
       cmd_size = r - p_line;
       for (arg = p_line; arg != r; ++arg) {
         if (*arg - 'A' + 0U <= 'Z' - 'A' + 0U) *arg |= 32;  /* Convert to lowercase. */
       }
+      if (bjs && (!is_batch_job_line(p_line, cmd_size) || redirect_fns[0][0] != '\0' || redirect_fns[1][0] != '\0' || pipe_next || pipe_fd >= 0)) {  /* Redirected commands are not run as batch jobs. */
+        if (echo_msg[0] != '\0' || (cmd_size != 0 && memcmp(p_line, "rem", cmd_size) != 0) || is_batch_wait_line(p_line, cmd_size, r)) {
+          exit_code = wait_batch_jobs_and_echo(bjs, tty_state, echo_msg, exit_code);  /* Barrier. */
+        }
+      }
+      if (pipe_fd >= 0) {
+        redirect_batch_fd(0, pipe_fd, &saved_fds[0], tty_state);
+        close(pipe_fd);
+        pipe_fd = -1;
+      }
+      if (redirect_fns[0][0] != '\0') {
+        const int fd = open_dos_file(redirect_fns[0], dos_prog_abs, O_RDONLY, dir_state, emu->fnbuf);
+        if (fd < 0) {
+          fprintf(stderr, "File not found - %s\r\n", redirect_fns[0]);  /* Like: MS-DOS 6.22. */
+          exit_code = 1;
+          goto done_command;
+        }
+        redirect_batch_fd(0, fd, &saved_fds[0], tty_state);
+        close(fd);
+      }
+      if (redirect_fns[1][0] != '\0') {
+        const int fd = open_dos_file(redirect_fns[1], dos_prog_abs, O_WRONLY | O_CREAT | (is_append_out ? O_APPEND : O_TRUNC), dir_state, emu->fnbuf);
+        if (fd < 0) {
+          fprintf(stderr, "File creation error - %s\r\n", redirect_fns[1]);  /* Like: MS-DOS 6.22. */
+          exit_code = 1;
+          goto done_command;
+        }
+        redirect_batch_fd(1, fd, &saved_fds[1], tty_state);
+        close(fd);
+      } else if (pipe_next) {  /* Like MS-DOS 6.22, buffer the output in a temporary file. The next command reads it. */
+        const int fd = create_memfd("kvikdos-pipe");
+        if (fd < 0) {
+          perror("fatal: memfd_create");
+          exit(252);
+        }
+        redirect_batch_fd(1, fd, &saved_fds[1], tty_state);
+        close(fd);
+        is_pipe_out = 1;
+      }
       if (cmd_size == 0) goto done_command;  /* Empty command. */
       for (arg = r; *arg == ' ' || *arg == '\t'; ++arg) {}
-      for (endarg = q; endarg != r && (endarg[-1] == ' ' || endarg[-1] == '\t'); --endarg) {}
+      for (endarg = line_end; endarg != r && (endarg[-1] == ' ' || endarg[-1] == '\t'); --endarg) {}
       c_endarg = *endarg;
       *endarg = '\0';  /* MS-DOS 6.22 passes trailing spaces to .com or .exe programs, but DOSBox 0.74-4 doesn't. We don't. This also affects the `echo' command in DOSBox 0.74-4, but for that we add trailing spaces. */
       if (cmd_size == 1 && (p_line[0] & ~32)  - 'A' + 0U <= 'Z' - 'A' + 0U) {
@@ -3567,7 +9873,7 @@ static unsigned char run_dos_batch(struct EmuState *emu, const char *prog_filena
           fprintf(stderr, "Too many parameters - %s\r\n", arg2 + 1);
           exit_code = 1;
         } else {  /* Now filename is in arg. */
-          int fd = open_dos_file(arg, dos_prog_abs, O_RDONLY, dir_state);
+          int fd = open_dos_file(arg, dos_prog_abs, O_RDONLY, dir_state, emu->fnbuf);
           if (fd < 0) {
             if (errno == ENOENT) {
               fprintf(stderr, "File not found - %s\r\n", arg);  /* MS-DOS 6.22. */
@@ -3618,70 +9924,1024 @@ static unsigned char run_dos_batch(struct EmuState *emu, const char *prog_filena
         *r = '\0';
         fprintf(stderr, "fatal: DOS command not supported: %s\n", p_line);
         exit(252);
-        /**r = c;*/
-      } else {  /* Run .com or .exe program. */
-        char *args_str = p_line, args_buf[0x80], c2;
-        const char* prog_filename;
-        const char* const *envp;
-        char prog_drive;
-        size_t size;
-        for (; (c2 = *args_str) != '\0' && c2 != ' ' && c2 != '\t' && c2 != '=' && c2 != ',' && c2 != '/'; ++args_str) {}  /* MS-DOS 6.22. */
-        if (args_str == p_line) {
-          fprintf(stderr, "Empty DOS program name to run\r\n");
-          exit_code = 1;
-        } else if ((size = q - args_str) >= sizeof(args_buf) - 1) {  /* DOS doesn't support longer than 0x7e, including leading spaces. */
-          fprintf(stderr, "DOS program arguments too long\r\n");
-          exit_code = 1;
-        } else {
-          memcpy(args_buf, args_str, size + 1);  /* Including the trailing '\0'. */
-          *args_str = '\0';  /* So that p_line becomes terminated by '\0'. */
-          for (envp = envp0; *envp && strncmp(*envp, "PATH=", 5) != 0; ++envp) {}
-          dir_state->dos_prog_abs = dos_prog_abs;  /* Of the .bat file. */
-          prog_filename = find_prog_on_path(p_line, dir_state, *envp ? *envp + 5 : NULL, &prog_drive);
-          if (!prog_filename) {
-            /* DOSBox 0.74-4 prints "Illegal command: %s.\r\n" to stdout, we print our error to stderr. */
-            /* MS-DOS 6.22 prints this to stderr: "Bad command or file name\r\n". */
-            fprintf(stderr, "Illegal command - %s\r\n", p_line);
-            exit_code = 1;
-          } else if (*prog_filename == '\0') {
-            fprintf(stderr, "Invalid DOS program name - %s\r\n", p_line);
-            exit_code = 1;
-          } else {
-            dir_state->dos_prog_abs = get_dos_abs_filename_r(prog_filename, prog_drive, dir_state, dosfnbuf);
-            if (dir_state->dos_prog_abs[0] == '\0') {
-              fprintf(stderr, "Error getting absolute filelename - %s\r\n", p_line);
-              exit_code = 1;
-            } else {
-              exit_code = run_dos_prog(emu, prog_filename, args_buf, NULL, dir_state, tty_state, emu_params, envp0);
-            }
-          }
-          dir_state->dos_prog_abs = NULL;  /* For security. */
-        }
+        /**r = c;*/
+      } else {  /* Run .com or .exe program. */
+        char *args_str = p_line, args_buf[0x80], c2;
+        const char* prog_filename;
+        const char* const *envp;
+        char prog_drive = '\0';  /* Not needed, pacifies gcc -Wmaybe-uninitialized. */
+        size_t size;
+        for (; (c2 = *args_str) != '\0' && c2 != ' ' && c2 != '\t' && c2 != '=' && c2 != ',' && c2 != '/'; ++args_str) {}  /* MS-DOS 6.22. */
+        if (bjs && !(args_str != p_line && line_end - args_str < (int)sizeof(args_buf) - 1)) exit_code = wait_batch_jobs_and_echo(bjs, tty_state, echo_msg, exit_code);  /* For the error message below. */
+        if (args_str == p_line) {
+          fprintf(stderr, "Empty DOS program name to run\r\n");
+          exit_code = 1;
+        } else if ((size = line_end - args_str) >= sizeof(args_buf) - 1) {  /* DOS doesn't support longer than 0x7e, including leading spaces. */
+          fprintf(stderr, "DOS program arguments too long\r\n");
+          exit_code = 1;
+        } else {
+          memcpy(args_buf, args_str, size + 1);  /* Including the trailing '\0'. */
+          *args_str = '\0';  /* So that p_line becomes terminated by '\0'. */
+          for (envp = envp0; *envp && strncmp(*envp, "PATH=", 5) != 0; ++envp) {}
+          dir_state->dos_prog_abs = dos_prog_abs;  /* Of the .bat file. */
+          if (run_state->timings) run_state->timings->pending_find_prog_sec = get_monotonic_sec();
+          prog_filename = find_prog_on_path(p_line, dir_state, *envp ? *envp + 5 : NULL, &prog_drive, emu->fnbuf, emu->fnbuf2);
+          if (run_state->timings) run_state->timings->pending_find_prog_sec = get_monotonic_sec() - run_state->timings->pending_find_prog_sec;
+          if (bjs && (!prog_filename || *prog_filename == '\0' || get_dos_abs_filename_r(prog_filename, prog_drive, dir_state, emu->dosfnbuf)[0] == '\0')) {
+            exit_code = wait_batch_jobs_and_echo(bjs, tty_state, echo_msg, exit_code);  /* For the error message below. */
+          }
+          if (!prog_filename) {
+            /* DOSBox 0.74-4 prints "Illegal command: %s.\r\n" to stdout, we print our error to stderr. */
+            /* MS-DOS 6.22 prints this to stderr: "Bad command or file name\r\n". */
+            fprintf(stderr, "Illegal command - %s\r\n", p_line);
+            exit_code = 1;
+          } else if (*prog_filename == '\0') {
+            fprintf(stderr, "Invalid DOS program name - %s\r\n", p_line);
+            exit_code = 1;
+          } else {
+            dir_state->dos_prog_abs = get_dos_abs_filename_r(prog_filename, prog_drive, dir_state, emu->dosfnbuf);
+            if (dir_state->dos_prog_abs[0] == '\0') {
+              fprintf(stderr, "Error getting absolute filelename - %s\r\n", p_line);
+              exit_code = 1;
+            } else if (bjs && saved_fds[0] < 0 && saved_fds[1] < 0) {
+              exit_code = start_batch_job(bjs, batch_jobs, echo_msg, prog_filename, args_buf, dir_state, tty_state, emu_params, envp0, exit_code);
+            } else {
+              exit_code = run_dos_prog(emu, prog_filename, args_buf, NULL, dir_state, tty_state, emu_params, envp0);
+            }
+          }
+          dir_state->dos_prog_abs = NULL;  /* For security. */
+        }
+      }
+     done_command:
+      if (pipe_fd >= 0) {  /* Not consumed by this command, don't let the next line read it. */
+        close(pipe_fd);
+        pipe_fd = -1;
+      }
+      if (pipe_next && (pipe_fd = is_pipe_out ? dup(1) : create_memfd("kvikdos-pipe")) < 0) {
+        perror("fatal: pipe");
+        exit(252);
+      }
+      restore_batch_fds(saved_fds, tty_state);
+      if (pipe_next) {
+        if (lseek(pipe_fd, 0, SEEK_SET) != 0) {
+          perror("fatal: lseek pipe");
+          exit(252);
+        }
+        p_line = pipe_next;
+        echo_msg[0] = '\0';
+        goto next_pipe_command;
+      }
+      ++q;  /* Skip over the '\0', formerly '\r' or '\n'. */
+      goto next_line;
+    }
+  }
+  restore_batch_fds(saved_fds, tty_state);  /* After `exit'. */
+  if (pipe_fd >= 0) close(pipe_fd);
+  if (bjs) {
+    exit_code = wait_batch_jobs(bjs, tty_state, exit_code);
+    free(bjs);
+  }
+  close(batch_fd);
+  return exit_code;
+}
+
+static TtyState *atexit_tty_state;
+
+static void flush_stdout_buf_atexit(void) {
+  if (atexit_tty_state) flush_stdout_buf(atexit_tty_state);
+}
+
+static void init_tty_state(TtyState *tty_state, int tty_in_fd, char stdout_buffer_mode) {
+  tty_state->tty_in_fd = tty_in_fd;
+  tty_state->is_tty_in_error = 0;
+  tty_state->next_fake_key = fake_keys;
+  tty_state->stdout_buffer_mode = stdout_buffer_mode != SBM_AUTO ? stdout_buffer_mode : isatty(1) ? SBM_NONE : SBM_FULL;
+  tty_state->stdout_size = 0;
+  if (!atexit_tty_state) atexit(flush_stdout_buf_atexit);  /* For exit(252) after fatal errors. */
+  atexit_tty_state = tty_state;
+}
+
+/* --- VM lifecycle.
+ *
+ * The state of running a DOS program is in EmuState (KVM VM, guest memory,
+ * pathname buffers and the DosRunState), DirState (drives and mount
+ * points), TtyState (stdin and stdout buffering) and EmuParams. main(...),
+ * the --serve=... workers and the --jobs=... workers keep an EmuState, and
+ * run DOS programs on it one after the other with kvikdos_run(...), which
+ * resets and reuses the VM.
+ *
+ * This is not a library API: the current run state (run_state), Linux fds
+ * 0, 1 and 2 (kvikdos_run(...) dup2(...)s the stdio fds of the DOS program
+ * there), the current directory, the signal handler of --sample-hz=...
+ * and atexit_tty_state are per process, and fatal errors exit(252). So
+ * only one kvikdos_run(...) may be active in a process, use processes for
+ * parallelism.
+ */
+
+/* Returns a new run state, with empty caches and no collectors. */
+static DosRunState *new_dos_run_state(void) {
+  DosRunState *rs;
+  unsigned u;
+  if ((rs = calloc(1, sizeof(*rs))) == NULL ||
+      (rs->mcb_index = calloc(1, sizeof(*rs->mcb_index))) == NULL ||
+      (rs->handle_bufs = calloc(HANDLE_BUF_COUNT, sizeof(*rs->handle_bufs))) == NULL ||
+      (rs->async_io_slots = calloc(ASYNC_IO_SLOT_COUNT, sizeof(*rs->async_io_slots))) == NULL ||
+      (rs->fn_cache = calloc(FN_CACHE_SIZE, sizeof(*rs->fn_cache))) == NULL ||
+      (rs->ram_files = calloc(RAM_FILE_HASH_SIZE, sizeof(*rs->ram_files))) == NULL ||
+      (rs->overlays = calloc(DRIVE_COUNT, sizeof(*rs->overlays))) == NULL ||
+      (rs->overlay_changes = calloc(OVERLAY_CHANGE_HASH_SIZE, sizeof(*rs->overlay_changes))) == NULL ||
+      (rs->find_dirs = calloc(FIND_DIR_COUNT, sizeof(*rs->find_dirs))) == NULL) {
+    fprintf(stderr, "fatal: out of memory for DosRunState\n");
+    exit(252);
+  }
+  for (u = 0; u < sizeof(rs->hidden_fds) / sizeof(rs->hidden_fds[0]); ++u) {
+    rs->hidden_fds[u] = -1;
+  }
+  for (u = 0; u < HANDLE_BUF_COUNT; ++u) {
+    rs->handle_bufs[u].fd = -1;
+  }
+  rs->async_io_fd = -1;
+  rs->fn_cache_enoent_generation = 1;
+  rs->find_dir_next_id = 1;
+  return rs;
+}
+
+/* Makes the run state of emu the current one (run_state), creating it on first use. */
+static void select_run_state(EmuState *emu) {
+  if (!emu->run_state) emu->run_state = new_dos_run_state();
+  run_state = emu->run_state;
+}
+
+/* Syncs the buffers of rs, writes its collectors (like at exit), and frees it. */
+static void free_dos_run_state(DosRunState *rs) {
+  DosRunState * const old_run_state = run_state;
+  unsigned u;
+  run_state = rs;
+  reset_handle_bufs();
+  write_profile();
+  write_samples();
+  write_timings();
+  clear_ram_files();
+  clear_overlay_changes();
+  for (u = 0; u < HANDLE_BUF_COUNT; ++u) {
+    free(rs->handle_bufs[u].buf);
+  }
+  for (u = 0; u < ASYNC_IO_SLOT_COUNT; ++u) {
+    free(rs->async_io_slots[u].buf);
+  }
+  for (u = 0; u < FIND_DIR_COUNT; ++u) {
+    free(rs->find_dirs[u].entries);
+  }
+  for (u = 0; u < rs->find_dir_name_count; ++u) {
+    free(rs->find_dir_names[u].linux_dir);
+  }
+  free(rs->find_dir_names);
+  if (rs->async_io_fd >= 0 && rs->async_io_pid == getpid()) close(rs->async_io_fd);  /* Its mappings stay until exit. */
+  run_state = old_run_state == rs ? NULL : old_run_state;
+  free(rs->find_dirs);
+  free(rs->overlay_changes);
+  free(rs->overlays);
+  free(rs->ram_files);
+  free(rs->fn_cache);
+  free(rs->async_io_slots);
+  free(rs->handle_bufs);
+  free(rs->mcb_index);
+  free(rs);
+}
+
+/* It's a cheap call, the real initialization is done by kvikdos_run(...). */
+static EmuState *kvikdos_vm_create(void) {
+  EmuState *vm = malloc(sizeof(EmuState));
+  if (!vm) {
+    fprintf(stderr, "fatal: out of memory for EmuState\n");
+    exit(252);
+  }
+  init_emu(vm);
+  return vm;
+}
+
+static void kvikdos_vm_destroy(EmuState *vm) {
+  if (vm->run_state) free_dos_run_state(vm->run_state);
+  free_emu_vm(vm);
+  free(vm);
+}
+
+/* Runs the DOS program (or .bat batch file) prog_filename (Linux pathname)
+ * on vm, with args (NULL-terminated) as command-line arguments, envp0 as
+ * extra environment variables, and stdin_fd, stdout_fd and stderr_fd as
+ * stdin, stdout and stderr. Returns the exit code of the DOS program.
+ * As a side effect, may change dir_state and tty_state.
+ */
+static unsigned char kvikdos_run(EmuState *vm, const char *prog_filename, const char* const *args, const char* const *envp0, int stdin_fd, int stdout_fd, int stderr_fd, DirState *dir_state, TtyState *tty_state, const EmuParams *emu_params) {
+  const char *ext = get_linux_ext(prog_filename);
+  unsigned char exit_code;
+  char *trace_key = NULL;
+  unsigned trace_key_size;
+  int stdio_fds[3], i;
+  select_run_state(vm);
+  stdio_fds[0] = stdin_fd;
+  stdio_fds[1] = stdout_fd;
+  stdio_fds[2] = stderr_fd;
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < 3; ++i) {
+    if (stdio_fds[i] == i) continue;
+    if ((run_state->hidden_fds[9 + i] = fcntl(i, F_DUPFD, 5)) < 0 || dup2(stdio_fds[i], i) != i) {
+      perror("fatal: dup2");
+      exit(252);
+    }
+  }
+  if (emu_params->trace_filename) {
+    trace_key = get_trace_key(prog_filename, args, envp0, dir_state, emu_params, &trace_key_size);
+    if (emu_params->is_replay_check && replay_trace(emu_params->trace_filename, trace_key, trace_key_size, emu_params->clock_mode != CLOCK_HOST, &exit_code)) {
+      free(trace_key);
+      goto done;
+    }
+  }
+  if (emu_params->profile_filename) start_profile(emu_params->profile_filename);
+  if (emu_params->is_timings) start_timings();
+  if (emu_params->sample_hz) start_sampling(emu_params->sample_hz, emu_params->sample_filename, emu_params->sample_map_filename);
+  run_state->clock_exit_count = 0;  /* The virtual clock of each --serve=... job starts at its epoch. */
+  init_overlays(dir_state);
+  if (trace_key) {
+    start_trace(emu_params->trace_filename, trace_key, trace_key_size);
+    free(trace_key);
+    if (has_ram_drive(dir_state) || run_state->overlay_count) trace_uncacheable("in-memory drive or overlay mount");
+    if (is_same_ascii_nocase(ext, "bat", 4)) trace_uncacheable("batch file");
+  }
+  if (is_same_ascii_nocase(ext, "bat", 4)) {
+    exit_code = run_dos_batch(vm, prog_filename, args, dir_state, tty_state, emu_params, envp0);
+  } else {
+    exit_code = run_dos_prog(vm, prog_filename, NULL, args, dir_state, tty_state, emu_params, envp0);
+  }
+  persist_ram_files(emu_params->persist, dir_state);
+  if (emu_params->overlay_manifest_filename) write_overlay_manifest(emu_params->overlay_manifest_filename);
+  clear_ram_files();  /* The next kvikdos_run(...) (e.g. in --serve=...) starts with empty in-memory drives. */
+  write_profile();
+  write_samples();
+  write_trace(exit_code);
+ done:
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < 3; ++i) {
+    const int saved_fd = run_state->hidden_fds[9 + i];
+    if (saved_fd < 0) continue;
+    if (dup2(saved_fd, i) != i) {
+      perror("fatal: dup2");
+      exit(252);
+    }
+    close(saved_fd);
+    run_state->hidden_fds[9 + i] = -1;
+  }
+  return exit_code;
+}
+
+/* Runs the DOS program (or .bat batch file) specified in the command-line. */
+static unsigned char run_cmd_args(EmuState *emu, ParsedCmdArgs *cmd_args, TtyState *tty_state) {
+  return kvikdos_run(emu, cmd_args->prog_filename, cmd_args->args, cmd_args->envp0, 0, 1, 2, &cmd_args->dir_state, tty_state, &cmd_args->emu_params);
+}
+
+static const char * const main_pre_msg = "kvikdos: run DOS programs headless (a very fast DOS emulator)\nUsage: ";
+static const char * const main_post_msg = "This is free software, GNU GPL >=2.0. There is NO WARRANTY. Use at your risk.\n";
+
+/* --- Server mode (--serve=...) and its thin client (--connect=...).
+ *
+ * The server keeps a pool of worker processes, each having a warm EmuState
+ * (with the KVM VM and vCPU already created), and each of them runs the DOS
+ * programs of the accepted client connections one after the other, reusing
+ * the EmuState (see reset_emu). A KVM VM can't be used by forked child
+ * processes, so each worker has its own.
+ *
+ * A request is a single SOCK_SEQPACKET message: SERVE_MAGIC followed by the
+ * command-line arguments of the client (starting with argv[0]), each
+ * terminated by '\0'. Environment variables and mounts are part of the
+ * command-line (--env=... and --mount=...). Attached as SCM_RIGHTS are the
+ * client's fds 0, 1 and 2, an fd of its current directory, and optionally
+ * an fd of its /dev/tty (for --tty-in=-1). The reply is a single byte, the
+ * DOS exit code. If the server closes the connection without replying, then
+ * the DOS program has failed fatally (and the error message has already
+ * been written to the client's stderr).
+ */
+
+#define SERVE_MAGIC "kvd1"
+#define SERVE_MAGIC_SIZE 4
+#define SERVE_MAX_REQUEST_SIZE 0x10000
+#define SERVE_MAX_ARGS 0x1000
+#define SERVE_MAX_FDS 5
+
+static char serve_request_buf[SERVE_MAX_REQUEST_SIZE];
+static char *serve_argv[SERVE_MAX_ARGS + 1];
+
+/* Builds the request from argv to serve_request_buf. Returns its size, or 0
+ * if it's too long.
+ */
+static unsigned serve_build_request(char **argv) {
+  char *p = serve_request_buf;
+  size_t size;
+  unsigned argc = 0;
+  memcpy(p, SERVE_MAGIC, SERVE_MAGIC_SIZE);
+  p += SERVE_MAGIC_SIZE;
+  for (; *argv; ++argv) {
+    size = strlen(*argv) + 1;
+    if (++argc > SERVE_MAX_ARGS || size > (size_t)(serve_request_buf + sizeof(serve_request_buf) - p)) return 0;
+    memcpy(p, *argv, size);
+    p += size;
+  }
+  return p - serve_request_buf;
+}
+
+static int serve_fill_addr(struct sockaddr_un *addr, const char *sock_path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr->sun_path)) return -1;
+  strcpy(addr->sun_path, sock_path);
+  return 0;
+}
+
+/* Sends the request in serve_request_buf on the connected sock_fd, with
+ * fds attached (SCM_RIGHTS). Returns the result of sendmsg(2).
+ */
+static int serve_send_request(int sock_fd, unsigned request_size, const int *fds, int fd_count) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)]; } cmsg_buf;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = serve_request_buf;
+  iov.iov_len = request_size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  return sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+}
+
+/* Sends the request in serve_request_buf to the server listening on
+ * sock_path, and waits for the reply. Returns the DOS exit code, or -1 if
+ * the server is not available (then the caller should run the program
+ * locally). Exits with 252 if the server has failed after accepting the
+ * request.
+ */
+static int serve_client_run(const char *sock_path, unsigned request_size, char do_send_tty) {
+  struct sockaddr_un addr;
+  int sock_fd, fds[SERVE_MAX_FDS], fd_count = 4, got;
+  unsigned char exit_code;
+  if (serve_fill_addr(&addr, sock_path) != 0) return -1;
+  if ((sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) return -1;
+  if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (DEBUG) fprintf(stderr, "debug: cannot connect to kvikdos server, running locally: %s: %s\n", sock_path, strerror(errno));
+    close(sock_fd);
+    return -1;
+  }
+  fds[0] = 0; fds[1] = 1; fds[2] = 2;  /* STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO. */
+  if ((fds[3] = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+    close(sock_fd);
+    return -1;
+  }
+  if (do_send_tty && (fds[4] = open("/dev/tty", O_RDWR | O_NOCTTY)) >= 0) ++fd_count;  /* Current controlling terminal. */
+  got = serve_send_request(sock_fd, request_size, fds, fd_count);
+  close(fds[3]);
+  if (fd_count > 4) close(fds[4]);
+  if (got < 0) {
+    if (DEBUG) fprintf(stderr, "debug: cannot send to kvikdos server, running locally: %s: %s\n", sock_path, strerror(errno));
+    close(sock_fd);
+    return -1;
+  }
+  while ((got = recv(sock_fd, &exit_code, 1, 0)) < 0 && errno == EINTR) {}
+  if (got != 1) exit(252);  /* The server has already reported the fatal error to our stderr. */
+  close(sock_fd);
+  return exit_code;
+}
+
+/* Closes all fds >= 3 except for those used by the worker itself, so that a
+ * DOS program can't leak fds to the next one run by the same worker.
+ */
+static void serve_close_leaked_fds(const EmuState *emu) {
+  DIR *dir;
+  struct dirent *de;
+  int fd, dir_fd;
+  if ((dir = opendir("/proc/self/fd")) == NULL) {
+    for (fd = 3; fd < 256; ++fd) {
+      if (fd != emu->kvm_fds.kvm_fd && fd != emu->kvm_fds.vm_fd && fd != emu->kvm_fds.vcpu_fd && !is_hidden_fd(fd)) close(fd);
+    }
+    return;
+  }
+  dir_fd = dirfd(dir);
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] - '0' + 0U > 9U) continue;  /* Skip "." and "..". */
+    fd = atoi(de->d_name);
+    if (fd >= 3 && fd != dir_fd && fd != emu->kvm_fds.kvm_fd && fd != emu->kvm_fds.vm_fd && fd != emu->kvm_fds.vcpu_fd && !is_hidden_fd(fd)) close(fd);
+  }
+  closedir(dir);
+}
+
+/* Receives a request on conn_fd, and runs it on emu. Replies with the exit
+ * code. Takes ownership of conn_fd. If saved_fds is not NULL, restores fds
+ * 0, 1 and 2 from it afterwards, and closes the fds leaked by the DOS
+ * program. snapshot_fd is for EmuParams.snapshot_fd.
+ */
+static void serve_job(EmuState *emu, int conn_fd, const int *saved_fds, int snapshot_fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)]; } cmsg_buf;
+  int fds[SERVE_MAX_FDS], fd_count = 0, tty_fd = -1, got, i;
+  unsigned argc;
+  char *p, *p_end;
+  ParsedCmdArgs cmd_args;
+  TtyState tty_state;
+  unsigned char exit_code;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = serve_request_buf;
+  iov.iov_len = sizeof(serve_request_buf);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf.buf;
+  msg.msg_controllen = sizeof(cmsg_buf.buf);
+  while ((got = recvmsg(conn_fd, &msg, 0)) < 0 && errno == EINTR) {}
+  for (cmsg = got < 0 ? NULL : CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      const unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (fd_count + count <= SERVE_MAX_FDS) {
+        memcpy(fds + fd_count, CMSG_DATA(cmsg), sizeof(int) * count);
+        fd_count += count;
+      }
+    }
+  }
+  if (got < SERVE_MAGIC_SIZE + 1 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || fd_count < 4 ||
+      memcmp(serve_request_buf, SERVE_MAGIC, SERVE_MAGIC_SIZE) != 0 || serve_request_buf[got - 1] != '\0') {
+    if (DEBUG) fprintf(stderr, "debug: bad kvikdos server request\n");
+    goto done;
+  }
+  for (argc = 0, p = serve_request_buf + SERVE_MAGIC_SIZE, p_end = serve_request_buf + got; p != p_end; p += strlen(p) + 1) {
+    if (argc == SERVE_MAX_ARGS) goto done;
+    serve_argv[argc++] = p;
+  }
+  serve_argv[argc] = NULL;
+  if (fchdir(fds[3]) != 0) goto done;
+  for (i = 0; i < 3; ++i) {
+    if (dup2(fds[i], i) != i) {
+      perror("fatal: dup2");
+      exit(252);
+    }
+  }
+  if (fd_count > 4) tty_fd = ensure_fd_is_at_least(fds[4], 5);
+  for (i = 0; i < fd_count && i < 4; ++i) close(fds[i]);
+  fd_count = 0;
+
+  parse_args(serve_argv, &cmd_args, main_pre_msg, "", main_post_msg);
+  cmd_args.emu_params.snapshot_fd = snapshot_fd;
+  init_tty_state(&tty_state, cmd_args.tty_in_fd != -1 ? cmd_args.tty_in_fd : tty_fd >= 0 ? tty_fd : -2, cmd_args.stdout_buffer_mode);
+  exit_code = run_cmd_args(emu, &cmd_args, &tty_state);
+  if (DEBUG) fprintf(stderr, "debug: DOS program exited with code: 0x%02x\n", exit_code);
+  atexit_tty_state = NULL;  /* tty_state is going out of scope. */
+
+  fflush(stdout);
+  fflush(stderr);
+  if (saved_fds) {
+    for (i = 0; i < 3; ++i) {
+      if (dup2(saved_fds[i], i) != i) {
+        perror("fatal: dup2");
+        exit(252);
       }
-     done_command:
-      ++q;  /* Skip over the '\0', formerly '\r' or '\n'. */
-      goto next_line;
     }
+    serve_close_leaked_fds(emu);  /* Also closes tty_fd. */
   }
-  close(batch_fd);
+  (void)!send(conn_fd, &exit_code, 1, MSG_NOSIGNAL);
+ done:
+  for (i = 0; i < fd_count; ++i) close(fds[i]);
+  close(conn_fd);
+}
+
+static void serve_worker(int listen_fd, pid_t server_pid) {
+  EmuState emu;
+  int saved_fds[3], conn_fd, i;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);  /* Exit when the server exits. */
+  if (getppid() != server_pid) exit(0);  /* The server has exited before prctl(...) above. */
+  for (i = 0; i < 3; ++i) {  /* Make sure fds 0, 1 and 2 are open, so that received fds won't be put there. */
+    if (fcntl(i, F_GETFD) < 0 && open("/dev/null", O_RDWR) != i) {
+      perror("fatal: open /dev/null");
+      exit(252);
+    }
+  }
+  init_emu(&emu);
+  select_run_state(&emu);
+  for (i = 0; i < 3; ++i) {
+    if ((saved_fds[i] = fcntl(i, F_DUPFD, 5)) < 0) {
+      perror("fatal: fcntl F_DUPFD");
+      exit(252);
+    }
+    run_state->hidden_fds[i] = saved_fds[i];
+  }
+  run_state->hidden_fds[3] = listen_fd;
+  reset_emu(&emu, 1, MEM_BACKING_LAZY, CPU_AUTO);  /* Create the KVM VM and vCPU before the first request. A job with --mem-mb=<n>, --prefault or --cpu=... recreates it. */
+  for (;;) {
+    if ((conn_fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("fatal: accept");
+      exit(252);
+    }
+    run_state->hidden_fds[4] = conn_fd;
+    serve_job(&emu, conn_fd, saved_fds, -1);
+    run_state->hidden_fds[4] = -1;
+  }
+}
+
+/* Creates the listening socket of the server. Returns its fd. */
+static int serve_listen(const char *sock_path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int listen_fd;
+  if (serve_fill_addr(&addr, sock_path) != 0) {
+    fprintf(stderr, "fatal: socket pathname too long: %s\n", sock_path);
+    exit(1);
+  }
+  if ((listen_fd = open("/dev/kvm", O_RDWR)) < 0) {  /* Fail early rather than in each worker. */
+    perror("fatal: failed to open /dev/kvm");
+    exit(252);
+  }
+  close(listen_fd);
+  if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+    perror("fatal: socket");
+    exit(252);
+  }
+  if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(sock_path);  /* Remove stale socket of a previous server. */
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "fatal: cannot bind to socket: %s: %s\n", sock_path, strerror(errno));
+    exit(252);
+  }
+  if (listen(listen_fd, 128) != 0) {
+    perror("fatal: listen");
+    exit(252);
+  }
+  return listen_fd;
+}
+
+static pid_t serve_spawn_worker(int listen_fd) {
+  const pid_t server_pid = getpid();
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fatal: fork");
+    exit(252);
+  } else if (pid == 0) {
+    serve_worker(listen_fd, server_pid);
+    exit(0);  /* Not reached. */
+  }
+  return pid;
+}
+
+/* Implements `kvikdos --serve=<socket> [--serve-workers=<n>]'. argv[0] is the
+ * --serve... flag. Doesn't return.
+ */
+static void serve_main(char **argv) {
+  const char *sock_path = NULL;
+  unsigned worker_count = 0, u;
+  int listen_fd, char_count, status;
+  for (; argv[0]; ++argv) {
+    const char *arg = argv[0];
+    if (0 == strcmp(arg, "--serve") || 0 == strcmp(arg, "--serve-workers")) {
+      if (!argv[1]) {
+        fprintf(stderr, "fatal: missing argument for flag: %s\n", arg);
+        exit(1);
+      }
+      if (arg[7] == '\0') {
+        sock_path = *++argv;
+      } else {
+        arg = *++argv;
+        goto do_serve_workers;
+      }
+    } else if (0 == strncmp(arg, "--serve=", 8)) {
+      sock_path = arg + 8;
+    } else if (0 == strncmp(arg, "--serve-workers=", 16)) {
+      arg += 16;
+     do_serve_workers:
+      if (sscanf(arg, "%u%n", &worker_count, &char_count) < 1 || char_count + 0U != strlen(arg) || worker_count == 0 || worker_count > 4096) {
+        fprintf(stderr, "fatal: serve-workers argument must be positive: %s\n", arg);
+        exit(1);
+      }
+    } else {
+      fprintf(stderr, "fatal: unknown command-line flag for --serve: %s\n", arg);
+      exit(1);
+    }
+  }
+  if (!sock_path || sock_path[0] == '\0') {
+    fprintf(stderr, "fatal: missing socket pathname for --serve\n");
+    exit(1);
+  }
+  if (worker_count == 0) {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cpu_count > 0 ? (unsigned)cpu_count : 1;
+  }
+  listen_fd = serve_listen(sock_path);
+  if (DEBUG) fprintf(stderr, "debug: kvikdos server listening on %s with %u workers\n", sock_path, worker_count);
+  fflush(stdout);
+  fflush(stderr);
+  for (u = 0; u < worker_count; ++u) {
+    serve_spawn_worker(listen_fd);
+  }
+  for (;;) {  /* Replace workers which have exited (e.g. because of a fatal error in a DOS program). */
+    if (wait(&status) < 0) {
+      if (errno == EINTR) continue;
+      perror("fatal: wait");
+      exit(252);
+    }
+    serve_spawn_worker(listen_fd);
+  }
+}
+
+/* Loads the DOS program prog_filename (without running it) to a new memfd
+ * snapshot, for --fork-server. There is no KVM VM, only guest memory.
+ * Returns the fd.
+ */
+static int preload_snapshot(const char *prog_filename) {
+  char header[PROGRAM_HEADER_SIZE];
+  unsigned header_size, u;
+  SnapshotHeader hdr;
+  struct kvm_regs regs;
+  struct kvm_sregs sregs;
+  int img_fd, fd;
+  void *mem;
+  if ((mem = mmap(NULL, DOS_MEM_LIMIT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+    perror("fatal: mmap");
+    exit(252);
+  }
+  for (u = 0; u < 0x100; ++u) { ((unsigned*)mem)[u] = MAGIC_INT_VALUE(u); }  /* Same as in run_dos_prog(...), some of these are copied to the PSP. */
+  memcpy((char*)mem + (PROGRAM_MCB_PARA << 4), default_program_mcb, 16);
+  memset(&regs, '\0', sizeof(regs));
+  memset(&sregs, '\0', sizeof(sregs));
+  if ((img_fd = open(prog_filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "fatal: cannot open DOS executable program: %s: %s\n", prog_filename, strerror(errno));
+    exit(252);
+  }
+  header_size = detect_dos_executable_program(img_fd, prog_filename, header);
+  load_dos_executable_program(img_fd, prog_filename, mem, header, header_size, PSP_PARA, ENV_PARA, &regs, &sregs, &MCB_SIZE_PARA((char*)mem + (PROGRAM_MCB_PARA << 4)));
+  if (get_snapshot_key(img_fd, &hdr) != 0) {
+    fprintf(stderr, "fatal: DOS executable program is not a regular file: %s\n", prog_filename);
+    exit(252);
+  }
+  close(img_fd);
+  if ((fd = create_memfd("kvikdos-snapshot")) < 0) {
+    perror("fatal: memfd_create");
+    exit(252);
+  }
+  if (write_snapshot(fd, (const char*)mem, &hdr, &regs, &sregs) != 0) {
+    perror("fatal: write snapshot");
+    exit(252);
+  }
+  munmap(mem, DOS_MEM_LIMIT);
+  return fd;
+}
+
+/* Implements `kvikdos --fork-server=<socket> [<flag> ...] <dos-executable-file>'.
+ * argv[1] is the --fork-server... flag. Doesn't return.
+ *
+ * It loads <dos-executable-file> to a memfd snapshot once, and then for
+ * each accepted client connection (see serve_client_run(...)) it forks a
+ * child process, which creates a fresh KVM VM (a KVM VM can't be shared
+ * across fork()), and runs the request of the client. If the client runs
+ * the same program file, then the child maps the snapshot copy-on-write
+ * instead of loading it, so the children share the memory pages of the
+ * program image. Other programs are loaded normally.
+ */
+static void fork_server_main(char **argv) {
+  ParsedCmdArgs cmd_args;
+  const char *sock_path;
+  int listen_fd, snapshot_fd, conn_fd;
+  pid_t pid;
+  EmuState emu;  /* Without a KVM VM, each child creates its own. */
+  if (0 == strcmp(argv[1], "--fork-server")) {
+    if (!argv[2]) {
+      fprintf(stderr, "fatal: missing argument for flag: %s\n", argv[1]);
+      exit(1);
+    }
+    sock_path = argv[2];
+    argv[2] = argv[0];
+    argv += 2;
+  } else {
+    sock_path = argv[1] + 14;
+    argv[1] = argv[0];
+    ++argv;
+  }
+  if (sock_path[0] == '\0') {
+    fprintf(stderr, "fatal: missing socket pathname for --fork-server\n");
+    exit(1);
+  }
+  parse_args(argv, &cmd_args, main_pre_msg, "", main_post_msg);
+  if (is_same_ascii_nocase(get_linux_ext(cmd_args.prog_filename), "bat", 4)) {
+    fprintf(stderr, "fatal: --fork-server needs a DOS .com or .exe program: %s\n", cmd_args.prog_filename);
+    exit(1);
+  }
+  init_emu(&emu);
+  select_run_state(&emu);  /* For preload_snapshot(...). */
+  snapshot_fd = preload_snapshot(cmd_args.prog_filename);
+  listen_fd = serve_listen(sock_path);
+  if (DEBUG) fprintf(stderr, "debug: kvikdos fork server listening on %s\n", sock_path);
+  fflush(stdout);
+  fflush(stderr);
+  signal(SIGCHLD, SIG_IGN);  /* Let the kernel reap the children. */
+  for (;;) {
+    if ((conn_fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("fatal: accept");
+      exit(252);
+    }
+    if ((pid = fork()) < 0) {
+      perror("error: fork");  /* The client will exit with code 252. */
+    } else if (pid == 0) {
+      close(listen_fd);
+      signal(SIGCHLD, SIG_DFL);
+      run_state->hidden_fds[4] = conn_fd;
+      run_state->hidden_fds[5] = snapshot_fd;
+      serve_job(&emu, conn_fd, NULL, snapshot_fd);
+      exit(0);
+    }
+    close(conn_fd);
+  }
+}
+
+/* --- Manifest driver (--jobs=... --manifest=...).
+ *
+ * `kvikdos --jobs=<n> --manifest=<file>' runs each line of <file> as a
+ * separate kvikdos command-line (flags, DOS program and its arguments,
+ * without the leading kvikdos) on a pool of <n> --serve workers (see
+ * above), each with its own warm EmuState reused across jobs. Thus there is
+ * no process creation, ELF startup or KVM VM creation per job. The run
+ * state (e.g. the filename cache, see DosRunState) is in the EmuState, so
+ * it is also per worker.
+ *
+ * Arguments in a line are separated by whitespace, and they can be quoted
+ * with '...' or "...", and a backslash escapes the next character (not
+ * within '...'). Empty lines and lines starting with # are ignored. The
+ * stdout and stderr of each job are captured, and they are written to
+ * the stdout and stderr of kvikdos in manifest order, followed by a message
+ * to stderr if the exit code of the job is nonzero. The exit code of kvikdos
+ * is the exit code of the first failed job (252 if it has failed fatally),
+ * or 0.
+ */
+
+typedef struct ManifestJob {
+  char **argv;  /* NULL-terminated. argv[0] is the kvikdos program. */
+  unsigned line_number;
+  int sock_fd, out_fd, err_fd;  /* -1 if not started. */
+} ManifestJob;
+
+/* Splits the line p to arguments in place, and saves them to argv, which
+ * must have room for strlen(p) / 2 + 1 pointers. Returns the number of
+ * arguments, or -1 on unterminated quote.
+ */
+static int split_manifest_line(char *p, char **argv) {
+  char *q = p, c, quote;
+  int argc = 0;
+  for (;;) {
+    for (; *p == ' ' || *p == '\t' || *p == '\r'; ++p) {}
+    if (*p == '\0') break;
+    argv[argc++] = q;
+    for (quote = '\0'; (c = *p) != '\0'; ++p) {
+      if (quote == '\0' && (c == ' ' || c == '\t' || c == '\r')) {
+        break;
+      } else if (c == quote) {
+        quote = '\0';
+      } else if (quote == '\0' && (c == '\'' || c == '"')) {
+        quote = c;
+      } else if (c == '\\' && quote != '\'' && p[1] != '\0') {
+        *q++ = *++p;
+      } else {
+        *q++ = c;
+      }
+    }
+    if (quote != '\0') return -1;
+    if (c != '\0') ++p;
+    *q++ = '\0';  /* Doesn't overwrite unparsed chars, because q <= p here. */
+  }
+  return argc;
+}
+
+/* Reads and parses the manifest file. Returns the number of jobs. */
+static unsigned read_manifest(const char *filename, char *argv0, ManifestJob **jobs_out) {
+  int fd, got;
+  size_t size = 0, capacity = 0x10000;
+  char *buf = NULL, *p, *line;
+  unsigned job_count = 0, line_number = 0;
+  ManifestJob *jobs;
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    fprintf(stderr, "fatal: cannot open manifest file: %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  for (;;) {
+    if (!buf || size == capacity) {
+      if (buf) capacity <<= 1;
+      if ((buf = realloc(buf, capacity + 1)) == NULL) goto out_of_memory;
+    }
+    if ((got = read(fd, buf + size, capacity - size)) <= 0) break;
+    size += got;
+  }
+  if (got < 0) {
+    fprintf(stderr, "fatal: error reading manifest file: %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  buf[size] = '\0';
+  for (p = buf; *p != '\0'; ++p) {
+    if (*p == '\n') ++job_count;
+  }
+  if ((jobs = malloc(sizeof(ManifestJob) * (job_count + 1))) == NULL) goto out_of_memory;
+  for (job_count = 0, line = buf; *line != '\0'; line = p) {
+    int argc;
+    for (p = line; *p != '\0' && *p != '\n'; ++p) {}
+    if (*p == '\n') *p++ = '\0';
+    ++line_number;
+    for (; *line == ' ' || *line == '\t'; ++line) {}
+    if (*line == '#' || *line == '\0') continue;
+    if ((jobs[job_count].argv = malloc(sizeof(char*) * (strlen(line) / 2 + 3))) == NULL) goto out_of_memory;
+    if ((argc = split_manifest_line(line, jobs[job_count].argv + 1)) < 0) {
+      fprintf(stderr, "fatal: unterminated quote in manifest line %u: %s\n", line_number, filename);
+      exit(1);
+    }
+    if (argc == 0) { free(jobs[job_count].argv); continue; }
+    jobs[job_count].argv[0] = argv0;
+    jobs[job_count].argv[argc + 1] = NULL;
+    jobs[job_count].line_number = line_number;
+    jobs[job_count].sock_fd = jobs[job_count].out_fd = jobs[job_count].err_fd = -1;
+    ++job_count;
+  }
+  *jobs_out = jobs;
+  return job_count;
+ out_of_memory:
+  fprintf(stderr, "fatal: out of memory for manifest\n");
+  exit(252);
+}
+
+/* Sends the job to a worker. */
+static void start_manifest_job(ManifestJob *job, const struct sockaddr_un *addr, int cwd_fd) {
+  int fds[4];
+  const unsigned request_size = serve_build_request(job->argv);
+  if (request_size == 0) {
+    fprintf(stderr, "fatal: manifest line %u too long\n", job->line_number);
+    exit(252);
+  }
+  if ((job->out_fd = create_memfd("kvikdos-job-stdout")) < 0 || (job->err_fd = create_memfd("kvikdos-job-stderr")) < 0) {
+    perror("fatal: memfd_create");
+    exit(252);
+  }
+  if ((job->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0 ||
+      connect(job->sock_fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0) {
+    perror("fatal: connect to kvikdos worker");
+    exit(252);
+  }
+  fds[0] = 0; fds[1] = job->out_fd; fds[2] = job->err_fd; fds[3] = cwd_fd;  /* STDIN_FILENO. */
+  if (serve_send_request(job->sock_fd, request_size, fds, 4) < 0) {
+    perror("fatal: send to kvikdos worker");
+    exit(252);
+  }
+}
+
+/* Waits for the job to finish, copies its output. Returns its exit code. */
+static unsigned char finish_manifest_job(ManifestJob *job) {
+  unsigned char exit_code;
+  int got;
+  while ((got = recv(job->sock_fd, &exit_code, 1, 0)) < 0 && errno == EINTR) {}
+  if (got != 1) exit_code = 252;  /* The worker has failed fatally, it has already written the error message to err_fd. */
+  fflush(stdout);
+  fflush(stderr);
+  copy_fd_to_fd(job->out_fd, 1);  /* STDOUT_FILENO. */
+  copy_fd_to_fd(job->err_fd, 2);  /* STDERR_FILENO. */
+  close(job->sock_fd);
+  close(job->out_fd);
+  close(job->err_fd);
+  job->sock_fd = job->out_fd = job->err_fd = -1;
+  if (exit_code != 0) fprintf(stderr, "kvikdos: manifest line %u: exit code %u\n", job->line_number, exit_code);
   return exit_code;
 }
 
-static void init_tty_state(TtyState *tty_state, int tty_in_fd) {
-  tty_state->tty_in_fd = tty_in_fd;
-  tty_state->is_tty_in_error = 0;
-  tty_state->next_fake_key = fake_keys;
+/* Implements `kvikdos --jobs=<n> --manifest=<file>'. Doesn't return. */
+static void manifest_main(char **argv) {
+  char * const argv0 = argv[0];
+  const char *manifest_filename = NULL;
+  unsigned worker_count = 0, job_count, started_count, u;
+  int listen_fd, cwd_fd, char_count, status;
+  unsigned char exit_code = 0, job_exit_code;
+  struct sockaddr_un addr;
+  ManifestJob *jobs;
+  pid_t pid;
+  for (++argv; argv[0]; ++argv) {
+    const char *arg = argv[0];
+    if (0 == strcmp(arg, "--jobs") || 0 == strcmp(arg, "--manifest")) {
+      if (!argv[1]) {
+        fprintf(stderr, "fatal: missing argument for flag: %s\n", arg);
+        exit(1);
+      }
+      if (arg[2] == 'm') {
+        manifest_filename = *++argv;
+      } else {
+        arg = *++argv;
+        goto do_jobs;
+      }
+    } else if (0 == strncmp(arg, "--manifest=", 11)) {
+      manifest_filename = arg + 11;
+    } else if (0 == strncmp(arg, "--jobs=", 7)) {
+      arg += 7;
+     do_jobs:
+      if (sscanf(arg, "%u%n", &worker_count, &char_count) < 1 || char_count + 0U != strlen(arg) || worker_count == 0 || worker_count > 4096) {
+        fprintf(stderr, "fatal: jobs argument must be positive: %s\n", arg);
+        exit(1);
+      }
+    } else {
+      fprintf(stderr, "fatal: unknown command-line flag for --jobs: %s\n", arg);
+      exit(1);
+    }
+  }
+  if (!manifest_filename) {
+    fprintf(stderr, "fatal: missing --manifest=<file> for --jobs\n");
+    exit(1);
+  }
+  if (worker_count == 0) {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cpu_count > 0 ? (unsigned)cpu_count : 1;
+  }
+  job_count = read_manifest(manifest_filename, argv0, &jobs);
+  if (job_count < worker_count) worker_count = job_count;
+  if ((cwd_fd = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+    perror("fatal: open current directory");
+    exit(252);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  sprintf(addr.sun_path + 1, "kvikdos-jobs-%ld", (long)getpid());  /* Abstract socket address, starts with '\0'. */
+  if ((listen_fd = open("/dev/kvm", O_RDWR)) < 0) {  /* Fail early rather than in each worker. */
+    perror("fatal: failed to open /dev/kvm");
+    exit(252);
+  }
+  close(listen_fd);
+  if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0 ||
+      bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 128) != 0) {
+    perror("fatal: cannot listen for kvikdos workers");
+    exit(252);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  for (u = 0; u < worker_count; ++u) {
+    serve_spawn_worker(listen_fd);
+  }
+  for (started_count = u = 0; u < job_count; ++u) {  /* Keep up to 2 * worker_count jobs queued, and finish them in order. */
+    for (; started_count < job_count && started_count < u + 2 * worker_count; ++started_count) {
+      start_manifest_job(jobs + started_count, &addr, cwd_fd);
+    }
+    job_exit_code = finish_manifest_job(jobs + u);
+    if (exit_code == 0) exit_code = job_exit_code;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {  /* Replace workers which have exited because of a fatal error. */
+      serve_spawn_worker(listen_fd);
+    }
+  }
+  exit(exit_code);  /* The workers exit because of PR_SET_PDEATHSIG. */
 }
 
 /* --- */
 
 int main(int argc, char **argv) {
   ParsedCmdArgs cmd_args;
+  const char *connect_sock_path = NULL;
+  unsigned serve_request_size = 0;
+  const double main_start_sec = get_monotonic_sec();  /* For --timings. */
+  EmuState *vm;
   (void)argc;
-  parse_args(
-      argv, &cmd_args,
-      "kvikdos: run DOS programs headless (a very fast DOS emulator)\nUsage: ", "",
-      "This is free software, GNU GPL >=2.0. There is NO WARRANTY. Use at your risk.\n");
+  if (argv[0] && argv[1]) {
+    if (0 == strcmp(argv[1], "--serve") || 0 == strncmp(argv[1], "--serve=", 8)) {
+      serve_main(argv + 1);
+    } else if (0 == strcmp(argv[1], "--fork-server") || 0 == strncmp(argv[1], "--fork-server=", 14)) {
+      fork_server_main(argv);
+    } else if (0 == strncmp(argv[1], "--jobs", 6) || 0 == strncmp(argv[1], "--manifest", 10)) {
+      manifest_main(argv);
+    } else if (0 == strcmp(argv[1], "--connect")) {
+      if (!argv[2]) {
+        fprintf(stderr, "fatal: missing argument for flag: %s\n", argv[1]);
+        exit(1);
+      }
+      connect_sock_path = argv[2];
+      argv[2] = argv[0];
+      argv += 2;
+    } else if (0 == strncmp(argv[1], "--connect=", 10)) {
+      connect_sock_path = argv[1] + 10;
+      argv[1] = argv[0];
+      ++argv;
+    }
+    if (connect_sock_path) serve_request_size = serve_build_request(argv);  /* Before parse_args(...) modifies argv. */
+  }
+  parse_args(argv, &cmd_args, main_pre_msg, "", main_post_msg);
+  vm = kvikdos_vm_create();  /* This is lightweight, it doesn't initialize KVM. */
+  select_run_state(vm);  /* For start_timings(). */
+  if (cmd_args.emu_params.is_timings) {
+    start_timings();
+    run_state->timings->main_start_sec = main_start_sec;
+    run_state->timings->parse_args_sec = get_monotonic_sec() - main_start_sec;
+    run_state->timings->find_prog_sec = cmd_args.find_prog_sec;
+  }
   if (0) {  /* Just dump the parsed command-line. */
     /* cmd_args.dir_state.linux_prog is still NULL, use cmd_args.prog_filename instead. */
     printf("linux prog: %s\n", cmd_args.prog_filename);
@@ -3691,8 +10951,9 @@ int main(int argc, char **argv) {
       for (drive_idx = 0; drive_idx < DRIVE_COUNT; ++drive_idx) {
         const char *mount_dir = cmd_args.dir_state.linux_mount_dir[(int)drive_idx];
         if (mount_dir) {
-          printf("mount dir of   %c: %s\n", 'A' + drive_idx, mount_dir[0] != '\0' ? mount_dir : "./");
+          printf("mount dir of   %c: %s\n", 'A' + drive_idx, mount_dir[0] == RAM_MOUNT_DIR[0] ? "~" : mount_dir[0] != '\0' ? mount_dir : "./");
           /*printf("current dir on %c: %s\n", 'A' + drive_idx, cmd_args.dir_state.current_dir[(int)drive_idx]);*/  /* Currently always empty. */
+          if (cmd_args.dir_state.linux_upper_dir[(int)drive_idx]) printf("upper dir of   %c: %s\n", 'A' + drive_idx, cmd_args.dir_state.linux_upper_dir[(int)drive_idx][0] != '\0' ? cmd_args.dir_state.linux_upper_dir[(int)drive_idx] : "./");
           printf("case mode of   %c: %d\n", 'A' + drive_idx, cmd_args.dir_state.case_mode[(int)drive_idx]);
         }
       }
@@ -3711,25 +10972,37 @@ int main(int argc, char **argv) {
       printf("end of envs\n");
     }
     printf("tty_in_fd: %d\n", cmd_args.tty_in_fd);
+    printf("stdout_buffer_mode: %d\n", cmd_args.stdout_buffer_mode);
     printf("mem_mb: %d\n", cmd_args.emu_params.mem_mb);
+    printf("mem_backing: %d\n", cmd_args.emu_params.mem_backing);
+    printf("cpu: %d\n", cmd_args.emu_params.cpu);
+    printf("is_async_io: %d\n", cmd_args.emu_params.is_async_io);
+    printf("is_timings: %d\n", cmd_args.emu_params.is_timings);
     printf("is_hlt_ok: %d\n", cmd_args.emu_params.is_hlt_ok);
+    printf("trampoline: %d\n", cmd_args.emu_params.trampoline);
+    printf("clock: %d:%lu\n", cmd_args.emu_params.clock_mode, cmd_args.emu_params.clock_epoch);
+    printf("trace: %s replay_check=%d\n", cmd_args.emu_params.trace_filename ? cmd_args.emu_params.trace_filename : "", cmd_args.emu_params.is_replay_check);
+    { const char* const *persist;
+      for (persist = cmd_args.emu_params.persist; *persist; ++persist) {
+        printf("persist: %s\n", *persist);
+      }
+    }
     return 0;
   }
   if (cmd_args.dpmi_prog) {  /* pts-fast-dosbox does support it, kvikdos doesn't. */
     fprintf(stderr, "fatal: DPMI not supported: %s\n", cmd_args.dpmi_prog);
     exit(1);
   }
+  if (connect_sock_path && serve_request_size != 0 && cmd_args.tty_in_fd < 3) {  /* The server can't see other fds of ours. */
+    const int exit_code = serve_client_run(connect_sock_path, serve_request_size, cmd_args.tty_in_fd == -1);
+    if (exit_code >= 0) return exit_code;
+  }
   { int exit_code;
-    const char *ext = get_linux_ext(cmd_args.prog_filename);
-    EmuState emu;
     TtyState tty_state;
-    init_emu(&emu);  /* This is lightweight, it doesn't initialize KVM. */
-    init_tty_state(&tty_state, cmd_args.tty_in_fd);
-    if (is_same_ascii_nocase(ext, "bat", 4)) {
-      exit_code = run_dos_batch(&emu, cmd_args.prog_filename, cmd_args.args, &cmd_args.dir_state, &tty_state, &cmd_args.emu_params, cmd_args.envp0);
-    } else {
-      exit_code = run_dos_prog(&emu, cmd_args.prog_filename, NULL, cmd_args.args, &cmd_args.dir_state, &tty_state, &cmd_args.emu_params, cmd_args.envp0);
-    }
+    init_tty_state(&tty_state, cmd_args.tty_in_fd, cmd_args.stdout_buffer_mode);
+    exit_code = run_cmd_args(vm, &cmd_args, &tty_state);
+    flush_stdout_buf(&tty_state);  /* Before the atexit handler, tty_state is on the stack. */
+    kvikdos_vm_destroy(vm);
     if (DEBUG) fprintf(stderr, "debug: DOS program exited with code: 0x%02x", exit_code);
     return exit_code;
   }
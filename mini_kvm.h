@@ -46,6 +46,16 @@ struct kvm_sregs {
         __u64 interrupt_bitmap[(KVM_NR_INTERRUPTS + 63) / 64];
 };
 
+/* Only the prefix used by kvikdos, struct kvm_vcpu_events etc. follow. */
+struct kvm_sync_regs {
+        struct kvm_regs regs;
+        struct kvm_sregs sregs;
+};
+
+#define KVM_SYNC_X86_REGS      (1UL << 0)
+#define KVM_SYNC_X86_SREGS     (1UL << 1)
+#define KVM_SYNC_X86_EVENTS    (1UL << 2)
+
 struct kvm_userspace_memory_region {
         __u32 slot;
         __u32 flags;
@@ -220,15 +230,14 @@ __extension__ struct kvm_run {
 	__u64 kvm_valid_regs;
 	__u64 kvm_dirty_regs;
 	union {
-#if 0
 		struct kvm_sync_regs regs;
-#endif
 		char padding[2048];
 	} s;
 };
 
 #define KVM_GET_API_VERSION       _IO(KVMIO,   0x00)
 #define KVM_CREATE_VM             _IO(KVMIO,   0x01) /* returns a VM fd */
+#define KVM_CHECK_EXTENSION       _IO(KVMIO,   0x03)
 #define KVM_SET_USER_MEMORY_REGION _IOW(KVMIO, 0x46, \
                                         struct kvm_userspace_memory_region)
 #define KVM_CREATE_VCPU           _IO(KVMIO,   0x41)
@@ -239,6 +248,8 @@ __extension__ struct kvm_run {
 #define KVM_GET_SREGS             _IOR(KVMIO,  0x83, struct kvm_sregs)
 #define KVM_SET_SREGS             _IOW(KVMIO,  0x84, struct kvm_sregs)
 
+#define KVM_CAP_SYNC_REGS 74
+
 #define KVM_MEM_LOG_DIRTY_PAGES (1UL << 0)
 #define KVM_MEM_READONLY        (1UL << 1)
 